@@ -8,6 +8,7 @@
 #  - ENABLE_LINUX_ETH
 #  - ENABLE_GEN_ETH
 #  - ENABLE_IPV6
+#  - ENABLE_ZLIB
 # accumulators:
 #  - DYNAMIPS_FLAGS
 #  - DYNAMIPS_DEFINITIONS
@@ -132,6 +133,19 @@ else ()
    list ( APPEND DYNAMIPS_DEFINITIONS "-DHAS_RFC2553=0" )
 endif ()
 
+# ENABLE_ZLIB
+if ( HAVE_ZLIB )
+   option ( ENABLE_ZLIB "Compression of VM checkpoints with zlib" ON )
+   print_variables ( ENABLE_ZLIB )
+endif ()
+if ( ENABLE_ZLIB )
+   list ( APPEND DYNAMIPS_DEFINITIONS "-DHAS_ZLIB=1" )
+   list ( APPEND DYNAMIPS_INCLUDES ${ZLIB_INCLUDE_DIRS} )
+   list ( APPEND DYNAMIPS_LIBRARIES ${ZLIB_LIBRARIES} )
+else ()
+   list ( APPEND DYNAMIPS_DEFINITIONS "-DHAS_ZLIB=0" )
+endif ()
+
 # target system
 if ( "SunOS" STREQUAL "${CMAKE_SYSTEM_NAME}" )
    list ( APPEND DYNAMIPS_DEFINITIONS "-DSUNOS" "-DINADDR_NONE=0xFFFFFFFF" )
@@ -202,6 +216,12 @@ macro ( print_summary )
       set ( _ipv6 "no, missing headers or functions" )
    endif ()
    message ( "  IPv6 support (RFC 2553)            : ${_ipv6}" )
+   if ( DEFINED ENABLE_ZLIB )
+      set ( _zlib "ENABLE_ZLIB=${ENABLE_ZLIB}" )
+   else ()
+      set ( _zlib "zlib not found" )
+   endif ()
+   message ( "  Checkpoint compression (zlib)      : ${_zlib}" )
 endmacro ( print_summary )
 
 message ( STATUS "configure - END" )
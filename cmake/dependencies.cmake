@@ -5,6 +5,7 @@
 #  - libelf          : required
 #  - pthreads        : required
 #  - libpcap/winpcap : optional
+#  - zlib            : optional
 # accumulators:
 #  - DYNAMIPS_FLAGS
 #  - DYNAMIPS_DEFINITIONS
@@ -203,6 +204,23 @@ if ( HAVE_PCAP AND CYGWIN )
 endif ()
 print_variables ( HAVE_PCAP )
 
+# zlib (optional)
+set_cmake_required ()
+find_package ( ZLIB )
+print_variables ( ZLIB_FOUND ZLIB_INCLUDE_DIRS ZLIB_LIBRARIES )
+set ( HAVE_ZLIB ${ZLIB_FOUND} )
+if ( HAVE_ZLIB )
+   # make sure it can be used
+   set_cmake_required ()
+   list ( APPEND CMAKE_REQUIRED_INCLUDES ${ZLIB_INCLUDE_DIRS} )
+   check_arch_library ( ZLIB_VALID gzopen "zlib.h" ZLIB_LIBRARIES z zlib )
+   if ( NOT ZLIB_VALID )
+      bad_arch_library ( WARNING "zlib" "ZLIB_INCLUDE_DIRS and ZLIB_LIBRARIES" )
+   endif ()
+   set ( HAVE_ZLIB ${ZLIB_VALID} )
+endif ()
+print_variables ( HAVE_ZLIB )
+
 # headers
 # TODO minimize headers in the source
 set ( _missing )
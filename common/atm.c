@@ -314,7 +314,7 @@ int atmsw_create_vpc(atmsw_table_t *t,char *nio_input,u_int vpi_in,
 
    /* Add as a RX listener */
    if (netio_rxl_add(swc->input,(netio_rx_handler_t)atmsw_recv_cell,
-                     t,NULL) == -1)
+                     t,NULL,NULL) == -1)
       goto error;
 
    hbucket = atmsw_vpc_hash(vpi_in);
@@ -407,7 +407,7 @@ int atmsw_create_vcc(atmsw_table_t *t,
 
    /* Add as a RX listener */
    if (netio_rxl_add(swc->input,(netio_rx_handler_t)atmsw_recv_cell,
-                     t,NULL) == -1)
+                     t,NULL,NULL) == -1)
       goto error;
 
    hbucket = atmsw_vcc_hash(vpi_in,vci_in);
@@ -145,12 +145,12 @@ int atm_bridge_configure(atm_bridge_t *t,char *eth_nio,
 
    /* Add ATM RX listener */
    if (netio_rxl_add(t->atm_nio,(netio_rx_handler_t)atm_bridge_recv_cell,
-                     t,NULL) == -1)
+                     t,NULL,NULL) == -1)
       goto error;
 
    /* Add Ethernet RX listener */
    if (netio_rxl_add(t->eth_nio,(netio_rx_handler_t)atm_bridge_recv_pkt,
-                     t,NULL) == -1)
+                     t,NULL,NULL) == -1)
       goto error;
 
    ATM_BRIDGE_UNLOCK(t);
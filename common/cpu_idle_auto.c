@@ -0,0 +1,393 @@
+/*
+ * Cisco router simulation platform.
+ * Copyright (c) 2005,2006 Christophe Fillot (cf@utc.fr)
+ *
+ * cpu_idle_auto.c: Automatic idle PC detection and idle throttling.
+ *
+ * The CPU loop calls cpu_idle_auto_check() at each timer IRQ check.
+ * PCs are sampled there, so candidates are always PCs at which the
+ * loop can detect the idle PC. The calls are made every timer IRQ check
+ * interval of guest code, so their count measures the guest progress.
+ * Once per window, the load of the CPU thread (host CPU time / wall
+ * time) and the guest progress per host CPU time are measured:
+ *
+ *  - SAMPLE: when the CPU is busy, the most frequent PC among the PCs
+ *    seen 2% to 8% of the time, as the idle PC calibration does (if it
+ *    was also the best one during the previous window) is tried;
+ *  - VALIDATE: the candidate is kept if the load dropped enough,
+ *    without timer drift, and if the guest still runs as much code per
+ *    host CPU time: an idle PC in the middle of real work makes the CPU
+ *    sleep and wake up over and over. Otherwise it is reverted and
+ *    rejected;
+ *  - ACTIVE: idle_max and idle_sleep_time are adapted to the load and
+ *    the host CPU time saved is accounted.
+ *
+ * When the candidate is reverted, or the detection disabled, the idle PC
+ * is cleared and idle_max/idle_sleep_time get back their former values.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cpu.h"
+#include "vm.h"
+#include "vclock.h"
+#include "cpu_idle_auto.h"
+
+/* Window length (nanoseconds) */
+#define CPU_IDLE_AUTO_WINDOW_NS  ((m_tmcnt_t)CPU_IDLE_AUTO_WINDOW * 1000000)
+
+/* Busy windows without idle sleeps before searching a new idle PC */
+#define CPU_IDLE_AUTO_MAX_MISSES  30
+
+/* Name of detection states */
+static char *cpu_idle_auto_states[] = {
+   "off", "wait", "sample", "validate", "active",
+};
+
+/* Get the name of a detection state */
+char *cpu_idle_auto_state_name(u_int state)
+{
+   if (state > CPU_IDLE_AUTO_ACTIVE)
+      return("unknown");
+
+   return(cpu_idle_auto_states[state]);
+}
+
+/* Get the idle PC of a CPU */
+static m_uint64_t cpu_idle_auto_get_idle_pc(cpu_gen_t *cpu)
+{
+   switch(cpu->type) {
+      case CPU_TYPE_MIPS64:
+         return(CPU_MIPS64(cpu)->idle_pc);
+      case CPU_TYPE_PPC32:
+         return((m_uint64_t)CPU_PPC32(cpu)->idle_pc);
+      default:
+         return(0);
+   }
+}
+
+/* Get the timer drift counter of a CPU */
+static u_int cpu_idle_auto_get_drift(cpu_gen_t *cpu)
+{
+   switch(cpu->type) {
+      case CPU_TYPE_MIPS64:
+         return(CPU_MIPS64(cpu)->timer_drift);
+      case CPU_TYPE_PPC32:
+         return(CPU_PPC32(cpu)->timer_drift);
+      default:
+         return(0);
+   }
+}
+
+/* Get the CPU time used by a CPU, from the calling thread (nanoseconds) */
+static m_tmcnt_t cpu_idle_auto_thread_time(cpu_gen_t *cpu)
+{
+   struct timespec ts;
+
+   /* Workers of the CPU scheduler run several CPUs */
+   if (cpu->sched != NULL)
+      return(cpu_sched_get_run_time(cpu));
+
+   if (clock_gettime(CLOCK_THREAD_CPUTIME_ID,&ts) == -1)
+      return(0);
+
+   return(((m_tmcnt_t)ts.tv_sec * 1000000000) + (m_tmcnt_t)ts.tv_nsec);
+}
+
+/* Start a new measurement window */
+static void cpu_idle_auto_new_window(cpu_gen_t *cpu,cpu_idle_auto_t *ia,
+                                     m_tmcnt_t now)
+{
+   ia->win_start  = now;
+   ia->win_cpu    = cpu_idle_auto_thread_time(cpu);
+   ia->win_sleeps = cpu->idle_sleep_count;
+   ia->win_drift  = cpu_idle_auto_get_drift(cpu);
+   ia->win_checks = 0;
+
+   if (ia->hist_samples) {
+      memset(ia->hist,0,sizeof(ia->hist));
+      ia->hist_samples = 0;
+   }
+}
+
+/* Record a PC sample */
+static void cpu_idle_auto_sample(cpu_idle_auto_t *ia,m_uint64_t pc)
+{
+   struct cpu_idle_auto_pc *e;
+   u_int i,h;
+
+   h = (pc >> 2) & (CPU_IDLE_AUTO_HIST_SIZE - 1);
+   ia->hist_samples++;
+
+   for(i=0;i<8;i++,h=(h+1)&(CPU_IDLE_AUTO_HIST_SIZE-1)) {
+      e = &ia->hist[h];
+
+      if (!e->count) {
+         e->pc = pc;
+         e->count = 1;
+         return;
+      }
+
+      if (e->pc == pc) {
+         e->count++;
+         return;
+      }
+   }
+}
+
+/* Check if a PC has already been rejected */
+static int cpu_idle_auto_rejected(cpu_idle_auto_t *ia,m_uint64_t pc)
+{
+   u_int i;
+
+   for(i=0;i<ia->reject_count;i++)
+      if (ia->reject[i] == pc)
+         return(TRUE);
+
+   return(FALSE);
+}
+
+/* Find the most frequent PC of the window in the candidate band */
+static m_uint64_t cpu_idle_auto_best_pc(cpu_idle_auto_t *ia)
+{
+   struct cpu_idle_auto_pc *e;
+   m_uint64_t best = 0;
+   u_int i,min,max,best_count = 0;
+
+   min = (ia->hist_samples * CPU_IDLE_AUTO_PC_MIN) / 1000;
+   max = (ia->hist_samples * CPU_IDLE_AUTO_PC_MAX) / 1000;
+
+   for(i=0;i<CPU_IDLE_AUTO_HIST_SIZE;i++) {
+      e = &ia->hist[i];
+
+      if (!e->count || !e->pc || (e->count < min) || (e->count > max) ||
+          (e->count <= best_count))
+         continue;
+
+      if (!cpu_idle_auto_rejected(ia,e->pc)) {
+         best = e->pc;
+         best_count = e->count;
+      }
+   }
+
+   return(best);
+}
+
+/* Revert the candidate idle PC, rejecting it if it did not work */
+static void cpu_idle_auto_revert(cpu_gen_t *cpu,cpu_idle_auto_t *ia,
+                                 int reject,char *reason)
+{
+   cpu_log(cpu,"IDLE_AUTO","reverting idle PC 0x%llx (%s)\n",
+           ia->candidate,reason);
+
+   /* Don't touch an idle PC set in the meantime by the operator */
+   if (cpu_idle_auto_get_idle_pc(cpu) == ia->candidate) {
+      cpu->set_idle_pc(cpu,0);
+      cpu->idle_max = ia->saved_idle_max;
+      cpu->idle_sleep_time = ia->saved_sleep_time;
+   }
+
+   if (reject) {
+      ia->reject[ia->reject_pos] = ia->candidate;
+      ia->reject_pos = (ia->reject_pos + 1) % CPU_IDLE_AUTO_MAX_REJECT;
+
+      if (ia->reject_count < CPU_IDLE_AUTO_MAX_REJECT)
+         ia->reject_count++;
+   }
+
+   ia->reverted++;
+   ia->candidate = 0;
+   ia->prev_best = 0;
+   ia->state = CPU_IDLE_AUTO_SAMPLE;
+}
+
+/* Adapt idle_max and idle_sleep_time (ACTIVE state) */
+static void cpu_idle_auto_adapt(cpu_gen_t *cpu,cpu_idle_auto_t *ia,
+                                u_int drift,m_uint64_t sleeps)
+{
+   if (drift) {
+      /* Timer IRQs are late: sleep later and shorter */
+      if ((cpu->idle_max >= CPU_IDLE_AUTO_IDLE_MAX_MAX) &&
+          (cpu->idle_sleep_time <= CPU_IDLE_AUTO_SLEEP_MIN))
+      {
+         cpu_idle_auto_revert(cpu,ia,TRUE,"timer drift");
+         return;
+      }
+
+      cpu->idle_max = m_min(cpu->idle_max * 2,CPU_IDLE_AUTO_IDLE_MAX_MAX);
+      cpu->idle_sleep_time = m_max(cpu->idle_sleep_time / 2,
+                                   CPU_IDLE_AUTO_SLEEP_MIN);
+      return;
+   }
+
+   /* The idle loop is reached but the host CPU is still used: be greedy */
+   if (sleeps && (ia->load >= CPU_IDLE_AUTO_BUSY_LOAD / 2)) {
+      cpu->idle_max = m_max(cpu->idle_max / 2,CPU_IDLE_AUTO_IDLE_MAX_MIN);
+      cpu->idle_sleep_time = m_min(cpu->idle_sleep_time +
+                                   (cpu->idle_sleep_time / 4),
+                                   CPU_IDLE_AUTO_SLEEP_MAX);
+   }
+}
+
+/* End of a measurement window */
+static void cpu_idle_auto_end_window(cpu_gen_t *cpu,cpu_idle_auto_t *ia,
+                                     m_tmcnt_t now)
+{
+   m_tmcnt_t len,used;
+   m_uint64_t sleeps,pc;
+   u_int drift;
+
+   len = now - ia->win_start;
+
+   /* Ignore a window including a pause of the CPU */
+   if (len > (2 * CPU_IDLE_AUTO_WINDOW_NS))
+      goto done;
+
+   used   = cpu_idle_auto_thread_time(cpu) - ia->win_cpu;
+   sleeps = cpu->idle_sleep_count - ia->win_sleeps;
+   drift  = cpu_idle_auto_get_drift(cpu) - ia->win_drift;
+   ia->load = m_min((used * 1000) / len,1000);
+   ia->progress = used ? (ia->win_checks * 1000000) / used : 0;
+
+   switch(ia->state) {
+      case CPU_IDLE_AUTO_WAIT:
+         if (++ia->warmup >= CPU_IDLE_AUTO_WARMUP)
+            ia->state = CPU_IDLE_AUTO_SAMPLE;
+         break;
+
+      case CPU_IDLE_AUTO_SAMPLE:
+         /* Nothing to save, or an idle PC has been set manually */
+         if ((ia->load < CPU_IDLE_AUTO_BUSY_LOAD) ||
+             (cpu_idle_auto_get_idle_pc(cpu) != 0))
+         {
+            ia->prev_best = 0;
+            break;
+         }
+
+         pc = cpu_idle_auto_best_pc(ia);
+
+         /* The candidate must be the best PC of two windows in a row */
+         if (pc && (pc == ia->prev_best)) {
+            cpu_log(cpu,"IDLE_AUTO","trying idle PC 0x%llx (load %u.%u%%)\n",
+                    pc,ia->load / 10,ia->load % 10);
+
+            ia->candidate = pc;
+            ia->base_load = ia->load;
+            ia->base_progress = ia->progress;
+            ia->saved_idle_max = cpu->idle_max;
+            ia->saved_sleep_time = cpu->idle_sleep_time;
+            ia->tried++;
+            ia->state = CPU_IDLE_AUTO_VALIDATE;
+            ia->misses = 0;
+            cpu->set_idle_pc(cpu,pc);
+            pc = 0;
+         }
+
+         ia->prev_best = pc;
+         break;
+
+      case CPU_IDLE_AUTO_VALIDATE:
+         if (drift) {
+            cpu_idle_auto_revert(cpu,ia,TRUE,"timer drift");
+         } else if (!sleeps) {
+            cpu_idle_auto_revert(cpu,ia,TRUE,"idle loop not reached");
+         } else if ((ia->load * 100) >
+                    (ia->base_load * (100 - CPU_IDLE_AUTO_MIN_GAIN)))
+         {
+            cpu_idle_auto_revert(cpu,ia,TRUE,"no host CPU gain");
+         } else if ((ia->progress * 100) <
+                    (ia->base_progress * CPU_IDLE_AUTO_MIN_PROGRESS))
+         {
+            cpu_idle_auto_revert(cpu,ia,TRUE,"guest progress dropped");
+         } else {
+            cpu_log(cpu,"IDLE_AUTO","using idle PC 0x%llx (load %u.%u%%)\n",
+                    ia->candidate,ia->load / 10,ia->load % 10);
+            ia->accepted++;
+            ia->state = CPU_IDLE_AUTO_ACTIVE;
+         }
+         break;
+
+      case CPU_IDLE_AUTO_ACTIVE:
+         if (ia->load < ia->base_load)
+            ia->cpu_saved += ((ia->base_load - ia->load) * len) / 1000;
+
+         /* The idle loop is not used anymore (reload, new image...) */
+         if (!sleeps && (ia->load >= CPU_IDLE_AUTO_BUSY_LOAD)) {
+            if (++ia->misses >= CPU_IDLE_AUTO_MAX_MISSES) {
+               cpu_idle_auto_revert(cpu,ia,FALSE,"idle loop not reached");
+               break;
+            }
+         } else {
+            ia->misses = 0;
+         }
+
+         cpu_idle_auto_adapt(cpu,ia,drift,sleeps);
+         break;
+   }
+
+ done:
+   cpu_idle_auto_new_window(cpu,ia,now);
+}
+
+/* Sample the PC and run the detection (called by the CPU loop) */
+void cpu_idle_auto_check(cpu_gen_t *cpu)
+{
+   cpu_idle_auto_t *ia = cpu->idle_auto;
+   m_tmcnt_t now;
+
+   if (unlikely(!ia->enabled)) {
+      if ((ia->state == CPU_IDLE_AUTO_VALIDATE) || 
+          (ia->state == CPU_IDLE_AUTO_ACTIVE))
+         cpu_idle_auto_revert(cpu,ia,FALSE,"detection disabled");
+
+      ia->state = CPU_IDLE_AUTO_OFF;
+      return;
+   }
+
+   now = vclock_gettime();
+   ia->win_checks++;
+
+   if (unlikely(ia->state == CPU_IDLE_AUTO_OFF)) {
+      ia->state  = CPU_IDLE_AUTO_WAIT;
+      ia->warmup = 0;
+      cpu_idle_auto_new_window(cpu,ia,now);
+      return;
+   }
+
+   if (ia->state == CPU_IDLE_AUTO_SAMPLE)
+      cpu_idle_auto_sample(ia,cpu_get_pc(cpu));
+
+   if (unlikely((now - ia->win_start) >= CPU_IDLE_AUTO_WINDOW_NS))
+      cpu_idle_auto_end_window(cpu,ia,now);
+}
+
+/* Enable or disable automatic idle PC detection for a CPU */
+int cpu_idle_auto_enable(cpu_gen_t *cpu,int enable)
+{
+   cpu_idle_auto_t *ia;
+
+   if (!cpu->idle_auto) {
+      if (!enable)
+         return(0);
+
+      if (!(ia = calloc(1,sizeof(*ia))))
+         return(-1);
+
+      ia->enabled = TRUE;
+      cpu->idle_auto = ia;
+      return(0);
+   }
+
+   cpu->idle_auto->enabled = enable;
+   return(0);
+}
+
+/* Free the automatic idle PC state of a CPU */
+void cpu_idle_auto_free(cpu_gen_t *cpu)
+{
+   free(cpu->idle_auto);
+   cpu->idle_auto = NULL;
+}
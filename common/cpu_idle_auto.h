@@ -0,0 +1,118 @@
+/*
+ * Cisco router simulation platform.
+ * Copyright (c) 2005,2006 Christophe Fillot (cf@utc.fr)
+ *
+ * cpu_idle_auto.h: Automatic idle PC detection and idle throttling.
+ */
+
+#ifndef __CPU_IDLE_AUTO_H__
+#define __CPU_IDLE_AUTO_H__  1
+
+#include <sys/types.h>
+#include "utils.h"
+
+/* Measurement window (milliseconds) */
+#define CPU_IDLE_AUTO_WINDOW       1000
+
+/* Windows to wait after start before sampling (IOS decompression, boot) */
+#define CPU_IDLE_AUTO_WARMUP       10
+
+/* Number of entries of the PC histogram (power of 2) */
+#define CPU_IDLE_AUTO_HIST_SIZE    1024
+
+/* Max number of rejected candidates remembered */
+#define CPU_IDLE_AUTO_MAX_REJECT   16
+
+/* Thread load (per mille) above which the CPU is considered busy */
+#define CPU_IDLE_AUTO_BUSY_LOAD    500
+
+/* 
+ * Frequency band of candidate PCs (per mille of samples), as used by the
+ * idle PC calibration: the idle loop spans several PCs, and a PC seen
+ * more often is usually a busy loop doing real work.
+ */
+#define CPU_IDLE_AUTO_PC_MIN       20
+#define CPU_IDLE_AUTO_PC_MAX       80
+
+/* A candidate must remove at least this part (%) of the host CPU load */
+#define CPU_IDLE_AUTO_MIN_GAIN     30
+
+/* Guest code run per host CPU time kept with a candidate (%, at least) */
+#define CPU_IDLE_AUTO_MIN_PROGRESS 50
+
+/* Bounds of the adapted idle_max and idle_sleep_time (us) values */
+#define CPU_IDLE_AUTO_IDLE_MAX_MIN    50
+#define CPU_IDLE_AUTO_IDLE_MAX_MAX    1500
+#define CPU_IDLE_AUTO_SLEEP_MIN       5000
+#define CPU_IDLE_AUTO_SLEEP_MAX       50000
+
+/* Detection states */
+enum {
+   CPU_IDLE_AUTO_OFF = 0,
+   CPU_IDLE_AUTO_WAIT,
+   CPU_IDLE_AUTO_SAMPLE,
+   CPU_IDLE_AUTO_VALIDATE,
+   CPU_IDLE_AUTO_ACTIVE,
+};
+
+/* PC histogram entry */
+struct cpu_idle_auto_pc {
+   m_uint64_t pc;
+   u_int count;
+};
+
+/* Automatic idle PC state of a CPU (only used by the CPU thread) */
+typedef struct cpu_idle_auto cpu_idle_auto_t;
+struct cpu_idle_auto {
+   volatile int enabled;
+   u_int state,warmup;
+
+   /* Current window: wall time and thread CPU time at start (ns) */
+   m_tmcnt_t win_start,win_cpu;
+   m_uint64_t win_sleeps;
+   u_int win_drift;
+
+   /* Calls of the CPU loop in the current window (guest progress) */
+   m_uint64_t win_checks;
+
+   /* PC histogram of the current window and previous best PC */
+   struct cpu_idle_auto_pc hist[CPU_IDLE_AUTO_HIST_SIZE];
+   u_int hist_samples;
+   m_uint64_t prev_best;
+
+   /* 
+    * Candidate idle PC, load (per mille) and guest progress (CPU loop
+    * calls per host CPU ms) measured without it
+    */
+   m_uint64_t candidate;
+   u_int base_load,load;
+   m_uint64_t base_progress,progress;
+
+   /* idle_max and idle_sleep_time before the candidate was installed */
+   u_int saved_idle_max,saved_sleep_time;
+
+   /* Busy windows without idle sleeps since the idle PC is used */
+   u_int misses;
+
+   /* Candidates which did not work */
+   m_uint64_t reject[CPU_IDLE_AUTO_MAX_REJECT];
+   u_int reject_count,reject_pos;
+
+   /* Statistics */
+   m_uint64_t tried,accepted,reverted;
+   m_tmcnt_t cpu_saved;
+};
+
+/* Enable or disable automatic idle PC detection for a CPU */
+int cpu_idle_auto_enable(cpu_gen_t *cpu,int enable);
+
+/* Free the automatic idle PC state of a CPU */
+void cpu_idle_auto_free(cpu_gen_t *cpu);
+
+/* Sample the PC and run the detection (called by the CPU loop) */
+void cpu_idle_auto_check(cpu_gen_t *cpu);
+
+/* Get the name of a detection state */
+char *cpu_idle_auto_state_name(u_int state);
+
+#endif
@@ -0,0 +1,840 @@
+/*
+ * Cisco router simulation platform.
+ * Copyright (c) 2005,2006 Christophe Fillot (cf@utc.fr)
+ *
+ * cpu_sched.c: M:N scheduler running virtual CPUs on a pool of threads.
+ *
+ * By default, each virtual CPU has its own thread, and with hundreds of
+ * instances the host scheduler switches between hundreds of runnable
+ * threads. When the scheduler is enabled, virtual CPUs are run by a fixed
+ * pool of worker threads instead (one per host CPU by default). A CPU
+ * keeps its usual run loop, executed on its own stack (ucontext), and
+ * gives its worker back when its time slice expires (checked with the
+ * timer IRQs), when it enters the idle loop or when it is paused.
+ *
+ * Each worker has a run queue and picks the CPU with the lowest virtual
+ * runtime (CPU time weighted by the priority of its VM). Workers take CPUs
+ * from longer queues, and idle workers get the CPUs which wake up. The CPU
+ * time of a VM can be limited to a quota (percentage of a host CPU).
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include "cpu.h"
+#include "vm.h"
+#include "cpu_sched.h"
+
+/* Number of worker threads (0: one per host CPU), -1 if disabled */
+int cpu_sched_workers = -1;
+
+static cpu_sched_worker_t cpu_sched_worker_array[CPU_SCHED_MAX_WORKERS];
+static u_int cpu_sched_worker_count = 0;
+
+/* Global lock (run queues, wait heap, groups and CPU states) */
+static pthread_mutex_t cpu_sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cpu_sched_done_cond = PTHREAD_COND_INITIALIZER;
+
+/* Sleeping CPUs, as a binary heap ordered by timeout */
+static cpu_sched_vcpu_t **cpu_sched_heap = NULL;
+static u_int cpu_sched_heap_count = 0;
+static u_int cpu_sched_heap_size = 0;
+static u_int cpu_sched_vcpu_count = 0;
+
+/* CPU accounting groups (one per VM) */
+static cpu_sched_group_t *cpu_sched_group_list = NULL;
+
+#define CPU_SCHED_LOCK()    pthread_mutex_lock(&cpu_sched_lock)
+#define CPU_SCHED_UNLOCK()  pthread_mutex_unlock(&cpu_sched_lock)
+
+/* Weights of priorities (ratio of 1.25 between two levels) */
+static const u_int cpu_sched_weights[] = {
+   110, 137, 172, 215, 268, 336, 419, 524, 655, 819,
+   1024,
+   1280, 1600, 2000, 2500, 3125, 3906, 4883, 6104, 7629, 9537,
+};
+
+/* Virtual CPU state names */
+static char *cpu_sched_state_names[] = {
+   "runnable", "running", "waiting", "done",
+};
+
+/* Get the monotonic time (nanoseconds) */
+static m_tmcnt_t cpu_sched_gettime(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC,&ts);
+   return(((m_tmcnt_t)ts.tv_sec * 1000000000) + (m_tmcnt_t)ts.tv_nsec);
+}
+
+/* Get the name of a virtual CPU state */
+char *cpu_sched_state_name(u_int state)
+{
+   if (state > CPU_SCHED_DONE)
+      return("unknown");
+
+   return(cpu_sched_state_names[state]);
+}
+
+/* Get the weight of a priority */
+u_int cpu_sched_prio_weight(int prio)
+{
+   prio = m_max(prio,CPU_SCHED_PRIO_MIN);
+   prio = m_min(prio,CPU_SCHED_PRIO_MAX);
+   return(cpu_sched_weights[prio - CPU_SCHED_PRIO_MIN]);
+}
+
+/* Get the CPU time a group can use per quota period (0: no limit) */
+static m_tmcnt_t cpu_sched_group_budget(cpu_sched_group_t *g)
+{
+   return((m_tmcnt_t)g->vm->sched_quota * CPU_SCHED_QUOTA_PERIOD * 10);
+}
+
+/* Start a new quota period if the current one is over */
+static void cpu_sched_group_update(cpu_sched_group_t *g,m_tmcnt_t now)
+{
+   if (now >= g->period_end) {
+      g->period_end  = now + ((m_tmcnt_t)CPU_SCHED_QUOTA_PERIOD * 1000);
+      g->period_used = 0;
+   }
+}
+
+/* Returns TRUE if a group has used its quota for the current period */
+static int cpu_sched_group_throttled(cpu_sched_group_t *g,m_tmcnt_t now)
+{
+   m_tmcnt_t budget;
+
+   if (!(budget = cpu_sched_group_budget(g)))
+      return(FALSE);
+
+   cpu_sched_group_update(g,now);
+   return(g->period_used >= budget);
+}
+
+/* Get the accounting group of a VM (lock held) */
+static cpu_sched_group_t *cpu_sched_group_get(vm_instance_t *vm)
+{
+   cpu_sched_group_t *g;
+
+   for(g=cpu_sched_group_list;g;g=g->next)
+      if (g->vm == vm) {
+         g->ref_count++;
+         return g;
+      }
+
+   if (!(g = malloc(sizeof(*g))))
+      return NULL;
+
+   memset(g,0,sizeof(*g));
+   g->vm = vm;
+   g->ref_count = 1;
+   g->next = cpu_sched_group_list;
+   cpu_sched_group_list = g;
+   return g;
+}
+
+/* Release an accounting group (lock held) */
+static void cpu_sched_group_put(cpu_sched_group_t *g)
+{
+   cpu_sched_group_t **p;
+
+   if (--g->ref_count > 0)
+      return;
+
+   for(p=&cpu_sched_group_list;*p;p=&(*p)->next)
+      if (*p == g) {
+         *p = g->next;
+         break;
+      }
+
+   free(g);
+}
+
+/* Swap two entries of the wait heap */
+static void cpu_sched_heap_swap(u_int a,u_int b)
+{
+   cpu_sched_vcpu_t *v = cpu_sched_heap[a];
+
+   cpu_sched_heap[a] = cpu_sched_heap[b];
+   cpu_sched_heap[b] = v;
+   cpu_sched_heap[a]->heap_index = a;
+   cpu_sched_heap[b]->heap_index = b;
+}
+
+/* Move an entry of the wait heap up */
+static void cpu_sched_heap_up(u_int i)
+{
+   u_int p;
+
+   while(i > 0) {
+      p = (i - 1) / 2;
+
+      if (cpu_sched_heap[p]->deadline <= cpu_sched_heap[i]->deadline)
+         break;
+
+      cpu_sched_heap_swap(p,i);
+      i = p;
+   }
+}
+
+/* Move an entry of the wait heap down */
+static void cpu_sched_heap_down(u_int i)
+{
+   u_int l,r,m;
+
+   for(;;) {
+      l = (2 * i) + 1;
+      r = l + 1;
+      m = i;
+
+      if ((l < cpu_sched_heap_count) &&
+          (cpu_sched_heap[l]->deadline < cpu_sched_heap[m]->deadline))
+         m = l;
+
+      if ((r < cpu_sched_heap_count) &&
+          (cpu_sched_heap[r]->deadline < cpu_sched_heap[m]->deadline))
+         m = r;
+
+      if (m == i)
+         break;
+
+      cpu_sched_heap_swap(i,m);
+      i = m;
+   }
+}
+
+/* Insert a sleeping CPU in the wait heap (lock held) */
+static void cpu_sched_heap_insert(cpu_sched_vcpu_t *v)
+{
+   u_int i = cpu_sched_heap_count++;
+
+   cpu_sched_heap[i] = v;
+   v->heap_index = i;
+   cpu_sched_heap_up(i);
+}
+
+/* Remove a CPU from the wait heap (lock held) */
+static void cpu_sched_heap_remove(cpu_sched_vcpu_t *v)
+{
+   u_int i = v->heap_index;
+   u_int last = --cpu_sched_heap_count;
+
+   if (i != last) {
+      cpu_sched_heap[i] = cpu_sched_heap[last];
+      cpu_sched_heap[i]->heap_index = i;
+      cpu_sched_heap_up(i);
+      cpu_sched_heap_down(i);
+   }
+}
+
+/* Insert a CPU in the run queue of a worker (lock held) */
+static void cpu_sched_rq_insert(cpu_sched_worker_t *w,cpu_sched_vcpu_t *v,
+                                m_tmcnt_t now)
+{
+   v->worker = w;
+   v->state = CPU_SCHED_RUNNABLE;
+   v->ready_time = now;
+
+   v->rq_next = w->rq_head;
+   v->rq_pprev = &w->rq_head;
+
+   if (w->rq_head != NULL)
+      w->rq_head->rq_pprev = &v->rq_next;
+
+   w->rq_head = v;
+   w->rq_count++;
+
+   if (w->idle)
+      pthread_cond_signal(&w->cond);
+}
+
+/* Remove a CPU from the run queue of its worker (lock held) */
+static void cpu_sched_rq_remove(cpu_sched_vcpu_t *v)
+{
+   if (v->rq_next != NULL)
+      v->rq_next->rq_pprev = v->rq_pprev;
+
+   *v->rq_pprev = v->rq_next;
+   v->worker->rq_count--;
+
+   v->rq_next = NULL;
+   v->rq_pprev = NULL;
+}
+
+/* Get the runnable CPU with the lowest virtual runtime (lock held) */
+static cpu_sched_vcpu_t *cpu_sched_rq_pick(cpu_sched_worker_t *w,
+                                           m_tmcnt_t now)
+{
+   cpu_sched_vcpu_t *v,*best = NULL;
+
+   for(v=w->rq_head;v;v=v->rq_next) {
+      /* A CPU being paused or stopped is not limited by the quota */
+      if ((v->cpu->state == CPU_STATE_RUNNING) &&
+          cpu_sched_group_throttled(v->group,now))
+         continue;
+
+      if (!best || (v->vruntime < best->vruntime))
+         best = v;
+   }
+
+   return best;
+}
+
+/* Move the virtual runtime of a CPU to the time base of another worker */
+static void cpu_sched_migrate(cpu_sched_vcpu_t *v,cpu_sched_worker_t *dst)
+{
+   cpu_sched_worker_t *src = v->worker;
+   m_tmcnt_t lag = 0;
+
+   if (src == dst)
+      return;
+
+   if (v->vruntime > src->min_vruntime)
+      lag = v->vruntime - src->min_vruntime;
+
+   v->vruntime = dst->min_vruntime + lag;
+   v->worker = dst;
+   v->migrate_count++;
+}
+
+/* Make a CPU runnable, preferably on its last worker (lock held) */
+static void cpu_sched_make_runnable(cpu_sched_vcpu_t *v,m_tmcnt_t now)
+{
+   cpu_sched_worker_t *w = v->worker;
+   m_tmcnt_t min_vruntime;
+   u_int i;
+
+   /* An idle worker will run it sooner than a busy one */
+   if (w->current || w->rq_count) {
+      for(i=0;i<cpu_sched_worker_count;i++) {
+         if (cpu_sched_worker_array[i].idle &&
+             !cpu_sched_worker_array[i].rq_count)
+         {
+            cpu_sched_migrate(v,&cpu_sched_worker_array[i]);
+            break;
+         }
+      }
+   }
+
+   /* A sleeping CPU doesn't get more than one slice of credit */
+   w = v->worker;
+   min_vruntime = w->min_vruntime;
+   min_vruntime -= m_min(min_vruntime,(m_tmcnt_t)CPU_SCHED_SLICE * 1000);
+
+   if (v->vruntime < min_vruntime)
+      v->vruntime = min_vruntime;
+
+   cpu_sched_rq_insert(w,v,now);
+}
+
+/* Make runnable the CPUs whose idle wait has timed out (lock held) */
+static void cpu_sched_expire(m_tmcnt_t now)
+{
+   cpu_sched_vcpu_t *v;
+
+   while(cpu_sched_heap_count && (cpu_sched_heap[0]->deadline <= now)) {
+      v = cpu_sched_heap[0];
+      cpu_sched_heap_remove(v);
+      cpu_sched_make_runnable(v,now);
+   }
+}
+
+/* Take a runnable CPU from the worker having the longest queue */
+static cpu_sched_vcpu_t *cpu_sched_steal(cpu_sched_worker_t *w,
+                                         u_int min_count,m_tmcnt_t now)
+{
+   cpu_sched_worker_t *x,*src = NULL;
+   cpu_sched_vcpu_t *v;
+   u_int i;
+
+   for(i=0;i<cpu_sched_worker_count;i++) {
+      x = &cpu_sched_worker_array[i];
+
+      if ((x != w) && (x->rq_count > min_count) &&
+          (!src || (x->rq_count > src->rq_count)))
+         src = x;
+   }
+
+   if (!src || !(v = cpu_sched_rq_pick(src,now)))
+      return NULL;
+
+   cpu_sched_rq_remove(v);
+   cpu_sched_migrate(v,w);
+   w->steal_count++;
+   return v;
+}
+
+/* Select the next CPU to run on a worker (lock held) */
+static cpu_sched_vcpu_t *cpu_sched_pick(cpu_sched_worker_t *w,m_tmcnt_t now)
+{
+   cpu_sched_vcpu_t *v;
+
+   cpu_sched_expire(now);
+
+   /* Balance the load with the workers having a longer queue */
+   if ((v = cpu_sched_steal(w,w->rq_count+1,now)) != NULL)
+      return v;
+
+   if ((v = cpu_sched_rq_pick(w,now)) != NULL) {
+      cpu_sched_rq_remove(v);
+      return v;
+   }
+
+   return(cpu_sched_steal(w,0,now));
+}
+
+/* Start a new time slice, limited by the quota of the VM (lock held) */
+static void cpu_sched_new_slice(cpu_sched_vcpu_t *v,m_tmcnt_t now)
+{
+   cpu_sched_group_t *g = v->group;
+   m_tmcnt_t budget,slice;
+
+   slice = (m_tmcnt_t)CPU_SCHED_SLICE * 1000;
+
+   if ((budget = cpu_sched_group_budget(g)) != 0) {
+      cpu_sched_group_update(g,now);
+
+      if (g->period_used < budget)
+         slice = m_min(slice,budget - g->period_used);
+   }
+
+   v->slice_start = now;
+   v->slice_end = now + slice;
+}
+
+/* Account the CPU time used since the start of the slice (lock held) */
+static void cpu_sched_account(cpu_sched_vcpu_t *v,m_tmcnt_t now)
+{
+   cpu_sched_group_t *g = v->group;
+   m_tmcnt_t delta,budget;
+
+   if (now <= v->slice_start)
+      return;
+
+   delta = now - v->slice_start;
+   v->slice_start = now;
+
+   v->run_time += delta;
+   v->vruntime += (delta * CPU_SCHED_WEIGHT_DEF) /
+      cpu_sched_prio_weight(g->vm->sched_prio);
+
+   g->run_time += delta;
+
+   if ((budget = cpu_sched_group_budget(g)) != 0) {
+      cpu_sched_group_update(g,now);
+
+      if ((g->period_used < budget) && ((g->period_used + delta) >= budget)) {
+         g->throttle_count++;
+         v->throttle_count++;
+      }
+
+      g->period_used += delta;
+   }
+}
+
+/* Give the worker back (called by the running CPU) */
+static void cpu_sched_switch(cpu_sched_vcpu_t *v,u_int next_state)
+{
+   v->next_state = next_state;
+   swapcontext(&v->ctx,&v->worker->ctx);
+}
+
+/* Entry point of a CPU context (the pointer is split in two integers) */
+static void cpu_sched_vcpu_start(u_int hi,u_int lo)
+{
+   cpu_sched_vcpu_t *v;
+
+   v = (cpu_sched_vcpu_t *)(m_iptr_t)(((m_uint64_t)hi << 32) | lo);
+   v->run_fn(v->cpu);
+
+   /* The run function has returned: the worker never resumes us */
+   cpu_sched_switch(v,CPU_SCHED_DONE);
+}
+
+/* End the time slice of the calling CPU if it has expired */
+void cpu_sched_check(cpu_gen_t *cpu)
+{
+   cpu_sched_vcpu_t *v = cpu->sched;
+   cpu_sched_vcpu_t *next;
+   m_tmcnt_t now;
+   int preempt;
+
+   now = cpu_sched_gettime();
+
+   if (now < v->slice_end)
+      return;
+
+   CPU_SCHED_LOCK();
+   cpu_sched_account(v,now);
+   cpu_sched_expire(now);
+
+   /* Go on if the quota allows it and no CPU of this worker is behind */
+   next = cpu_sched_rq_pick(v->worker,now);
+
+   preempt = ((cpu->state == CPU_STATE_RUNNING) &&
+              cpu_sched_group_throttled(v->group,now)) ||
+      (next && (next->vruntime < v->vruntime));
+
+   if (!preempt) {
+      cpu_sched_new_slice(v,now);
+      CPU_SCHED_UNLOCK();
+      return;
+   }
+
+   v->preempt_count++;
+   CPU_SCHED_UNLOCK();
+
+   cpu_sched_switch(v,CPU_SCHED_RUNNABLE);
+}
+
+/* Let the calling CPU sleep until it is woken up or the timeout expires */
+void cpu_sched_sleep(cpu_gen_t *cpu,u_int usec)
+{
+   cpu_sched_vcpu_t *v = cpu->sched;
+
+   v->deadline = cpu_sched_gettime() + ((m_tmcnt_t)usec * 1000);
+   cpu_sched_switch(v,CPU_SCHED_WAITING);
+}
+
+/* Make a sleeping CPU runnable */
+void cpu_sched_wakeup(cpu_gen_t *cpu)
+{
+   cpu_sched_vcpu_t *v;
+
+   CPU_SCHED_LOCK();
+
+   /*
+    * If the CPU is still being switched out, its worker sees the wakeup
+    * in the wake word and doesn't put it to sleep.
+    */
+   if ((v = cpu->sched) && (v->state == CPU_SCHED_WAITING)) {
+      cpu_sched_heap_remove(v);
+      v->wakeup_count++;
+      cpu_sched_make_runnable(v,cpu_sched_gettime());
+   }
+
+   CPU_SCHED_UNLOCK();
+}
+
+/* Worker thread */
+static void *cpu_sched_worker_run(void *arg)
+{
+   cpu_sched_worker_t *w = arg;
+   struct timespec t_spc;
+   cpu_sched_vcpu_t *v;
+   m_tmcnt_t now,start,expire;
+
+   CPU_SCHED_LOCK();
+
+   for(;;) {
+      now = cpu_sched_gettime();
+
+      if (!(v = cpu_sched_pick(w,now))) {
+         /* Wait for a CPU, the next timeout or the end of a quota period */
+         expire = now + ((m_tmcnt_t)CPU_SCHED_IDLE_WAIT * 1000);
+
+         if (cpu_sched_heap_count)
+            expire = m_min(expire,cpu_sched_heap[0]->deadline);
+
+         t_spc.tv_sec = expire / 1000000000;
+         t_spc.tv_nsec = expire % 1000000000;
+
+         w->idle = TRUE;
+         pthread_cond_timedwait(&w->cond,&cpu_sched_lock,&t_spc);
+         w->idle = FALSE;
+
+         w->idle_time += cpu_sched_gettime() - now;
+         continue;
+      }
+
+      /* Statistics: time spent in the run queue */
+      v->wait_time += now - v->ready_time;
+      v->wait_max = m_max(v->wait_max,now - v->ready_time);
+      v->switch_count++;
+      w->switch_count++;
+
+      if (v->vruntime > w->min_vruntime)
+         w->min_vruntime = v->vruntime;
+
+      v->state = CPU_SCHED_RUNNING;
+      v->worker = w;
+      w->current = v;
+      cpu_sched_new_slice(v,now);
+      start = now;
+
+      /* Run the CPU until it gives the worker back */
+      CPU_SCHED_UNLOCK();
+      swapcontext(&w->ctx,&v->ctx);
+      CPU_SCHED_LOCK();
+
+      now = cpu_sched_gettime();
+      w->busy_time += now - start;
+      w->current = NULL;
+      cpu_sched_account(v,now);
+
+      switch(v->next_state) {
+         case CPU_SCHED_RUNNABLE:
+            cpu_sched_rq_insert(w,v,now);
+            break;
+
+         case CPU_SCHED_WAITING:
+            /* A wakeup may have been posted while switching */
+            if (v->cpu->idle_wake != CPU_IDLE_SLEEPING) {
+               v->wakeup_count++;
+               cpu_sched_make_runnable(v,now);
+            } else {
+               v->state = CPU_SCHED_WAITING;
+               cpu_sched_heap_insert(v);
+            }
+            break;
+
+         case CPU_SCHED_DONE:
+            v->state = CPU_SCHED_DONE;
+            pthread_cond_broadcast(&cpu_sched_done_cond);
+            break;
+      }
+   }
+
+   return NULL;
+}
+
+/* Add a CPU to the scheduler (instead of creating a thread) */
+int cpu_sched_add(cpu_gen_t *cpu,void *(*run_fn)(void *))
+{
+   cpu_sched_worker_t *w,*x;
+   cpu_sched_vcpu_t **heap;
+   cpu_sched_vcpu_t *v;
+   m_iptr_t ptr;
+   u_int i;
+
+   if (!cpu_sched_worker_count) {
+      fprintf(stderr,"cpu_sched_add: scheduler not initialized.\n");
+      return(-1);
+   }
+
+   if (!(v = malloc(sizeof(*v))))
+      return(-1);
+
+   memset(v,0,sizeof(*v));
+   v->cpu = cpu;
+   v->run_fn = run_fn;
+
+   v->stack = mmap(NULL,CPU_SCHED_STACK_SIZE,PROT_READ|PROT_WRITE,
+                   MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+
+   if (v->stack == MAP_FAILED) {
+      perror("cpu_sched_add: mmap");
+      goto err_stack;
+   }
+
+   /* Guard page to catch stack overflows */
+   mprotect(v->stack,getpagesize(),PROT_NONE);
+
+   if (getcontext(&v->ctx) == -1) {
+      perror("cpu_sched_add: getcontext");
+      goto err_ctx;
+   }
+
+   ptr = (m_iptr_t)v;
+   v->ctx.uc_stack.ss_sp = v->stack;
+   v->ctx.uc_stack.ss_size = CPU_SCHED_STACK_SIZE;
+   v->ctx.uc_link = NULL;
+   makecontext(&v->ctx,(void (*)(void))cpu_sched_vcpu_start,2,
+               (u_int)((m_uint64_t)ptr >> 32),(u_int)ptr);
+
+   CPU_SCHED_LOCK();
+
+   /* The wait heap can hold all CPUs, so inserting never fails */
+   if (cpu_sched_heap_size <= cpu_sched_vcpu_count) {
+      i = (cpu_sched_heap_size * 2) + 16;
+
+      if (!(heap = realloc(cpu_sched_heap,i * sizeof(*heap)))) {
+         CPU_SCHED_UNLOCK();
+         goto err_ctx;
+      }
+
+      cpu_sched_heap = heap;
+      cpu_sched_heap_size = i;
+   }
+
+   if (!(v->group = cpu_sched_group_get(cpu->vm))) {
+      CPU_SCHED_UNLOCK();
+      goto err_ctx;
+   }
+
+   /* Start on the least loaded worker */
+   for(i=0,w=NULL;i<cpu_sched_worker_count;i++) {
+      x = &cpu_sched_worker_array[i];
+
+      if (!w || ((x->rq_count + (x->current != NULL)) <
+                 (w->rq_count + (w->current != NULL))))
+         w = x;
+   }
+
+   cpu->sched = v;
+   cpu_sched_vcpu_count++;
+   v->vruntime = w->min_vruntime;
+   cpu_sched_rq_insert(w,v,cpu_sched_gettime());
+
+   CPU_SCHED_UNLOCK();
+   return(0);
+
+ err_ctx:
+   munmap(v->stack,CPU_SCHED_STACK_SIZE);
+ err_stack:
+   free(v);
+   return(-1);
+}
+
+/* Remove a CPU from the scheduler, once its run function has returned */
+void cpu_sched_remove(cpu_gen_t *cpu)
+{
+   cpu_sched_vcpu_t *v = cpu->sched;
+
+   if (!v)
+      return;
+
+   CPU_SCHED_LOCK();
+
+   while(v->state != CPU_SCHED_DONE)
+      pthread_cond_wait(&cpu_sched_done_cond,&cpu_sched_lock);
+
+   cpu_sched_group_put(v->group);
+   cpu_sched_vcpu_count--;
+   cpu->sched = NULL;
+
+   CPU_SCHED_UNLOCK();
+
+   munmap(v->stack,CPU_SCHED_STACK_SIZE);
+   free(v);
+}
+
+/* Get the CPU time used by a CPU (nanoseconds) */
+m_tmcnt_t cpu_sched_get_run_time(cpu_gen_t *cpu)
+{
+   cpu_sched_vcpu_t *v = cpu->sched;
+   m_tmcnt_t run_time;
+
+   CPU_SCHED_LOCK();
+   run_time = v->run_time;
+
+   if (v->state == CPU_SCHED_RUNNING)
+      run_time += cpu_sched_gettime() - v->slice_start;
+
+   CPU_SCHED_UNLOCK();
+   return(run_time);
+}
+
+/* Get the statistics of a CPU */
+int cpu_sched_get_stats(cpu_gen_t *cpu,cpu_sched_stats_t *s)
+{
+   cpu_sched_vcpu_t *v;
+
+   CPU_SCHED_LOCK();
+
+   if (!(v = cpu->sched)) {
+      CPU_SCHED_UNLOCK();
+      return(-1);
+   }
+
+   s->state          = v->state;
+   s->worker         = v->worker->index;
+   s->weight         = cpu_sched_prio_weight(v->group->vm->sched_prio);
+   s->switch_count   = v->switch_count;
+   s->preempt_count  = v->preempt_count;
+   s->wakeup_count   = v->wakeup_count;
+   s->migrate_count  = v->migrate_count;
+   s->throttle_count = v->throttle_count;
+   s->run_time       = v->run_time;
+   s->wait_time      = v->wait_time;
+   s->wait_max       = v->wait_max;
+   s->group_run_time = v->group->run_time;
+   s->group_throttle_count = v->group->throttle_count;
+
+   CPU_SCHED_UNLOCK();
+   return(0);
+}
+
+/* Enumerate worker statistics */
+void cpu_sched_worker_stats_foreach(cpu_sched_worker_stats_cbk cbk,
+                                    void *opt)
+{
+   cpu_sched_worker_stats_t array[CPU_SCHED_MAX_WORKERS];
+   cpu_sched_worker_t *w;
+   u_int i;
+
+   /* take a snapshot, so the callback doesn't delay the workers */
+   CPU_SCHED_LOCK();
+
+   for(i=0;i<cpu_sched_worker_count;i++) {
+      w = &cpu_sched_worker_array[i];
+      array[i].index        = w->index;
+      array[i].rq_count     = w->rq_count;
+      array[i].running      = (w->current != NULL);
+      array[i].switch_count = w->switch_count;
+      array[i].steal_count  = w->steal_count;
+      array[i].busy_time    = w->busy_time;
+      array[i].idle_time    = w->idle_time;
+   }
+
+   CPU_SCHED_UNLOCK();
+
+   for(i=0;i<cpu_sched_worker_count;i++)
+      cbk(&array[i],opt);
+}
+
+/* Initialize the scheduler (if enabled) */
+int cpu_sched_init(void)
+{
+   pthread_condattr_t attr;
+   cpu_sched_worker_t *w;
+   long count;
+   u_int i;
+
+   if (cpu_sched_workers < 0)
+      return(0);
+
+   if (!(count = cpu_sched_workers))
+      count = sysconf(_SC_NPROCESSORS_ONLN);
+
+   count = m_max(count,1);
+   count = m_min(count,CPU_SCHED_MAX_WORKERS);
+
+   /* Idle workers wait with monotonic timeouts */
+   pthread_condattr_init(&attr);
+   pthread_condattr_setclock(&attr,CLOCK_MONOTONIC);
+
+   for(i=0;i<count;i++) {
+      w = &cpu_sched_worker_array[i];
+      memset(w,0,sizeof(*w));
+      w->index = i;
+      pthread_cond_init(&w->cond,&attr);
+   }
+
+   pthread_condattr_destroy(&attr);
+
+   /* workers look at each other, so all are set up before starting */
+   cpu_sched_worker_count = count;
+   cpu_sched_workers = count;
+
+   for(i=0;i<count;i++) {
+      w = &cpu_sched_worker_array[i];
+
+      if (pthread_create(&w->thread,NULL,cpu_sched_worker_run,w) != 0) {
+         fprintf(stderr,"cpu_sched_init: unable to create thread.\n");
+         return(-1);
+      }
+   }
+
+   return(0);
+}
@@ -0,0 +1,179 @@
+/*
+ * Cisco router simulation platform.
+ * Copyright (c) 2005,2006 Christophe Fillot (cf@utc.fr)
+ *
+ * cpu_sched.h: M:N scheduler running virtual CPUs on a pool of threads.
+ */
+
+#ifndef __CPU_SCHED_H__
+#define __CPU_SCHED_H__  1
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include "utils.h"
+
+/* Maximum number of worker threads */
+#define CPU_SCHED_MAX_WORKERS   64
+
+/* Time slice of a virtual CPU (microseconds) */
+#define CPU_SCHED_SLICE         2000
+
+/* Accounting period of CPU quotas (microseconds) */
+#define CPU_SCHED_QUOTA_PERIOD  100000
+
+/* Max CPU quota of a VM (percentage of a host CPU) */
+#define CPU_SCHED_QUOTA_MAX     100
+
+/* Max time an idle worker waits before checking quotas (microseconds) */
+#define CPU_SCHED_IDLE_WAIT     10000
+
+/* Stack size of a virtual CPU (only touched pages use memory) */
+#define CPU_SCHED_STACK_SIZE    (2 * 1048576)
+
+/* Priority range of a VM (higher values get more CPU time) */
+#define CPU_SCHED_PRIO_MIN      -10
+#define CPU_SCHED_PRIO_MAX      10
+
+/* Weight of the default priority (0) */
+#define CPU_SCHED_WEIGHT_DEF    1024
+
+/* Virtual CPU states */
+enum {
+   CPU_SCHED_RUNNABLE = 0,
+   CPU_SCHED_RUNNING,
+   CPU_SCHED_WAITING,
+   CPU_SCHED_DONE,
+};
+
+typedef struct cpu_sched_worker cpu_sched_worker_t;
+typedef struct cpu_sched_group cpu_sched_group_t;
+typedef struct cpu_sched_vcpu cpu_sched_vcpu_t;
+
+/* CPU accounting of a VM (quota) */
+struct cpu_sched_group {
+   vm_instance_t *vm;
+   cpu_sched_group_t *next;
+   u_int ref_count;
+
+   /* Current quota period: end and CPU time used (ns) */
+   m_tmcnt_t period_end,period_used;
+
+   /* Statistics */
+   m_tmcnt_t run_time;
+   m_uint64_t throttle_count;
+};
+
+/* Virtual CPU scheduled by the worker pool */
+struct cpu_sched_vcpu {
+   cpu_gen_t *cpu;
+   cpu_sched_group_t *group;
+   void *(*run_fn)(void *);
+   u_int state,next_state;
+
+   /* Execution context and stack */
+   ucontext_t ctx;
+   void *stack;
+
+   /* Current or last worker, and run queue chaining */
+   cpu_sched_worker_t *worker;
+   cpu_sched_vcpu_t *rq_next,**rq_pprev;
+
+   /* Idle wait: timeout and position in the wait heap */
+   m_tmcnt_t deadline;
+   u_int heap_index;
+
+   /* Fair share: CPU time weighted by the priority (ns) */
+   m_tmcnt_t vruntime;
+
+   /* Current slice, and time at which the CPU became runnable */
+   m_tmcnt_t slice_start,slice_end;
+   m_tmcnt_t ready_time;
+
+   /* Statistics (times in ns) */
+   m_uint64_t switch_count,preempt_count,wakeup_count;
+   m_uint64_t migrate_count,throttle_count;
+   m_tmcnt_t run_time,wait_time,wait_max;
+};
+
+/* Worker thread */
+struct cpu_sched_worker {
+   u_int index;
+   pthread_t thread;
+   pthread_cond_t cond;
+   ucontext_t ctx;
+   int idle;
+
+   /* Running virtual CPU and run queue */
+   cpu_sched_vcpu_t *current;
+   cpu_sched_vcpu_t *rq_head;
+   u_int rq_count;
+   m_tmcnt_t min_vruntime;
+
+   /* Statistics (times in ns) */
+   m_uint64_t switch_count,steal_count;
+   m_tmcnt_t busy_time,idle_time;
+};
+
+/* Snapshot of the statistics of a virtual CPU */
+typedef struct cpu_sched_stats cpu_sched_stats_t;
+struct cpu_sched_stats {
+   u_int state,worker,weight;
+   m_uint64_t switch_count,preempt_count,wakeup_count;
+   m_uint64_t migrate_count,throttle_count;
+   m_tmcnt_t run_time,wait_time,wait_max;
+   m_tmcnt_t group_run_time;
+   m_uint64_t group_throttle_count;
+};
+
+/* Snapshot of the statistics of a worker */
+typedef struct cpu_sched_worker_stats cpu_sched_worker_stats_t;
+struct cpu_sched_worker_stats {
+   u_int index,rq_count;
+   int running;
+   m_uint64_t switch_count,steal_count;
+   m_tmcnt_t busy_time,idle_time;
+};
+
+/* Worker statistics enumeration callback */
+typedef void (*cpu_sched_worker_stats_cbk)(cpu_sched_worker_stats_t *stats,
+                                           void *opt);
+
+/* Number of worker threads (0: one per host CPU), -1 if disabled */
+extern int cpu_sched_workers;
+
+/* Add a CPU to the scheduler (instead of creating a thread) */
+int cpu_sched_add(cpu_gen_t *cpu,void *(*run_fn)(void *));
+
+/* Remove a CPU from the scheduler, once its run function has returned */
+void cpu_sched_remove(cpu_gen_t *cpu);
+
+/* End the time slice of the calling CPU if it has expired */
+void cpu_sched_check(cpu_gen_t *cpu);
+
+/* Let the calling CPU sleep until it is woken up or the timeout expires */
+void cpu_sched_sleep(cpu_gen_t *cpu,u_int usec);
+
+/* Make a sleeping CPU runnable */
+void cpu_sched_wakeup(cpu_gen_t *cpu);
+
+/* Get the CPU time used by a CPU (nanoseconds) */
+m_tmcnt_t cpu_sched_get_run_time(cpu_gen_t *cpu);
+
+/* Get the statistics of a CPU */
+int cpu_sched_get_stats(cpu_gen_t *cpu,cpu_sched_stats_t *stats);
+
+/* Enumerate worker statistics */
+void cpu_sched_worker_stats_foreach(cpu_sched_worker_stats_cbk cbk,
+                                    void *opt);
+
+/* Get the name of a virtual CPU state */
+char *cpu_sched_state_name(u_int state);
+
+/* Get the weight of a priority */
+u_int cpu_sched_prio_weight(int prio);
+
+/* Initialize the scheduler (if enabled) */
+int cpu_sched_init(void);
+
+#endif
@@ -23,6 +23,7 @@
 #include "net.h"
 #include "net_io.h"
 #include "ptask.h"
+#include "vm_ckpt.h"
 #include "dev_am79c971.h"
 
 /* Debugging flags */
@@ -406,6 +407,10 @@ static void am79c971_rdp_access(cpu_gen_t *cpu,struct am79c971_data *d,
                am79c971_update_rx_tx_on_bits(d);
             }
 
+            /* Transmit demand: scan the TX ring right now */
+            if (*data & AM79C971_CSR0_TDMD)
+               ptask_kick(d->tx_tid);
+
             /* Update IRQ status */
             am79c971_update_irq_status(d);
          }
@@ -1010,6 +1015,29 @@ static void pci_am79c971_write(cpu_gen_t *cpu,struct pci_device *dev,
    }
 }
 
+/* Save or restore the AM79C971 state in a VM checkpoint */
+static void dev_am79c971_ckpt(vm_ckpt_t *ckpt,struct vdevice *dev)
+{
+   struct am79c971_data *d = dev->priv_data;
+
+   AM79C971_LOCK(d);
+   VM_CKPT_FIELD(ckpt,d->rx_tx_clear_count);
+   VM_CKPT_FIELD(ckpt,d->rap);
+   VM_CKPT_FIELD(ckpt,d->csr);
+   VM_CKPT_FIELD(ckpt,d->bcr);
+   VM_CKPT_FIELD(ckpt,d->rx_start);
+   VM_CKPT_FIELD(ckpt,d->tx_start);
+   VM_CKPT_FIELD(ckpt,d->rx_l2len);
+   VM_CKPT_FIELD(ckpt,d->tx_l2len);
+   VM_CKPT_FIELD(ckpt,d->rx_len);
+   VM_CKPT_FIELD(ckpt,d->tx_len);
+   VM_CKPT_FIELD(ckpt,d->rx_pos);
+   VM_CKPT_FIELD(ckpt,d->tx_pos);
+   VM_CKPT_FIELD(ckpt,d->mii_regs);
+   VM_CKPT_FIELD(ckpt,d->mac_addr);
+   AM79C971_UNLOCK(d);
+}
+
 /* 
  * dev_am79c971_init()
  *
@@ -1059,6 +1087,7 @@ dev_am79c971_init(vm_instance_t *vm,char *name,int interface_type,
    dev->phys_addr = 0;
    dev->phys_len  = 0x4000;
    dev->handler   = dev_am79c971_access;
+   dev->ckpt_handler = dev_am79c971_ckpt;
    dev->priv_data = d;
    return(d);
 
@@ -1089,8 +1118,9 @@ int dev_am79c971_set_nio(struct am79c971_data *d,netio_desc_t *nio)
       return(-1);
 
    d->nio = nio;
-   d->tx_tid = ptask_add((ptask_callback)am79c971_handle_txring,d,NULL);
-   netio_rxl_add(nio,(netio_rx_handler_t)am79c971_handle_rxring,d,NULL);
+   d->tx_tid = ptask_add((ptask_callback)am79c971_handle_txring,
+                         d,NULL,d->vm,"am79c971_handle_txring");
+   netio_rxl_add(nio,(netio_rx_handler_t)am79c971_handle_rxring,d,NULL,d->vm);
    return(0);
 }
 
@@ -449,7 +449,7 @@ int dev_c6msfc1_iofpga_init(c6msfc1_t *router,m_uint64_t paddr,m_uint32_t len)
 
    /* Trigger periodically a dummy IRQ to flush buffers */
    d->duart_irq_tid = ptask_add((ptask_callback)tty_trigger_dummy_irq,
-                                d,NULL);
+                                d,NULL,vm,"tty_trigger_dummy_irq");
 
    /* Map this device to the VM */
    vm_bind_device(vm,&d->dev);
@@ -2134,6 +2134,48 @@ static int c7200_pa_stop_online(vm_instance_t *vm,u_int slot,u_int subslot)
    return(0);
 }
 
+/* Port adapters whose state is saved in VM checkpoints */
+static char *c7200_ckpt_drivers[] = {
+   "C7200-IO-FE", "PA-FE-TX", "PA-4E", "PA-8E", NULL,
+};
+
+/* 
+ * Check that the whole state of an instance can be saved in a checkpoint:
+ * the GT64k system controller, the FPGAs and the Ethernet controllers of
+ * the port adapters listed above have checkpoint handlers.
+ */
+static int c7200_ckpt_check(vm_instance_t *vm)
+{
+   c7200_t *router = VM_C7200(vm);
+   struct cisco_card *card;
+   u_int i,j;
+
+   if ((router->npe_driver->npe_family != C7200_NPE_FAMILY_MIPS) ||
+       !router->npe_driver->supported)
+   {
+      vm_error(vm,"checkpoint: NPE '%s' is not supported.\n",
+               router->npe_driver->npe_type);
+      return(-1);
+   }
+
+   for(i=0;i<vm->nr_slots;i++) {
+      if (!(card = vm_slot_get_card_ptr(vm,i)))
+         continue;
+
+      for(j=0;c7200_ckpt_drivers[j];j++)
+         if (!strcmp(card->dev_type,c7200_ckpt_drivers[j]))
+            break;
+
+      if (!c7200_ckpt_drivers[j]) {
+         vm_error(vm,"checkpoint: port adapter %s (slot %u) "
+                  "is not supported.\n",card->dev_type,i);
+         return(-1);
+      }
+   }
+
+   return(0);
+}
+
 /* Get MAC address MSB */
 static u_int c7200_get_mac_addr_msb(void)
 {
@@ -2204,6 +2246,7 @@ static vm_platform_t c7200_platform = {
    c7200_cli_parse_options,
    c7200_cli_show_options,
    c7200_npe_show_drivers,
+   c7200_ckpt_check,
 };
 
 /* Register the c7200 platform */
@@ -880,7 +880,8 @@ int dev_c7200_pa_bri_set_nio(vm_instance_t *vm,struct cisco_card *card,
 
    /* TEST */
    d->m32_data.tx_tid = ptask_add((ptask_callback)m32_tx_scan_all_channels,
-                                  &d->m32_data,NULL);
+                                  &d->m32_data,NULL,vm,
+                                  "m32_tx_scan_all_channels");
 
    //netio_rxl_add(nio,(netio_rx_handler_t)dev_pa_4b_handle_rxring,d,NULL);
    return(0);
@@ -28,6 +28,7 @@
 #include "dev_vtty.h"
 #include "nmc93cX6.h"
 #include "dev_ds1620.h"
+#include "vm_ckpt.h"
 #include "dev_c7200.h"
 
 /* Debugging flags */
@@ -660,6 +661,28 @@ void c7200_init_sys_eeprom_groups(c7200_t *router)
    router->sys_eeprom_g2.eeprom[0] = &router->pem_eeprom;
 }
 
+/* Save or restore the IO FPGA state in a VM checkpoint */
+static void dev_c7200_iofpga_ckpt(vm_ckpt_t *ckpt,struct vdevice *dev)
+{
+   struct iofpga_data *d = dev->priv_data;
+   c7200_t *router = d->router;
+
+   IOFPGA_LOCK(d);
+   VM_CKPT_FIELD(ckpt,d->duart_isr);
+   VM_CKPT_FIELD(ckpt,d->duart_imr);
+   VM_CKPT_FIELD(ckpt,d->duart_irq_seq);
+   VM_CKPT_FIELD(ckpt,d->io_ctrl_reg);
+   VM_CKPT_FIELD(ckpt,d->mux);
+   VM_CKPT_FIELD(ckpt,d->envm_r0);
+   VM_CKPT_FIELD(ckpt,d->envm_r1);
+   VM_CKPT_FIELD(ckpt,d->envm_r2);
+   VM_CKPT_FIELD(ckpt,router->ds1620_sensors);
+   nmc93cX6_ckpt(ckpt,&router->sys_eeprom_g1);
+   nmc93cX6_ckpt(ckpt,&router->sys_eeprom_g2);
+   nmc93cX6_ckpt(ckpt,&router->pa_eeprom_g3);
+   IOFPGA_UNLOCK(d);
+}
+
 /* Shutdown the IO FPGA device */
 void dev_c7200_iofpga_shutdown(vm_instance_t *vm,struct iofpga_data *d)
 {
@@ -714,6 +737,7 @@ int dev_c7200_iofpga_init(c7200_t *router,m_uint64_t paddr,m_uint32_t len)
    d->dev.phys_addr = paddr;
    d->dev.phys_len  = len;
    d->dev.handler   = dev_c7200_iofpga_access;
+   d->dev.ckpt_handler = dev_c7200_iofpga_ckpt;
    d->dev.priv_data = d;
 
    /* If we have an I/O slot, we use the I/O slot DUART */
@@ -728,7 +752,7 @@ int dev_c7200_iofpga_init(c7200_t *router,m_uint64_t paddr,m_uint32_t len)
 
       /* Trigger periodically a dummy IRQ to flush buffers */
       d->duart_irq_tid = ptask_add((ptask_callback)tty_trigger_dummy_irq,
-                                   d,NULL);
+                                   d,NULL,vm,"tty_trigger_dummy_irq");
    }
 
    /* Map this device to the VM */
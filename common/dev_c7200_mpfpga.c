@@ -15,6 +15,7 @@
 #include "memory.h"
 #include "device.h"
 #include "nmc93cX6.h"
+#include "vm_ckpt.h"
 #include "dev_c7200.h"
 
 #define DEBUG_UNKNOWN  1
@@ -440,6 +441,21 @@ dev_c7200_mpfpga_shutdown(vm_instance_t *vm,struct c7200_mpfpga_data *d)
    }
 }
 
+/* Save or restore the Midplane FPGA state in a VM checkpoint */
+static void dev_c7200_mpfpga_ckpt(vm_ckpt_t *ckpt,struct vdevice *dev)
+{
+   struct c7200_mpfpga_data *d = dev->priv_data;
+   c7200_t *router = d->router;
+
+   VM_CKPT_FIELD(ckpt,router->oir_status);
+   VM_CKPT_FIELD(ckpt,router->pa_status_reg);
+   VM_CKPT_FIELD(ckpt,router->pa_ctrl_reg);
+   VM_CKPT_FIELD(ckpt,router->net_irq_status);
+   VM_CKPT_FIELD(ckpt,router->net_irq_mask);
+   nmc93cX6_ckpt(ckpt,&router->pa_eeprom_g1);
+   nmc93cX6_ckpt(ckpt,&router->pa_eeprom_g2);
+}
+
 /* Create the c7200 Midplane FPGA */
 int dev_c7200_mpfpga_init(c7200_t *router,m_uint64_t paddr,m_uint32_t len)
 {   
@@ -466,6 +482,7 @@ int dev_c7200_mpfpga_init(c7200_t *router,m_uint64_t paddr,m_uint32_t len)
    d->dev.phys_addr = paddr;
    d->dev.phys_len  = len;
    d->dev.handler   = dev_c7200_mpfpga_access;
+   d->dev.ckpt_handler = dev_c7200_mpfpga_ckpt;
    d->dev.priv_data = d;
 
    /* Map this device to the VM */
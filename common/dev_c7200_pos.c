@@ -778,8 +778,10 @@ int dev_c7200_pa_pos_set_nio(vm_instance_t *vm,struct cisco_card *card,
       return(-1);
 
    d->nio = nio;
-   d->tx_tid = ptask_add((ptask_callback)dev_pos_oc3_handle_txring,d,NULL);
-   netio_rxl_add(nio,(netio_rx_handler_t)dev_pos_oc3_handle_rxring,d,NULL);
+   d->tx_tid = ptask_add((ptask_callback)dev_pos_oc3_handle_txring,
+                         d,NULL,d->vm,"dev_pos_oc3_handle_txring");
+   netio_rxl_add(nio,(netio_rx_handler_t)dev_pos_oc3_handle_rxring,
+                 d,NULL,d->vm);
    return(0);
 }
 
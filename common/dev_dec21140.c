@@ -39,6 +39,7 @@
 #include "net.h"
 #include "net_io.h"
 #include "ptask.h"
+#include "vm_ckpt.h"
 #include "dev_dec21140.h"
 
 /* Debugging flags */
@@ -148,6 +149,9 @@ struct tx_desc {
 /* DEC21140 Data */
 struct dec21140_data {
    char *name;
+
+   /* Lock */
+   pthread_mutex_t lock;
    
    /* Physical addresses of current RX and TX descriptors */
    m_uint32_t rx_current;
@@ -182,8 +186,16 @@ struct dec21140_data {
 
    /* TX ring scanner task id */
    ptask_id_t tx_tid;
+
+   /* TX packet batch (flushed at the end of each TX ring scan) */
+   u_char tx_pkt[NETIO_BATCH_MAX][DEC21140_MAX_PKT_SIZE];
+   netio_pkt_vec_t tx_vec[NETIO_BATCH_MAX];
+   u_int tx_count;
 };
 
+#define DEC21140_LOCK(d)    pthread_mutex_lock(&(d)->lock)
+#define DEC21140_UNLOCK(d)  pthread_mutex_unlock(&(d)->lock)
+
 /* Log a dec21140 message */
 #define DEC21140_LOG(d,msg...) vm_log((d)->vm,(d)->name,msg)
 
@@ -429,6 +441,8 @@ void *dev_dec21140_access(cpu_gen_t *cpu,struct vdevice *dev,
       return NULL;
    }
 
+   DEC21140_LOCK(d);
+
    if (op_type == MTS_READ) {
 #if DEBUG_CSR_REGS
       cpu_log(cpu,d->name,"read CSR%u value 0x%x\n",reg,d->csr[reg]);
@@ -461,6 +475,11 @@ void *dev_dec21140_access(cpu_gen_t *cpu,struct vdevice *dev,
       cpu_log(cpu,d->name,"write CSR%u value 0x%x\n",reg,(m_uint32_t)*data);
 #endif
       switch(reg) {
+         case 1:
+            /* Transmit poll demand: scan the TX ring right now */
+            d->csr[reg] = *data;
+            ptask_kick(d->tx_tid);
+            break;
          case 3:
             d->csr[reg] = *data;
             d->rx_current = d->csr[reg];
@@ -510,6 +529,7 @@ void *dev_dec21140_access(cpu_gen_t *cpu,struct vdevice *dev,
       }
    }
 
+   DEC21140_UNLOCK(d);
    return NULL;
 }
 
@@ -683,6 +703,8 @@ static int dev_dec21140_handle_rxring(netio_desc_t *nio,
                                       u_char *pkt,ssize_t pkt_len,
                                       struct dec21140_data *d)
 {
+   int res = FALSE;
+
    /* 
     * Don't start receive if the RX ring address has not been set
     * and if the SR bit in CSR6 is not set yet.
@@ -695,14 +717,17 @@ static int dev_dec21140_handle_rxring(netio_desc_t *nio,
    mem_dump(log_file,pkt,pkt_len);
 #endif
 
+   DEC21140_LOCK(d);
+
    /* 
     * Receive only multicast/broadcast trafic + unicast traffic 
     * for this virtual machine.
     */
    if (dec21140_handle_mac_addr(d,pkt))
-      return(dev_dec21140_receive_pkt(d,pkt,pkt_len));
+      res = dev_dec21140_receive_pkt(d,pkt,pkt_len);
 
-   return(FALSE);
+   DEC21140_UNLOCK(d);
+   return(res);
 }
 
 /* Read a TX descriptor */
@@ -732,10 +757,19 @@ static void txdesc_set_next(struct dec21140_data *d,struct tx_desc *txd)
    }
 }
 
+/* Flush the TX packet batch */
+static void dev_dec21140_flush_tx(struct dec21140_data *d)
+{
+   if (d->tx_count != 0) {
+      netio_send_batch(d->nio,d->tx_vec,d->tx_count);
+      d->tx_count = 0;
+   }
+}
+
 /* Handle the TX ring (single packet) */
 static int dev_dec21140_handle_txring_single(struct dec21140_data *d)
 {   
-   u_char pkt[DEC21140_MAX_PKT_SIZE],*pkt_ptr;
+   u_char *pkt = d->tx_pkt[d->tx_count],*pkt_ptr;
    u_char setup_frame[DEC21140_SETUP_FRAME_SIZE];
    m_uint32_t tx_start,len1,len2,clen,tot_len;
    struct tx_desc txd0,ctxd,*ptxd;
@@ -846,8 +880,12 @@ static int dev_dec21140_handle_txring_single(struct dec21140_data *d)
       /* rewrite ISL header if required */
       cisco_isl_rewrite(pkt,tot_len);
 
-      /* send it on wire */
-      netio_send(d->nio,pkt,tot_len);
+      /* queue it for the wire */
+      d->tx_vec[d->tx_count].pkt = pkt;
+      d->tx_vec[d->tx_count].len = tot_len;
+
+      if (++d->tx_count == NETIO_BATCH_MAX)
+         dev_dec21140_flush_tx(d);
    }
 
  clear_txd0_own_bit:
@@ -868,11 +906,15 @@ static int dev_dec21140_handle_txring(struct dec21140_data *d)
 {  
    int i;
 
+   DEC21140_LOCK(d);
+
    for(i=0;i<DEC21140_TXRING_PASS_COUNT;i++)
       if (!dev_dec21140_handle_txring_single(d))
          break;
 
+   dev_dec21140_flush_tx(d);
    netio_clear_bw_stat(d->nio);
+   DEC21140_UNLOCK(d);
    return(TRUE);
 }
 
@@ -924,6 +966,30 @@ static void pci_dec21140_write(cpu_gen_t *cpu,struct pci_device *dev,
    }
 }
 
+/* Save or restore the DEC21140 state in a VM checkpoint */
+static void dev_dec21140_ckpt(vm_ckpt_t *ckpt,struct vdevice *dev)
+{
+   struct dec21140_data *d = dev->priv_data;
+
+   DEC21140_LOCK(d);
+   VM_CKPT_FIELD(ckpt,d->rx_current);
+   VM_CKPT_FIELD(ckpt,d->tx_current);
+   VM_CKPT_FIELD(ckpt,d->csr);
+   VM_CKPT_FIELD(ckpt,d->mii_state);
+   VM_CKPT_FIELD(ckpt,d->mii_phy);
+   VM_CKPT_FIELD(ckpt,d->mii_reg);
+   VM_CKPT_FIELD(ckpt,d->mii_data);
+   VM_CKPT_FIELD(ckpt,d->mii_outbits);
+   VM_CKPT_FIELD(ckpt,d->mii_regs);
+   VM_CKPT_FIELD(ckpt,d->mac_addr);
+   VM_CKPT_FIELD(ckpt,d->mac_addr_count);
+
+   if (d->mac_addr_count > 16)
+      ckpt->error = TRUE;
+
+   DEC21140_UNLOCK(d);
+}
+
 /* 
  * dev_dec21140_init()
  *
@@ -944,6 +1010,7 @@ struct dec21140_data *dev_dec21140_init(vm_instance_t *vm,char *name,
    }
 
    memset(d,0,sizeof(*d));
+   pthread_mutex_init(&d->lock,NULL);
 
    /* Add as PCI device */
    pci_dev = pci_dev_add(pci_bus,name,
@@ -975,6 +1042,7 @@ struct dec21140_data *dev_dec21140_init(vm_instance_t *vm,char *name,
    dev->phys_addr = 0;
    dev->phys_len  = 0x20000;
    dev->handler   = dev_dec21140_access;
+   dev->ckpt_handler = dev_dec21140_ckpt;
    dev->priv_data = d;
    return(d);
 
@@ -1005,8 +1073,10 @@ int dev_dec21140_set_nio(struct dec21140_data *d,netio_desc_t *nio)
       return(-1);
 
    d->nio = nio;
-   d->tx_tid = ptask_add((ptask_callback)dev_dec21140_handle_txring,d,NULL);
-   netio_rxl_add(nio,(netio_rx_handler_t)dev_dec21140_handle_rxring,d,NULL);
+   d->tx_tid = ptask_add((ptask_callback)dev_dec21140_handle_txring,
+                         d,NULL,d->vm,"dev_dec21140_handle_txring");
+   netio_rxl_add(nio,(netio_rx_handler_t)dev_dec21140_handle_rxring,
+                 d,NULL,d->vm);
    return(0);
 }
 
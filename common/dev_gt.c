@@ -26,6 +26,7 @@
 #include "device.h"
 #include "net_io.h"
 #include "ptask.h"
+#include "vm_ckpt.h"
 #include "dev_gt.h"
 
 /* Debugging flags */
@@ -435,18 +436,18 @@ static void gt64k_update_irq_status(struct gt_data *gt_data)
 /* Fetch a DMA record (chained mode) */
 static void gt_dma_fetch_rec(vm_instance_t *vm,struct dma_channel *channel)
 {
-   m_uint32_t ptr;
+   m_uint32_t rec[4];
  
 #if DEBUG_DMA
    vm_log(vm,"GT_DMA","fetching record at address 0x%x\n",channel->nrptr);
 #endif
 
-   /* fetch the record from RAM */
-   ptr = channel->nrptr;
-   channel->byte_count = swap32(physmem_copy_u32_from_vm(vm,ptr));
-   channel->src_addr   = swap32(physmem_copy_u32_from_vm(vm,ptr+0x04));
-   channel->dst_addr   = swap32(physmem_copy_u32_from_vm(vm,ptr+0x08));
-   channel->nrptr      = swap32(physmem_copy_u32_from_vm(vm,ptr+0x0c));
+   /* fetch the record from RAM (single DMA window lookup) */
+   physmem_copy_from_vm(vm,rec,channel->nrptr,sizeof(rec));
+   channel->byte_count = swap32(vmtoh32(rec[0]));
+   channel->src_addr   = swap32(vmtoh32(rec[1]));
+   channel->dst_addr   = swap32(vmtoh32(rec[2]));
+   channel->nrptr      = swap32(vmtoh32(rec[3]));
    
    /* clear the "fetch next record bit" */
    channel->ctrl &= ~GT_DMA_FETCH_NEXT;
@@ -1375,7 +1376,7 @@ int dev_gt96100_mpsc_set_nio(struct gt_data *d,u_int chan_id,
 
    channel->nio = nio;
    netio_rxl_add(nio,(netio_rx_handler_t)gt_sdma_handle_rx_pkt,
-                 d,(void *)(u_long)chan_id);
+                 d,(void *)(u_long)chan_id,d->vm);
    return(0);
 }
 
@@ -1791,6 +1792,10 @@ static int gt_eth_access(cpu_gen_t *cpu,struct vdevice *dev,
                port->sdcmr &= ~GT_SDCMR_TXDL;
                port->sdcmr |= GT_SDCMR_STDL;
             }
+
+            /* TX demand: scan the TX queues right now */
+            if (*data & (GT_SDCMR_TXDH|GT_SDCMR_TXDL))
+               ptask_kick(d->eth_tx_tid);
          } else {
             *data = port->sdcmr;
          }
@@ -2608,6 +2613,70 @@ static int gt_eth_handle_rx_pkt(netio_desc_t *nio,
    return(TRUE);
 }
 
+/* Save or restore the GT state in a VM checkpoint */
+static void dev_gt_ckpt(vm_ckpt_t *ckpt,struct vdevice *dev)
+{
+   struct gt_data *d = dev->priv_data;
+   struct mpsc_channel *mpsc;
+   struct eth_port *port;
+   u_int i;
+
+   GT_LOCK(d);
+
+   for(i=0;i<2;i++)
+      if (d->bus[i])
+         VM_CKPT_FIELD(ckpt,d->bus[i]->pci_addr);
+
+   VM_CKPT_FIELD(ckpt,d->dma);
+   VM_CKPT_FIELD(ckpt,d->int_cause_reg);
+   VM_CKPT_FIELD(ckpt,d->int_high_cause_reg);
+   VM_CKPT_FIELD(ckpt,d->int_mask_reg);
+   VM_CKPT_FIELD(ckpt,d->int0_main_mask_reg);
+   VM_CKPT_FIELD(ckpt,d->int0_high_mask_reg);
+   VM_CKPT_FIELD(ckpt,d->int1_main_mask_reg);
+   VM_CKPT_FIELD(ckpt,d->int1_high_mask_reg);
+   VM_CKPT_FIELD(ckpt,d->ser_cause_reg);
+   VM_CKPT_FIELD(ckpt,d->serint0_mask_reg);
+   VM_CKPT_FIELD(ckpt,d->serint1_mask_reg);
+   VM_CKPT_FIELD(ckpt,d->sgcr);
+   VM_CKPT_FIELD(ckpt,d->sdma_cause_reg);
+   VM_CKPT_FIELD(ckpt,d->sdma_mask_reg);
+   VM_CKPT_FIELD(ckpt,d->sdma);
+
+   /* NIO and vtty bindings belong to the instance configuration */
+   for(i=0;i<GT_MPSC_CHANNELS;i++) {
+      mpsc = &d->mpsc[i];
+      VM_CKPT_FIELD(ckpt,mpsc->mmcrl);
+      VM_CKPT_FIELD(ckpt,mpsc->mmcrh);
+      VM_CKPT_FIELD(ckpt,mpsc->mpcr);
+      VM_CKPT_FIELD(ckpt,mpsc->chr);
+   }
+
+   for(i=0;i<GT_ETH_PORTS;i++) {
+      port = &d->eth_ports[i];
+      VM_CKPT_FIELD(ckpt,port->rx_start);
+      VM_CKPT_FIELD(ckpt,port->rx_current);
+      VM_CKPT_FIELD(ckpt,port->tx_current);
+      VM_CKPT_FIELD(ckpt,port->pcr);
+      VM_CKPT_FIELD(ckpt,port->pcxr);
+      VM_CKPT_FIELD(ckpt,port->pcmr);
+      VM_CKPT_FIELD(ckpt,port->psr);
+      VM_CKPT_FIELD(ckpt,port->sdcr);
+      VM_CKPT_FIELD(ckpt,port->sdcmr);
+      VM_CKPT_FIELD(ckpt,port->icr);
+      VM_CKPT_FIELD(ckpt,port->imr);
+      VM_CKPT_FIELD(ckpt,port->ht_addr);
+   }
+
+   VM_CKPT_FIELD(ckpt,d->smi_reg);
+   VM_CKPT_FIELD(ckpt,d->mii_regs);
+
+   if (ckpt->restore && !ckpt->error)
+      d->gt_update_irq_status(d);
+
+   GT_UNLOCK(d);
+}
+
 /* Shutdown a GT system controller */
 void dev_gt_shutdown(vm_instance_t *vm,struct gt_data *d)
 {
@@ -2654,6 +2723,7 @@ int dev_gt64010_init(vm_instance_t *vm,char *name,
    d->dev.phys_addr = paddr;
    d->dev.phys_len  = len;
    d->dev.handler   = dev_gt64010_access;
+   d->dev.ckpt_handler = dev_gt_ckpt;
 
    /* Add the controller as a PCI device */
    if (!pci_dev_lookup(d->bus[0],0,0,0)) {
@@ -2718,6 +2788,7 @@ int dev_gt64120_init(vm_instance_t *vm,char *name,
    d->dev.phys_addr = paddr;
    d->dev.phys_len  = len;
    d->dev.handler   = dev_gt64120_access;
+   d->dev.ckpt_handler = dev_gt_ckpt;
 
    /* Add the controller as a PCI device */
    if (!pci_dev_lookup(d->bus[0],0,0,0)) {
@@ -2797,6 +2868,7 @@ int dev_gt96100_init(vm_instance_t *vm,char *name,
    d->dev.phys_addr = paddr;
    d->dev.phys_len  = len;
    d->dev.handler   = dev_gt96100_access;
+   d->dev.ckpt_handler = dev_gt_ckpt;
 
    /* Add the controller as a PCI device */
    if (!pci_dev_lookup(d->bus[0],0,0,0)) {
@@ -2810,7 +2882,8 @@ int dev_gt96100_init(vm_instance_t *vm,char *name,
    }
 
    /* Start the Ethernet TX ring scanner */
-   d->eth_tx_tid = ptask_add((ptask_callback)gt_eth_handle_txqueues,d,NULL);
+   d->eth_tx_tid = ptask_add((ptask_callback)gt_eth_handle_txqueues,
+                             d,NULL,vm,"gt_eth_handle_txqueues");
 
    /* Map this device to the VM */
    vm_bind_device(vm,&d->dev);
@@ -2834,7 +2907,7 @@ int dev_gt96100_eth_set_nio(struct gt_data *d,u_int port_id,netio_desc_t *nio)
 
    port->nio = nio;
    netio_rxl_add(nio,(netio_rx_handler_t)gt_eth_handle_rx_pkt,
-                 d,(void *)(u_long)port_id);
+                 d,(void *)(u_long)port_id,d->vm);
    return(0);
 }
 
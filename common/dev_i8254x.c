@@ -757,9 +757,10 @@ void *dev_i8254x_access(cpu_gen_t *cpu,struct vdevice *dev,
       /* TX Descriptor Tail */
       case I82542_REG_TDT:
       case I8254X_REG_TDT:
-         if (op_type == MTS_WRITE)
+         if (op_type == MTS_WRITE) {
             d->tdt = *data & 0xFFFF;
-         else
+            ptask_kick(d->tx_tid);
+         } else
             *data = d->tdt;
          break;
 
@@ -937,6 +938,17 @@ static void rxdesc_read(struct i8254x_data *d,m_uint64_t rxd_addr,
    rxd->rdes[3] = vmtoh32(rxd->rdes[3]);
 }
 
+/* Write back the length and status words of a RX descriptor */
+static void rxdesc_write_status(struct i8254x_data *d,m_uint64_t rxd_addr,
+                                struct rx_desc *rxd)
+{
+   m_uint32_t tmp[2];
+
+   tmp[0] = htovm32(rxd->rdes[2]);
+   tmp[1] = htovm32(rxd->rdes[3]);
+   physmem_copy_to_vm(d->vm,tmp,rxd_addr+0x08,sizeof(tmp));
+}
+
 /*
  * Put a packet in the RX ring.
  */
@@ -992,8 +1004,7 @@ static int dev_i8254x_receive_pkt(struct i8254x_data *d,
       }
 
       /* Write back updated descriptor */
-      physmem_copy_u32_to_vm(d->vm,rxd_addr+0x08,rxd.rdes[2]);
-      physmem_copy_u32_to_vm(d->vm,rxd_addr+0x0c,rxd.rdes[3]);
+      rxdesc_write_status(d,rxd_addr,&rxd);
 
       /* Goto to the next descriptor, and wrap if necessary */
       if (++d->rdh == (d->rdlen / sizeof(struct rx_desc)))
@@ -1156,8 +1167,9 @@ int dev_i8254x_set_nio(struct i8254x_data *d,netio_desc_t *nio)
       return(-1);
 
    d->nio = nio;
-   d->tx_tid = ptask_add((ptask_callback)dev_i8254x_handle_txring,d,NULL);
-   netio_rxl_add(nio,(netio_rx_handler_t)dev_i8254x_handle_rxring,d,NULL);
+   d->tx_tid = ptask_add((ptask_callback)dev_i8254x_handle_txring,
+                         d,NULL,d->vm,"dev_i8254x_handle_txring");
+   netio_rxl_add(nio,(netio_rx_handler_t)dev_i8254x_handle_rxring,d,NULL,d->vm);
    return(0);
 }
 
@@ -1039,7 +1039,8 @@ int dev_i8255x_set_nio(struct i8255x_data *d,netio_desc_t *nio)
       return(-1);
 
    d->nio = nio;
-   netio_rxl_add(nio,(netio_rx_handler_t)dev_i8255x_handle_rxring,d,NULL);
+   netio_rxl_add(nio,(netio_rx_handler_t)dev_i8255x_handle_rxring,
+                 d,NULL,d->vm);
    return(0);
 }
 
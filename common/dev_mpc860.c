@@ -1103,7 +1103,7 @@ int mpc860_scc_set_nio(struct mpc860_data *d,u_int scc_chan,netio_desc_t *nio)
 
    chan->nio = nio;
    netio_rxl_add(nio,(netio_rx_handler_t)mpc860_scc_handle_rx_pkt,
-                 d,(void *)(u_long)scc_chan);
+                 d,(void *)(u_long)scc_chan,d->vm);
    return(0);
 }
 
@@ -1723,7 +1723,8 @@ int mpc860_fec_set_nio(struct mpc860_data *d,netio_desc_t *nio)
       return(-1);
 
    d->fec_nio = nio;
-   netio_rxl_add(nio,(netio_rx_handler_t)mpc860_fec_handle_rx_pkt,d,NULL);
+   netio_rxl_add(nio,(netio_rx_handler_t)mpc860_fec_handle_rx_pkt,
+                 d,NULL,d->vm);
    mpc860_fec_mii_update_regs(d);
    return(0);
 }
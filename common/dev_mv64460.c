@@ -362,6 +362,7 @@ struct mpsc_channel {
 /* Transmit Command Queue */
 #define MV64460_ETH_TQC_ENQ(i)   (0x0001 << (i))
 #define MV64460_ETH_TQC_DISQ(i)  (0x0100 << (i))
+#define MV64460_ETH_TQC_ENQ_ALL  0x00FF
 
 /* Receive Command Queue */
 #define MV64460_ETH_RQC_ENQ(i)   (0x0001 << (i))
@@ -2063,6 +2064,10 @@ static int mv64460_eth_access(cpu_gen_t *cpu,struct vdevice *dev,
                   port->tqc |= MV64460_ETH_TQC_DISQ(i);
                }
             }
+
+            /* Queue enabled: scan the TX queues right now */
+            if (*data & MV64460_ETH_TQC_ENQ_ALL)
+               ptask_kick(mv_data->eth_tx_tid);
          }
          break;
 
@@ -2233,7 +2238,7 @@ int dev_mv64460_eth_set_nio(struct mv64460_data *d,u_int port_id,
 
    port->nio = nio;
    netio_rxl_add(nio,(netio_rx_handler_t)mv64460_eth_handle_rx_pkt,
-                 d,(void *)(u_long)port_id);
+                 d,(void *)(u_long)port_id,d->vm);
    return(0);
 }
 
@@ -2670,7 +2675,7 @@ int dev_mv64460_init(vm_instance_t *vm,char *name,
 
    /* Start the Ethernet TX ring scanner */
    d->eth_tx_tid = ptask_add((ptask_callback)mv64460_eth_handle_txqueues,
-                             d,NULL);
+                             d,NULL,vm,"mv64460_eth_handle_txqueues");
 
    /* Map this device to the VM */
    vm_bind_device(vm,&d->dev);
@@ -1482,6 +1482,7 @@ void *dev_bcm5605_access(cpu_gen_t *cpu,struct vdevice *dev,m_uint32_t offset,
          else {
             d->tx_ring_addr = d->tx_current = *data;   
             d->tx_end_scan = 0;
+            ptask_kick(d->tx_tid);
 #if DEBUG_TRANSMIT
             BCM_LOG(d,"tx_ring_addr = 0x%8.8x\n",d->tx_ring_addr);
 #endif
@@ -2510,7 +2511,7 @@ dev_nm_16esw_init(vm_instance_t *vm,char *name,u_int nm_bay,
 
    /* Create the TX ring scanner */
    data->tx_tid = ptask_add((ptask_callback)dev_bcm5600_handle_txring,
-                            data,NULL);
+                            data,NULL,vm,"dev_bcm5600_handle_txring");
 
    /* Start the MAC address ager */
    data->ager_tid = timer_create_entry(15000,FALSE,10,
@@ -2552,7 +2553,8 @@ int dev_nm_16esw_set_nio(struct nm_16esw_data *d,u_int port_id,
    /* define the new NIO */
    port = &d->ports[nm16esw_port_mapping[port_id]];
    port->nio = nio;
-   netio_rxl_add(nio,(netio_rx_handler_t)dev_bcm5600_handle_rxring,d,port);
+   netio_rxl_add(nio,(netio_rx_handler_t)dev_bcm5600_handle_rxring,
+                 d,port,d->vm);
    return(0);
 }
 
@@ -397,7 +397,8 @@ int dev_ns16552_init(vm_instance_t *vm,m_uint64_t paddr,m_uint32_t len,
    vtty_B->read_notifier = tty_aux_input;
 
    /* Trigger periodically a dummy IRQ to flush buffers */
-   d->tid = ptask_add((ptask_callback)tty_trigger_dummy_irq,d,NULL);
+   d->tid = ptask_add((ptask_callback)tty_trigger_dummy_irq,
+                      d,NULL,vm,"tty_trigger_dummy_irq");
 
    /* Map this device to the VM */
    vm_bind_device(vm,&d->dev);   
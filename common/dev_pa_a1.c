@@ -1675,8 +1675,9 @@ int dev_c7200_pa_a1_set_nio(vm_instance_t *vm,struct cisco_card *card,
       return(-1);
 
    d->nio = nio;
-   d->tx_tid = ptask_add((ptask_callback)ti1570_scan_tx_sched_table,d,NULL);
-   netio_rxl_add(nio,(netio_rx_handler_t)ti1570_handle_rx_cell,d,NULL);
+   d->tx_tid = ptask_add((ptask_callback)ti1570_scan_tx_sched_table,
+                         d,NULL,d->vm,"ti1570_scan_tx_sched_table");
+   netio_rxl_add(nio,(netio_rx_handler_t)ti1570_handle_rx_cell,d,NULL,d->vm);
    return(0);
 }
 
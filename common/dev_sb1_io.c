@@ -316,7 +316,8 @@ int dev_sb1_io_init(vm_instance_t *vm,u_int duart_irq)
    vm->vtty_aux->read_notifier = tty_aux_input;
 
    /* Trigger periodically a dummy IRQ to flush buffers */
-   d->duart_irq_tid = ptask_add((ptask_callback)tty_trigger_dummy_irq,d,NULL);
+   d->duart_irq_tid = ptask_add((ptask_callback)tty_trigger_dummy_irq,
+                                d,NULL,vm,"tty_trigger_dummy_irq");
 
    /* Map this device to the VM */
    vm_bind_device(vm,&d->dev);  
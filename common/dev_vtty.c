@@ -812,12 +812,16 @@ static void remote_control(vtty_t *vtty,u_char c)
          
       /* Suspend CPU emulation */
       case 's':
+         VM_STATE_LOCK(vm);
          vm_suspend(vm);
+         VM_STATE_UNLOCK(vm);
          break;
   
       /* Resume CPU emulation */
       case 'u':
+         VM_STATE_LOCK(vm);
          vm_resume(vm);
+         VM_STATE_UNLOCK(vm);
          break;
   
       /* Dump the MMU information */
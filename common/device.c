@@ -18,6 +18,8 @@
 #include "dynamips.h"
 #include "memory.h"
 #include "device.h"
+#include "page_merge.h"
+#include "ram_snap.h"
 
 #define DEBUG_DEV_ACCESS  0
 
@@ -45,14 +47,178 @@ struct vdevice *dev_get_by_name(vm_instance_t *vm,char *name)
    return NULL;
 }
 
-/* Device lookup by physical address */
-struct vdevice *dev_lookup(vm_instance_t *vm,m_uint64_t phys_addr,int cached)
+/* Allocate an index for the specified number of devices */
+static vm_dev_index_t *dev_index_alloc(u_int count)
+{
+   vm_dev_index_t *idx;
+   size_t len;
+
+   len = sizeof(*idx) + 
+      count * (2 * sizeof(m_uint64_t) + sizeof(struct vdevice *));
+
+   if (!(idx = malloc(len)))
+      return NULL;
+
+   idx->next    = NULL;
+   idx->count   = 0;
+   idx->max_end = (m_uint64_t *)(idx + 1);
+   idx->start   = idx->max_end + count;
+   idx->dev     = (struct vdevice **)(idx->start + count);
+   return idx;
+}
+
+/* Add a device to an index */
+static void dev_index_add(vm_dev_index_t *idx,struct vdevice *dev)
+{
+   m_uint64_t end;
+   u_int i;
+
+   i = idx->count;
+   end = dev->phys_addr + dev->phys_len;
+
+   idx->start[i]   = dev->phys_addr;
+   idx->max_end[i] = (i > 0) ? m_max(idx->max_end[i-1],end) : end;
+   idx->dev[i]     = dev;
+   idx->count++;
+}
+
+/* Replace an index, the old one is retired (lookups may still use it) */
+static void dev_index_publish(vm_instance_t *vm,vm_dev_index_t **ptr,
+                              vm_dev_index_t *idx)
+{
+   vm_dev_index_t *old = *ptr;
+
+   __sync_synchronize();
+   *ptr = idx;
+
+   if (old != NULL) {
+      old->next = vm->dev_index_retired;
+      vm->dev_index_retired = old;
+   }
+}
+
+/* 
+ * Check that no CPU of a VM can be doing a lookup: the VM is not started,
+ * or the caller is its only CPU (device remapped by the guest).
+ */
+static int dev_index_cpu_quiescent(vm_instance_t *vm)
+{
+   cpu_gen_t *cpu;
+
+   if ((vm->status == VM_STATUS_HALTED) || !vm->cpu_group)
+      return(TRUE);
+
+   for(cpu=vm->cpu_group->cpu_list;cpu;cpu=cpu->next)
+      if (!pthread_equal(cpu->cpu_thread,pthread_self()))
+         return(FALSE);
+
+   return(TRUE);
+}
+
+/* 
+ * Rebuild the device indexes of a VM (device list is sorted).
+ * New indexes are built aside and published when complete, so that
+ * lookups done concurrently by CPU and device threads see either the
+ * old or the new index. If memory is short, lookups walk the device list.
+ */
+void dev_index_rebuild(vm_instance_t *vm)
 {
+   vm_dev_index_t *idx,*cidx;
    struct vdevice *dev;
-   
-   if (!vm)
+   u_int count = 0;
+
+   for(dev=vm->dev_list;dev;dev=dev->next)
+      count++;
+
+   idx = dev_index_alloc(count);
+   cidx = dev_index_alloc(count);
+
+   if (!idx || !cidx) {
+      fprintf(stderr,"VM%u: unable to rebuild device index, "
+              "using device list.\n",vm->instance_id);
+      free(idx);
+      free(cidx);
+      idx = cidx = NULL;
+   } else {
+      for(dev=vm->dev_list;dev;dev=dev->next) {
+         dev_index_add(idx,dev);
+
+         if (dev->flags & VDEVICE_FLAG_CACHING)
+            dev_index_add(cidx,dev);
+      }
+   }
+
+   dev_index_publish(vm,&vm->dev_index,idx);
+   dev_index_publish(vm,&vm->dev_cindex,cidx);
+
+   /* 
+    * Device threads do lookups with the RAM lock held: once it is taken,
+    * the retired indexes are not used anymore.
+    */
+   if (dev_index_cpu_quiescent(vm)) {
+      VM_RAM_LOCK(vm);
+      dev_index_reclaim(vm);
+      VM_RAM_UNLOCK(vm);
+   }
+}
+
+/* Free the retired device indexes of a VM (no lookup can use them) */
+void dev_index_reclaim(vm_instance_t *vm)
+{
+   vm_dev_index_t *idx,*next;
+
+   for(idx=vm->dev_index_retired;idx;idx=next) {
+      next = idx->next;
+      free(idx);
+   }
+
+   vm->dev_index_retired = NULL;
+}
+
+/* Free the device indexes of a VM (no lookup can be in progress) */
+void dev_index_free(vm_instance_t *vm)
+{
+   dev_index_reclaim(vm);
+
+   free(vm->dev_index);
+   free(vm->dev_cindex);
+   vm->dev_index = vm->dev_cindex = NULL;
+}
+
+/* Find the first device whose range contains the specified address */
+static inline struct vdevice *
+dev_index_lookup(vm_dev_index_t *idx,m_uint64_t phys_addr)
+{
+   u_int low,high,mid;
+
+   if (!idx)
       return NULL;
 
+   /* first entry with max_end > phys_addr */
+   low = 0;
+   high = idx->count;
+
+   while(low < high) {
+      mid = (low + high) >> 1;
+
+      if (idx->max_end[mid] > phys_addr)
+         high = mid;
+      else
+         low = mid + 1;
+   }
+
+   if ((low < idx->count) && (idx->start[low] <= phys_addr))
+      return(idx->dev[low]);
+
+   return NULL;
+}
+
+/* Device lookup by physical address in the device list */
+static struct vdevice *
+dev_list_lookup(vm_instance_t *vm,m_uint64_t phys_addr,int cached)
+{
+   struct vdevice *dev;
+
    for(dev=vm->dev_list;dev;dev=dev->next) {
       if (cached && !(dev->flags & VDEVICE_FLAG_CACHING))
          continue;
@@ -65,25 +231,61 @@ struct vdevice *dev_lookup(vm_instance_t *vm,m_uint64_t phys_addr,int cached)
    return NULL;
 }
 
+/* Device lookup by physical address */
+struct vdevice *dev_lookup(vm_instance_t *vm,m_uint64_t phys_addr,int cached)
+{
+   vm_dev_index_t *idx;
+
+   if (!vm)
+      return NULL;
+
+   if (unlikely(!(idx = cached ? vm->dev_cindex : vm->dev_index)))
+      return(dev_list_lookup(vm,phys_addr,cached));
+
+   return(dev_index_lookup(idx,phys_addr));
+}
+
 /* Find the next device after the specified address */
 struct vdevice *dev_lookup_next(vm_instance_t *vm,m_uint64_t phys_addr,
                                 struct vdevice *dev_start,int cached)
 {
+   vm_dev_index_t *idx;
    struct vdevice *dev;
+   u_int low,high,mid;
    
    if (!vm)
       return NULL;
 
-   dev = (dev_start != NULL) ? dev_start : vm->dev_list;
-   for(;dev;dev=dev->next) {
-      if (cached && !(dev->flags & VDEVICE_FLAG_CACHING))
-         continue;
+   idx = cached ? vm->dev_cindex : vm->dev_index;
 
-      if (dev->phys_addr > phys_addr)
-         return dev;
+   if ((dev_start != NULL) || !idx) {
+      dev = (dev_start != NULL) ? dev_start : vm->dev_list;
+
+      for(;dev;dev=dev->next) {
+         if (cached && !(dev->flags & VDEVICE_FLAG_CACHING))
+            continue;
+
+         if (dev->phys_addr > phys_addr)
+            return dev;
+      }
+
+      return NULL;
    }
 
-   return NULL;
+   /* first entry with start > phys_addr */
+   low = 0;
+   high = idx->count;
+
+   while(low < high) {
+      mid = (low + high) >> 1;
+
+      if (idx->start[mid] > phys_addr)
+         high = mid;
+      else
+         low = mid + 1;
+   }
+
+   return((low < idx->count) ? idx->dev[low] : NULL);
 }
 
 /* Initialize a device */
@@ -154,9 +356,13 @@ void dev_remove(vm_instance_t *vm,struct vdevice *dev)
 
       close(dev->fd);
    } else {
-      /* Use of malloc'ed host memory: free it */
-      if (dev->host_addr)
-         free((void *)dev->host_addr);
+      /* Use of malloc'ed or anonymous host memory: free it */
+      if (dev->host_addr) {
+         if (dev->flags & VDEVICE_FLAG_ANON_MMAP)
+            memzone_unmap((void *)dev->host_addr,dev->phys_len);
+         else
+            free((void *)dev->host_addr);
+      }
    }
 
    /* reinitialize the device to a clean state */
@@ -235,13 +441,14 @@ struct vdevice *dev_create_ram(vm_instance_t *vm,char *name,
 {
    struct vdevice *dev;
    u_char *ram_ptr;
+   int backing = MEMZONE_BACKING_STD;
 
    if (!(dev = dev_create(name)))
       return NULL;
 
    dev->phys_addr = paddr;
    dev->phys_len = len;
-   dev->flags = VDEVICE_FLAG_CACHING;
+   dev->flags = VDEVICE_FLAG_CACHING|VDEVICE_FLAG_RAM;
 
    if (!sparse) {
       if (filename) {
@@ -253,7 +460,12 @@ struct vdevice *dev_create_ram(vm_instance_t *vm,char *name,
             return NULL;
          }
       
+         /* file mappings stay on standard pages */
+         dev->host_addr = (m_iptr_t)ram_ptr;
+      } else if (vm->ram_hugepages &&
+                 (ram_ptr = memzone_map_huge(dev->phys_len,&backing))) {
          dev->host_addr = (m_iptr_t)ram_ptr;
+         dev->flags |= VDEVICE_FLAG_ANON_MMAP;
       } else {
          dev->host_addr = (m_iptr_t)m_memalign(4096,dev->phys_len);
       }
@@ -262,6 +474,10 @@ struct vdevice *dev_create_ram(vm_instance_t *vm,char *name,
          free(dev);
          return NULL;
       }
+
+      if (vm->ram_hugepages)
+         vm_log(vm,"RAM","device '%s' (%u KB) backed by %s\n",
+                name,len >> 10,memzone_get_backing_str(backing));
    } else {
       dev_sparse_init(dev);
    }
@@ -283,7 +499,7 @@ dev_create_ghost_ram(vm_instance_t *vm,char *name,int sparse,char *filename,
 
    dev->phys_addr = paddr;
    dev->phys_len = len;
-   dev->flags = VDEVICE_FLAG_CACHING|VDEVICE_FLAG_GHOST;
+   dev->flags = VDEVICE_FLAG_CACHING|VDEVICE_FLAG_GHOST|VDEVICE_FLAG_RAM;
 
    if (!sparse) {
       dev->fd = memzone_open_cow_file(filename,dev->phys_len,&ram_ptr);
@@ -297,6 +513,11 @@ dev_create_ghost_ram(vm_instance_t *vm,char *name,int sparse,char *filename,
          free(dev);
          return NULL;
       }
+
+      /* the COW file mapping stays on standard pages */
+      if (vm->ram_hugepages)
+         vm_log(vm,"RAM","ghost device '%s' (%u KB) backed by %s\n",
+                name,len >> 10,memzone_get_backing_str(MEMZONE_BACKING_STD));
    } else {
       if (vm_ghost_image_get(filename,&ram_ptr,&dev->fd) == -1) {
          free(dev);
@@ -361,9 +582,18 @@ int dev_sparse_init(struct vdevice *dev)
 /* Shutdown sparse device structures */
 int dev_sparse_shutdown(struct vdevice *dev)
 {
+   u_int i,nr_pages;
+
    if (!(dev->flags & VDEVICE_FLAG_SPARSE))
       return(-1);
 
+   /* Release the merged pages */
+   nr_pages = normalize_size(dev->phys_len,VM_PAGE_SIZE,VM_PAGE_SHIFT);
+
+   for(i=0;i<nr_pages;i++)
+      if (dev->sparse_map[i] & VDEVICE_PTE_SHARED)
+         page_merge_release(dev->sparse_map[i] & VM_PAGE_MASK);
+
    free(dev->sparse_map);
    dev->sparse_map = NULL;
    return(0);
@@ -372,7 +602,7 @@ int dev_sparse_shutdown(struct vdevice *dev)
 /* Show info about a sparse device */
 int dev_sparse_show_info(struct vdevice *dev)
 {
-   u_int i,nr_pages,dirty_pages;
+   u_int i,nr_pages,dirty_pages,shared_pages,file_pages;
 
    printf("Sparse information for device '%s':\n",dev->name);
 
@@ -387,16 +617,66 @@ int dev_sparse_show_info(struct vdevice *dev)
    }
 
    nr_pages = normalize_size(dev->phys_len,VM_PAGE_SIZE,VM_PAGE_SHIFT);
-   dirty_pages = 0;
+   dirty_pages = shared_pages = file_pages = 0;
   
-   for(i=0;i<nr_pages;i++)
+   for(i=0;i<nr_pages;i++) {
       if (dev->sparse_map[i] & VDEVICE_PTE_DIRTY)
          dirty_pages++;
+      else if (dev->sparse_map[i] & VDEVICE_PTE_SHARED)
+         shared_pages++;
+      else if (dev->sparse_map[i] & VDEVICE_PTE_FILE)
+         file_pages++;
+   }
+
+   printf("%u dirty pages, %u merged pages and %u image file pages "
+          "on a total of %u pages.\n",
+          dirty_pages,shared_pages,file_pages,nr_pages);
+   return(0);
+}
 
-   printf("%u dirty pages on a total of %u pages.\n",dirty_pages,nr_pages);
+/* 
+ * Map a read-only page of an image file in a sparse device, at the 
+ * specified physical address. The page is duplicated on first write.
+ *
+ * Returns -1 if the address doesn't belong to a sparse RAM device, or if 
+ * the physical page has already been populated.
+ */
+int dev_sparse_map_file_page(vm_instance_t *vm,m_uint64_t paddr,
+                             m_iptr_t host_page)
+{
+   struct vdevice *dev;
+   u_int offset;
+
+   if (!(dev = dev_lookup(vm,paddr,FALSE)))
+      return(-1);
+
+   if (!(dev->flags & VDEVICE_FLAG_SPARSE) || dev->host_addr)
+      return(-1);
+
+   offset = (paddr - dev->phys_addr) >> VM_PAGE_SHIFT;
+
+   if (dev->sparse_map[offset] & 
+       (VDEVICE_PTE_DIRTY|VDEVICE_PTE_SHARED|VDEVICE_PTE_SNAP))
+      return(-1);
+
+   dev->sparse_map[offset] = (host_page & VM_PAGE_MASK) | VDEVICE_PTE_FILE;
    return(0);
 }
 
+/* 
+ * Install a new host page in a sparse PTE. Another thread of the VM may
+ * have installed a page first: the new one is freed and FALSE is returned.
+ */
+static int dev_sparse_install_page(vm_instance_t *vm,m_iptr_t *pte,
+                                   m_iptr_t old_pte,m_iptr_t page)
+{
+   if (__sync_bool_compare_and_swap(pte,old_pte,page | VDEVICE_PTE_DIRTY))
+      return(TRUE);
+
+   vm_free_host_page(vm,(void *)page);
+   return(FALSE);
+}
+
 /* Get an host address for a sparse device */
 m_iptr_t dev_sparse_get_host_addr(vm_instance_t *vm,struct vdevice *dev,
                                   m_uint64_t paddr,u_int op_type,int *cow)
@@ -408,20 +688,63 @@ m_iptr_t dev_sparse_get_host_addr(vm_instance_t *vm,struct vdevice *dev,
    ptr = dev->sparse_map[offset];
    *cow = 0;
 
+   /* 
+    * Page saved by a RAM snapshot: it is mapped read-only until the next
+    * write, which marks it as modified since the snapshot.
+    */
+   if (ptr & VDEVICE_PTE_LOGGED) {
+      if (op_type == MTS_READ)
+         *cow = 1;
+      else
+         ptr = ram_snap_track_write(vm,&dev->sparse_map[offset]);
+   }
+
+   /* Page merged with identical pages: duplicate it on write */
+   if (ptr & VDEVICE_PTE_SHARED) {
+      if (op_type == MTS_READ) {
+         *cow = 1;
+         return(ptr & VM_PAGE_MASK);
+      }
+
+      ptr_new = page_merge_unshare(vm,&dev->sparse_map[offset]);
+      assert(ptr_new);
+      return(ptr_new);
+   }
+
    /* 
     * If the device is not in COW mode, allocate a host page if the physical
     * page is requested for the first time.
     */
    if (!dev->host_addr) {
-      if (!(ptr & VDEVICE_PTE_DIRTY)) {
-         ptr = (m_iptr_t)vm_alloc_host_page(vm);
-         assert(ptr);
+      if (ptr & VDEVICE_PTE_DIRTY)
+         return(ptr & VM_PAGE_MASK);
+
+      /* Page of an image file, loaded on demand */
+      if (ptr & VDEVICE_PTE_FILE) {
+         if (op_type == MTS_READ) {
+            *cow = 1;
+            return(ptr & VM_PAGE_MASK);
+         }
 
-         dev->sparse_map[offset] = ptr | VDEVICE_PTE_DIRTY;
-         return(ptr);
-      } 
+         ptr_new = (m_iptr_t)vm_alloc_host_page(vm);
+         assert(ptr_new);
 
-      return(ptr & VM_PAGE_MASK);
+         memcpy((void *)ptr_new,(void *)(ptr & VM_PAGE_MASK),VM_PAGE_SIZE);
+
+         if (!dev_sparse_install_page(vm,&dev->sparse_map[offset],
+                                      ptr,ptr_new))
+            return(dev_sparse_get_host_addr(vm,dev,paddr,op_type,cow));
+
+         return(ptr_new);
+      }
+
+      ptr_new = (m_iptr_t)vm_alloc_host_page(vm);
+      assert(ptr_new);
+
+      if (!dev_sparse_install_page(vm,&dev->sparse_map[offset],ptr,ptr_new))
+         return(dev_sparse_get_host_addr(vm,dev,paddr,op_type,cow));
+
+      return(ptr_new);
    }
 
    /* 
@@ -441,7 +764,10 @@ m_iptr_t dev_sparse_get_host_addr(vm_instance_t *vm,struct vdevice *dev,
    assert(ptr_new);
 
    memcpy((void *)ptr_new,(void *)(ptr & VM_PAGE_MASK),VM_PAGE_SIZE);
-   dev->sparse_map[offset] = ptr_new | VDEVICE_PTE_DIRTY;
+
+   if (!dev_sparse_install_page(vm,&dev->sparse_map[offset],ptr,ptr_new))
+      return(dev_sparse_get_host_addr(vm,dev,paddr,op_type,cow));
+
    return(ptr_new);
 }
 
@@ -19,8 +19,14 @@
 #define VDEVICE_FLAG_SYNC         0x08  /* Forced sync */
 #define VDEVICE_FLAG_SPARSE       0x10  /* Sparse device */
 #define VDEVICE_FLAG_GHOST        0x20  /* Ghost device */
+#define VDEVICE_FLAG_ANON_MMAP    0x40  /* Anonymous mapping (munmap) */
+#define VDEVICE_FLAG_RAM          0x80  /* RAM (saved by checkpoints) */
 
 #define VDEVICE_PTE_DIRTY  0x01
+#define VDEVICE_PTE_SHARED 0x02  /* Merged page (see page_merge.c) */
+#define VDEVICE_PTE_FILE   0x04  /* Read-only page of an image file */
+#define VDEVICE_PTE_LOGGED 0x08  /* Saved by the last RAM snapshot */
+#define VDEVICE_PTE_SNAP   0x10  /* Not written yet by the RAM snapshot */
 
 typedef void *(*dev_handler_t)(cpu_gen_t *cpu,struct vdevice *dev,
                                m_uint32_t offset,u_int op_size,u_int op_type,
@@ -38,6 +44,10 @@ struct vdevice {
    int fd;
    dev_handler_t handler;
    m_iptr_t *sparse_map;
+
+   /* Save/restore of the device state (see vm_ckpt.c) */
+   void (*ckpt_handler)(vm_ckpt_t *ckpt,struct vdevice *dev);
+
    struct vdevice *next,**pprev;
 };
 
@@ -101,6 +111,15 @@ struct vdevice *dev_get_by_id(vm_instance_t *vm,u_int dev_id);
 /* Get device by name */
 struct vdevice *dev_get_by_name(vm_instance_t *vm,char *name);
 
+/* Rebuild the device indexes of a VM */
+void dev_index_rebuild(vm_instance_t *vm);
+
+/* Free the retired device indexes of a VM */
+void dev_index_reclaim(vm_instance_t *vm);
+
+/* Free the device indexes of a VM */
+void dev_index_free(vm_instance_t *vm);
+
 /* Device lookup by physical address */
 struct vdevice *dev_lookup(vm_instance_t *vm,m_uint64_t phys_addr,int cached);
 
@@ -154,6 +173,10 @@ int dev_sparse_init(struct vdevice *dev);
 /* Shutdown sparse device structures */
 int dev_sparse_shutdown(struct vdevice *dev);
 
+/* Map a read-only page of an image file in a sparse device */
+int dev_sparse_map_file_page(vm_instance_t *vm,m_uint64_t paddr,
+                             m_iptr_t host_page);
+
 /* Get an host address for a sparse device */
 m_iptr_t dev_sparse_get_host_addr(vm_instance_t *vm,struct vdevice *dev,
                                   m_uint64_t paddr,u_int op_type,int *cow);
@@ -45,7 +45,9 @@
 #include "ppc32_vmtest.h"
 #include "dev_vtty.h"
 #include "ptask.h"
+#include "cpu_sched.h"
 #include "timer.h"
+#include "vclock.h"
 #include "plugin.h"
 #include "registry.h"
 #include "hypervisor.h"
@@ -193,6 +195,7 @@ static void show_usage(vm_instance_t *vm,int argc,char *argv[])
           "  -l <log_file>      : Set logging file (default is %s)\n"
           "  -j                 : Disable the JIT compiler, very slow\n"
           "  --idle-pc <pc>     : Set the idle PC (default: disabled)\n"
+          "  --idle-auto        : Detect the idle PC automatically\n"
           "  --timer-itv <val>  : Timer IRQ interval check (default: %u)\n"
           "\n"
           "  -i <instance>      : Set instance ID\n"
@@ -208,7 +211,10 @@ static void show_usage(vm_instance_t *vm,int argc,char *argv[])
           "  -X                 : Do not use a file to simulate RAM (faster)\n"
           "  -G <ghost_file>    : Use a ghost file to simulate RAM\n"
           "  -g <ghost_file>    : Generate a ghost RAM file\n"
+          "  --ghost-cache <dir>: Use or generate ghost RAM files in a cache\n"
           "  --sparse-mem       : Use sparse memory\n"
+          "  --ram-hugepages    : Back RAM with huge pages when available\n"
+          "  --page-merge       : Merge identical sparse RAM pages\n"
           "  -R <rom_file>      : Load an alternate ROM (default: embedded)\n"
           "  -k <clock_div>     : Set the clock divisor (default: %d)\n"
           "\n"
@@ -228,6 +234,16 @@ static void show_usage(vm_instance_t *vm,int argc,char *argv[])
           "  --noctrl           : Disable ctrl+] monitor console\n"
           "  --notelnetmsg      : Disable message when using tcp console/aux\n"
           "  --filepid filename : Store dynamips pid in a file\n"
+          "  --ptask-affinity   : Bind periodic task workers to host CPUs\n"
+          "  --cpu-sched <n>    : Run CPUs on <n> worker threads "
+          "(0: one per host CPU)\n"
+#ifdef USE_UNSTABLE
+          "  --jit-cache <file> : Keep translated code in a persistent cache\n"
+          "  --tsg-shm <name>   : Share translated code with other processes\n"
+          "                       (trusted processes only)\n"
+#else
+          "  --jit-tier2 <count>: Recompile pages run <count> times (0: off)\n"
+#endif
           "\n",
           LOGFILE_DEFAULT_NAME,VM_TIMER_IRQ_CHECK_ITV,
           vm->ram_size,vm->rom_size,vm->nvram_size,vm->conf_reg_setup,
@@ -363,13 +379,25 @@ static struct option cmd_line_lopts[] = {
    { "disk0"      , 1, NULL, OPT_DISK0_SIZE },
    { "disk1"      , 1, NULL, OPT_DISK1_SIZE },
    { "idle-pc"    , 1, NULL, OPT_IDLE_PC },
+   { "idle-auto"  , 0, NULL, OPT_IDLE_AUTO },
    { "timer-itv"  , 1, NULL, OPT_TIMER_ITV },
    { "vm-debug"   , 1, NULL, OPT_VM_DEBUG },
    { "iomem-size" , 1, NULL, OPT_IOMEM_SIZE },
    { "sparse-mem" , 0, NULL, OPT_SPARSE_MEM },
+   { "ram-hugepages", 0, NULL, OPT_RAM_HUGEPAGES },
+   { "page-merge" , 0, NULL, OPT_PAGE_MERGE },
+   { "ghost-cache", 1, NULL, OPT_GHOST_CACHE },
    { "noctrl"     , 0, NULL, OPT_NOCTRL },
    { "notelnetmsg", 0, NULL, OPT_NOTELMSG },
    { "filepid"    , 1, NULL, OPT_FILEPID },
+   { "ptask-affinity", 0, NULL, OPT_PTASK_AFFINITY },
+   { "cpu-sched"  , 1, NULL, OPT_CPU_SCHED },
+#ifdef USE_UNSTABLE
+   { "jit-cache"  , 1, NULL, OPT_JIT_CACHE },
+   { "tsg-shm"    , 1, NULL, OPT_TSG_SHM },
+#else
+   { "jit-tier2"  , 1, NULL, OPT_JIT_TIER2 },
+#endif
    { "startup-config", 1, NULL, OPT_STARTUP_CONFIG_FILE },
    { "private-config", 1, NULL, OPT_PRIVATE_CONFIG_FILE },
    { NULL         , 0, NULL, 0 },
@@ -518,11 +546,27 @@ static int parse_std_cmd_line(int argc,char *argv[])
             vm->ghost_status = VM_GHOST_RAM_GENERATE;
             break;
 
+         /* Use or generate ghost RAM images in a cache directory */
+         case OPT_GHOST_CACHE:
+            free(vm->ghost_cache_dir);
+            vm->ghost_cache_dir = strdup(optarg);
+            break;
+
          /* Use sparse memory */
          case OPT_SPARSE_MEM:
             vm->sparse_mem = TRUE;
             break;
 
+         /* Back RAM with huge pages */
+         case OPT_RAM_HUGEPAGES:
+            vm->ram_hugepages = TRUE;
+            break;
+
+         /* Merge identical RAM pages with other instances */
+         case OPT_PAGE_MERGE:
+            vm->page_merge = TRUE;
+            break;
+
          /* Alternate ROM */
          case 'R':
             free(vm->rom_filename);
@@ -543,12 +587,44 @@ static int parse_std_cmd_line(int argc,char *argv[])
             }
             break;
 
+         /* Bind periodic task workers to host CPUs */
+         case OPT_PTASK_AFFINITY:
+            ptask_cpu_affinity = TRUE;
+            break;
+
+         /* Run CPUs on a pool of worker threads */
+         case OPT_CPU_SCHED:
+            cpu_sched_workers = m_max(atoi(optarg),0);
+            break;
+
+#ifdef USE_UNSTABLE
+         /* Persistent cache of JIT translated code */
+         case OPT_JIT_CACHE:
+            tc_cache_file = optarg;
+            break;
+
+         /* Translated code shared between processes */
+         case OPT_TSG_SHM:
+            tsg_shm_name = optarg;
+            break;
+#else
+         /* Hot page recompilation threshold */
+         case OPT_JIT_TIER2:
+            mips64_jit_tier2_threshold = strtoul(optarg,NULL,0);
+            break;
+#endif
+
          /* Idle PC */
          case OPT_IDLE_PC:
             vm->idle_pc = strtoull(optarg,NULL,0);
             printf("Idle PC set to 0x%llx.\n",vm->idle_pc);
             break;
 
+         /* Automatic idle PC detection */
+         case OPT_IDLE_AUTO:
+            vm->idle_auto = TRUE;
+            break;
+
          /* Timer IRQ check interval */
          case OPT_TIMER_ITV:
             vm->timer_irq_check_itv = atoi(optarg);
@@ -816,6 +892,33 @@ static int run_hypervisor(int argc,char *argv[])
             }
             break;
 
+         /* Bind periodic task workers to host CPUs */
+         case OPT_PTASK_AFFINITY:
+            ptask_cpu_affinity = TRUE;
+            break;
+
+         /* Run CPUs on a pool of worker threads */
+         case OPT_CPU_SCHED:
+            cpu_sched_workers = m_max(atoi(optarg),0);
+            break;
+
+#ifdef USE_UNSTABLE
+         /* Persistent cache of JIT translated code */
+         case OPT_JIT_CACHE:
+            tc_cache_file = optarg;
+            break;
+
+         /* Translated code shared between processes */
+         case OPT_TSG_SHM:
+            tsg_shm_name = optarg;
+            break;
+#else
+         /* Hot page recompilation threshold */
+         case OPT_JIT_TIER2:
+            mips64_jit_tier2_threshold = strtoul(optarg,NULL,0);
+            break;
+#endif
+
          /* Oops ! */
          case '?':
             //show_usage(argc,argv,VM_TYPE_C7200);
@@ -920,6 +1023,9 @@ int main(int argc,char *argv[])
    /* Initialize timers */
    timer_init();
 
+   /* Start the virtual clock service (CPU timer IRQs) */
+   vclock_init();
+
    /* Initialize object registry */
    registry_init();
 
@@ -950,6 +1056,10 @@ int main(int argc,char *argv[])
    if (ptask_init(0) == -1)
       exit(EXIT_FAILURE);
 
+   /* CPU scheduler initialization */
+   if (cpu_sched_init() == -1)
+      exit(EXIT_FAILURE);
+
    /* Create instruction lookup tables */
    mips64_jit_create_ilt();
    mips64_exec_create_ilt();
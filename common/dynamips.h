@@ -29,6 +29,7 @@
 #define DEBUG_BLOCK_PERF_CNT   0   /* Block performance counter */
 #define DEBUG_DEV_PERF_CNT     1   /* Device performance counter */
 #define DEBUG_TLB_ACTIVITY     0 
+#define DEBUG_TLB_INDEX        0   /* Check TLB index against linear scan */
 #define DEBUG_SYSCALL          0
 #define DEBUG_CACHE            0
 #define DEBUG_JR0              0   /* Debug register jumps to 0 */
@@ -74,6 +75,15 @@ extern char *binding_addr;
 #define OPT_NOCTRL      0x120
 #define OPT_NOTELMSG    0x121
 #define OPT_FILEPID     0x122
+#define OPT_PTASK_AFFINITY  0x123
+#define OPT_JIT_CACHE       0x124
+#define OPT_TSG_SHM         0x125
+#define OPT_JIT_TIER2       0x126
+#define OPT_RAM_HUGEPAGES   0x127
+#define OPT_PAGE_MERGE      0x128
+#define OPT_GHOST_CACHE     0x129
+#define OPT_IDLE_AUTO       0x12a
+#define OPT_CPU_SCHED       0x12b
 #define OPT_STARTUP_CONFIG_FILE  0x140
 #define OPT_PRIVATE_CONFIG_FILE  0x141
 
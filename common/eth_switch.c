@@ -469,7 +469,7 @@ int ethsw_add_netio(ethsw_table_t *t,char *nio_name)
    set_access_port(nio,1);
 
    t->nio[i] = nio;
-   netio_rxl_add(nio,(netio_rx_handler_t)ethsw_recv_pkt,t,NULL);
+   netio_rxl_add(nio,(netio_rx_handler_t)ethsw_recv_pkt,t,NULL,NULL);
    ETHSW_UNLOCK(t);
    return(0);
 
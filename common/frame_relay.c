@@ -379,7 +379,8 @@ int frsw_create_vc(frsw_table_t *t,char *nio_input,u_int dlci_in,
    }
 
    /* Add as a RX listener */
-   if (netio_rxl_add(vc->input,(netio_rx_handler_t)frsw_recv_pkt,t,NULL) == -1)
+   if (netio_rxl_add(vc->input,(netio_rx_handler_t)frsw_recv_pkt,
+                     t,NULL,NULL) == -1)
       goto error;
 
    hbucket = frsw_dlci_hash(dlci_in);
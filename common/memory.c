@@ -94,7 +94,13 @@ void memlog_update_read(cpu_gen_t *cpu,m_iptr_t raddr)
 
 /* === Operations on physical memory ====================================== */
 
-/* Get host pointer for the physical address */
+/*
+ * Devices access RAM from their own threads: the RAM lock of the VM is held
+ * while a host pointer to a RAM page is used, so that page merging cannot
+ * release the page meanwhile. It is not held while device handlers run.
+ */
+
+/* Get host pointer for the physical address (RAM lock held) */
 static inline void *physmem_get_hptr(vm_instance_t *vm,m_uint64_t paddr,
                                      u_int op_size,u_int op_type,
                                      m_uint64_t *data)
@@ -121,24 +127,68 @@ static inline void *physmem_get_hptr(vm_instance_t *vm,m_uint64_t paddr,
       return NULL;
 
    offset = paddr - dev->phys_addr;
-   return(dev->handler(vm->boot_cpu,dev,offset,op_size,op_type,data));
+
+   VM_RAM_UNLOCK(vm);
+   ptr = dev->handler(vm->boot_cpu,dev,offset,op_size,op_type,data);
+   VM_RAM_LOCK(vm);
+   return(ptr);
+}
+
+/* 
+ * Get a DMA window: resolve a physical range to a host pointer span.
+ *
+ * Returns the host pointer for "paddr" and stores in "win_len" the number
+ * of bytes (at most "len") that can be accessed linearly from it. The window
+ * stops at the end of the device, and at the end of the page for sparse
+ * devices. With MTS_WRITE, ghost pages are duplicated (copy-on-write).
+ * Returns NULL if the range is not backed by host memory (MMIO).
+ * The RAM lock must be held while the window is used.
+ */
+void *physmem_dma_window(vm_instance_t *vm,m_uint64_t paddr,size_t len,
+                         u_int op_type,size_t *win_len)
+{
+   struct vdevice *dev;
+   m_uint64_t dev_len;
+   void *ptr;
+   int cow;
+
+   if (!(dev = dev_lookup(vm,paddr,FALSE)))
+      return NULL;
+
+   if (dev->flags & VDEVICE_FLAG_SPARSE) {
+      ptr = (void *)dev_sparse_get_host_addr(vm,dev,paddr,op_type,&cow);
+      if (!ptr) return NULL;
+
+      *win_len = m_min(VM_PAGE_SIZE - (paddr & VM_PAGE_IMASK),len);
+      return(ptr + (paddr & VM_PAGE_IMASK));
+   }
+
+   if ((dev->host_addr == 0) || (dev->flags & VDEVICE_FLAG_NO_MTS_MMAP))
+      return NULL;
+
+   dev_len = dev->phys_len - (paddr - dev->phys_addr);
+   *win_len = m_min(dev_len,len);
+   return((void *)dev->host_addr + (paddr - dev->phys_addr));
 }
 
 /* Copy a memory block from VM physical RAM to real host */
 void physmem_copy_from_vm(vm_instance_t *vm,void *real_buffer,
                           m_uint64_t paddr,size_t len)
 {
-   m_uint64_t dummy;
+   size_t win_len;
    m_uint32_t r;
    u_char *ptr;
 
    while(len > 0) {
-      r = m_min(VM_PAGE_SIZE - (paddr & VM_PAGE_IMASK), len);
-      ptr = physmem_get_hptr(vm,paddr,0,MTS_READ,&dummy);
-      
+      VM_RAM_LOCK(vm);
+      ptr = physmem_dma_window(vm,paddr,len,MTS_READ,&win_len);
+
       if (likely(ptr != NULL)) {
+         r = win_len;
          memcpy(real_buffer,ptr,r);
+         VM_RAM_UNLOCK(vm);
       } else {
+         VM_RAM_UNLOCK(vm);
          r = m_min(len,4);
          switch(r) {
             case 4:
@@ -165,17 +215,20 @@ void physmem_copy_from_vm(vm_instance_t *vm,void *real_buffer,
 void physmem_copy_to_vm(vm_instance_t *vm,void *real_buffer,
                         m_uint64_t paddr,size_t len)
 {
-   m_uint64_t dummy;
+   size_t win_len;
    m_uint32_t r;
    u_char *ptr;
 
    while(len > 0) {
-      r = m_min(VM_PAGE_SIZE - (paddr & VM_PAGE_IMASK), len);
-      ptr = physmem_get_hptr(vm,paddr,0,MTS_WRITE,&dummy);
-      
+      VM_RAM_LOCK(vm);
+      ptr = physmem_dma_window(vm,paddr,len,MTS_WRITE,&win_len);
+
       if (likely(ptr != NULL)) {
+         r = win_len;
          memcpy(ptr,real_buffer,r);
+         VM_RAM_UNLOCK(vm);
       } else {
+         VM_RAM_UNLOCK(vm);
          r = m_min(len,4);
          switch(r) {
             case 4:
@@ -204,9 +257,12 @@ m_uint32_t physmem_copy_u32_from_vm(vm_instance_t *vm,m_uint64_t paddr)
    m_uint64_t tmp = 0;
    m_uint32_t *ptr;
 
+   VM_RAM_LOCK(vm);
+
    if ((ptr = physmem_get_hptr(vm,paddr,4,MTS_READ,&tmp)) != NULL)
-      return(vmtoh32(*ptr));
+      tmp = vmtoh32(*ptr);
 
+   VM_RAM_UNLOCK(vm);
    return(tmp);
 }
 
@@ -216,8 +272,12 @@ void physmem_copy_u32_to_vm(vm_instance_t *vm,m_uint64_t paddr,m_uint32_t val)
    m_uint64_t tmp = val;
    m_uint32_t *ptr;
 
+   VM_RAM_LOCK(vm);
+
    if ((ptr = physmem_get_hptr(vm,paddr,4,MTS_WRITE,&tmp)) != NULL)
       *ptr = htovm32(val);
+
+   VM_RAM_UNLOCK(vm);
 }
 
 /* Copy a 16-bit word from the VM physical RAM to real host */
@@ -226,9 +286,12 @@ m_uint16_t physmem_copy_u16_from_vm(vm_instance_t *vm,m_uint64_t paddr)
    m_uint64_t tmp = 0;
    m_uint16_t *ptr;
 
+   VM_RAM_LOCK(vm);
+
    if ((ptr = physmem_get_hptr(vm,paddr,2,MTS_READ,&tmp)) != NULL)
-      return(vmtoh16(*ptr));
+      tmp = vmtoh16(*ptr);
 
+   VM_RAM_UNLOCK(vm);
    return(tmp);
 }
 
@@ -238,8 +301,12 @@ void physmem_copy_u16_to_vm(vm_instance_t *vm,m_uint64_t paddr,m_uint16_t val)
    m_uint64_t tmp = val;
    m_uint16_t *ptr;
 
-   if ((ptr = physmem_get_hptr(vm,paddr,2,MTS_WRITE,&tmp)) != NULL)   
+   VM_RAM_LOCK(vm);
+
+   if ((ptr = physmem_get_hptr(vm,paddr,2,MTS_WRITE,&tmp)) != NULL)
       *ptr = htovm16(val);
+
+   VM_RAM_UNLOCK(vm);
 }
 
 /* Copy a byte from the VM physical RAM to real host */
@@ -248,9 +315,12 @@ m_uint8_t physmem_copy_u8_from_vm(vm_instance_t *vm,m_uint64_t paddr)
    m_uint64_t tmp = 0;
    m_uint8_t *ptr;
 
+   VM_RAM_LOCK(vm);
+
    if ((ptr = physmem_get_hptr(vm,paddr,1,MTS_READ,&tmp)) != NULL)
-      return(*ptr);
+      tmp = *ptr;
 
+   VM_RAM_UNLOCK(vm);
    return(tmp);
 }
 
@@ -260,33 +330,35 @@ void physmem_copy_u8_to_vm(vm_instance_t *vm,m_uint64_t paddr,m_uint8_t val)
    m_uint64_t tmp = val;
    m_uint8_t *ptr;
 
-   if ((ptr = physmem_get_hptr(vm,paddr,1,MTS_WRITE,&tmp)) != NULL)   
+   VM_RAM_LOCK(vm);
+
+   if ((ptr = physmem_get_hptr(vm,paddr,1,MTS_WRITE,&tmp)) != NULL)
       *ptr = val;
+
+   VM_RAM_UNLOCK(vm);
 }
 
 /* DMA transfer operation */
 void physmem_dma_transfer(vm_instance_t *vm,m_uint64_t src,m_uint64_t dst,
                           size_t len)
 {
-   m_uint64_t dummy;
    u_char *sptr,*dptr;
    size_t clen,sl,dl;
 
    while(len > 0) {
-      sptr = physmem_get_hptr(vm,src,0,MTS_READ,&dummy);
-      dptr = physmem_get_hptr(vm,dst,0,MTS_WRITE,&dummy);
+      VM_RAM_LOCK(vm);
+      sptr = physmem_dma_window(vm,src,len,MTS_READ,&sl);
+      dptr = physmem_dma_window(vm,dst,len,MTS_WRITE,&dl);
 
       if (!sptr || !dptr) {
+         VM_RAM_UNLOCK(vm);
          vm_log(vm,"DMA","unable to transfer from 0x%llx to 0x%llx\n",src,dst);
          return;
       }
 
-      sl = VM_PAGE_SIZE - (src & VM_PAGE_IMASK);
-      dl = VM_PAGE_SIZE - (dst & VM_PAGE_IMASK);
       clen = m_min(sl,dl);
-      clen = m_min(clen,len);
-
-      memcpy(dptr,sptr,clen);
+      memmove(dptr,sptr,clen);
+      VM_RAM_UNLOCK(vm);
 
       src += clen;
       dst += clen;
@@ -32,6 +32,7 @@
 #ifdef __linux__
 #include <net/if.h>
 #include <linux/if_tun.h>
+#include <sys/epoll.h>
 #endif
 
 #include "registry.h"
@@ -43,20 +44,47 @@
 /* Free a NetIO descriptor */
 static int netio_free(void *data,void *arg);
 
-/* NIO RX listener */
-static pthread_mutex_t netio_rxl_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t netio_rxq_mutex = PTHREAD_MUTEX_INITIALIZER;
-static struct netio_rx_listener *netio_rxl_list = NULL;
-static struct netio_rx_listener *netio_rxl_add_list = NULL;
-static netio_desc_t *netio_rxl_remove_list = NULL;
-static pthread_t netio_rxl_thread;
-static pthread_cond_t netio_rxl_cond;
+/* NIO RX listener: maximum number of events handled per poller wakeup */
+#define NETIO_RXL_MAX_EVENTS  64
 
-#define NETIO_RXL_LOCK()   pthread_mutex_lock(&netio_rxl_mutex);
-#define NETIO_RXL_UNLOCK() pthread_mutex_unlock(&netio_rxl_mutex);
+#ifdef __linux__
+#define NETIO_RXL_USE_EPOLL   1
+#else
+#define NETIO_RXL_USE_EPOLL   0
+#endif
+
+/* Batched UDP send/receive (sendmmsg/recvmmsg) */
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+#define NETIO_USE_MMSG        1
+#else
+#define NETIO_USE_MMSG        0
+#endif
+
+/* NIO RX listener worker */
+struct netio_rxl_worker {
+   u_int id;
+   pthread_t thread;
+
+   /* Listeners owned by this worker (only used by the worker thread) */
+   struct netio_rx_listener *rxl_list;
+
+   /* Pending requests (lock-free lists) */
+   struct netio_rx_listener *volatile add_list;
+   netio_desc_t *volatile remove_list;
 
-#define NETIO_RXQ_LOCK()   pthread_mutex_lock(&netio_rxq_mutex);
-#define NETIO_RXQ_UNLOCK() pthread_mutex_unlock(&netio_rxq_mutex);
+   /* Request/acknowledge generations for synchronous removal */
+   volatile m_uint32_t req_gen;
+   m_uint32_t done_gen;
+   pthread_mutex_t ack_lock;
+   pthread_cond_t ack_cond;
+
+   /* Poller and wakeup pipe */
+   int poll_fd;
+   int wake_fd[2];
+};
+
+static netio_rxl_worker_t netio_rxl_workers[NETIO_RXL_MAX_WORKERS];
+static u_int netio_rxl_worker_count = 0;
 
 /* NetIO type */
 typedef struct {
@@ -184,14 +212,11 @@ void netio_save_config_all(FILE *fd)
    fprintf(fd,"\n");
 }
 
-/* Send a packet through a NetIO descriptor */
-ssize_t netio_send(netio_desc_t *nio,void *pkt,size_t len)
+/* Apply TX filters and update output statistics (FALSE if dropped) */
+static int netio_tx_filter(netio_desc_t *nio,void *pkt,size_t len)
 {
    int res;
 
-   if (!nio)
-      return(-1);
-
    if (nio->debug) {
       printf("NIO %s: sending a packet of %lu bytes:\n",nio->name,(u_long)len);
       mem_dump(stdout,pkt,len);
@@ -202,7 +227,7 @@ ssize_t netio_send(netio_desc_t *nio,void *pkt,size_t len)
       res = nio->tx_filter->pkt_handler(nio,pkt,len,nio->tx_filter_data);
 
       if (res <= 0)
-         return(-1);
+         return(FALSE);
    }
 
    /* Apply the bidirectional filter */
@@ -210,7 +235,7 @@ ssize_t netio_send(netio_desc_t *nio,void *pkt,size_t len)
       res = nio->both_filter->pkt_handler(nio,pkt,len,nio->both_filter_data);
 
       if (res == NETIO_FILTER_ACTION_DROP)
-         return(-1);
+         return(FALSE);
    }
 
    /* Update output statistics */
@@ -218,23 +243,14 @@ ssize_t netio_send(netio_desc_t *nio,void *pkt,size_t len)
    nio->stats_bytes_out += len;
 
    netio_update_bw_stat(nio,len);
-
-   return(nio->send(nio->dptr,pkt,len));
+   return(TRUE);
 }
 
-/* Receive a packet through a NetIO descriptor */
-ssize_t netio_recv(netio_desc_t *nio,void *pkt,size_t max_len)
+/* Apply RX filters and update input statistics (FALSE if dropped) */
+static int netio_rx_filter(netio_desc_t *nio,void *pkt,size_t len)
 {
-   ssize_t len;
    int res;
 
-   if (!nio)
-      return(-1);
-
-   /* Receive the packet */
-   if ((len = nio->recv(nio->dptr,pkt,max_len)) <= 0)
-      return(-1);
-
    if (nio->debug) {
       printf("NIO %s: receiving a packet of %ld bytes:\n",nio->name,(long)len);
       mem_dump(stdout,pkt,len);
@@ -245,7 +261,7 @@ ssize_t netio_recv(netio_desc_t *nio,void *pkt,size_t max_len)
       res = nio->rx_filter->pkt_handler(nio,pkt,len,nio->rx_filter_data);
 
       if (res == NETIO_FILTER_ACTION_DROP)
-         return(-1);
+         return(FALSE);
    }
 
    /* Apply the bidirectional filter */
@@ -253,15 +269,138 @@ ssize_t netio_recv(netio_desc_t *nio,void *pkt,size_t max_len)
       res = nio->both_filter->pkt_handler(nio,pkt,len,nio->both_filter_data);
 
       if (res == NETIO_FILTER_ACTION_DROP)
-         return(-1);
+         return(FALSE);
    }
 
    /* Update input statistics */
    nio->stats_pkts_in++;
    nio->stats_bytes_in += len;
+   return(TRUE);
+}
+
+/* Send a packet through a NetIO descriptor */
+ssize_t netio_send(netio_desc_t *nio,void *pkt,size_t len)
+{
+   if (!nio)
+      return(-1);
+
+   if (!netio_tx_filter(nio,pkt,len))
+      return(-1);
+
+   return(nio->send(nio->dptr,pkt,len));
+}
+
+/* Receive a packet through a NetIO descriptor */
+ssize_t netio_recv(netio_desc_t *nio,void *pkt,size_t max_len)
+{
+   ssize_t len;
+
+   if (!nio)
+      return(-1);
+
+   /* Receive the packet */
+   if ((len = nio->recv(nio->dptr,pkt,max_len)) <= 0)
+      return(-1);
+
+   if (!netio_rx_filter(nio,pkt,len))
+      return(-1);
+
    return(len);
 }
 
+/* 
+ * Send a batch of packets through a NetIO descriptor.
+ *
+ * A batched send may stop before the end of the batch: the remaining
+ * packets are sent again, and a packet which cannot be sent is dropped,
+ * as with netio_send(). Returns the number of packets transmitted
+ * (filtered and dropped ones excluded).
+ */
+int netio_send_batch(netio_desc_t *nio,netio_pkt_vec_t *vec,u_int count)
+{
+   netio_pkt_vec_t tx_vec[NETIO_BATCH_MAX];
+   u_int i,n,pos,sent = 0;
+   int res;
+
+   if (!nio)
+      return(-1);
+
+   while(count > 0) {
+      /* Keep only the packets accepted by the filters */
+      for(i=0,n=0;(i<count) && (n<NETIO_BATCH_MAX);i++) {
+         if (netio_tx_filter(nio,vec[i].pkt,vec[i].len))
+            tx_vec[n++] = vec[i];
+      }
+
+      vec += i;
+      count -= i;
+
+      if (!n)
+         continue;
+
+      for(pos=0;pos<n;) {
+         if (nio->send_batch != NULL)
+            res = nio->send_batch(nio->dptr,&tx_vec[pos],n - pos);
+         else
+            res = (nio->send(nio->dptr,tx_vec[pos].pkt,
+                             tx_vec[pos].len) < 0) ? -1 : 1;
+
+         /* The first packet cannot be sent: drop it */
+         if (res <= 0) {
+            pos++;
+            continue;
+         }
+
+         pos  += res;
+         sent += res;
+      }
+   }
+
+   return(sent);
+}
+
+/* 
+ * Receive a batch of packets through a NetIO descriptor.
+ *
+ * On input, vec gives the packet buffers and their size. On output,
+ * the first entries describe the received packets (filtered ones are
+ * removed). Returns the number of packets, or -1 if nothing was read.
+ * NIO types without batch support receive a single packet.
+ */
+int netio_recv_batch(netio_desc_t *nio,netio_pkt_vec_t *vec,u_int count)
+{
+   ssize_t len;
+   int i,n,res;
+
+   if (!nio || !count)
+      return(-1);
+
+   if (nio->recv_batch != NULL) {
+      n = nio->recv_batch(nio->dptr,vec,m_min(count,NETIO_BATCH_MAX));
+
+      if (n <= 0)
+         return(-1);
+   } else {
+      if ((len = nio->recv(nio->dptr,vec[0].pkt,vec[0].len)) <= 0)
+         return(-1);
+
+      vec[0].len = len;
+      n = 1;
+   }
+
+   for(i=0,res=0;i<n;i++) {
+      if (!vec[i].len || !netio_rx_filter(nio,vec[i].pkt,vec[i].len))
+         continue;
+
+      if (i != res)
+         vec[res] = vec[i];
+
+      res++;
+   }
+
+   return(res);
+}
+
 /* Get a NetIO FD */
 int netio_get_fd(netio_desc_t *nio)
 {
@@ -921,6 +1060,55 @@ static ssize_t netio_udp_recv(netio_inet_desc_t *nid,void *pkt,size_t max_len)
    return(recvfrom(nid->fd,pkt,max_len,0,NULL,NULL));
 }
 
+#if NETIO_USE_MMSG
+/* Send a batch of packets to an UDP socket */
+static int netio_udp_send_batch(netio_inet_desc_t *nid,
+                                netio_pkt_vec_t *vec,u_int count)
+{
+   struct mmsghdr msg[NETIO_BATCH_MAX];
+   struct iovec iov[NETIO_BATCH_MAX];
+   u_int i;
+
+   memset(msg,0,count * sizeof(msg[0]));
+
+   for(i=0;i<count;i++) {
+      iov[i].iov_base = vec[i].pkt;
+      iov[i].iov_len  = vec[i].len;
+      msg[i].msg_hdr.msg_iov = &iov[i];
+      msg[i].msg_hdr.msg_iovlen = 1;
+   }
+
+   return(sendmmsg(nid->fd,msg,count,0));
+}
+
+/* Receive a batch of packets from an UDP socket */
+static int netio_udp_recv_batch(netio_inet_desc_t *nid,
+                                netio_pkt_vec_t *vec,u_int count)
+{
+   struct mmsghdr msg[NETIO_BATCH_MAX];
+   struct iovec iov[NETIO_BATCH_MAX];
+   int i,res;
+
+   memset(msg,0,count * sizeof(msg[0]));
+
+   for(i=0;i<count;i++) {
+      iov[i].iov_base = vec[i].pkt;
+      iov[i].iov_len  = vec[i].len;
+      msg[i].msg_hdr.msg_iov = &iov[i];
+      msg[i].msg_hdr.msg_iovlen = 1;
+   }
+
+   /* Block only until the first datagram is available */
+   if ((res = recvmmsg(nid->fd,msg,count,MSG_WAITFORONE,NULL)) <= 0)
+      return(res);
+
+   for(i=0;i<res;i++)
+      vec[i].len = msg[i].msg_len;
+
+   return(res);
+}
+#endif
+
 /* Save the NIO configuration */
 static void netio_udp_save_cfg(netio_desc_t *nio,FILE *fd)
 {
@@ -957,6 +1145,10 @@ netio_desc_t *netio_desc_create_udp(char *nio_name,int local_port,
    nio->type     = NETIO_TYPE_UDP;
    nio->send     = (void *)netio_udp_send;
    nio->recv     = (void *)netio_udp_recv;
+#if NETIO_USE_MMSG
+   nio->send_batch = (void *)netio_udp_send_batch;
+   nio->recv_batch = (void *)netio_udp_recv_batch;
+#endif
    nio->free     = (void *)netio_udp_free;
    nio->save_cfg = netio_udp_save_cfg;
    nio->dptr     = &nio->u.nid;
@@ -1039,6 +1231,10 @@ netio_desc_t *netio_desc_create_udp_auto(char *nio_name,char *local_addr,
    nio->type     = NETIO_TYPE_UDP_AUTO;
    nio->send     = (void *)netio_udp_send;
    nio->recv     = (void *)netio_udp_recv;
+#if NETIO_USE_MMSG
+   nio->send_batch = (void *)netio_udp_send_batch;
+   nio->recv_batch = (void *)netio_udp_recv_batch;
+#endif
    nio->free     = (void *)netio_udp_free;
    nio->save_cfg = netio_udp_save_cfg;
    nio->dptr     = &nio->u.nid;
@@ -1450,6 +1646,7 @@ static int netio_free(void *data,void *arg)
       if (nio->free != NULL)
          nio->free(nio->dptr);
 
+      free(nio->rx_ring);
       free(nio->name);
       free(nio);
    }
@@ -1490,8 +1687,11 @@ void netio_update_bw_stat(netio_desc_t *nio,m_uint64_t bytes)
 /* Reset NIO bandwidth counter */
 void netio_clear_bw_stat(netio_desc_t *nio)
 {
-   if (++nio->bw_ptask_cnt == (NETIO_BW_SAMPLE_ITV / ptask_sleep_time)) {
-      nio->bw_ptask_cnt = 0;
+   m_tmcnt_t now = m_gettime();
+
+   /* TX scanners can be kicked, so rotate samples based on time */
+   if ((now - nio->bw_last_update) >= NETIO_BW_SAMPLE_ITV) {
+      nio->bw_last_update = now;
 
       if (++nio->bw_pos == NETIO_BW_SAMPLES)
          nio->bw_pos = 0;
@@ -1513,25 +1713,129 @@ void netio_set_bandwidth(netio_desc_t *nio,u_int bandwidth)
  * =========================================================================
  */
 
+/*
+ * Each worker thread owns a stable subset of the RX listeners and waits
+ * for incoming packets with epoll (select on non-Linux hosts). Listeners
+ * sharing the same handler context (arg1) are always bound to the same
+ * worker, so device models and switches keep seeing serialized RX calls.
+ *
+ * Add/remove requests are pushed on per-worker lock-free lists and the
+ * worker is woken up through a pipe. Only removal waits for completion,
+ * since the caller is generally about to free the NIO.
+ */
+
 /* Find a RX listener */
-static inline struct netio_rx_listener *netio_rxl_find(netio_desc_t *nio)
+static inline struct netio_rx_listener *
+netio_rxl_find(netio_rxl_worker_t *w,netio_desc_t *nio)
 {
    struct netio_rx_listener *rxl;
 
-   for(rxl=netio_rxl_list;rxl;rxl=rxl->next)
+   for(rxl=w->rxl_list;rxl;rxl=rxl->next)
       if (rxl->nio == nio)
          return rxl;
 
    return NULL;
 }
 
+/* Wake up a worker */
+static void netio_rxl_kick(netio_rxl_worker_t *w)
+{
+   char c = 0;
+
+   if ((write(w->wake_fd[1],&c,1) == -1) && (errno != EAGAIN))
+      perror("netio_rxl_kick: write");
+}
+
+/* Flush the wakeup pipe of a worker */
+static void netio_rxl_drain_wakeup(netio_rxl_worker_t *w)
+{
+   char buffer[64];
+
+   while(read(w->wake_fd[0],buffer,sizeof(buffer)) > 0)
+      ;
+}
+
+/* Register the FD of a RX listener in the worker poller */
+static void netio_rxl_poll_add(netio_rxl_worker_t *w,
+                               struct netio_rx_listener *rxl)
+{
+#if NETIO_RXL_USE_EPOLL
+   struct epoll_event ev;
+   int fd;
+
+   if ((fd = netio_get_fd(rxl->nio)) == -1)
+      return;
+
+   memset(&ev,0,sizeof(ev));
+   ev.events = EPOLLIN;
+   ev.data.ptr = rxl;
+
+   if (epoll_ctl(w->poll_fd,EPOLL_CTL_ADD,fd,&ev) == -1)
+      perror("netio_rxl_poll_add: epoll_ctl");
+#endif
+}
+
+/* Unregister the FD of a RX listener from the worker poller */
+static void netio_rxl_poll_remove(netio_rxl_worker_t *w,
+                                  struct netio_rx_listener *rxl)
+{
+#if NETIO_RXL_USE_EPOLL
+   struct epoll_event ev;
+   int fd;
+
+   if ((fd = netio_get_fd(rxl->nio)) == -1)
+      return;
+
+   /* a non-NULL event is required by kernels older than 2.6.9 */
+   memset(&ev,0,sizeof(ev));
+   epoll_ctl(w->poll_fd,EPOLL_CTL_DEL,fd,&ev);
+#endif
+}
+
+/* Receive packets for a listener and call the user handler */
+static inline void netio_rxl_dispatch(struct netio_rx_listener *rxl)
+{
+   netio_pkt_vec_t vec[NETIO_BATCH_MAX];
+   netio_desc_t *nio = rxl->nio;
+   int i,count;
+
+   if (nio->rx_ring != NULL) {
+      for(i=0;i<NETIO_BATCH_MAX;i++) {
+         vec[i].pkt = &nio->rx_ring[i * NETIO_MAX_PKT_SIZE];
+         vec[i].len = NETIO_MAX_PKT_SIZE;
+      }
+
+      count = NETIO_BATCH_MAX;
+   } else {
+      vec[0].pkt = nio->rx_pkt;
+      vec[0].len = sizeof(nio->rx_pkt);
+      count = 1;
+   }
+
+   count = netio_recv_batch(nio,vec,count);
+
+   for(i=0;i<count;i++)
+      rxl->rx_handler(nio,vec[i].pkt,vec[i].len,rxl->arg1,rxl->arg2);
+}
+
+/* RX Listener dedicated thread (for non-FD NIO) */
+static void *netio_rxl_spec_thread(void *arg)
+{
+   struct netio_rx_listener *rxl = arg;
+
+   while(rxl->running)
+      netio_rxl_dispatch(rxl);
+
+   return NULL;
+}
+
 /* Remove a NIO from the listener list */
-static int netio_rxl_remove_internal(netio_desc_t *nio)
+static int netio_rxl_remove_internal(netio_rxl_worker_t *w,netio_desc_t *nio)
 {
    struct netio_rx_listener *rxl;
    int res = -1;
 
-   if ((rxl = netio_rxl_find(nio))) {
+   if ((rxl = netio_rxl_find(w,nio))) {
       /* we suppress this NIO only when the ref count hits 0 */
       rxl->ref_count--;
 
@@ -1543,14 +1847,17 @@ static int netio_rxl_remove_internal(netio_desc_t *nio)
          if (rxl->prev)
             rxl->prev->next = rxl->next;
          else
-            netio_rxl_list = rxl->next;
+            w->rxl_list = rxl->next;
 
          /* if this is non-FD NIO, wait for thread to terminate */
          if (netio_get_fd(rxl->nio) == -1) {
             rxl->running = FALSE;
             pthread_join(rxl->spec_thread,NULL);
+         } else {
+            netio_rxl_poll_remove(w,rxl);
          }
-         
+
+         nio->rxl_worker = NULL;
          free(rxl);
       }
 
@@ -1561,85 +1868,129 @@ static int netio_rxl_remove_internal(netio_desc_t *nio)
 }
 
 /* Add a RXL listener to the listener list */
-static void netio_rxl_add_internal(struct netio_rx_listener *rxl)
+static void netio_rxl_add_internal(netio_rxl_worker_t *w,
+                                   struct netio_rx_listener *rxl)
 {  
    struct netio_rx_listener *tmp;
    
-   if ((tmp = netio_rxl_find(rxl->nio))) {
+   if ((tmp = netio_rxl_find(w,rxl->nio))) {
       tmp->ref_count++;
       free(rxl);
-   } else {
-      rxl->prev = NULL;
-      rxl->next = netio_rxl_list;
-      if (rxl->next) rxl->next->prev = rxl;
-      netio_rxl_list = rxl;
+      return;
+   }
+
+   if ((netio_get_fd(rxl->nio) == -1) &&
+       pthread_create(&rxl->spec_thread,NULL,netio_rxl_spec_thread,rxl))
+   {
+      fprintf(stderr,"netio_rxl_add: unable to create specific thread.\n");
+      rxl->nio->rxl_worker = NULL;
+      free(rxl);
+      return;
    }
+
+   /* 
+    * Allocate the RX packet ring for batched receive. Only the pages
+    * touched by received packets are actually backed by host memory.
+    */
+   if ((rxl->nio->recv_batch != NULL) && !rxl->nio->rx_ring)
+      rxl->nio->rx_ring = malloc(NETIO_BATCH_MAX * NETIO_MAX_PKT_SIZE);
+
+   rxl->nio->rxl_worker = w;
+   rxl->prev = NULL;
+   rxl->next = w->rxl_list;
+   if (rxl->next) rxl->next->prev = rxl;
+   w->rxl_list = rxl;
+
+   netio_rxl_poll_add(w,rxl);
 }
 
-/* RX Listener dedicated thread (for non-FD NIO) */
-static void *netio_rxl_spec_thread(void *arg)
+/* Process the pending add/remove requests of a worker */
+static void netio_rxl_worker_sync(netio_rxl_worker_t *w)
 {
-   struct netio_rx_listener *rxl = arg;
-   netio_desc_t *nio = rxl->nio;
-   ssize_t pkt_len;
+   struct netio_rx_listener *rxl,*add_list;
+   netio_desc_t *nio,*remove_list;
+   m_uint32_t gen;
+
+   /* requests with a generation <= gen are already in the lists */
+   gen = w->req_gen;
+   __sync_synchronize();
 
-   while(rxl->running) {
-      pkt_len = netio_recv(nio,nio->rx_pkt,sizeof(nio->rx_pkt));
+   add_list = __sync_lock_test_and_set(&w->add_list,NULL);
+   remove_list = __sync_lock_test_and_set(&w->remove_list,NULL);
 
-      if (pkt_len > 0)
-         rxl->rx_handler(nio,nio->rx_pkt,pkt_len,rxl->arg1,rxl->arg2);
+   /* Add the new waiting NIO to the active list */
+   while(add_list != NULL) {
+      rxl = add_list;
+      add_list = add_list->next;
+      netio_rxl_add_internal(w,rxl);
    }
 
-   return NULL;
+   /* Delete the NIO present in the remove list */
+   while(remove_list != NULL) {
+      nio = remove_list;
+      remove_list = remove_list->rxl_next;
+      netio_rxl_remove_internal(w,nio);
+   }
+
+   /* Acknowledge removal requests */
+   if (gen != w->done_gen) {
+      pthread_mutex_lock(&w->ack_lock);
+      w->done_gen = gen;
+      pthread_cond_broadcast(&w->ack_cond);
+      pthread_mutex_unlock(&w->ack_lock);
+   }
 }
 
-/* RX Listener General Thread */
-void *netio_rxl_gen_thread(void *arg)
+/* RX Listener worker thread */
+static void *netio_rxl_worker_thread(void *arg)
 { 
+   netio_rxl_worker_t *w = arg;
    struct netio_rx_listener *rxl;
-   ssize_t pkt_len;
-   netio_desc_t *nio;
-   struct timeval tv;
-   int fd,fd_max,res;
+#if NETIO_RXL_USE_EPOLL
+   struct epoll_event ev[NETIO_RXL_MAX_EVENTS];
+   int i;
+#else
+   int fd,fd_max;
    fd_set rfds;
+#endif
+   int res;
 
    for(;;) {
-      NETIO_RXL_LOCK();
-
-      NETIO_RXQ_LOCK();
-      /* Add the new waiting NIO to the active list */
-      while(netio_rxl_add_list != NULL) {
-         rxl = netio_rxl_add_list;
-         netio_rxl_add_list = netio_rxl_add_list->next;
-         netio_rxl_add_internal(rxl);
-      }
+      netio_rxl_worker_sync(w);
 
-      /* Delete the NIO present in the remove list */
-      while(netio_rxl_remove_list != NULL) {
-         nio = netio_rxl_remove_list;
-         netio_rxl_remove_list = netio_rxl_remove_list->rxl_next;
-         netio_rxl_remove_internal(nio);
-      }
+#if NETIO_RXL_USE_EPOLL
+      /* Wait for incoming packets */
+      res = epoll_wait(w->poll_fd,ev,NETIO_RXL_MAX_EVENTS,-1);
 
-      pthread_cond_broadcast(&netio_rxl_cond);
-      NETIO_RXQ_UNLOCK();
+      if (res == -1) {
+         if (errno != EINTR)
+            perror("netio_rxl_thread: epoll_wait");
+         continue;
+      }
 
+      /* Call user handlers (listeners can only go away in sync) */
+      for(i=0;i<res;i++) {
+         if (!(rxl = ev[i].data.ptr))
+            netio_rxl_drain_wakeup(w);
+         else
+            netio_rxl_dispatch(rxl);
+      }
+#else
       /* Build the FD set */
       FD_ZERO(&rfds);
-      fd_max = -1;
-      for(rxl=netio_rxl_list;rxl;rxl=rxl->next) {
+      FD_SET(w->wake_fd[0],&rfds);
+      fd_max = w->wake_fd[0];
+
+      for(rxl=w->rxl_list;rxl;rxl=rxl->next) {
          if ((fd = netio_get_fd(rxl->nio)) == -1)
             continue;
 
          if (fd > fd_max) fd_max = fd;
          FD_SET(fd,&rfds);
       }
-      NETIO_RXL_UNLOCK();
 
       /* Wait for incoming packets */
-      tv.tv_sec = 0;
-      tv.tv_usec = 20 * 1000;  /* 200 ms */
-      res = select(fd_max+1,&rfds,NULL,NULL,&tv);
+      res = select(fd_max+1,&rfds,NULL,NULL,NULL);
 
       if (res == -1) {
          if (errno != EINTR)
@@ -1647,39 +1998,45 @@ void *netio_rxl_gen_thread(void *arg)
          continue;
       }
 
-      /* Examine active FDs and call user handlers */
-      NETIO_RXL_LOCK();
-
-      for(rxl=netio_rxl_list;rxl;rxl=rxl->next) {
-         nio = rxl->nio;
+      if (FD_ISSET(w->wake_fd[0],&rfds))
+         netio_rxl_drain_wakeup(w);
 
-         if ((fd = netio_get_fd(nio)) == -1)
+      /* Examine active FDs and call user handlers */
+      for(rxl=w->rxl_list;rxl;rxl=rxl->next) {
+         if ((fd = netio_get_fd(rxl->nio)) == -1)
             continue;
 
-         if (FD_ISSET(fd,&rfds)) {
-            pkt_len = netio_recv(nio,nio->rx_pkt,sizeof(nio->rx_pkt));
-
-            if (pkt_len > 0)
-               rxl->rx_handler(nio,nio->rx_pkt,pkt_len,rxl->arg1,rxl->arg2);
-         }
+         if (FD_ISSET(fd,&rfds))
+            netio_rxl_dispatch(rxl);
       }
-
-      NETIO_RXL_UNLOCK();
+#endif
    }
    
    return NULL;
 }
 
+/* 
+ * Select the worker owning listeners of the specified group, or with the
+ * specified handler context when no group is given. Listeners of a group
+ * are served by the same worker, so that their handlers never run
+ * concurrently.
+ */
+static netio_rxl_worker_t *netio_rxl_select_worker(void *arg1,void *group)
+{
+   m_iptr_t key = (m_iptr_t)(group ? group : arg1);
+
+   key = (key >> 4) ^ (key >> 12);
+   return(&netio_rxl_workers[key % netio_rxl_worker_count]);
+}
+
 /* Add a RX listener in the listener list */
 int netio_rxl_add(netio_desc_t *nio,netio_rx_handler_t rx_handler,
-                  void *arg1,void *arg2)
+                  void *arg1,void *arg2,void *group)
 {
-   struct netio_rx_listener *rxl;
-
-   NETIO_RXQ_LOCK();
+   struct netio_rx_listener *rxl,*head;
+   netio_rxl_worker_t *w;
 
    if (!(rxl = malloc(sizeof(*rxl)))) {
-      NETIO_RXQ_UNLOCK();
       fprintf(stderr,"netio_rxl_add: unable to create structure.\n");
       return(-1);
    }
@@ -1692,43 +2049,110 @@ int netio_rxl_add(netio_desc_t *nio,netio_rx_handler_t rx_handler,
    rxl->arg2 = arg2;
    rxl->running = TRUE;
 
-   if ((netio_get_fd(rxl->nio) == -1) &&
-       pthread_create(&rxl->spec_thread,NULL,netio_rxl_spec_thread,rxl)) 
-   {
-      NETIO_RXQ_UNLOCK();
-      fprintf(stderr,"netio_rxl_add: unable to create specific thread.\n");
-      free(rxl);
-      return(-1);
-   }
+   /* A NIO already listened to stays on its current worker */
+   w = netio_rxl_select_worker(arg1,group);
 
-   rxl->next = netio_rxl_add_list;
-   netio_rxl_add_list = rxl;
+   if (!__sync_bool_compare_and_swap(&nio->rxl_worker,NULL,w))
+      w = nio->rxl_worker;
 
-   pthread_cond_wait(&netio_rxl_cond,&netio_rxq_mutex);
-   NETIO_RXQ_UNLOCK();
+   do {
+      head = w->add_list;
+      rxl->next = head;
+   }while(!__sync_bool_compare_and_swap(&w->add_list,head,rxl));
+
+   netio_rxl_kick(w);
    return(0);
 }
 
 /* Remove a NIO from the listener list */
 int netio_rxl_remove(netio_desc_t *nio)
 {
-   NETIO_RXQ_LOCK();
-   nio->rxl_next = netio_rxl_remove_list;
-   netio_rxl_remove_list = nio;
-   pthread_cond_wait(&netio_rxl_cond,&netio_rxq_mutex);
-   NETIO_RXQ_UNLOCK();
+   netio_rxl_worker_t *w;
+   netio_desc_t *head;
+   m_uint32_t gen;
+
+   if (!(w = nio->rxl_worker))
+      return(0);
+
+   do {
+      head = w->remove_list;
+      nio->rxl_next = head;
+   }while(!__sync_bool_compare_and_swap(&w->remove_list,head,nio));
+
+   gen = __sync_add_and_fetch(&w->req_gen,1);
+   netio_rxl_kick(w);
+
+   /* Wait for the worker to stop listening on this NIO */
+   pthread_mutex_lock(&w->ack_lock);
+   while((m_int32_t)(w->done_gen - gen) < 0)
+      pthread_cond_wait(&w->ack_cond,&w->ack_lock);
+   pthread_mutex_unlock(&w->ack_lock);
    return(0);
 }
 
-/* Initialize the RXL thread */
-int netio_rxl_init(void)
+/* Initialize a RXL worker */
+static int netio_rxl_worker_init(netio_rxl_worker_t *w,u_int id)
 {
-   pthread_cond_init(&netio_rxl_cond,NULL);
+#if NETIO_RXL_USE_EPOLL
+   struct epoll_event ev;
+#endif
+
+   memset(w,0,sizeof(*w));
+   w->id = id;
+   w->poll_fd = -1;
+
+   pthread_mutex_init(&w->ack_lock,NULL);
+   pthread_cond_init(&w->ack_cond,NULL);
+
+   if (pipe(w->wake_fd) == -1) {
+      perror("netio_rxl_init: pipe");
+      return(-1);
+   }
+
+   fcntl(w->wake_fd[0],F_SETFL,fcntl(w->wake_fd[0],F_GETFL) | O_NONBLOCK);
+   fcntl(w->wake_fd[1],F_SETFL,fcntl(w->wake_fd[1],F_GETFL) | O_NONBLOCK);
+
+#if NETIO_RXL_USE_EPOLL
+   if ((w->poll_fd = epoll_create(NETIO_RXL_MAX_EVENTS)) == -1) {
+      perror("netio_rxl_init: epoll_create");
+      return(-1);
+   }
+
+   memset(&ev,0,sizeof(ev));
+   ev.events = EPOLLIN;
+   ev.data.ptr = NULL;
 
-   if (pthread_create(&netio_rxl_thread,NULL,netio_rxl_gen_thread,NULL)) {
+   if (epoll_ctl(w->poll_fd,EPOLL_CTL_ADD,w->wake_fd[0],&ev) == -1) {
+      perror("netio_rxl_init: epoll_ctl");
+      return(-1);
+   }
+#endif
+
+   if (pthread_create(&w->thread,NULL,netio_rxl_worker_thread,w)) {
       perror("netio_rxl_init: pthread_create");
       return(-1);
    }
 
    return(0);
 }
+
+/* Initialize the RXL worker threads (one per host CPU, bounded) */
+int netio_rxl_init(void)
+{
+   long ncpu;
+   u_int i;
+
+   ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+   ncpu = m_max(ncpu,1);
+   ncpu = m_min(ncpu,NETIO_RXL_MAX_WORKERS);
+
+   for(i=0;i<ncpu;i++) {
+      if (netio_rxl_worker_init(&netio_rxl_workers[i],i) == -1)
+         break;
+   }
+
+   if (!(netio_rxl_worker_count = i))
+      return(-1);
+
+   return(0);
+}
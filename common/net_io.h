@@ -25,9 +25,15 @@
 /* Maximum packet size */
 #define NETIO_MAX_PKT_SIZE  32768
 
+/* Maximum number of packets moved by a batched send/receive */
+#define NETIO_BATCH_MAX     8
+
 /* Maximum device length */
 #define NETIO_DEV_MAXLEN    64
 
+/* Maximum number of RX listener worker threads */
+#define NETIO_RXL_MAX_WORKERS  8
+
 enum {
    NETIO_TYPE_UNIX = 0,
    NETIO_TYPE_VDE,
@@ -55,6 +61,7 @@ enum {
 };
 
 typedef struct netio_desc netio_desc_t;
+typedef struct netio_rxl_worker netio_rxl_worker_t;
 
 /* VDE switch definitions */
 enum vde_request_type { VDE_REQ_NEW_CONTROL };
@@ -146,6 +153,13 @@ struct netio_pktfilter {
    netio_pktfilter_t *next;
 };
 
+/* Packet vector entry (for batched send/receive) */
+typedef struct netio_pkt_vec netio_pkt_vec_t;
+struct netio_pkt_vec {
+   void *pkt;
+   size_t len;
+};
+
 /* Statistics */
 typedef struct netio_stat netio_stat_t;
 struct netio_stat {
@@ -190,6 +204,10 @@ struct netio_desc {
    ssize_t (*send)(void *desc,void *pkt,size_t len);
    ssize_t (*recv)(void *desc,void *pkt,size_t len);
 
+   /* Batched send and receive (optional) */
+   int (*send_batch)(void *desc,netio_pkt_vec_t *vec,u_int count);
+   int (*recv_batch)(void *desc,netio_pkt_vec_t *vec,u_int count);
+
    /* Configuration saving */
    void (*save_cfg)(netio_desc_t *nio,FILE *fd);
 
@@ -201,7 +219,7 @@ struct netio_desc {
    m_uint64_t bw_cnt[NETIO_BW_SAMPLES];
    m_uint64_t bw_cnt_total;
    u_int bw_pos;
-   u_int bw_ptask_cnt;
+   m_tmcnt_t bw_last_update;
 
    /* Packet filters */
    netio_pktfilter_t *rx_filter,*tx_filter,*both_filter;
@@ -211,11 +229,15 @@ struct netio_desc {
    m_uint64_t stats_pkts_in,stats_pkts_out;
    m_uint64_t stats_bytes_in,stats_bytes_out;
 
-   /* Next pointer (for RX listener) */
+   /* Next pointer and owner worker (for RX listener) */
    netio_desc_t *rxl_next;
+   netio_rxl_worker_t *rxl_worker;
 
    /* Packet data */
    u_char rx_pkt[NETIO_MAX_PKT_SIZE];
+
+   /* RX packet ring for batched receive (NETIO_BATCH_MAX packets) */
+   u_char *rx_ring;
 };
 
 /* RX listener */
@@ -311,6 +333,12 @@ ssize_t netio_send(netio_desc_t *nio,void *pkt,size_t len);
 /* Receive a packet through a NetIO descriptor */
 ssize_t netio_recv(netio_desc_t *nio,void *pkt,size_t max_len);
 
+/* Send a batch of packets through a NetIO descriptor */
+int netio_send_batch(netio_desc_t *nio,netio_pkt_vec_t *vec,u_int count);
+
+/* Receive a batch of packets through a NetIO descriptor */
+int netio_recv_batch(netio_desc_t *nio,netio_pkt_vec_t *vec,u_int count);
+
 /* Get a NetIO FD */
 int netio_get_fd(netio_desc_t *nio);
 
@@ -332,14 +360,17 @@ void netio_set_bandwidth(netio_desc_t *nio,u_int bandwidth);
 /* Enable a RX listener */
 int netio_rxl_enable(netio_desc_t *nio);
 
-/* Add an RX listener in the listener list */
+/* 
+ * Add an RX listener in the listener list. Listeners of a group (the VM
+ * of the handler, NULL for none) are served by the same worker.
+ */
 int netio_rxl_add(netio_desc_t *nio,netio_rx_handler_t rx_handler,
-                  void *arg1,void *arg2);
+                  void *arg1,void *arg2,void *group);
 
 /* Remove a NIO from the listener list */
 int netio_rxl_remove(netio_desc_t *nio);
 
-/* Initialize the RXL thread */
+/* Initialize the RXL worker threads */
 int netio_rxl_init(void);
 
 #endif
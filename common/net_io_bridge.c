@@ -103,7 +103,7 @@ int netio_bridge_add_netio(netio_bridge_t *t,char *nio_name)
       goto error;
 
    t->nio[i] = nio;
-   netio_rxl_add(nio,(netio_rx_handler_t)netio_bridge_recv_pkt,t,NULL);
+   netio_rxl_add(nio,(netio_rx_handler_t)netio_bridge_recv_pkt,t,NULL,NULL);
    NETIO_BRIDGE_UNLOCK(t);
    return(0);
 
@@ -10,6 +10,7 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "vm_ckpt.h"
 #include "nmc93cX6.h"
 
 #define DEBUG_EEPROM  0
@@ -246,3 +247,10 @@ u_int nmc93cX6_read(struct nmc93cX6_group *g)
    return(res);
 }
 
+/* Save or restore the state of an EEPROM group in a VM checkpoint */
+void nmc93cX6_ckpt(vm_ckpt_t *ckpt,struct nmc93cX6_group *g)
+{
+   VM_CKPT_FIELD(ckpt,g->eeprom_reg);
+   VM_CKPT_FIELD(ckpt,g->dout_status);
+   VM_CKPT_FIELD(ckpt,g->state);
+}
@@ -98,4 +98,7 @@ u_int nmc93cX6_get_dout(struct nmc93cX6_group *g,u_int group_id);
 /* Handle read */
 u_int nmc93cX6_read(struct nmc93cX6_group *p);
 
+/* Save or restore the state of an EEPROM group in a VM checkpoint */
+void nmc93cX6_ckpt(vm_ckpt_t *ckpt,struct nmc93cX6_group *g);
+
 #endif /* __NMC93CX6_H__ */
@@ -0,0 +1,551 @@
+/*
+ * Cisco router simulation platform.
+ * Copyright (c) 2005,2006 Christophe Fillot (cf@utc.fr)
+ *
+ * Merging of identical RAM pages across VM instances.
+ *
+ * A background thread periodically hashes the private host pages of the
+ * sparse RAM devices (sparse and ghost RAM) of the registered VMs. A page
+ * whose content has been seen at another location is moved to a pool of
+ * shared pages, and identical pages are then mapped to this shared copy.
+ * Shared pages are marked with VDEVICE_PTE_SHARED in the sparse map and
+ * are copied back on the first write, as ghost pages are.
+ *
+ * A VM is suspended while its pages are scanned. Before it is resumed,
+ * its MTS is rebuilt and its translated code is dropped (JIT blocks and
+ * current exec page of the interpreter keep host pointers to the guest
+ * code), so that no CPU keeps a pointer to a released page.
+ * Device threads keep running: the RAM lock of the VM, which they hold
+ * while they access a RAM page, is held during the scan. The state lock
+ * of the VM is held for the whole round, so an operator suspend or resume
+ * waits for the end of the round instead of being undone by it.
+ * A shared page which is not referenced anymore may still be present in
+ * the MTS or translated code of the VMs which used it: it is given back to
+ * the pool only once all registered VMs have been through this step.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <assert.h>
+
+#include "cpu.h"
+#include "vm.h"
+#include "device.h"
+#include "page_merge.h"
+
+/* VM registered in the page merging service */
+typedef struct page_merge_vm page_merge_vm_t;
+struct page_merge_vm {
+   vm_instance_t *vm;
+   m_uint64_t rebuild_round;   /* Last round with a MTS rebuild */
+   page_merge_vm_t *next;
+};
+
+/* Candidate page: content seen once, not shared yet */
+typedef struct page_merge_cand page_merge_cand_t;
+struct page_merge_cand {
+   m_uint64_t hash;
+   m_iptr_t *pte;
+};
+
+/* The round lock serializes merge rounds and VM (un)registration */
+static pthread_mutex_t page_merge_round_lock = PTHREAD_MUTEX_INITIALIZER;
+#define PAGE_MERGE_ROUND_LOCK()   pthread_mutex_lock(&page_merge_round_lock)
+#define PAGE_MERGE_ROUND_UNLOCK() pthread_mutex_unlock(&page_merge_round_lock)
+
+/* The pool lock protects shared pages and their reference counts */
+static pthread_mutex_t page_merge_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+#define PAGE_MERGE_POOL_LOCK()   pthread_mutex_lock(&page_merge_pool_lock)
+#define PAGE_MERGE_POOL_UNLOCK() pthread_mutex_unlock(&page_merge_pool_lock)
+
+static page_merge_vm_t *page_merge_vm_list = NULL;
+static int page_merge_thread_running = FALSE;
+static m_uint64_t page_merge_round = 0;
+
+/* Shared pages, indexed by content hash and by host address */
+static page_merge_entry_t *page_merge_hash_table[PAGE_MERGE_HASH_SIZE];
+static page_merge_entry_t *page_merge_addr_table[PAGE_MERGE_HASH_SIZE];
+
+/* Unreferenced shared pages, waiting for MTS rebuilds */
+static page_merge_entry_t *page_merge_dead_list = NULL;
+
+/* Candidate pages */
+static page_merge_cand_t *page_merge_cand_table = NULL;
+
+/* Free pages of the pool */
+static void **page_merge_free_pages = NULL;
+static u_int page_merge_free_count = 0,page_merge_free_max = 0;
+
+/* Hash the content of a page (4 independent lanes) */
+static m_uint64_t page_merge_hash(void *page)
+{
+   m_uint64_t *p = page;
+   m_uint64_t h0,h1,h2,h3;
+   u_int i;
+
+   h0 = h1 = h2 = h3 = 0xcbf29ce484222325ULL;
+
+   for(i=0;i<VM_PAGE_SIZE/sizeof(m_uint64_t);i+=4) {
+      h0 = (h0 ^ p[i])   * 0x100000001b3ULL;
+      h1 = (h1 ^ p[i+1]) * 0x100000001b3ULL;
+      h2 = (h2 ^ p[i+2]) * 0x100000001b3ULL;
+      h3 = (h3 ^ p[i+3]) * 0x100000001b3ULL;
+   }
+
+   h0 ^= (h1 << 16 | h1 >> 48) ^ (h2 << 32 | h2 >> 32) ^ (h3 << 48 | h3 >> 16);
+   return(h0 ^ (h0 >> 29));
+}
+
+/* Get the bucket of a content hash */
+static inline u_int page_merge_hash_bucket(m_uint64_t hash)
+{
+   return(hash & (PAGE_MERGE_HASH_SIZE - 1));
+}
+
+/* Get the bucket of a host address */
+static inline u_int page_merge_addr_bucket(m_iptr_t page)
+{
+   m_uint32_t pn = (m_uint32_t)(page >> VM_PAGE_SHIFT);
+   return((pn * 0x9E3779B1) >> (32 - PAGE_MERGE_HASH_BITS));
+}
+
+/* Add a page to the pool free list */
+static void page_merge_free_page(void *page)
+{
+   void **list;
+   u_int max;
+
+   if (page_merge_free_count == page_merge_free_max) {
+      max = page_merge_free_max ? page_merge_free_max * 2 :
+         PAGE_MERGE_CHUNK_SIZE;
+
+      /* The page is lost if the free list cannot grow */
+      if (!(list = realloc(page_merge_free_pages,max * sizeof(void *))))
+         return;
+
+      page_merge_free_pages = list;
+      page_merge_free_max = max;
+   }
+
+   /* Give the memory back to the host until the page is reused */
+   memzone_discard(page,VM_PAGE_SIZE);
+   page_merge_free_pages[page_merge_free_count++] = page;
+}
+
+/* Allocate a page from the pool */
+static void *page_merge_alloc_page(void)
+{
+   u_char *area;
+   u_int i;
+
+   if (!page_merge_free_count) {
+      area = m_memalign(VM_PAGE_SIZE,PAGE_MERGE_CHUNK_SIZE * VM_PAGE_SIZE);
+      if (!area) return NULL;
+
+      for(i=PAGE_MERGE_CHUNK_SIZE-1;i>0;i--)
+         page_merge_free_page(area + (i * VM_PAGE_SIZE));
+
+      return area;
+   }
+
+   return(page_merge_free_pages[--page_merge_free_count]);
+}
+
+/* Find a shared page with the specified content */
+static page_merge_entry_t *page_merge_find(m_uint64_t hash,m_iptr_t page)
+{
+   page_merge_entry_t *e;
+
+   for(e=page_merge_hash_table[page_merge_hash_bucket(hash)];e;e=e->hash_next)
+      if ((e->hash == hash) &&
+          !memcmp((void *)e->page,(void *)page,VM_PAGE_SIZE))
+         return e;
+
+   return NULL;
+}
+
+/* Find a shared page given its host address */
+static page_merge_entry_t *page_merge_find_addr(m_iptr_t page)
+{
+   page_merge_entry_t *e;
+
+   for(e=page_merge_addr_table[page_merge_addr_bucket(page)];e;e=e->addr_next)
+      if (e->page == page)
+         return e;
+
+   return NULL;
+}
+
+/* Create a shared page from a copy of a private page */
+static page_merge_entry_t *page_merge_create(m_uint64_t hash,m_iptr_t page)
+{
+   page_merge_entry_t *e;
+   u_int bucket;
+
+   if (!(e = malloc(sizeof(*e))))
+      return NULL;
+
+   if (!(e->page = (m_iptr_t)page_merge_alloc_page())) {
+      free(e);
+      return NULL;
+   }
+
+   memcpy((void *)e->page,(void *)page,VM_PAGE_SIZE);
+   e->hash = hash;
+   e->ref_count = 0;
+   e->dead_round = 0;
+
+   bucket = page_merge_hash_bucket(hash);
+   e->hash_next = page_merge_hash_table[bucket];
+   page_merge_hash_table[bucket] = e;
+
+   bucket = page_merge_addr_bucket(e->page);
+   e->addr_next = page_merge_addr_table[bucket];
+   page_merge_addr_table[bucket] = e;
+   return e;
+}
+
+/* Remove a shared page from the lookup tables */
+static void page_merge_unlink(page_merge_entry_t *e)
+{
+   page_merge_entry_t **ep;
+
+   ep = &page_merge_hash_table[page_merge_hash_bucket(e->hash)];
+   for(;*ep;ep=&(*ep)->hash_next)
+      if (*ep == e) {
+         *ep = e->hash_next;
+         break;
+      }
+
+   ep = &page_merge_addr_table[page_merge_addr_bucket(e->page)];
+   for(;*ep;ep=&(*ep)->addr_next)
+      if (*ep == e) {
+         *ep = e->addr_next;
+         break;
+      }
+}
+
+/* Drop a reference on a shared page (pool lock held) */
+static void page_merge_put(m_iptr_t page)
+{
+   page_merge_entry_t *e;
+
+   if (!(e = page_merge_find_addr(page)))
+      return;
+
+   assert(e->ref_count > 0);
+
+   if (--e->ref_count == 0) {
+      page_merge_unlink(e);
+      e->dead_round = page_merge_round;
+      e->hash_next = page_merge_dead_list;
+      page_merge_dead_list = e;
+   }
+}
+
+/* Drop a reference on a shared page */
+void page_merge_release(m_iptr_t page)
+{
+   PAGE_MERGE_POOL_LOCK();
+   page_merge_put(page);
+   PAGE_MERGE_POOL_UNLOCK();
+}
+
+/* Give a private copy of a shared page to a VM (copy-on-write) */
+m_iptr_t page_merge_unshare(vm_instance_t *vm,m_iptr_t *pte)
+{
+   m_iptr_t page,ptr_new;
+
+   if (!(ptr_new = (m_iptr_t)vm_alloc_host_page(vm)))
+      return(0);
+
+   PAGE_MERGE_POOL_LOCK();
+
+   /* Another thread did the job */
+   if (!(*pte & VDEVICE_PTE_SHARED)) {
+      PAGE_MERGE_POOL_UNLOCK();
+      vm_free_host_page(vm,(void *)ptr_new);
+      return(*pte & VM_PAGE_MASK);
+   }
+
+   page = *pte & VM_PAGE_MASK;
+   memcpy((void *)ptr_new,(void *)page,VM_PAGE_SIZE);
+   *pte = ptr_new | VDEVICE_PTE_DIRTY;
+   page_merge_put(page);
+
+   PAGE_MERGE_POOL_UNLOCK();
+   return(ptr_new);
+}
+
+/* Give back to the pool the dead pages which are not mapped anymore */
+static void page_merge_reclaim(void)
+{
+   page_merge_entry_t **ep,*e;
+   page_merge_vm_t *pv;
+   m_uint64_t min_round;
+
+   min_round = page_merge_round + 1;
+
+   for(pv=page_merge_vm_list;pv;pv=pv->next)
+      min_round = m_min(min_round,pv->rebuild_round);
+
+   for(ep=&page_merge_dead_list;*ep;) {
+      e = *ep;
+
+      if (e->dead_round < min_round) {
+         *ep = e->hash_next;
+         page_merge_free_page((void *)e->page);
+         free(e);
+      } else {
+         ep = &e->hash_next;
+      }
+   }
+}
+
+/* Merge the private pages of a sparse device */
+static u_int page_merge_scan_dev(vm_instance_t *vm,struct vdevice *dev)
+{
+   page_merge_entry_t *e;
+   page_merge_cand_t *cand;
+   m_iptr_t *pte,page;
+   m_uint64_t hash;
+   u_int i,nr_pages;
+   u_int merged = 0;
+
+   nr_pages = normalize_size(dev->phys_len,VM_PAGE_SIZE,VM_PAGE_SHIFT);
+
+   for(i=0;i<nr_pages;i++) {
+      pte = &dev->sparse_map[i];
+
+      /* Pages being written by a RAM snapshot must stay in place */
+      if (!(*pte & VDEVICE_PTE_DIRTY) || (*pte & VDEVICE_PTE_SNAP))
+         continue;
+
+      page = *pte & VM_PAGE_MASK;
+      hash = page_merge_hash((void *)page);
+
+      PAGE_MERGE_POOL_LOCK();
+
+      if (!(e = page_merge_find(hash,page))) {
+         cand = &page_merge_cand_table[hash & (PAGE_MERGE_CAND_SIZE - 1)];
+
+         /* First time this content is seen: remember where */
+         if ((cand->hash != hash) || (cand->pte == pte)) {
+            cand->hash = hash;
+            cand->pte  = pte;
+         } else {
+            e = page_merge_create(hash,page);
+         }
+      }
+
+      if (e != NULL) {
+         e->ref_count++;
+         *pte = e->page | VDEVICE_PTE_SHARED | (*pte & VDEVICE_PTE_LOGGED);
+      }
+
+      PAGE_MERGE_POOL_UNLOCK();
+
+      if (e != NULL) {
+         vm_free_host_page(vm,(void *)page);
+         merged++;
+      }
+   }
+
+   return(merged);
+}
+
+/* Merge the pages of a VM */
+static void page_merge_scan_vm(page_merge_vm_t *pv)
+{
+   vm_instance_t *vm = pv->vm;
+   page_merge_stats_t stats;
+   struct vdevice *dev;
+   u_int merged = 0;
+
+   VM_STATE_LOCK(vm);
+
+   if (vm->status != VM_STATUS_RUNNING) {
+      VM_STATE_UNLOCK(vm);
+      return;
+   }
+
+   vm_suspend(vm);
+
+   if (cpu_group_sync_state(vm->cpu_group) == -1) {
+      vm_log(vm,"PAGE_MERGE","unable to sync with system CPUs.\n");
+      vm_resume(vm);
+      VM_STATE_UNLOCK(vm);
+      return;
+   }
+
+   /* Wait for the devices accessing RAM pages */
+   VM_RAM_LOCK(vm);
+
+   for(dev=vm->dev_list;dev;dev=dev->next) {
+      if (!(dev->flags & VDEVICE_FLAG_SPARSE) ||
+          (dev->flags & VDEVICE_FLAG_REMAP) || !dev->sparse_map)
+         continue;
+
+      merged += page_merge_scan_dev(vm,dev);
+   }
+
+   /* Drop the host pointers to the released pages */
+   cpu_group_rebuild_mts(vm->cpu_group);
+   cpu_group_flush_code(vm->cpu_group);
+   pv->rebuild_round = page_merge_round;
+
+   /* No lookup can use the retired device indexes anymore */
+   dev_index_reclaim(vm);
+
+   VM_RAM_UNLOCK(vm);
+   vm_resume(vm);
+   VM_STATE_UNLOCK(vm);
+
+   if (merged) {
+      page_merge_get_stats(vm,&stats);
+      vm_log(vm,"PAGE_MERGE","merged %u pages, %u shared pages "
+             "(%llu KB saved).\n",
+             merged,stats.shared_pages,(unsigned long long)stats.saved_kb);
+   }
+}
+
+/* Page merging thread */
+static void *page_merge_thread_main(void *arg)
+{
+   page_merge_vm_t *pv;
+
+   for(;;) {
+      sleep(PAGE_MERGE_INTERVAL);
+
+      PAGE_MERGE_ROUND_LOCK();
+      page_merge_round++;
+
+      for(pv=page_merge_vm_list;pv;pv=pv->next)
+         page_merge_scan_vm(pv);
+
+      PAGE_MERGE_POOL_LOCK();
+      page_merge_reclaim();
+      PAGE_MERGE_POOL_UNLOCK();
+
+      PAGE_MERGE_ROUND_UNLOCK();
+   }
+
+   return NULL;
+}
+
+/* Add a VM to the page merging service */
+int page_merge_add_vm(vm_instance_t *vm)
+{
+   page_merge_vm_t *pv;
+   pthread_t thread;
+
+   PAGE_MERGE_ROUND_LOCK();
+
+   if (!page_merge_cand_table) {
+      page_merge_cand_table = calloc(PAGE_MERGE_CAND_SIZE,
+                                     sizeof(page_merge_cand_t));
+
+      if (!page_merge_cand_table)
+         goto err_alloc;
+   }
+
+   if (!page_merge_thread_running) {
+      if (pthread_create(&thread,NULL,page_merge_thread_main,NULL) != 0)
+         goto err_alloc;
+
+      pthread_detach(thread);
+      page_merge_thread_running = TRUE;
+   }
+
+   if (!(pv = malloc(sizeof(*pv))))
+      goto err_alloc;
+
+   pv->vm = vm;
+   pv->rebuild_round = page_merge_round;
+   pv->next = page_merge_vm_list;
+   page_merge_vm_list = pv;
+
+   PAGE_MERGE_ROUND_UNLOCK();
+   vm_log(vm,"PAGE_MERGE","page merging enabled.\n");
+   return(0);
+
+ err_alloc:
+   PAGE_MERGE_ROUND_UNLOCK();
+   vm_error(vm,"unable to enable page merging.\n");
+   return(-1);
+}
+
+/* Remove a VM from the page merging service */
+void page_merge_remove_vm(vm_instance_t *vm)
+{
+   page_merge_vm_t **pvp,*pv;
+
+   PAGE_MERGE_ROUND_LOCK();
+
+   for(pvp=&page_merge_vm_list;*pvp;pvp=&(*pvp)->next)
+      if ((*pvp)->vm == vm) {
+         pv = *pvp;
+         *pvp = pv->next;
+         free(pv);
+         break;
+      }
+
+   PAGE_MERGE_ROUND_UNLOCK();
+}
+
+/* Prevent merge rounds from running (while the caller walks RAM pages) */
+void page_merge_lock_rounds(void)
+{
+   PAGE_MERGE_ROUND_LOCK();
+}
+
+/* Allow merge rounds to run again */
+void page_merge_unlock_rounds(void)
+{
+   PAGE_MERGE_ROUND_UNLOCK();
+}
+
+/*
+ * Get page merging statistics for a VM.
+ *
+ * A shared page referenced n times saves n-1 pages, accounted for
+ * (n-1)/n to each of its users.
+ */
+void page_merge_get_stats(vm_instance_t *vm,page_merge_stats_t *stats)
+{
+   page_merge_entry_t *e;
+   struct vdevice *dev;
+   u_int i,nr_pages;
+   m_uint64_t saved = 0;
+
+   stats->shared_pages = 0;
+
+   PAGE_MERGE_POOL_LOCK();
+
+   for(dev=vm->dev_list;dev;dev=dev->next) {
+      if (!(dev->flags & VDEVICE_FLAG_SPARSE) ||
+          (dev->flags & VDEVICE_FLAG_REMAP) || !dev->sparse_map)
+         continue;
+
+      nr_pages = normalize_size(dev->phys_len,VM_PAGE_SIZE,VM_PAGE_SHIFT);
+
+      for(i=0;i<nr_pages;i++) {
+         if (!(dev->sparse_map[i] & VDEVICE_PTE_SHARED))
+            continue;
+
+         e = page_merge_find_addr(dev->sparse_map[i] & VM_PAGE_MASK);
+
+         if (e != NULL) {
+            saved += ((m_uint64_t)(e->ref_count - 1) * VM_PAGE_SIZE) /
+               e->ref_count;
+            stats->shared_pages++;
+         }
+      }
+   }
+
+   PAGE_MERGE_POOL_UNLOCK();
+   stats->saved_kb = saved >> 10;
+}
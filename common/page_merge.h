@@ -0,0 +1,66 @@
+/*
+ * Cisco router simulation platform.
+ * Copyright (c) 2005,2006 Christophe Fillot (cf@utc.fr)
+ *
+ * page_merge.h: Merging of identical RAM pages across VM instances.
+ */
+
+#ifndef __PAGE_MERGE_H__
+#define __PAGE_MERGE_H__
+
+#include <sys/types.h>
+#include "utils.h"
+#include "vm.h"
+
+/* Interval between two merge rounds (in seconds) */
+#define PAGE_MERGE_INTERVAL  30
+
+/* Number of buckets of the shared page tables */
+#define PAGE_MERGE_HASH_BITS  16
+#define PAGE_MERGE_HASH_SIZE  (1 << PAGE_MERGE_HASH_BITS)
+
+/* Number of entries of the candidate table */
+#define PAGE_MERGE_CAND_SIZE  (1 << 16)
+
+/* Number of pages in a pool chunk */
+#define PAGE_MERGE_CHUNK_SIZE  256
+
+/* Shared page */
+typedef struct page_merge_entry page_merge_entry_t;
+struct page_merge_entry {
+   m_uint64_t hash;
+   m_iptr_t page;
+   u_int ref_count;
+   m_uint64_t dead_round;
+   page_merge_entry_t *hash_next,*addr_next;
+};
+
+/* Memory saved by page merging for a VM */
+typedef struct page_merge_stats page_merge_stats_t;
+struct page_merge_stats {
+   u_int shared_pages;        /* Pages mapped to a shared page */
+   m_uint64_t saved_kb;       /* Share of the memory saved (in KB) */
+};
+
+/* Add a VM to the page merging service */
+int page_merge_add_vm(vm_instance_t *vm);
+
+/* Remove a VM from the page merging service */
+void page_merge_remove_vm(vm_instance_t *vm);
+
+/* Drop a reference on a shared page */
+void page_merge_release(m_iptr_t page);
+
+/* Give a private copy of a shared page to a VM (copy-on-write) */
+m_iptr_t page_merge_unshare(vm_instance_t *vm,m_iptr_t *pte);
+
+/* Prevent merge rounds from running (while the caller walks RAM pages) */
+void page_merge_lock_rounds(void);
+
+/* Allow merge rounds to run again */
+void page_merge_unlock_rounds(void);
+
+/* Get page merging statistics for a VM */
+void page_merge_get_stats(vm_instance_t *vm,page_merge_stats_t *stats);
+
+#endif
@@ -17,6 +17,21 @@ struct ppc32_insn_exec_tag {
    m_uint64_t count;
 };
 
+/* Number of predecoded pages kept per CPU (non-JIT mode, power of 2) */
+#define PPC32_NJM_CACHE_SIZE  512
+
+/* Predecoded instruction: raw instruction word, its handler and tag index */
+struct ppc32_njm_insn {
+   fastcall int (*exec)(cpu_ppc_t *,ppc_insn_t);
+   ppc_insn_t insn;
+   int index;
+};
+
+/* Predecoded page, indexed in the per-CPU cache by physical page number */
+struct ppc32_njm_page {
+   struct ppc32_njm_insn insn[PPC32_INSN_PER_PAGE];
+};
+
 /* Get a rotation mask */
 static forced_inline m_uint32_t ppc32_rotate_mask(m_uint32_t mb,m_uint32_t me)
 {
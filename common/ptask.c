@@ -3,8 +3,16 @@
  * Copyright (c) 2005,2006 Christophe Fillot (cf@utc.fr)
  *
  * Periodic tasks centralization. Used for TX part of network devices.
+ *
+ * Tasks are spread over a set of worker threads (one per host CPU, up to
+ * PTASK_MAX_WORKERS), so a slow callback only delays the tasks sharing its
+ * worker. Each worker keeps its tasks in a timer wheel: a task is run every
+ * "interval" ms (ptask_sleep_time by default). A task can also be kicked
+ * (typically when the guest writes a TX poll demand register), in which
+ * case it is run as soon as possible, the periodic run being a fallback.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,6 +23,7 @@
 #include <fcntl.h>
 #include <ctype.h>
 #include <time.h>
+#include <sched.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <pthread.h>
@@ -22,57 +31,273 @@
 
 #include "ptask.h"
 
-static pthread_t ptask_thread;
-static pthread_mutex_t ptask_mutex = PTHREAD_MUTEX_INITIALIZER;
-static ptask_t *ptask_list = NULL;
+/* Timer wheel: 256 slots of 1 ms */
+#define PTASK_WHEEL_SIZE   256
+#define PTASK_WHEEL_MASK   (PTASK_WHEEL_SIZE - 1)
+#define PTASK_TICK_USEC    1000
+
+/* The worker index is stored in the low bits of task identifiers */
+#define PTASK_WORKER_BITS  4
+#define PTASK_WORKER_MASK  ((1 << PTASK_WORKER_BITS) - 1)
+
+/* Kicked tasks per worker */
+#define PTASK_KICK_MAX     64
+
+/* Worker thread */
+typedef struct ptask_worker ptask_worker_t;
+struct ptask_worker {
+   u_int index;
+   pthread_t thread;
+
+   /* Task list and timer wheel (held while callbacks run) */
+   pthread_mutex_t lock;
+   ptask_t *task_list;
+   ptask_t *wheel[PTASK_WHEEL_SIZE];
+   m_tmcnt_t cur_tick;
+
+   /* Doorbell (never held by callbacks) */
+   pthread_mutex_t kick_lock;
+   pthread_cond_t kick_cond;
+   ptask_id_t kick_list[PTASK_KICK_MAX];
+   u_int kick_count;
+   int kick_overflow;
+   int resched;
+};
+
+static ptask_worker_t ptask_workers[PTASK_MAX_WORKERS];
+static u_int ptask_worker_count = 0;
 static ptask_id_t ptask_current_id = 0;
 
 u_int ptask_sleep_time = 10;
+int ptask_cpu_affinity = FALSE;
 
-#define PTASK_LOCK() pthread_mutex_lock(&ptask_mutex)
-#define PTASK_UNLOCK() pthread_mutex_unlock(&ptask_mutex)
+#define PTASK_LOCK(w)   pthread_mutex_lock(&(w)->lock)
+#define PTASK_UNLOCK(w) pthread_mutex_unlock(&(w)->lock)
 
-/* Periodic task thread */
-static void *ptask_run(void *arg)
+/* Get the current wheel tick */
+static inline m_tmcnt_t ptask_get_tick(void)
+{
+   return(m_gettime_usec() / PTASK_TICK_USEC);
+}
+
+/* Get the worker owning a task identifier */
+static inline ptask_worker_t *ptask_get_worker(ptask_id_t id)
+{
+   u_int index = id & PTASK_WORKER_MASK;
+
+   if ((id <= 0) || (index >= ptask_worker_count))
+      return NULL;
+
+   return(&ptask_workers[index]);
+}
+
+/* 
+ * Select a worker for a new task (tasks of a group, or of an object when
+ * no group is given, share a worker)
+ */
+static ptask_worker_t *ptask_select_worker(void *object,void *group)
 {
-   pthread_mutex_t umutex = PTHREAD_MUTEX_INITIALIZER;
-   pthread_cond_t ucond = PTHREAD_COND_INITIALIZER;
+   m_iptr_t key = (m_iptr_t)(group ? group : object);
+   return(&ptask_workers[((key >> 4) ^ (key >> 12)) % ptask_worker_count]);
+}
+
+/* Wake up a worker */
+static void ptask_worker_resched(ptask_worker_t *w)
+{
+   pthread_mutex_lock(&w->kick_lock);
+   w->resched = TRUE;
+   pthread_cond_signal(&w->kick_cond);
+   pthread_mutex_unlock(&w->kick_lock);
+}
+
+/* Insert a task in the timer wheel */
+static void ptask_wheel_insert(ptask_worker_t *w,ptask_t *task)
+{
+   u_int slot = task->deadline & PTASK_WHEEL_MASK;
+
+   task->wheel_next = w->wheel[slot];
+   w->wheel[slot] = task;
+}
+
+/* Remove a task from the timer wheel */
+static void ptask_wheel_remove(ptask_worker_t *w,ptask_t *task)
+{
+   ptask_t **p;
+
+   for(p=&w->wheel[task->deadline & PTASK_WHEEL_MASK];*p;p=&(*p)->wheel_next)
+      if (*p == task) {
+         *p = task->wheel_next;
+         break;
+      }
+}
+
+/* Execute a task callback and account its run time */
+static void ptask_exec(ptask_t *task)
+{
+   m_tmcnt_t t0,delta;
+
+   t0 = m_gettime_usec();
+   task->cbk(task->object,task->arg);
+   delta = m_gettime_usec() - t0;
 
+   task->run_count++;
+   task->run_time += delta;
+
+   if (delta > task->run_time_max)
+      task->run_time_max = delta;
+}
+
+/* Run the specified task (if it still exists) */
+static void ptask_run_id(ptask_worker_t *w,ptask_id_t id)
+{
    ptask_t *task;
 
-   for(;;) {
-      PTASK_LOCK();
-      for(task=ptask_list;task;task=task->next)
-         task->cbk(task->object,task->arg);
-      PTASK_UNLOCK();
+   for(task=w->task_list;task;task=task->next)
+      if (task->id == id) {
+         task->kick_count++;
+         ptask_exec(task);
+         break;
+      }
+}
 
-      /* For testing! */
-      {
-         struct timespec t_spc;
-         m_tmcnt_t expire;
+/* Run the expired tasks and advance the timer wheel */
+static void ptask_wheel_advance(ptask_worker_t *w)
+{
+   ptask_t *list,*task;
+   m_tmcnt_t now;
+
+   now = ptask_get_tick();
+
+   /* don't walk the wheel more than once */
+   if ((now >= w->cur_tick) && ((now - w->cur_tick) >= PTASK_WHEEL_SIZE))
+      w->cur_tick = now - PTASK_WHEEL_MASK;
+
+   for(;w->cur_tick<=now;w->cur_tick++) {
+      list = w->wheel[w->cur_tick & PTASK_WHEEL_MASK];
+      w->wheel[w->cur_tick & PTASK_WHEEL_MASK] = NULL;
 
-         expire = m_gettime_usec() + (ptask_sleep_time * 1000);
+      while(list != NULL) {
+         task = list;
+         list = list->wheel_next;
 
-         pthread_mutex_lock(&umutex);
+         if (task->deadline <= now) {
+            ptask_exec(task);
+
+            task->deadline += task->interval;
+
+            /* we are late: skip the missed periods */
+            if (task->deadline <= now) {
+               task->deadline = now + task->interval;
+               task->late_count++;
+            }
+         }
+
+         ptask_wheel_insert(w,task);
+      }
+   }
+}
+
+/* Get the tick of the next non-empty wheel slot */
+static m_tmcnt_t ptask_wheel_next_tick(ptask_worker_t *w)
+{
+   u_int i;
+
+   for(i=0;i<PTASK_WHEEL_SIZE;i++)
+      if (w->wheel[(w->cur_tick + i) & PTASK_WHEEL_MASK] != NULL)
+         break;
+
+   return(w->cur_tick + i);
+}
+
+/* Bind a worker to a host CPU */
+static void ptask_worker_set_affinity(ptask_worker_t *w)
+{
+#ifdef __linux__
+   cpu_set_t cpuset;
+   long ncpu;
+
+   ncpu = m_max(sysconf(_SC_NPROCESSORS_ONLN),1);
+
+   CPU_ZERO(&cpuset);
+   CPU_SET(w->index % ncpu,&cpuset);
+
+   if (pthread_setaffinity_np(pthread_self(),sizeof(cpuset),&cpuset) != 0)
+      fprintf(stderr,"ptask: unable to bind worker %u to CPU %ld\n",
+              w->index,w->index % ncpu);
+#endif
+}
+
+/* Periodic task worker thread */
+static void *ptask_run(void *arg)
+{
+   ptask_worker_t *w = arg;
+   ptask_id_t kicked[PTASK_KICK_MAX];
+   struct timespec t_spc;
+   m_tmcnt_t expire;
+   u_int i,count;
+   int run_all;
+   ptask_t *task;
+
+   if (ptask_cpu_affinity)
+      ptask_worker_set_affinity(w);
+
+   expire = m_gettime_usec();
+
+   for(;;) {
+      /* Wait for the next wheel slot or for a doorbell */
+      pthread_mutex_lock(&w->kick_lock);
+
+      while(!w->kick_count && !w->kick_overflow && !w->resched &&
+            (m_gettime_usec() < expire))
+      {
          t_spc.tv_sec = expire / 1000000;
          t_spc.tv_nsec = (expire % 1000000) * 1000;
-         pthread_cond_timedwait(&ucond,&umutex,&t_spc);
-         pthread_mutex_unlock(&umutex);
+         pthread_cond_timedwait(&w->kick_cond,&w->kick_lock,&t_spc);
       }
 
-      /* Old method... */
-      //usleep(ptask_sleep_time*1000);
+      count = w->kick_count;
+      memcpy(kicked,w->kick_list,count * sizeof(kicked[0]));
+      run_all = w->kick_overflow;
+      w->kick_count = 0;
+      w->kick_overflow = FALSE;
+      w->resched = FALSE;
+
+      pthread_mutex_unlock(&w->kick_lock);
+
+      PTASK_LOCK(w);
+
+      if (run_all) {
+         for(task=w->task_list;task;task=task->next) {
+            task->kick_count++;
+            ptask_exec(task);
+         }
+      } else {
+         for(i=0;i<count;i++)
+            ptask_run_id(w,kicked[i]);
+      }
+
+      ptask_wheel_advance(w);
+      expire = ptask_wheel_next_tick(w) * PTASK_TICK_USEC;
+
+      PTASK_UNLOCK(w);
    }
 
    return NULL;
 }
 
-/* Add a new task */
-ptask_id_t ptask_add(ptask_callback cbk,void *object,void *arg)
+/* Add a new task with a name and an interval (0 = ptask_sleep_time) */
+ptask_id_t ptask_add_ext(ptask_callback cbk,void *object,void *arg,
+                         void *group,char *name,u_int interval)
 {
+   ptask_worker_t *w;
    ptask_t *task;
    ptask_id_t id;
 
+   if (!ptask_worker_count) {
+      fprintf(stderr,"ptask_add: module not initialized.\n");
+      return(-1);
+   }
+
    if (!(task = malloc(sizeof(*task)))) {
       fprintf(stderr,"ptask_add: unable to add new task.\n");
       return(-1);
@@ -82,48 +307,163 @@ ptask_id_t ptask_add(ptask_callback cbk,void *object,void *arg)
    task->cbk = cbk;
    task->object = object;
    task->arg = arg;
+   task->name = name ? name : "unknown";
+   task->interval = interval ? interval : ptask_sleep_time;
 
-   PTASK_LOCK();
-   id = ++ptask_current_id;
-   assert(id != 0);
-   task->id = id;
-   task->next = ptask_list;
-   ptask_list = task;
-   PTASK_UNLOCK();
-   return(id);
+   w = ptask_select_worker(object,group);
+   id = __sync_add_and_fetch(&ptask_current_id,1);
+   task->id = (id << PTASK_WORKER_BITS) | w->index;
+   assert(task->id > 0);
+
+   PTASK_LOCK(w);
+   task->deadline = ptask_get_tick() + task->interval;
+   task->next = w->task_list;
+   w->task_list = task;
+   ptask_wheel_insert(w,task);
+   PTASK_UNLOCK(w);
+
+   ptask_worker_resched(w);
+   return(task->id);
 }
 
 /* Remove a task */
 int ptask_remove(ptask_id_t id)
-{   
+{
+   ptask_worker_t *w;
    ptask_t **task,*p;
    int res = -1;
 
-   PTASK_LOCK();
+   if (!(w = ptask_get_worker(id)))
+      return(-1);
+
+   PTASK_LOCK(w);
 
-   for(task=&ptask_list;*task;task=&(*task)->next)
+   for(task=&w->task_list;*task;task=&(*task)->next)
       if ((*task)->id == id) {
          p = *task;
          *task = (*task)->next;
+         ptask_wheel_remove(w,p);
          free(p);
          res = 0;
          break;
       }
-   
-   PTASK_UNLOCK();
+
+   PTASK_UNLOCK(w);
    return(res);
 }
 
+/* Request an immediate run of a task (doorbell) */
+void ptask_kick(ptask_id_t id)
+{
+   ptask_worker_t *w;
+   u_int i;
+
+   if (!(w = ptask_get_worker(id)))
+      return;
+
+   pthread_mutex_lock(&w->kick_lock);
+
+   for(i=0;i<w->kick_count;i++)
+      if (w->kick_list[i] == id)
+         break;
+
+   if (i == w->kick_count) {
+      if (w->kick_count < PTASK_KICK_MAX)
+         w->kick_list[w->kick_count++] = id;
+      else
+         w->kick_overflow = TRUE;
+
+      pthread_cond_signal(&w->kick_cond);
+   }
+
+   pthread_mutex_unlock(&w->kick_lock);
+}
+
+/* Enumerate task statistics */
+void ptask_stats_foreach(ptask_stats_cbk cbk,void *opt)
+{
+   ptask_stats_t *array,*s;
+   ptask_worker_t *w;
+   u_int i,j,count;
+   ptask_t *task;
+
+   for(i=0;i<ptask_worker_count;i++) {
+      w = &ptask_workers[i];
+
+      /* take a snapshot, so the callback doesn't delay the worker */
+      PTASK_LOCK(w);
+
+      for(count=0,task=w->task_list;task;task=task->next)
+         count++;
+
+      if (!count || !(array = calloc(count,sizeof(*array)))) {
+         PTASK_UNLOCK(w);
+         continue;
+      }
+
+      for(s=array,task=w->task_list;task;task=task->next,s++) {
+         s->id           = task->id;
+         s->name         = task->name;
+         s->object       = task->object;
+         s->worker       = w->index;
+         s->interval     = task->interval;
+         s->run_count    = task->run_count;
+         s->kick_count   = task->kick_count;
+         s->late_count   = task->late_count;
+         s->run_time     = task->run_time;
+         s->run_time_max = task->run_time_max;
+      }
+
+      PTASK_UNLOCK(w);
+
+      for(j=0;j<count;j++)
+         cbk(&array[j],opt);
+
+      free(array);
+   }
+}
+
+/* Initialize a worker thread */
+static int ptask_worker_init(ptask_worker_t *w,u_int index)
+{
+   memset(w,0,sizeof(*w));
+   w->index = index;
+   w->cur_tick = ptask_get_tick();
+   pthread_mutex_init(&w->lock,NULL);
+   pthread_mutex_init(&w->kick_lock,NULL);
+   pthread_cond_init(&w->kick_cond,NULL);
+
+   if (pthread_create(&w->thread,NULL,ptask_run,w) != 0) {
+      fprintf(stderr,"ptask_init: unable to create thread.\n");
+      return(-1);
+   }
+
+   return(0);
+}
+
 /* Initialize ptask module */
 int ptask_init(u_int sleep_time)
 {
+   long ncpu;
+   u_int i;
+
    if (sleep_time)
       ptask_sleep_time = sleep_time;
 
-   if (pthread_create(&ptask_thread,NULL,ptask_run,NULL) != 0) {
-      fprintf(stderr,"ptask_init: unable to create thread.\n");
-      return(-1);
+   ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+   ncpu = m_max(ncpu,1);
+   ncpu = m_min(ncpu,PTASK_MAX_WORKERS);
+
+   for(i=0;i<ncpu;i++) {
+      /* workers are published once fully initialized */
+      if (ptask_worker_init(&ptask_workers[i],i) == -1)
+         break;
+
+      ptask_worker_count = i + 1;
    }
 
+   if (!ptask_worker_count)
+      return(-1);
+
    return(0);
 }
@@ -26,16 +26,58 @@ struct ptask {
    ptask_t *next;
    ptask_callback cbk;
    void *object,*arg;
+
+   /* Timer wheel: interval (ms), next deadline (ticks) and slot chaining */
+   char *name;
+   u_int interval;
+   m_tmcnt_t deadline;
+   ptask_t *wheel_next;
+
+   /* Statistics (run times in microseconds) */
+   m_uint64_t run_count,kick_count,late_count;
+   m_tmcnt_t run_time,run_time_max;
+};
+
+/* Snapshot of task statistics */
+typedef struct ptask_stats ptask_stats_t;
+struct ptask_stats {
+   ptask_id_t id;
+   char *name;
+   void *object;
+   u_int worker,interval;
+   m_uint64_t run_count,kick_count,late_count;
+   m_tmcnt_t run_time,run_time_max;
 };
 
+/* Statistics enumeration callback */
+typedef void (*ptask_stats_cbk)(ptask_stats_t *stats,void *opt);
+
+/* Maximum number of worker threads */
+#define PTASK_MAX_WORKERS  8
+
 extern u_int ptask_sleep_time;
+extern int ptask_cpu_affinity;
+
+/* 
+ * Add a new task with a name and an interval (0 = ptask_sleep_time).
+ * Tasks of a group (the VM of the object, NULL for none) share a worker.
+ */
+ptask_id_t ptask_add_ext(ptask_callback cbk,void *object,void *arg,
+                         void *group,char *name,u_int interval);
 
-/* Add a new task */
-ptask_id_t ptask_add(ptask_callback cbk,void *object,void *arg);
+/* Add a new task (with the default interval) */
+#define ptask_add(cbk,object,arg,group,name) \
+   ptask_add_ext((cbk),(object),(arg),(group),(name),0)
 
 /* Remove a task */
 int ptask_remove(ptask_id_t id);
 
+/* Request an immediate run of a task (doorbell) */
+void ptask_kick(ptask_id_t id);
+
+/* Enumerate task statistics */
+void ptask_stats_foreach(ptask_stats_cbk cbk,void *opt);
+
 /* Initialize ptask module */
 int ptask_init(u_int sleep_time);
 
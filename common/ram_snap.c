@@ -0,0 +1,403 @@
+/*
+ * Cisco router simulation platform.
+ * Copyright (c) 2005,2006 Christophe Fillot (cf@utc.fr)
+ *
+ * Incremental snapshots of sparse RAM.
+ *
+ * A snapshot appends to a log the RAM pages modified since the previous
+ * snapshot of the VM. The first snapshot written to a log contains all
+ * the populated pages.
+ *
+ * The VM is suspended only while the sparse maps are walked: the pages to
+ * save are marked with VDEVICE_PTE_LOGGED and VDEVICE_PTE_SNAP, and the
+ * MTS is rebuilt so that these pages are mapped read-only. The VM is then
+ * resumed, and a thread writes the pages to the log. The first write to a
+ * page which has not been written yet to the log saves a copy of it.
+ *
+ * The first write to a LOGGED page clears the flag, so that the page is
+ * part of the next snapshot.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <assert.h>
+
+#include "cpu.h"
+#include "vm.h"
+#include "device.h"
+#include "page_merge.h"
+#include "ram_snap.h"
+
+#define RAM_SNAP_LOCK(snap)   pthread_mutex_lock(&(snap)->lock)
+#define RAM_SNAP_UNLOCK(snap) pthread_mutex_unlock(&(snap)->lock)
+
+/* Populated pages */
+#define RAM_SNAP_PTE_USED  \
+   (VDEVICE_PTE_DIRTY|VDEVICE_PTE_SHARED|VDEVICE_PTE_FILE)
+
+/* Check if a device is a sparse RAM device */
+static inline int ram_snap_dev_check(struct vdevice *dev)
+{
+   return((dev->flags & VDEVICE_FLAG_SPARSE) &&
+          !(dev->flags & VDEVICE_FLAG_REMAP) && dev->sparse_map);
+}
+
+/* Check if a page has to be saved */
+static inline int ram_snap_page_check(struct vdevice *dev,m_iptr_t pte,
+                                      int full)
+{
+   /* Pages of a ghost device are always populated */
+   if (full)
+      return(dev->host_addr || (pte & RAM_SNAP_PTE_USED));
+
+   return((pte & RAM_SNAP_PTE_USED) && !(pte & VDEVICE_PTE_LOGGED));
+}
+
+/* Compare two snapshot pages (sorted by sparse map entry) */
+static int ram_snap_page_cmp(const void *a,const void *b)
+{
+   const ram_snap_page_t *pa = a,*pb = b;
+
+   if (pa->pte < pb->pte)
+      return(-1);
+
+   return(pa->pte > pb->pte);
+}
+
+/* Walk the sparse RAM devices, and mark the pages to save */
+static int ram_snap_collect(vm_instance_t *vm,ram_snap_t *snap,int full)
+{
+   struct vdevice *dev;
+   ram_snap_page_t *p;
+   u_int i,nr_pages,count = 0;
+   m_iptr_t *pte;
+
+   for(dev=vm->dev_list;dev;dev=dev->next) {
+      if (!ram_snap_dev_check(dev))
+         continue;
+
+      nr_pages = normalize_size(dev->phys_len,VM_PAGE_SIZE,VM_PAGE_SHIFT);
+
+      for(i=0;i<nr_pages;i++)
+         if (ram_snap_page_check(dev,dev->sparse_map[i],full))
+            count++;
+   }
+
+   snap->pages = NULL;
+   snap->page_count = 0;
+
+   if (count && !(snap->pages = calloc(count,sizeof(*p))))
+      return(-1);
+
+   p = snap->pages;
+
+   for(dev=vm->dev_list;dev;dev=dev->next) {
+      if (!ram_snap_dev_check(dev))
+         continue;
+
+      nr_pages = normalize_size(dev->phys_len,VM_PAGE_SIZE,VM_PAGE_SHIFT);
+
+      for(i=0;i<nr_pages;i++) {
+         pte = &dev->sparse_map[i];
+
+         if (!ram_snap_page_check(dev,*pte,full))
+            continue;
+
+         p->pte   = pte;
+         p->paddr = dev->phys_addr + ((m_uint64_t)i << VM_PAGE_SHIFT);
+         p->page  = *pte & VM_PAGE_MASK;
+         p->copy  = NULL;
+         p++;
+
+         *pte |= VDEVICE_PTE_LOGGED | VDEVICE_PTE_SNAP;
+      }
+   }
+
+   snap->page_count = count;
+   qsort(snap->pages,count,sizeof(*p),ram_snap_page_cmp);
+   return(0);
+}
+
+/* Write the header of a snapshot */
+static int ram_snap_write_hdr(ram_snap_t *snap,int full)
+{
+   m_uint8_t hdr[RAM_SNAP_HDR_SIZE];
+   m_uint64_t now = time(NULL);
+
+   m_hton32(&hdr[0],RAM_SNAP_MAGIC);
+   m_hton32(&hdr[4],RAM_SNAP_VERSION);
+   m_hton32(&hdr[8],snap->seq);
+   m_hton32(&hdr[12],(full) ? RAM_SNAP_FLAG_FULL : 0);
+   m_hton32(&hdr[16],VM_PAGE_SIZE);
+   m_hton32(&hdr[20],snap->page_count);
+   m_hton32(&hdr[24],now >> 32);
+   m_hton32(&hdr[28],now);
+
+   if (fwrite(hdr,sizeof(hdr),1,snap->fd) != 1)
+      return(-1);
+
+   return(0);
+}
+
+/* Write a page record */
+static int ram_snap_write_page(ram_snap_t *snap,m_uint64_t paddr,void *data)
+{
+   m_uint8_t hdr[RAM_SNAP_PAGE_HDR];
+
+   m_hton32(&hdr[0],paddr >> 32);
+   m_hton32(&hdr[4],paddr);
+
+   if ((fwrite(hdr,sizeof(hdr),1,snap->fd) != 1) ||
+       (fwrite(data,VM_PAGE_SIZE,1,snap->fd) != 1))
+      return(-1);
+
+   return(0);
+}
+
+/* Write the pages of a snapshot */
+static void *ram_snap_thread(void *arg)
+{
+   vm_instance_t *vm = arg;
+   ram_snap_t *snap = vm->ram_snap;
+   m_uint8_t buf[VM_PAGE_SIZE];
+   ram_snap_page_t *p;
+   int valid;
+   u_int i;
+
+   for(i=0;i<snap->page_count;i++) {
+      p = &snap->pages[i];
+      valid = TRUE;
+
+      RAM_SNAP_LOCK(snap);
+
+      if (*p->pte & VDEVICE_PTE_SNAP) {
+         memcpy(buf,(void *)p->page,VM_PAGE_SIZE);
+         *p->pte &= ~VDEVICE_PTE_SNAP;
+      } else if (p->copy != NULL) {
+         memcpy(buf,p->copy,VM_PAGE_SIZE);
+         free(p->copy);
+         p->copy = NULL;
+      } else {
+         valid = FALSE;
+      }
+
+      RAM_SNAP_UNLOCK(snap);
+
+      if (!valid || (snap->status == -1) ||
+          (ram_snap_write_page(snap,p->paddr,buf) == -1))
+         snap->status = -1;
+   }
+
+   if (fclose(snap->fd) != 0)
+      snap->status = -1;
+
+   snap->fd = NULL;
+
+   RAM_SNAP_LOCK(snap);
+   snap->total++;
+   snap->last_seq    = snap->seq;
+   snap->last_pages  = snap->page_count;
+   snap->last_status = snap->status;
+   snap->last_time   = m_gettime() - snap->start_time;
+
+   free(snap->pages);
+   snap->pages = NULL;
+   snap->page_count = 0;
+
+   /* The log is not usable anymore: the next snapshot will be a full one */
+   if (snap->status == -1) {
+      free(snap->filename);
+      snap->filename = NULL;
+   } else {
+      snap->seq++;
+   }
+
+   snap->in_progress = FALSE;
+   RAM_SNAP_UNLOCK(snap);
+
+   if (snap->last_status == -1) {
+      vm_error(vm,"RAM snapshot %u failed.\n",snap->last_seq);
+   } else {
+      vm_log(vm,"RAM_SNAP","snapshot %u: %u pages written in %llu ms.\n",
+             snap->last_seq,snap->last_pages,
+             (unsigned long long)snap->last_time);
+   }
+
+   return NULL;
+}
+
+/* Get the RAM snapshot state of a VM, create it if needed */
+static ram_snap_t *ram_snap_get(vm_instance_t *vm)
+{
+   ram_snap_t *snap;
+
+   if (vm->ram_snap != NULL)
+      return(vm->ram_snap);
+
+   if (!(snap = calloc(1,sizeof(*snap))))
+      return NULL;
+
+   pthread_mutex_init(&snap->lock,NULL);
+   vm->ram_snap = snap;
+   return snap;
+}
+
+/* Take a RAM snapshot, pages are written in the background */
+int ram_snap_take(vm_instance_t *vm,char *filename)
+{
+   ram_snap_t *snap;
+   int full,running,res;
+
+   if (!vm->sparse_mem) {
+      vm_error(vm,"RAM snapshots require sparse memory.\n");
+      return(-1);
+   }
+
+   if ((vm->status != VM_STATUS_RUNNING) &&
+       (vm->status != VM_STATUS_SUSPENDED))
+   {
+      vm_error(vm,"RAM snapshot: instance is not running.\n");
+      return(-1);
+   }
+
+   if (!(snap = ram_snap_get(vm)))
+      return(-1);
+
+   if (snap->in_progress) {
+      vm_error(vm,"a RAM snapshot is already in progress.\n");
+      return(-1);
+   }
+
+   ram_snap_wait(vm);
+
+   /* Start a new log with a full snapshot */
+   full = !snap->filename || strcmp(snap->filename,filename);
+
+   if (full) {
+      free(snap->filename);
+
+      if (!(snap->filename = strdup(filename)))
+         return(-1);
+
+      snap->seq = 0;
+   }
+
+   if (!(snap->fd = fopen(filename,(full) ? "wb" : "ab"))) {
+      vm_error(vm,"unable to open RAM snapshot log '%s'.\n",filename);
+      free(snap->filename);
+      snap->filename = NULL;
+      return(-1);
+   }
+
+   /* Mark the pages to save, with the CPUs stopped */
+   if (vm->page_merge)
+      page_merge_lock_rounds();
+
+   running = (vm->status == VM_STATUS_RUNNING);
+   vm_suspend(vm);
+
+   if ((res = cpu_group_sync_state(vm->cpu_group)) != -1) {
+      res = ram_snap_collect(vm,snap,full);
+      cpu_group_rebuild_mts(vm->cpu_group);
+   }
+
+   if (running)
+      vm_resume(vm);
+
+   if (vm->page_merge)
+      page_merge_unlock_rounds();
+
+   if (res == -1) {
+      vm_error(vm,"RAM snapshot: unable to collect pages.\n");
+      fclose(snap->fd);
+      snap->fd = NULL;
+      free(snap->filename);
+      snap->filename = NULL;
+      return(-1);
+   }
+
+   snap->status = ram_snap_write_hdr(snap,full);
+   snap->start_time = m_gettime();
+   snap->last_full = full;
+   snap->in_progress = TRUE;
+
+   vm_log(vm,"RAM_SNAP","snapshot %u (%s): writing %u pages to '%s'.\n",
+          snap->seq,(full) ? "full" : "incremental",snap->page_count,
+          filename);
+
+   if (pthread_create(&snap->thread,NULL,ram_snap_thread,vm) != 0) {
+      ram_snap_thread(vm);
+      return(snap->last_status);
+   }
+
+   snap->thread_active = TRUE;
+   return(0);
+}
+
+/* Wait for the end of the current RAM snapshot */
+int ram_snap_wait(vm_instance_t *vm)
+{
+   ram_snap_t *snap = vm->ram_snap;
+
+   if (!snap)
+      return(0);
+
+   if (snap->thread_active) {
+      pthread_join(snap->thread,NULL);
+      snap->thread_active = FALSE;
+   }
+
+   return(snap->last_status);
+}
+
+/*
+ * First write to a page saved by a snapshot. If the snapshot has not
+ * written the page yet, its current content is saved for it.
+ * Returns the new sparse map entry.
+ */
+m_iptr_t ram_snap_track_write(vm_instance_t *vm,m_iptr_t *pte)
+{
+   ram_snap_t *snap = vm->ram_snap;
+   ram_snap_page_t key,*p;
+
+   if (*pte & VDEVICE_PTE_SNAP) {
+      RAM_SNAP_LOCK(snap);
+
+      if (*pte & VDEVICE_PTE_SNAP) {
+         key.pte = pte;
+         p = bsearch(&key,snap->pages,snap->page_count,sizeof(key),
+                     ram_snap_page_cmp);
+         assert(p != NULL);
+
+         if ((p->copy = malloc(VM_PAGE_SIZE)) != NULL)
+            memcpy(p->copy,(void *)p->page,VM_PAGE_SIZE);
+
+         *pte &= ~VDEVICE_PTE_SNAP;
+      }
+
+      RAM_SNAP_UNLOCK(snap);
+   }
+
+   *pte &= ~VDEVICE_PTE_LOGGED;
+   return(*pte);
+}
+
+/* Release the RAM snapshot resources of a VM */
+void ram_snap_shutdown(vm_instance_t *vm)
+{
+   ram_snap_t *snap = vm->ram_snap;
+
+   if (!snap)
+      return;
+
+   ram_snap_wait(vm);
+
+   pthread_mutex_destroy(&snap->lock);
+   free(snap->filename);
+   free(snap);
+   vm->ram_snap = NULL;
+}
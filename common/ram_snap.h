@@ -0,0 +1,80 @@
+/*
+ * Cisco router simulation platform.
+ * Copyright (c) 2005,2006 Christophe Fillot (cf@utc.fr)
+ *
+ * ram_snap.h: Incremental snapshots of sparse RAM.
+ */
+
+#ifndef __RAM_SNAP_H__
+#define __RAM_SNAP_H__
+
+#include <sys/types.h>
+#include <pthread.h>
+#include "utils.h"
+#include "vm.h"
+
+/* Snapshot log format */
+#define RAM_SNAP_MAGIC    0x52414d53  /* "RAMS" */
+#define RAM_SNAP_VERSION  1
+
+/* Snapshot flags */
+#define RAM_SNAP_FLAG_FULL  0x01  /* All RAM pages, starts a new log */
+
+/* 
+ * Size of a snapshot header in the log: magic, version, sequence number,
+ * flags, page size, page count (32-bit) and timestamp (64-bit), big-endian.
+ * It is followed by "page count" records: physical address (64-bit) and
+ * page content.
+ */
+#define RAM_SNAP_HDR_SIZE   32
+#define RAM_SNAP_PAGE_HDR   8
+
+/* Page to be written by a snapshot */
+typedef struct ram_snap_page ram_snap_page_t;
+struct ram_snap_page {
+   m_iptr_t *pte;             /* Entry in the sparse map */
+   m_uint64_t paddr;          /* Physical address */
+   m_iptr_t page;             /* Host page at snapshot time */
+   void *copy;                /* Content saved before a write */
+};
+
+/* RAM snapshot state of a VM */
+typedef struct ram_snap ram_snap_t;
+struct ram_snap {
+   pthread_mutex_t lock;
+   pthread_t thread;
+   int thread_active;         /* Thread has to be joined */
+   volatile int in_progress;  /* Pages are being written */
+
+   char *filename;            /* Log of the previous snapshot */
+   FILE *fd;
+   u_int seq;                 /* Sequence number in the log */
+
+   /* Pages of the snapshot being written */
+   ram_snap_page_t *pages;
+   u_int page_count;
+   int status;
+
+   /* Last snapshot */
+   u_int total;               /* Snapshots taken since VM start */
+   u_int last_seq;
+   u_int last_pages;
+   int last_full;
+   int last_status;
+   m_tmcnt_t last_time;       /* Duration (in ms) */
+   m_tmcnt_t start_time;
+};
+
+/* Take a RAM snapshot, pages are written in the background */
+int ram_snap_take(vm_instance_t *vm,char *filename);
+
+/* Wait for the end of the current RAM snapshot */
+int ram_snap_wait(vm_instance_t *vm);
+
+/* First write to a page saved by a snapshot */
+m_iptr_t ram_snap_track_write(vm_instance_t *vm,m_iptr_t *pte);
+
+/* Release the RAM snapshot resources of a VM */
+void ram_snap_shutdown(vm_instance_t *vm);
+
+#endif
@@ -92,30 +92,76 @@ timer_queue_t *timer_select_queue_from_pool(void)
    return s_queue;
 }
 
-/* Add a timer in a queue */
-static inline void timer_add_to_queue(timer_queue_t *queue,
+/* Get the wheel level and slot of an expiration date */
+static inline timer_entry_t **timer_wheel_bucket(timer_queue_t *queue,
+                                                 m_tmcnt_t expire,int *level)
+{
+   m_tmcnt_t delta;
+   int i,shift;
+
+   /* Already expired: run it on the next tick */
+   if (expire <= queue->wheel_time)
+      expire = queue->wheel_time + 1;
+
+   delta = expire - queue->wheel_time;
+
+   for(i=0;i<TIMER_WHEEL_LEVELS-1;i++)
+      if (delta < (1ULL << (TIMER_WHEEL_BITS * (i+1))))
+         break;
+
+   /* Far timers are parked in the last level and cascaded again */
+   if (i == (TIMER_WHEEL_LEVELS-1) &&
+       (delta >= (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))))
+      expire = queue->wheel_time +
+         (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+
+   shift = TIMER_WHEEL_BITS * i;
+   *level = i;
+   return(&queue->wheel[i][(expire >> shift) & TIMER_WHEEL_MASK]);
+}
+
+/* Insert a timer in the wheel of a queue */
+static inline void timer_wheel_insert(timer_queue_t *queue,
                                       timer_entry_t *timer)
 {
-   timer_entry_t *t,*prev = NULL;
+   timer_entry_t **bucket;
 
-   /* Insert after the last timer with the same or earlier time */
-   for(t=queue->list;t;t=t->next) {
-      if (t->expire > timer->expire) break;
-      prev = t;
-   }
+   bucket = timer_wheel_bucket(queue,timer->expire,&timer->wheel_level);
 
-   /* Add it in linked list */
-   timer->next = t;
-   timer->prev = prev;
-   timer->queue = queue;
+   timer->prev = NULL;
+   timer->next = *bucket;
+   timer->bucket = bucket;
 
    if (timer->next)
       timer->next->prev = timer;
 
+   *bucket = timer;
+   queue->wheel_count[timer->wheel_level]++;
+}
+
+/* Remove a timer from the wheel of a queue */
+static inline void timer_wheel_remove(timer_queue_t *queue,
+                                      timer_entry_t *timer)
+{
    if (timer->prev)
-      timer->prev->next = timer;
+      timer->prev->next = timer->next;
    else
-      queue->list = timer;
+      *timer->bucket = timer->next;
+
+   if (timer->next)
+      timer->next->prev = timer->prev;
+
+   timer->next = timer->prev = NULL;
+   timer->bucket = NULL;
+   queue->wheel_count[timer->wheel_level]--;
+}
+
+/* Add a timer in a queue */
+static inline void timer_add_to_queue(timer_queue_t *queue,
+                                      timer_entry_t *timer)
+{
+   timer->queue = queue;
+   timer_wheel_insert(queue,timer);
 
    /* Increment number of timers in queue */
    queue->timer_count++;
@@ -137,15 +183,11 @@ _Unused static inline void timer_add_to_queue_atomic(timer_queue_t *queue,
 static inline void timer_remove_from_queue(timer_queue_t *queue,
                                            timer_entry_t *timer)
 {
-   if (timer->prev)
-      timer->prev->next = timer->next;
-   else
-      queue->list = timer->next;
+   /* Not queued (running, or not rescheduled by its callback) */
+   if (!timer->bucket)
+      return;
 
-   if (timer->next)
-      timer->next->prev = timer->prev;
-
-   timer->next = timer->prev = NULL;
+   timer_wheel_remove(queue,timer);
 
    /* Decrement number of timers in queue */
    queue->timer_count--;
@@ -223,12 +265,118 @@ static int timer_schedule(timer_entry_t *timer)
    return(0);
 }
 
+/* Move the timers of a wheel slot to lower levels */
+static void timer_wheel_cascade(timer_queue_t *queue,int level)
+{
+   timer_entry_t *timer,*next;
+   u_int slot;
+
+   slot = (queue->wheel_time >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+   timer = queue->wheel[level][slot];
+   queue->wheel[level][slot] = NULL;
+
+   for(;timer;timer=next) {
+      next = timer->next;
+      queue->wheel_count[level]--;
+      timer_wheel_insert(queue,timer);
+   }
+}
+
+/* 
+ * Advance the wheel up to the specified date. Expired timers are removed
+ * from the queue and returned as a list, so they are run in a batch.
+ */
+static timer_entry_t *timer_wheel_advance(timer_queue_t *queue,
+                                          m_tmcnt_t c_time)
+{
+   timer_entry_t *expired = NULL,*timer,*next;
+   m_tmcnt_t t,mask;
+   u_int slot;
+   int i;
+
+   while(queue->wheel_time < c_time) {
+      /* Skip ticks while the lowest levels are empty */
+      for(i=0;(i<TIMER_WHEEL_LEVELS) && !queue->wheel_count[i];i++);
+
+      if (i == TIMER_WHEEL_LEVELS) {
+         queue->wheel_time = c_time;
+         break;
+      }
+
+      if (i > 0) {
+         mask = (1ULL << (TIMER_WHEEL_BITS * i)) - 1;
+         t = (queue->wheel_time | mask) + 1;
+         
+         if (t > c_time) {
+            queue->wheel_time = c_time;
+            break;
+         }
+      } else {
+         t = queue->wheel_time + 1;
+      }
+
+      queue->wheel_time = t;
+
+      /* Cascade higher levels at their boundaries (highest first) */
+      for(i=TIMER_WHEEL_LEVELS-1;i>0;i--) {
+         mask = (1ULL << (TIMER_WHEEL_BITS * i)) - 1;
+
+         if (!(t & mask))
+            timer_wheel_cascade(queue,i);
+      }
+
+      /* Collect expired timers of the current slot */
+      slot = t & TIMER_WHEEL_MASK;
+
+      for(timer=queue->wheel[0][slot];timer;timer=next) {
+         next = timer->next;
+         timer_remove_from_queue(queue,timer);
+         timer->next = expired;
+         expired = timer;
+      }
+   }
+
+   return(expired);
+}
+
+/* Get the next date at which the wheel must be advanced */
+static int timer_wheel_next_expire(timer_queue_t *queue,m_tmcnt_t *expire)
+{
+   m_tmcnt_t t,mask;
+   int i,found = FALSE;
+
+   if (queue->wheel_count[0]) {
+      for(t=queue->wheel_time+1;;t++)
+         if (queue->wheel[0][t & TIMER_WHEEL_MASK] != NULL)
+            break;
+
+      *expire = t;
+      found = TRUE;
+   }
+
+   /* next cascade of the lowest non-empty level */
+   for(i=1;i<TIMER_WHEEL_LEVELS;i++) {
+      if (queue->wheel_count[i]) {
+         mask = (1ULL << (TIMER_WHEEL_BITS * i)) - 1;
+         t = (queue->wheel_time | mask) + 1;
+
+         if (!found || (t < *expire))
+            *expire = t;
+
+         found = TRUE;
+         break;
+      }
+   }
+
+   return(found);
+}
+
 /* Timer loop */
 static void *timer_loop(timer_queue_t *queue)
 {
    struct timespec t_spc;
-   timer_entry_t *timer;
-   m_tmcnt_t c_time;
+   timer_entry_t *timer,*next;
+   m_tmcnt_t expire = 0;
 
    /* Set signal properties */
    m_signal_block(SIGINT);
@@ -246,16 +394,13 @@ static void *timer_loop(timer_queue_t *queue)
          break;
       }
 
-      /* Get first event */
-      timer = queue->list;
-
       /* 
        * If we have timers in queue, we setup a timer to wait for first one.
        * In all cases, thread is woken up when a reschedule occurs.
        */
-      if (timer) {
-         t_spc.tv_sec = timer->expire / 1000;
-         t_spc.tv_nsec = (timer->expire % 1000) * 1000000;
+      if (timer_wheel_next_expire(queue,&expire)) {
+         t_spc.tv_sec = expire / 1000;
+         t_spc.tv_nsec = (expire % 1000) * 1000000;
          pthread_cond_timedwait(&queue->schedule,&queue->lock,&t_spc);
       }
       else {
@@ -270,32 +415,19 @@ static void *timer_loop(timer_queue_t *queue)
       }
 
       /* 
-       * Now, we need to find why we were woken up. So, we compare current
-       * time with first timer to see if we must execute action associated
-       * with it.
+       * Now, we need to find why we were woken up: advance the wheel up
+       * to the current time and run all the expired timers.
        */
-      c_time = m_gettime();
-
-      /* Get first event */
-      timer = queue->list;
-
-      /* If there is nothing to do for now, wait again */
-      if ((timer == NULL) || (timer->expire > c_time)) {
-         TIMERQ_UNLOCK(queue);
-         continue;
+      for(timer=timer_wheel_advance(queue,m_gettime());timer;timer=next) {
+         next = timer->next;
+         timer->next = NULL;
+         timer->flags |= TIMER_RUNNING;
+
+         /* Execute user function and reschedule timer if required */
+         if (timer_exec(timer))
+            timer_schedule_in_queue(queue,timer);
       }
 
-      /* 
-       * We have a timer to manage. Remove it from queue and mark it as
-       * running.
-       */
-      timer_remove_from_queue(queue,timer);
-      timer->flags |= TIMER_RUNNING;
-      
-      /* Execute user function and reschedule timer if required */
-      if (timer_exec(timer))
-         timer_schedule_in_queue(queue,timer);
-
       TIMERQ_UNLOCK(queue);
    }
 
@@ -452,9 +584,9 @@ timer_queue_t *timer_create_queue(void)
    if (!(queue = malloc(sizeof(*queue))))
       return NULL;
 
+   memset(queue,0,sizeof(*queue));
    queue->running = TRUE;
-   queue->list = NULL;
-   queue->level = 0;
+   queue->wheel_time = m_gettime();
 
    /* Create mutex */
    if (pthread_mutex_init(&queue->lock,NULL))
@@ -485,6 +617,7 @@ void timer_flush_queues(void)
    timer_entry_t *timer,*next_timer;
    timer_queue_t *queue,*next_queue;
    pthread_t thread;
+   int i,j;
 
    TIMER_LOCK();
 
@@ -498,10 +631,14 @@ void timer_flush_queues(void)
       queue->running = FALSE;
 
       /* suppress all timers */
-      for(timer=queue->list;timer;timer=next_timer) {
-         next_timer = timer->next;
-         timer_free_id(timer->id);
-         free(timer);
+      for(i=0;i<TIMER_WHEEL_LEVELS;i++) {
+         for(j=0;j<TIMER_WHEEL_SIZE;j++) {
+            for(timer=queue->wheel[i][j];timer;timer=next_timer) {
+               next_timer = timer->next;
+               timer_free_id(timer->id);
+               free(timer);
+            }
+         }
       }
 
       /* signal changes to the queue thread */
@@ -32,6 +32,12 @@ typedef int (*timer_proc)(void *,timer_entry_t *);
 /* Number of entries in hash table */
 #define TIMER_HASH_SIZE  512
 
+/* Hierarchical timing wheel: 4 levels of 64 slots (1 ms to ~4.6 hours) */
+#define TIMER_WHEEL_BITS    6
+#define TIMER_WHEEL_SIZE    (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK    (TIMER_WHEEL_SIZE - 1)
+#define TIMER_WHEEL_LEVELS  4
+
 /* Timer properties */
 struct timer_entry {
    long interval;                   /* Interval in msecs */
@@ -44,11 +50,15 @@ struct timer_entry {
 
    timer_queue_t *queue;            /* Associated Timer Queue */
    timer_entry_t *prev,*next;       /* Double linked-list */
+   timer_entry_t **bucket;          /* Wheel slot (NULL if not queued) */
+   int wheel_level;                 /* Wheel level */
 };
 
 /* Timer Queue */
 struct timer_queue {
-   timer_entry_t * volatile list;   /* List of timers */
+   timer_entry_t *wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+   int wheel_count[TIMER_WHEEL_LEVELS];  /* Timers per wheel level */
+   m_tmcnt_t wheel_time;            /* Time up to which timers were run */
    pthread_mutex_t lock;            /* Mutex for concurrent accesses */
    pthread_cond_t schedule;         /* Scheduling condition */
    pthread_t thread;                /* Thread running timer loop */
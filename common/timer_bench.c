@@ -0,0 +1,338 @@
+/*
+ * Cisco router simulation platform.
+ * Copyright (c) 2005,2006 Christophe Fillot (cf@utc.fr)
+ *
+ * timer_bench.c: compare the timing wheel of timer queues with the sorted
+ * list they used before.
+ *
+ * For each number of timers, timers with random intervals are created,
+ * then cancelled in random order. The wheel is measured through the
+ * timer API (timer_create_entry/timer_remove). The sorted lists are a
+ * copy of the former queue code: the same number of queues, each with
+ * its thread, ID hash table and locks, so that only the queue data
+ * structure differs.
+ *
+ * Usage: timer_bench [nr_timers...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "utils.h"
+#include "hash.h"
+#include "timer.h"
+
+/* Log file (used by utils.c) */
+FILE *log_file = NULL;
+
+/* Default numbers of timers */
+static int bench_default_sizes[] = { 100, 1000, 10000, 50000, 0 };
+
+/* Timer intervals: 1 ms to 10 minutes */
+#define BENCH_MAX_INTERVAL  600000
+
+/* Sorted list queue (former timer queue implementation) */
+struct list_queue {
+   timer_entry_t *list;
+   pthread_mutex_t lock;
+   pthread_cond_t schedule;
+   pthread_t thread;
+   int volatile running;
+   int timer_count;
+   int level;
+};
+
+/* Sorted list queues and timer IDs */
+static struct list_queue list_queues[TIMERQ_NUMBER];
+static pthread_mutex_t list_id_lock = PTHREAD_MUTEX_INITIALIZER;
+static hash_table_t *list_id_hash;
+static timer_id list_next_id = 1;
+static u_int list_next_queue = 0;
+
+/* Callback of benchmark timers */
+static int bench_timer_cbk(void *arg,timer_entry_t *timer)
+{
+   return(TRUE);
+}
+
+/* Add a timer in a sorted list queue */
+static void list_add_to_queue(struct list_queue *queue,timer_entry_t *timer)
+{
+   timer_entry_t *t,*prev = NULL;
+
+   /* Insert after the last timer with the same or earlier time */
+   for(t=queue->list;t;t=t->next) {
+      if (t->expire > timer->expire) break;
+      prev = t;
+   }
+
+   timer->next = t;
+   timer->prev = prev;
+
+   if (timer->next)
+      timer->next->prev = timer;
+
+   if (timer->prev)
+      timer->prev->next = timer;
+   else
+      queue->list = timer;
+
+   queue->timer_count++;
+   queue->level += timer->level;
+}
+
+/* Remove a timer from a sorted list queue */
+static void list_remove_from_queue(struct list_queue *queue,
+                                   timer_entry_t *timer)
+{
+   if (timer->prev)
+      timer->prev->next = timer->next;
+   else
+      queue->list = timer->next;
+
+   if (timer->next)
+      timer->next->prev = timer->prev;
+
+   timer->next = timer->prev = NULL;
+   queue->timer_count--;
+   queue->level -= timer->level;
+}
+
+/* Thread of a sorted list queue (former timer loop) */
+static void *list_loop(struct list_queue *queue)
+{
+   struct timespec t_spc;
+   timer_entry_t *timer;
+
+   pthread_mutex_lock(&queue->lock);
+
+   while(queue->running) {
+      if ((timer = queue->list) != NULL) {
+         t_spc.tv_sec = timer->expire / 1000;
+         t_spc.tv_nsec = (timer->expire % 1000) * 1000000;
+         pthread_cond_timedwait(&queue->schedule,&queue->lock,&t_spc);
+      } else {
+         pthread_cond_wait(&queue->schedule,&queue->lock);
+      }
+
+      timer = queue->list;
+
+      if (!timer || (timer->expire > m_gettime()))
+         continue;
+
+      list_remove_from_queue(queue,timer);
+
+      if (timer->callback(timer->user_arg,timer)) {
+         timer->expire += timer->interval;
+         list_add_to_queue(queue,timer);
+      }
+   }
+
+   pthread_mutex_unlock(&queue->lock);
+   return NULL;
+}
+
+/* Start the sorted list queues */
+static int list_init(void)
+{
+   struct list_queue *queue;
+   int i;
+
+   if (!(list_id_hash = hash_u64_create(TIMER_HASH_SIZE)))
+      return(-1);
+
+   for(i=0;i<TIMERQ_NUMBER;i++) {
+      queue = &list_queues[i];
+      memset(queue,0,sizeof(*queue));
+      pthread_mutex_init(&queue->lock,NULL);
+      pthread_cond_init(&queue->schedule,NULL);
+      queue->running = TRUE;
+
+      if (pthread_create(&queue->thread,NULL,
+                         (void *(*)(void *))list_loop,queue) != 0)
+         return(-1);
+   }
+
+   return(0);
+}
+
+/* Create a timer in a sorted list queue */
+static timer_id list_create_entry(m_tmcnt_t interval,int level,
+                                  timer_proc callback)
+{
+   struct list_queue *queue;
+   timer_entry_t *timer;
+
+   if (!(timer = malloc(sizeof(*timer))))
+      return(0);
+
+   memset(timer,0,sizeof(*timer));
+   timer->interval = interval;
+   timer->callback = callback;
+   timer->level = level;
+   timer->expire = m_gettime() + interval;
+
+   pthread_mutex_lock(&list_id_lock);
+
+   while(hash_table_lookup(list_id_hash,&list_next_id))
+      list_next_id++;
+
+   timer->id = list_next_id++;
+
+   if (hash_table_insert(list_id_hash,&timer->id,timer) == -1) {
+      pthread_mutex_unlock(&list_id_lock);
+      free(timer);
+      return(0);
+   }
+
+   /* Queues have the same level: use them in turn */
+   queue = &list_queues[list_next_queue++ % TIMERQ_NUMBER];
+   timer->user_arg = queue;
+
+   pthread_mutex_lock(&queue->lock);
+   list_add_to_queue(queue,timer);
+   pthread_mutex_unlock(&queue->lock);
+   pthread_mutex_unlock(&list_id_lock);
+
+   pthread_cond_signal(&queue->schedule);
+   return(timer->id);
+}
+
+/* Remove a timer from a sorted list queue */
+static int list_remove(timer_id id)
+{
+   struct list_queue *queue;
+   timer_entry_t *timer;
+
+   pthread_mutex_lock(&list_id_lock);
+
+   if (!(timer = hash_table_lookup(list_id_hash,&id))) {
+      pthread_mutex_unlock(&list_id_lock);
+      return(-1);
+   }
+
+   queue = timer->user_arg;
+   pthread_mutex_lock(&queue->lock);
+   list_remove_from_queue(queue,timer);
+   pthread_mutex_unlock(&queue->lock);
+
+   hash_table_remove(list_id_hash,&id);
+   free(timer);
+   pthread_mutex_unlock(&list_id_lock);
+
+   pthread_cond_signal(&queue->schedule);
+   return(0);
+}
+
+/* Shuffle timer IDs (cancellation order) */
+static void bench_shuffle(timer_id *ids,int count)
+{
+   timer_id tmp;
+   int i,j;
+
+   for(i=count-1;i>0;i--) {
+      j = rand() % (i + 1);
+      tmp = ids[i];
+      ids[i] = ids[j];
+      ids[j] = tmp;
+   }
+}
+
+/* Run the benchmark for a number of timers */
+static int bench_run(int count)
+{
+   m_tmcnt_t *intervals;
+   m_tmcnt_t t0,t1,t2;
+   double wheel_add,wheel_del,list_add,list_del;
+   timer_id *ids;
+   int i;
+
+   intervals = malloc(count * sizeof(*intervals));
+   ids = malloc(count * sizeof(*ids));
+
+   if (!intervals || !ids) {
+      fprintf(stderr,"timer_bench: out of memory.\n");
+      free(intervals);
+      free(ids);
+      return(-1);
+   }
+
+   for(i=0;i<count;i++)
+      intervals[i] = 1 + (rand() % BENCH_MAX_INTERVAL);
+
+   /* Timing wheel */
+   t0 = m_gettime_usec();
+
+   for(i=0;i<count;i++)
+      ids[i] = timer_create_entry(intervals[i],FALSE,1,bench_timer_cbk,NULL);
+
+   t1 = m_gettime_usec();
+   bench_shuffle(ids,count);
+
+   for(i=0;i<count;i++)
+      timer_remove(ids[i]);
+
+   t2 = m_gettime_usec();
+   wheel_add = (double)(t1 - t0) / count;
+   wheel_del = (double)(t2 - t1) / count;
+
+   /* Sorted lists */
+   t0 = m_gettime_usec();
+
+   for(i=0;i<count;i++)
+      ids[i] = list_create_entry(intervals[i],1,bench_timer_cbk);
+
+   t1 = m_gettime_usec();
+   bench_shuffle(ids,count);
+
+   for(i=0;i<count;i++)
+      list_remove(ids[i]);
+
+   t2 = m_gettime_usec();
+   list_add = (double)(t1 - t0) / count;
+   list_del = (double)(t2 - t1) / count;
+
+   printf("%8d  %10.3f %10.3f  %10.3f %10.3f\n",
+          count,wheel_add,wheel_del,list_add,list_del);
+
+   free(intervals);
+   free(ids);
+   return(0);
+}
+
+int main(int argc,char *argv[])
+{
+   int i,count;
+
+   if ((timer_init() == -1) || (list_init() == -1)) {
+      fprintf(stderr,"timer_bench: unable to initialize timers.\n");
+      return(EXIT_FAILURE);
+   }
+
+   srand(1);
+
+   printf("                  wheel (us/timer)       list (us/timer)\n");
+   printf("  timers      create     cancel      create     cancel\n");
+
+   if (argc > 1) {
+      for(i=1;i<argc;i++) {
+         if ((count = atoi(argv[i])) <= 0) {
+            fprintf(stderr,"timer_bench: invalid number of timers '%s'.\n",
+                    argv[i]);
+            return(EXIT_FAILURE);
+         }
+
+         if (bench_run(count) == -1)
+            return(EXIT_FAILURE);
+      }
+   } else {
+      for(i=0;bench_default_sizes[i];i++)
+         if (bench_run(bench_default_sizes[i]) == -1)
+            return(EXIT_FAILURE);
+   }
+
+   return(EXIT_SUCCESS);
+}
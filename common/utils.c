@@ -423,6 +423,16 @@ int memzone_unmap(void *addr, size_t len)
    return(munmap(addr, len));
 }
 
+/* Discard the content of a memory zone and give its memory back */
+int memzone_discard(void *addr, size_t len)
+{
+#ifdef MADV_DONTNEED
+   return(madvise(addr, len, MADV_DONTNEED));
+#else
+   return(0);
+#endif
+}
+
 /* Return a memory zone or NULL on error */
 static void *mmap_or_null(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
 {
@@ -434,6 +444,101 @@ static void *mmap_or_null(void *addr, size_t length, int prot, int flags, int fd
    return(ptr);
 }
 
+/*
+ * Check that the kernel may give transparent huge pages to a memory zone.
+ *
+ * The sysfs file holds the list of modes, the current one in brackets.
+ * Anything but "never" and "deny" lets an advised zone get huge pages.
+ */
+static int memzone_thp_enabled(int shared)
+{
+   char buffer[256],*mode;
+   FILE *fd;
+   size_t n;
+
+   fd = fopen(shared ?
+              "/sys/kernel/mm/transparent_hugepage/shmem_enabled" :
+              "/sys/kernel/mm/transparent_hugepage/enabled","r");
+
+   if (!fd)
+      return(FALSE);
+
+   n = fread(buffer,1,sizeof(buffer)-1,fd);
+   buffer[n] = 0;
+   fclose(fd);
+
+   if (!(mode = strchr(buffer,'[')))
+      return(FALSE);
+
+   return(strncmp(mode,"[never]",7) && strncmp(mode,"[deny]",6));
+}
+
+/*
+ * Advise the kernel to back an anonymous memory zone with transparent huge
+ * pages ("shared" is set for MAP_SHARED zones, which are shmem).
+ *
+ * Success only means the zone is eligible: the huge pages themselves are
+ * allocated later, when the kernel finds some.
+ */
+int memzone_advise_hugepages(void *addr,size_t len,int shared)
+{
+#ifdef MADV_HUGEPAGE
+   if (memzone_thp_enabled(shared) &&
+       (madvise(addr,len,MADV_HUGEPAGE) == 0))
+      return(0);
+#endif
+   return(-1);
+}
+
+/*
+ * Map an anonymous memory zone, backed by huge pages if possible.
+ *
+ * hugetlbfs pages are tried first (they must have been reserved by the
+ * administrator), then transparent huge pages. The zone is released
+ * with memzone_unmap().
+ */
+u_char *memzone_map_huge(size_t len,int *backing)
+{
+   u_char *ptr;
+
+#ifdef MAP_HUGETLB
+   if (!(len & (MEMZONE_HUGE_PAGE_SIZE - 1))) {
+      ptr = mmap_or_null(NULL,len,PROT_READ|PROT_WRITE,
+                         MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB,-1,(off_t)0);
+
+      if (ptr != NULL) {
+         *backing = MEMZONE_BACKING_HUGETLB;
+         return ptr;
+      }
+   }
+#endif
+
+   ptr = mmap_or_null(NULL,len,PROT_READ|PROT_WRITE,
+                      MAP_PRIVATE|MAP_ANONYMOUS,-1,(off_t)0);
+
+   if (ptr != NULL) {
+      if (memzone_advise_hugepages(ptr,len,FALSE) == 0)
+         *backing = MEMZONE_BACKING_THP;
+      else
+         *backing = MEMZONE_BACKING_STD;
+   }
+
+   return ptr;
+}
+
+/* Get the name of a memory zone backing */
+char *memzone_get_backing_str(int backing)
+{
+   switch(backing) {
+      case MEMZONE_BACKING_THP:
+         return "standard pages, transparent huge pages advised";
+      case MEMZONE_BACKING_HUGETLB:
+         return "hugetlbfs pages";
+      default:
+         return "standard pages";
+   }
+}
+
 /* Map a memory zone as an executable area */
 u_char *memzone_map_exec_area(size_t len)
 {
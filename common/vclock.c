@@ -0,0 +1,305 @@
+/*
+ * Cisco router simulation platform.
+ * Copyright (c) 2005,2006 Christophe Fillot (cf@utc.fr)
+ *
+ * vclock.c: Shared virtual clock service (CPU timer interrupts).
+ *
+ * CPUs do not have a timer thread anymore: the number of timer ticks
+ * is computed on demand from a monotonic clock when the CPU loop checks
+ * for a timer IRQ, so ticks are never lost when the host is loaded.
+ * A single thread (timerfd/epoll) keeps a shared copy of the clock,
+ * which makes the check a simple memory read. Its timer is only armed
+ * while CPUs are registered, and the thread is the only one to update
+ * the shared clock (0 when the timer is disarmed).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#define VCLOCK_USE_TIMERFD  1
+#else
+#define VCLOCK_USE_TIMERFD  0
+#endif
+
+#include "utils.h"
+#include "vclock.h"
+
+/* Time maintained by the clock service (0 if the service is not running) */
+static volatile m_tmcnt_t vclock_now = 0;
+
+/* Number of timer expirations missed by the clock service */
+static volatile m_uint64_t vclock_overruns = 0;
+
+/* Get the host monotonic time (nanoseconds) */
+static m_tmcnt_t vclock_host_time(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC,&ts);
+   return(((m_tmcnt_t)ts.tv_sec * 1000000000) + (m_tmcnt_t)ts.tv_nsec);
+}
+
+/* Get the current time of the clock service (nanoseconds) */
+m_tmcnt_t vclock_gettime(void)
+{
+   m_tmcnt_t now = vclock_now;
+
+   return(now ? now : vclock_host_time());
+}
+
+/* Start a virtual clock (also used to resynchronize it after a pause) */
+void vclock_start(vclock_t *vc,u_int freq)
+{
+   vc->period = 1000000000 / (freq ? freq : 1);
+   vc->next_tick = vclock_gettime() + vc->period;
+}
+
+/* Get the number of ticks elapsed since the last call */
+u_int vclock_ticks(vclock_t *vc)
+{
+   m_tmcnt_t now,late;
+   u_int ticks;
+
+   now = vclock_gettime();
+
+   if (now < vc->next_tick)
+      return(0);
+
+   late  = now - vc->next_tick;
+   ticks = (late / vc->period) + 1;
+
+   if (late > vc->late_max)
+      vc->late_max = late;
+
+   vc->next_tick += (m_tmcnt_t)ticks * vc->period;
+   vc->tick_count += ticks;
+   return(ticks);
+}
+
+/* Get the time until the next tick (nanoseconds, 0 if it is due) */
+m_tmcnt_t vclock_next_delay(vclock_t *vc)
+{
+   m_tmcnt_t now = vclock_gettime();
+
+   return((now < vc->next_tick) ? vc->next_tick - now : 0);
+}
+
+/* Get the number of timer expirations missed by the clock service */
+m_uint64_t vclock_get_overruns(void)
+{
+   return(vclock_overruns);
+}
+
+#if VCLOCK_USE_TIMERFD
+static pthread_t vclock_thread;
+static int vclock_timer_fd = -1;
+static int vclock_wake_fd = -1;
+static int vclock_poll_fd = -1;
+
+/* Registered CPUs, and timer state (only changed by the thread) */
+static pthread_mutex_t vclock_lock = PTHREAD_MUTEX_INITIALIZER;
+static u_int vclock_users = 0;
+static int vclock_armed = FALSE;
+static volatile int vclock_stop = FALSE;
+
+/* Wake up the clock service thread */
+static void vclock_kick(void)
+{
+   m_uint64_t val = 1;
+
+   if (vclock_wake_fd != -1)
+      (void)write(vclock_wake_fd,&val,sizeof(val));
+}
+
+/* Register a CPU using the clock service (its timer runs while used) */
+void vclock_register(void)
+{
+   pthread_mutex_lock(&vclock_lock);
+   if (vclock_users++ == 0)
+      vclock_kick();
+   pthread_mutex_unlock(&vclock_lock);
+}
+
+/* Unregister a CPU using the clock service */
+void vclock_unregister(void)
+{
+   pthread_mutex_lock(&vclock_lock);
+   if (--vclock_users == 0)
+      vclock_kick();
+   pthread_mutex_unlock(&vclock_lock);
+}
+
+/* Arm the timer if CPUs are registered, disarm it otherwise */
+static void vclock_update_timer(void)
+{
+   struct itimerspec its;
+   int armed;
+
+   pthread_mutex_lock(&vclock_lock);
+   armed = (vclock_users > 0);
+
+   if (armed != vclock_armed) {
+      memset(&its,0,sizeof(its));
+
+      if (armed) {
+         its.it_interval.tv_nsec = VCLOCK_RESOLUTION * 1000;
+         its.it_value = its.it_interval;
+      }
+
+      if (timerfd_settime(vclock_timer_fd,0,&its,NULL) == -1)
+         perror("vclock_update_timer: timerfd_settime");
+      else
+         vclock_armed = armed;
+   }
+
+   pthread_mutex_unlock(&vclock_lock);
+}
+
+/* Clock service thread */
+static void *vclock_thread_run(void *arg)
+{
+   struct epoll_event ev[2];
+   m_uint64_t count;
+   int i,res;
+
+   vclock_update_timer();
+   vclock_now = vclock_armed ? vclock_host_time() : 0;
+
+   for(;;) {
+      res = epoll_wait(vclock_poll_fd,ev,2,-1);
+
+      if (res == -1) {
+         if (errno == EINTR)
+            continue;
+
+         perror("vclock_thread_run: epoll_wait");
+         break;
+      }
+
+      for(i=0;i<res;i++) {
+         /* Shutdown request, or CPUs registered/unregistered */
+         if (ev[i].data.fd == vclock_wake_fd) {
+            if (vclock_stop)
+               goto done;
+
+            (void)read(vclock_wake_fd,&count,sizeof(count));
+            vclock_update_timer();
+            continue;
+         }
+
+         if (read(vclock_timer_fd,&count,sizeof(count)) == sizeof(count)) {
+            if (count > 1)
+               vclock_overruns += count - 1;
+         }
+      }
+
+      /* CPUs read the host clock directly while the timer is disarmed */
+      vclock_now = vclock_armed ? vclock_host_time() : 0;
+   }
+
+ done:
+   /* CPUs read the host clock directly from now on */
+   vclock_now = 0;
+   return NULL;
+}
+
+/* Close the file descriptors of the clock service */
+static void vclock_close_fds(void)
+{
+   if (vclock_timer_fd != -1) close(vclock_timer_fd);
+   if (vclock_wake_fd != -1)  close(vclock_wake_fd);
+   if (vclock_poll_fd != -1)  close(vclock_poll_fd);
+
+   vclock_timer_fd = vclock_wake_fd = vclock_poll_fd = -1;
+}
+
+/* Stop the clock service */
+static void vclock_shutdown(void)
+{
+   m_uint64_t val = 1;
+
+   vclock_stop = TRUE;
+
+   if (write(vclock_wake_fd,&val,sizeof(val)) == sizeof(val))
+      pthread_join(vclock_thread,NULL);
+
+   vclock_close_fds();
+}
+
+/* Initialize the clock service */
+int vclock_init(void)
+{
+   struct epoll_event ev;
+
+   if ((vclock_timer_fd = timerfd_create(CLOCK_MONOTONIC,TFD_NONBLOCK)) == -1)
+   {
+      perror("vclock_init: timerfd_create");
+      goto err;
+   }
+
+   if ((vclock_wake_fd = eventfd(0,0)) == -1) {
+      perror("vclock_init: eventfd");
+      goto err;
+   }
+
+   if ((vclock_poll_fd = epoll_create(2)) == -1) {
+      perror("vclock_init: epoll_create");
+      goto err;
+   }
+
+   memset(&ev,0,sizeof(ev));
+   ev.events = EPOLLIN;
+   ev.data.fd = vclock_timer_fd;
+
+   if (epoll_ctl(vclock_poll_fd,EPOLL_CTL_ADD,vclock_timer_fd,&ev) == -1) {
+      perror("vclock_init: epoll_ctl");
+      goto err;
+   }
+
+   ev.data.fd = vclock_wake_fd;
+
+   if (epoll_ctl(vclock_poll_fd,EPOLL_CTL_ADD,vclock_wake_fd,&ev) == -1) {
+      perror("vclock_init: epoll_ctl");
+      goto err;
+   }
+
+   /* The timer is armed by the thread when CPUs are registered */
+   if (pthread_create(&vclock_thread,NULL,vclock_thread_run,NULL) != 0) {
+      fprintf(stderr,"vclock_init: unable to create thread\n");
+      goto err;
+   }
+
+   atexit(vclock_shutdown);
+   return(0);
+
+ err:
+   /* Not fatal: the host clock is read directly */
+   vclock_close_fds();
+   return(-1);
+}
+#else
+/* Register a CPU using the clock service (nothing to do) */
+void vclock_register(void)
+{
+}
+
+/* Unregister a CPU using the clock service (nothing to do) */
+void vclock_unregister(void)
+{
+}
+
+/* Initialize the clock service (the host clock is read directly) */
+int vclock_init(void)
+{
+   return(0);
+}
+#endif
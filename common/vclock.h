@@ -0,0 +1,52 @@
+/*
+ * Cisco router simulation platform.
+ * Copyright (c) 2005,2006 Christophe Fillot (cf@utc.fr)
+ *
+ * vclock.h: Shared virtual clock service (CPU timer interrupts).
+ */
+
+#ifndef __VCLOCK_H__
+#define __VCLOCK_H__  1
+
+#include <sys/types.h>
+#include "utils.h"
+
+/* Resolution of the clock service (microseconds) */
+#define VCLOCK_RESOLUTION  500
+
+/* Virtual clock: periodic tick source of a CPU timer */
+typedef struct vclock vclock_t;
+struct vclock {
+   /* Tick period and monotonic time of the next tick (nanoseconds) */
+   m_tmcnt_t period,next_tick;
+
+   /* Statistics: ticks generated, ticks dropped, worst tick latency (ns) */
+   m_uint64_t tick_count,drop_count;
+   m_tmcnt_t late_max;
+};
+
+/* Get the current time of the clock service (nanoseconds) */
+m_tmcnt_t vclock_gettime(void);
+
+/* Start a virtual clock (also used to resynchronize it after a pause) */
+void vclock_start(vclock_t *vc,u_int freq);
+
+/* Get the number of ticks elapsed since the last call */
+u_int vclock_ticks(vclock_t *vc);
+
+/* Get the time until the next tick (nanoseconds, 0 if it is due) */
+m_tmcnt_t vclock_next_delay(vclock_t *vc);
+
+/* Get the number of timer expirations missed by the clock service */
+m_uint64_t vclock_get_overruns(void);
+
+/* Register a CPU using the clock service (its timer runs while used) */
+void vclock_register(void);
+
+/* Unregister a CPU using the clock service */
+void vclock_unregister(void);
+
+/* Initialize the clock service */
+int vclock_init(void);
+
+#endif
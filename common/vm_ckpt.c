@@ -0,0 +1,973 @@
+/*
+ * Cisco router simulation platform.
+ * Copyright (c) 2005,2006 Christophe Fillot (cf@utc.fr)
+ *
+ * VM checkpoints: save/restore of CPU, devices and RAM.
+ *
+ * A checkpoint is a header followed by a sequence of chunks: type, name
+ * and data. CPU chunks hold the architectural state of a CPU, PCI chunks
+ * the configuration registers of a PCI device, and DEV chunks the state
+ * of a device which provides a checkpoint handler. RAM chunks list the
+ * pages of a RAM device which differ from its base content (zero pages or
+ * ghost image).
+ *
+ * Fields are stored in host byte order: checkpoints can only be restored
+ * on the same host architecture, in an instance with the same
+ * configuration (platform, RAM size, cards) which has been started.
+ *
+ * Only platforms which save the state of their board devices (system
+ * controller, FPGAs) provide a ckpt_check handler, which also refuses
+ * the cards whose state is not saved. Other VMs can't be checkpointed.
+ *
+ * Checkpoints are compressed with zlib when available.
+ *
+ * A checkpoint is read twice on restore: it is first checked completely,
+ * so that a truncated or corrupted file leaves the VM unchanged.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cpu.h"
+#include "vm.h"
+#include "device.h"
+#include "pci_dev.h"
+#include "page_merge.h"
+#include "ram_snap.h"
+#include "vm_ckpt.h"
+
+/* Open a checkpoint file */
+static int vm_ckpt_open(vm_ckpt_t *ckpt,char *filename)
+{
+#if HAS_ZLIB
+   ckpt->fd = gzopen(filename,(ckpt->restore) ? "rb" : "wb1");
+#else
+   ckpt->fd = fopen(filename,(ckpt->restore) ? "rb" : "wb");
+#endif
+   return((ckpt->fd != NULL) ? 0 : -1);
+}
+
+/* Close a checkpoint file */
+static int vm_ckpt_close(vm_ckpt_t *ckpt)
+{
+   int res;
+
+#if HAS_ZLIB
+   res = (gzclose(ckpt->fd) == Z_OK) ? 0 : -1;
+#else
+   res = fclose(ckpt->fd);
+#endif
+   ckpt->fd = NULL;
+   return(res);
+}
+
+/* Write data to a checkpoint file */
+static void vm_ckpt_write(vm_ckpt_t *ckpt,void *ptr,size_t len)
+{
+   if (ckpt->error || !len)
+      return;
+
+#if HAS_ZLIB
+   if (gzwrite(ckpt->fd,ptr,len) != (int)len)
+      ckpt->error = TRUE;
+#else
+   if (fwrite(ptr,len,1,ckpt->fd) != 1)
+      ckpt->error = TRUE;
+#endif
+}
+
+/* Read data from a checkpoint file */
+static void vm_ckpt_read(vm_ckpt_t *ckpt,void *ptr,size_t len)
+{
+   if (ckpt->error || !len)
+      return;
+
+#if HAS_ZLIB
+   if (gzread(ckpt->fd,ptr,len) != (int)len)
+      ckpt->error = TRUE;
+#else
+   if (fread(ptr,len,1,ckpt->fd) != 1)
+      ckpt->error = TRUE;
+#endif
+}
+
+/* Save or restore a 32-bit value */
+static void vm_ckpt_io_u32(vm_ckpt_t *ckpt,m_uint32_t *val)
+{
+   if (ckpt->restore)
+      vm_ckpt_read(ckpt,val,sizeof(*val));
+   else
+      vm_ckpt_write(ckpt,val,sizeof(*val));
+}
+
+/* Save or restore a field of the current chunk */
+void vm_ckpt_field(vm_ckpt_t *ckpt,void *ptr,size_t len)
+{
+   u_char *buf;
+   size_t size;
+
+   if (ckpt->error)
+      return;
+
+   if (ckpt->restore) {
+      if ((ckpt->buf_pos + len) > ckpt->buf_len) {
+         ckpt->error = TRUE;
+         return;
+      }
+
+      memcpy(ptr,ckpt->buf + ckpt->buf_pos,len);
+      ckpt->buf_pos += len;
+      return;
+   }
+
+   if ((ckpt->buf_len + len) > ckpt->buf_size) {
+      size = m_max(ckpt->buf_size * 2,ckpt->buf_len + len + 4096);
+
+      if (!(buf = realloc(ckpt->buf,size))) {
+         ckpt->error = TRUE;
+         return;
+      }
+
+      ckpt->buf = buf;
+      ckpt->buf_size = size;
+   }
+
+   memcpy(ckpt->buf + ckpt->buf_len,ptr,len);
+   ckpt->buf_len += len;
+}
+
+/* Write a chunk header, and the data collected for it */
+static void vm_ckpt_write_chunk(vm_ckpt_t *ckpt,m_uint32_t type,char *name)
+{
+   m_uint32_t name_len,data_len;
+
+   name_len = strlen(name);
+   data_len = ckpt->buf_len;
+
+   vm_ckpt_write(ckpt,&type,sizeof(type));
+   vm_ckpt_write(ckpt,&name_len,sizeof(name_len));
+   vm_ckpt_write(ckpt,name,name_len);
+   vm_ckpt_write(ckpt,&data_len,sizeof(data_len));
+   vm_ckpt_write(ckpt,ckpt->buf,data_len);
+   ckpt->buf_len = 0;
+}
+
+/* Read a chunk header. Data is read by the caller */
+static int vm_ckpt_read_chunk(vm_ckpt_t *ckpt,m_uint32_t *type,char *name,
+                              m_uint32_t *data_len)
+{
+   m_uint32_t name_len;
+
+   vm_ckpt_read(ckpt,type,sizeof(*type));
+   vm_ckpt_read(ckpt,&name_len,sizeof(name_len));
+
+   if (ckpt->error || (name_len >= VM_CKPT_NAME_LEN)) {
+      ckpt->error = TRUE;
+      return(-1);
+   }
+
+   vm_ckpt_read(ckpt,name,name_len);
+   name[name_len] = 0;
+
+   vm_ckpt_read(ckpt,data_len,sizeof(*data_len));
+   return(ckpt->error ? -1 : 0);
+}
+
+/* Read the data of a chunk in the chunk buffer */
+static int vm_ckpt_load_chunk(vm_ckpt_t *ckpt,m_uint32_t data_len)
+{
+   u_char *buf;
+
+   if (data_len > ckpt->buf_size) {
+      if (!(buf = realloc(ckpt->buf,data_len))) {
+         ckpt->error = TRUE;
+         return(-1);
+      }
+
+      ckpt->buf = buf;
+      ckpt->buf_size = data_len;
+   }
+
+   vm_ckpt_read(ckpt,ckpt->buf,data_len);
+   ckpt->buf_len = data_len;
+   ckpt->buf_pos = 0;
+   return(ckpt->error ? -1 : 0);
+}
+
+/* Save or restore the architectural state of a CPU */
+static void vm_ckpt_cpu(vm_ckpt_t *ckpt,cpu_gen_t *cpu)
+{
+   switch(cpu->type) {
+      case CPU_TYPE_MIPS64:
+         mips64_ckpt(CPU_MIPS64(cpu),ckpt);
+         break;
+      case CPU_TYPE_PPC32:
+         ppc32_ckpt(CPU_PPC32(cpu),ckpt);
+         break;
+      default:
+         ckpt->error = TRUE;
+   }
+}
+
+/* PCI configuration registers, in restore order (BARs before command) */
+static int vm_ckpt_pci_regs[VM_CKPT_PCI_REG_NR] = {
+   0x10, 0x14, 0x18, 0x1C, 0x20, 0x24, 0x0C, 0x3C, 0x04,
+};
+
+/* Build the chunk name of a PCI device */
+static void vm_ckpt_pci_name(struct pci_device *dev,char *name)
+{
+   snprintf(name,VM_CKPT_NAME_LEN,"%s:%d.%d",
+            dev->pci_bus->name,dev->device,dev->function);
+}
+
+/* Get the PCI busses of a VM, without duplicates */
+static u_int vm_ckpt_get_pci_busses(vm_instance_t *vm,struct pci_bus **list)
+{
+   struct pci_bus *candidates[2+VM_PCI_POOL_SIZE+VM_MAX_SLOTS];
+   u_int i,j,count,nr;
+
+   nr = 0;
+   candidates[nr++] = vm->pci_bus[0];
+   candidates[nr++] = vm->pci_bus[1];
+
+   for(i=0;i<VM_PCI_POOL_SIZE;i++)
+      candidates[nr++] = vm->pci_bus_pool[i];
+
+   for(i=0;i<VM_MAX_SLOTS;i++)
+      candidates[nr++] = vm->slots_pci_bus[i];
+
+   for(i=0,count=0;i<nr;i++) {
+      if (!candidates[i])
+         continue;
+
+      for(j=0;j<count;j++)
+         if (list[j] == candidates[i])
+            break;
+
+      if (j == count)
+         list[count++] = candidates[i];
+   }
+
+   return(count);
+}
+
+/* Save the configuration registers of the PCI devices */
+static void vm_ckpt_save_pci(vm_ckpt_t *ckpt)
+{
+   struct pci_bus *busses[2+VM_PCI_POOL_SIZE+VM_MAX_SLOTS];
+   vm_instance_t *vm = ckpt->vm;
+   struct pci_device *dev;
+   char name[VM_CKPT_NAME_LEN];
+   m_uint32_t val;
+   u_int i,j,nr;
+
+   nr = vm_ckpt_get_pci_busses(vm,busses);
+
+   for(i=0;i<nr;i++) {
+      for(dev=busses[i]->dev_list;dev;dev=dev->next) {
+         if (!dev->read_register || !dev->write_register)
+            continue;
+
+         for(j=0;j<VM_CKPT_PCI_REG_NR;j++) {
+            val = dev->read_register(vm->boot_cpu,dev,vm_ckpt_pci_regs[j]);
+            VM_CKPT_FIELD(ckpt,val);
+         }
+
+         vm_ckpt_pci_name(dev,name);
+         vm_ckpt_write_chunk(ckpt,VM_CKPT_CHUNK_PCI,name);
+      }
+   }
+}
+
+/* Find a PCI device given its chunk name */
+static struct pci_device *vm_ckpt_find_pci(vm_instance_t *vm,char *name)
+{
+   struct pci_bus *busses[2+VM_PCI_POOL_SIZE+VM_MAX_SLOTS];
+   char dev_name[VM_CKPT_NAME_LEN];
+   struct pci_device *dev;
+   u_int i,nr;
+
+   nr = vm_ckpt_get_pci_busses(vm,busses);
+
+   for(i=0;i<nr;i++) {
+      for(dev=busses[i]->dev_list;dev;dev=dev->next) {
+         vm_ckpt_pci_name(dev,dev_name);
+
+         if (!strcmp(dev_name,name) && dev->write_register)
+            return dev;
+      }
+   }
+
+   return NULL;
+}
+
+/* Restore the configuration registers of a PCI device */
+static int vm_ckpt_restore_pci(vm_ckpt_t *ckpt,char *name)
+{
+   vm_instance_t *vm = ckpt->vm;
+   struct pci_device *dev;
+   m_uint32_t val;
+   u_int j;
+
+   if (!(dev = vm_ckpt_find_pci(vm,name))) {
+      vm_error(vm,"checkpoint: unknown PCI device '%s'.\n",name);
+      return(-1);
+   }
+
+   for(j=0;j<VM_CKPT_PCI_REG_NR;j++) {
+      VM_CKPT_FIELD(ckpt,val);
+
+      if (ckpt->error)
+         return(-1);
+
+      dev->write_register(vm->boot_cpu,dev,vm_ckpt_pci_regs[j],val);
+   }
+
+   return(0);
+}
+
+/* Find a device with a checkpoint handler */
+static struct vdevice *vm_ckpt_find_dev(vm_instance_t *vm,char *name)
+{
+   struct vdevice *dev;
+
+   for(dev=vm->dev_list;dev;dev=dev->next)
+      if (dev->ckpt_handler && !strcmp(dev->name,name))
+         return dev;
+
+   return NULL;
+}
+
+/* Check if a page contains only zeroes */
+static int vm_ckpt_page_is_zero(void *page)
+{
+   m_uint64_t *p = page;
+   u_int i;
+
+   for(i=0;i<(VM_PAGE_SIZE/sizeof(*p));i++)
+      if (p[i] != 0)
+         return(FALSE);
+
+   return(TRUE);
+}
+
+/* Check if a device is a RAM device to save */
+static inline int vm_ckpt_is_ram(struct vdevice *dev)
+{
+   return((dev->flags & (VDEVICE_FLAG_RAM|VDEVICE_FLAG_REMAP)) ==
+          VDEVICE_FLAG_RAM);
+}
+
+/* Get the base content of a RAM device */
+static inline m_uint32_t vm_ckpt_ram_base(struct vdevice *dev)
+{
+   if ((dev->flags & VDEVICE_FLAG_SPARSE) && dev->host_addr)
+      return(VM_CKPT_RAM_BASE_GHOST);
+
+   return(VM_CKPT_RAM_BASE_ZERO);
+}
+
+/* Save the pages of a RAM device which differ from its base content */
+static void vm_ckpt_save_ram(vm_ckpt_t *ckpt,struct vdevice *dev)
+{
+   m_uint32_t i,nr_pages,base,end;
+   m_iptr_t page;
+
+   nr_pages = normalize_size(dev->phys_len,VM_PAGE_SIZE,VM_PAGE_SHIFT);
+   base = vm_ckpt_ram_base(dev);
+
+   /* The chunk data is streamed */
+   ckpt->buf_len = 0;
+   vm_ckpt_write_chunk(ckpt,VM_CKPT_CHUNK_RAM,dev->name);
+
+   vm_ckpt_write(ckpt,&dev->phys_addr,sizeof(dev->phys_addr));
+   vm_ckpt_write(ckpt,&dev->phys_len,sizeof(dev->phys_len));
+   vm_ckpt_write(ckpt,&base,sizeof(base));
+
+   for(i=0;(i<nr_pages) && !ckpt->error;i++) {
+      if (dev->flags & VDEVICE_FLAG_SPARSE) {
+         if (!(dev->sparse_map[i] & (VDEVICE_PTE_DIRTY|VDEVICE_PTE_SHARED|
+                                     VDEVICE_PTE_FILE)))
+            continue;
+
+         page = dev->sparse_map[i] & VM_PAGE_MASK;
+      } else {
+         page = dev->host_addr + ((m_iptr_t)i << VM_PAGE_SHIFT);
+      }
+
+      if ((base == VM_CKPT_RAM_BASE_ZERO) &&
+          vm_ckpt_page_is_zero((void *)page))
+         continue;
+
+      vm_ckpt_write(ckpt,&i,sizeof(i));
+      vm_ckpt_write(ckpt,(void *)page,VM_PAGE_SIZE);
+   }
+
+   end = VM_CKPT_RAM_END;
+   vm_ckpt_write(ckpt,&end,sizeof(end));
+}
+
+/* Reset a sparse RAM device to its base content */
+static void vm_ckpt_reset_sparse_ram(vm_instance_t *vm,struct vdevice *dev)
+{
+   m_uint32_t i,nr_pages;
+   m_iptr_t pte;
+
+   nr_pages = normalize_size(dev->phys_len,VM_PAGE_SIZE,VM_PAGE_SHIFT);
+
+   for(i=0;i<nr_pages;i++) {
+      pte = dev->sparse_map[i];
+
+      if (pte & VDEVICE_PTE_DIRTY)
+         vm_free_host_page(vm,(void *)(pte & VM_PAGE_MASK));
+      else if (pte & VDEVICE_PTE_SHARED)
+         page_merge_release(pte & VM_PAGE_MASK);
+
+      if (dev->host_addr)
+         dev->sparse_map[i] = dev->host_addr + ((m_iptr_t)i << VM_PAGE_SHIFT);
+      else
+         dev->sparse_map[i] = 0;
+   }
+}
+
+/* Restore the pages of a RAM device */
+static int vm_ckpt_restore_ram(vm_ckpt_t *ckpt,char *name)
+{
+   vm_instance_t *vm = ckpt->vm;
+   m_uint32_t i,next,nr_pages,phys_len,base;
+   m_uint64_t phys_addr;
+   struct vdevice *dev;
+   m_iptr_t page;
+   int cow;
+
+   vm_ckpt_read(ckpt,&phys_addr,sizeof(phys_addr));
+   vm_ckpt_read(ckpt,&phys_len,sizeof(phys_len));
+   vm_ckpt_read(ckpt,&base,sizeof(base));
+
+   if (ckpt->error)
+      return(-1);
+
+   if (!(dev = dev_get_by_name(vm,name)) || !vm_ckpt_is_ram(dev) ||
+       (dev->phys_addr != phys_addr) || (dev->phys_len != phys_len) ||
+       (vm_ckpt_ram_base(dev) != base))
+   {
+      vm_error(vm,"checkpoint: RAM device '%s' doesn't match.\n",name);
+      return(-1);
+   }
+
+   nr_pages = normalize_size(dev->phys_len,VM_PAGE_SIZE,VM_PAGE_SHIFT);
+
+   if (dev->flags & VDEVICE_FLAG_SPARSE)
+      vm_ckpt_reset_sparse_ram(vm,dev);
+
+   for(next=0;;next=i+1) {
+      vm_ckpt_read(ckpt,&i,sizeof(i));
+
+      if (ckpt->error)
+         return(-1);
+
+      if (i == VM_CKPT_RAM_END)
+         i = nr_pages;
+      else if (i >= nr_pages) {
+         ckpt->error = TRUE;
+         return(-1);
+      }
+
+      /* Zero the pages of a non-sparse device which are not recorded */
+      if (!(dev->flags & VDEVICE_FLAG_SPARSE)) {
+         for(;next<i;next++) {
+            page = dev->host_addr + ((m_iptr_t)next << VM_PAGE_SHIFT);
+
+            if (!vm_ckpt_page_is_zero((void *)page))
+               memset((void *)page,0,VM_PAGE_SIZE);
+         }
+      }
+
+      if (i == nr_pages)
+         break;
+
+      if (dev->flags & VDEVICE_FLAG_SPARSE) {
+         page = dev_sparse_get_host_addr(vm,dev,
+                                         dev->phys_addr +
+                                         ((m_uint64_t)i << VM_PAGE_SHIFT),
+                                         MTS_WRITE,&cow);
+      } else {
+         page = dev->host_addr + ((m_iptr_t)i << VM_PAGE_SHIFT);
+      }
+
+      vm_ckpt_read(ckpt,(void *)page,VM_PAGE_SIZE);
+   }
+
+   return(ckpt->error ? -1 : 0);
+}
+
+/* Get the number of CPUs of a VM */
+static m_uint32_t vm_ckpt_cpu_count(vm_instance_t *vm)
+{
+   m_uint32_t count = 0;
+   cpu_gen_t *cpu;
+
+   for(cpu=vm->cpu_group->cpu_list;cpu;cpu=cpu->next)
+      count++;
+
+   return(count);
+}
+
+/* Save or restore the checkpoint header */
+static int vm_ckpt_header(vm_ckpt_t *ckpt)
+{
+   vm_instance_t *vm = ckpt->vm;
+   m_uint32_t magic,version,ram_size,cpu_count;
+   char platform[VM_CKPT_NAME_LEN];
+
+   magic = VM_CKPT_MAGIC;
+   version = VM_CKPT_VERSION;
+   ram_size = vm->ram_size;
+   cpu_count = vm_ckpt_cpu_count(vm);
+
+   memset(platform,0,sizeof(platform));
+   strncpy(platform,vm->platform->name,sizeof(platform)-1);
+
+   vm_ckpt_io_u32(ckpt,&magic);
+   vm_ckpt_io_u32(ckpt,&version);
+
+   if (ckpt->restore) {
+      vm_ckpt_read(ckpt,platform,sizeof(platform));
+      platform[sizeof(platform)-1] = 0;
+   } else {
+      vm_ckpt_write(ckpt,platform,sizeof(platform));
+   }
+
+   vm_ckpt_io_u32(ckpt,&ram_size);
+   vm_ckpt_io_u32(ckpt,&cpu_count);
+
+   if (ckpt->error || (magic != VM_CKPT_MAGIC) ||
+       (version != VM_CKPT_VERSION))
+   {
+      vm_error(vm,"checkpoint: invalid file.\n");
+      return(-1);
+   }
+
+   if (strcmp(platform,vm->platform->name) ||
+       (ram_size != vm->ram_size) ||
+       (cpu_count != vm_ckpt_cpu_count(vm)))
+   {
+      vm_error(vm,"checkpoint: taken on a different configuration "
+               "(platform %s, %u MB of RAM, %u CPUs).\n",
+               platform,ram_size,cpu_count);
+      return(-1);
+   }
+
+   return(0);
+}
+
+/* Save the state of a suspended VM */
+static int vm_ckpt_save_state(vm_ckpt_t *ckpt)
+{
+   vm_instance_t *vm = ckpt->vm;
+   char name[VM_CKPT_NAME_LEN];
+   struct vdevice *dev;
+   cpu_gen_t *cpu;
+
+   if (vm_ckpt_header(ckpt) == -1)
+      return(-1);
+
+   for(cpu=vm->cpu_group->cpu_list;cpu;cpu=cpu->next) {
+      vm_ckpt_cpu(ckpt,cpu);
+      snprintf(name,sizeof(name),"cpu%u",cpu->id);
+      vm_ckpt_write_chunk(ckpt,VM_CKPT_CHUNK_CPU,name);
+   }
+
+   vm_ckpt_save_pci(ckpt);
+
+   for(dev=vm->dev_list;dev;dev=dev->next) {
+      if (!dev->ckpt_handler)
+         continue;
+
+      dev->ckpt_handler(ckpt,dev);
+      vm_ckpt_write_chunk(ckpt,VM_CKPT_CHUNK_DEV,dev->name);
+   }
+
+   for(dev=vm->dev_list;dev;dev=dev->next)
+      if (vm_ckpt_is_ram(dev))
+         vm_ckpt_save_ram(ckpt,dev);
+
+   vm_ckpt_write_chunk(ckpt,VM_CKPT_CHUNK_END,"");
+   return(ckpt->error ? -1 : 0);
+}
+
+/* Get the size of the data saved for a CPU or a device */
+static ssize_t vm_ckpt_data_size(vm_ckpt_t *ckpt,cpu_gen_t *cpu,
+                                 struct vdevice *dev)
+{
+   vm_ckpt_t tmp;
+   ssize_t size;
+
+   memset(&tmp,0,sizeof(tmp));
+   tmp.vm = ckpt->vm;
+
+   if (cpu != NULL)
+      vm_ckpt_cpu(&tmp,cpu);
+   else
+      dev->ckpt_handler(&tmp,dev);
+
+   size = tmp.error ? -1 : (ssize_t)tmp.buf_len;
+   free(tmp.buf);
+   return(size);
+}
+
+/* Check the page records of a RAM chunk */
+static int vm_ckpt_check_ram(vm_ckpt_t *ckpt,char *name)
+{
+   vm_instance_t *vm = ckpt->vm;
+   m_uint32_t i,next,nr_pages,phys_len,base;
+   u_char page[VM_PAGE_SIZE];
+   m_uint64_t phys_addr;
+   struct vdevice *dev;
+
+   vm_ckpt_read(ckpt,&phys_addr,sizeof(phys_addr));
+   vm_ckpt_read(ckpt,&phys_len,sizeof(phys_len));
+   vm_ckpt_read(ckpt,&base,sizeof(base));
+
+   if (ckpt->error)
+      return(-1);
+
+   if (!(dev = dev_get_by_name(vm,name)) || !vm_ckpt_is_ram(dev) ||
+       (dev->phys_addr != phys_addr) || (dev->phys_len != phys_len) ||
+       (vm_ckpt_ram_base(dev) != base))
+   {
+      vm_error(vm,"checkpoint: RAM device '%s' doesn't match.\n",name);
+      return(-1);
+   }
+
+   nr_pages = normalize_size(dev->phys_len,VM_PAGE_SIZE,VM_PAGE_SHIFT);
+
+   for(next=0;;next=i+1) {
+      vm_ckpt_read(ckpt,&i,sizeof(i));
+
+      if (ckpt->error)
+         return(-1);
+
+      if (i == VM_CKPT_RAM_END)
+         return(0);
+
+      /* Pages are recorded in ascending order */
+      if ((i >= nr_pages) || (i < next)) {
+         ckpt->error = TRUE;
+         return(-1);
+      }
+
+      vm_ckpt_read(ckpt,page,VM_PAGE_SIZE);
+   }
+}
+
+/* Check that the end of a checkpoint file has been reached without error */
+static int vm_ckpt_at_eof(vm_ckpt_t *ckpt)
+{
+   u_char c;
+#if HAS_ZLIB
+   int err;
+
+   /* The CRC of the zlib stream is checked when its end is read */
+   if (gzread(ckpt->fd,&c,sizeof(c)) != 0)
+      return(FALSE);
+
+   gzerror(ckpt->fd,&err);
+   return(err == Z_OK);
+#else
+   return((fread(&c,sizeof(c),1,ckpt->fd) == 0) && feof(ckpt->fd));
+#endif
+}
+
+/*
+ * Check that a checkpoint can be restored, without modifying the VM:
+ * chunks must match the devices of the VM and have the size of the state
+ * they restore, and the file must be complete and end after the end chunk.
+ */
+static int vm_ckpt_check_state(vm_ckpt_t *ckpt)
+{
+   vm_instance_t *vm = ckpt->vm;
+   char name[VM_CKPT_NAME_LEN];
+   m_uint32_t type,data_len;
+   struct vdevice *dev;
+   cpu_gen_t *cpu;
+   ssize_t size;
+   u_int id;
+
+   if (vm_ckpt_header(ckpt) == -1)
+      return(-1);
+
+   for(;;) {
+      if (vm_ckpt_read_chunk(ckpt,&type,name,&data_len) == -1)
+         break;
+
+      switch(type) {
+         case VM_CKPT_CHUNK_END:
+            if ((data_len != 0) || !vm_ckpt_at_eof(ckpt))
+               goto corrupted;
+            return(0);
+
+         case VM_CKPT_CHUNK_RAM:
+            if (vm_ckpt_check_ram(ckpt,name) == -1)
+               goto corrupted;
+            continue;
+
+         case VM_CKPT_CHUNK_CPU:
+            if ((sscanf(name,"cpu%u",&id) != 1) ||
+                !(cpu = cpu_group_find_id(vm->cpu_group,id)))
+            {
+               vm_error(vm,"checkpoint: unknown CPU '%s'.\n",name);
+               return(-1);
+            }
+
+            size = vm_ckpt_data_size(ckpt,cpu,NULL);
+            break;
+
+         case VM_CKPT_CHUNK_PCI:
+            if (!vm_ckpt_find_pci(vm,name)) {
+               vm_error(vm,"checkpoint: unknown PCI device '%s'.\n",name);
+               return(-1);
+            }
+
+            size = VM_CKPT_PCI_REG_NR * sizeof(m_uint32_t);
+            break;
+
+         case VM_CKPT_CHUNK_DEV:
+            if (!(dev = vm_ckpt_find_dev(vm,name))) {
+               vm_error(vm,"checkpoint: unknown device '%s'.\n",name);
+               return(-1);
+            }
+
+            size = vm_ckpt_data_size(ckpt,NULL,dev);
+            break;
+
+         default:
+            size = data_len;
+      }
+
+      if ((size != (ssize_t)data_len) ||
+          (vm_ckpt_load_chunk(ckpt,data_len) == -1))
+         break;
+   }
+
+ corrupted:
+   vm_error(vm,"checkpoint: truncated or corrupted file.\n");
+   return(-1);
+}
+
+/* Restore the state of a suspended VM */
+static int vm_ckpt_restore_state(vm_ckpt_t *ckpt)
+{
+   vm_instance_t *vm = ckpt->vm;
+   char name[VM_CKPT_NAME_LEN];
+   m_uint32_t type,data_len;
+   struct vdevice *dev;
+   cpu_gen_t *cpu;
+   u_int id;
+   int res;
+
+   if (vm_ckpt_header(ckpt) == -1)
+      return(-1);
+
+   for(;;) {
+      if (vm_ckpt_read_chunk(ckpt,&type,name,&data_len) == -1)
+         break;
+
+      if (type == VM_CKPT_CHUNK_END)
+         return(0);
+
+      /* RAM chunks are streamed (devices don't access RAM meanwhile) */
+      if (type == VM_CKPT_CHUNK_RAM) {
+         VM_RAM_LOCK(vm);
+         res = vm_ckpt_restore_ram(ckpt,name);
+         VM_RAM_UNLOCK(vm);
+
+         if (res == -1)
+            return(-1);
+         continue;
+      }
+
+      if (vm_ckpt_load_chunk(ckpt,data_len) == -1)
+         break;
+
+      switch(type) {
+         case VM_CKPT_CHUNK_CPU:
+            if ((sscanf(name,"cpu%u",&id) != 1) ||
+                !(cpu = cpu_group_find_id(vm->cpu_group,id)))
+            {
+               vm_error(vm,"checkpoint: unknown CPU '%s'.\n",name);
+               return(-1);
+            }
+
+            vm_ckpt_cpu(ckpt,cpu);
+            break;
+
+         case VM_CKPT_CHUNK_PCI:
+            if (vm_ckpt_restore_pci(ckpt,name) == -1)
+               return(-1);
+            break;
+
+         case VM_CKPT_CHUNK_DEV:
+            if (!(dev = vm_ckpt_find_dev(vm,name))) {
+               vm_error(vm,"checkpoint: unknown device '%s'.\n",name);
+               return(-1);
+            }
+
+            dev->ckpt_handler(ckpt,dev);
+            break;
+
+         default:
+            vm_log(vm,"CKPT","skipping unknown chunk %u (%s).\n",type,name);
+      }
+
+      if (ckpt->error)
+         break;
+   }
+
+   vm_error(vm,"checkpoint: truncated or corrupted file.\n");
+   return(-1);
+}
+
+/* 
+ * Check that a VM can be checkpointed: it must be started, and the
+ * platform must save the state of all its board devices (the others
+ * would not match the restored CPU and RAM).
+ */
+static int vm_ckpt_check_vm(vm_instance_t *vm)
+{
+   if ((vm->status != VM_STATUS_RUNNING) &&
+       (vm->status != VM_STATUS_SUSPENDED))
+   {
+      vm_error(vm,"checkpoint: instance is not running.\n");
+      return(-1);
+   }
+
+   if (!vm->platform->ckpt_check) {
+      vm_error(vm,"checkpoint: not supported on platform %s.\n",
+               vm->platform->name);
+      return(-1);
+   }
+
+   return(vm->platform->ckpt_check(vm));
+}
+
+/* Save a checkpoint of a VM */
+int vm_ckpt_save(vm_instance_t *vm,char *filename)
+{
+   vm_ckpt_t ckpt;
+   int running,res;
+
+   if (vm_ckpt_check_vm(vm) == -1)
+      return(-1);
+
+   memset(&ckpt,0,sizeof(ckpt));
+   ckpt.vm = vm;
+
+   if (vm_ckpt_open(&ckpt,filename) == -1) {
+      vm_error(vm,"unable to create checkpoint file '%s'.\n",filename);
+      return(-1);
+   }
+
+   VM_STATE_LOCK(vm);
+   running = (vm->status == VM_STATUS_RUNNING);
+   vm_suspend(vm);
+
+   if ((res = cpu_group_sync_state(vm->cpu_group)) != -1)
+      res = vm_ckpt_save_state(&ckpt);
+
+   if (running)
+      vm_resume(vm);
+
+   VM_STATE_UNLOCK(vm);
+
+   if ((vm_ckpt_close(&ckpt) == -1) || ckpt.error)
+      res = -1;
+
+   free(ckpt.buf);
+
+   if (res == -1) {
+      vm_error(vm,"unable to save checkpoint to '%s'.\n",filename);
+      unlink(filename);
+      return(-1);
+   }
+
+   vm_log(vm,"CKPT","checkpoint saved to '%s'.\n",filename);
+   return(0);
+}
+
+/* Restore a checkpoint into a running VM */
+int vm_ckpt_restore(vm_instance_t *vm,char *filename)
+{
+   vm_ckpt_t ckpt;
+   int running,res;
+
+   if (vm_ckpt_check_vm(vm) == -1)
+      return(-1);
+
+   memset(&ckpt,0,sizeof(ckpt));
+   ckpt.vm = vm;
+   ckpt.restore = TRUE;
+
+   /* Read the whole file once before the VM is modified */
+   if (vm_ckpt_open(&ckpt,filename) == -1) {
+      vm_error(vm,"unable to open checkpoint file '%s'.\n",filename);
+      return(-1);
+   }
+
+   res = vm_ckpt_check_state(&ckpt);
+
+   if ((vm_ckpt_close(&ckpt) == -1) && (res != -1)) {
+      vm_error(vm,"checkpoint: corrupted file.\n");
+      res = -1;
+   }
+
+   if ((res == -1) || (vm_ckpt_open(&ckpt,filename) == -1)) {
+      free(ckpt.buf);
+      vm_error(vm,"unable to restore checkpoint from '%s', "
+               "instance unchanged.\n",filename);
+      return(-1);
+   }
+
+   ckpt.error = FALSE;
+
+   /* RAM snapshots don't apply to the restored RAM */
+   ram_snap_shutdown(vm);
+
+   if (vm->page_merge)
+      page_merge_lock_rounds();
+
+   VM_STATE_LOCK(vm);
+   running = (vm->status == VM_STATUS_RUNNING);
+   vm_suspend(vm);
+
+   if ((res = cpu_group_sync_state(vm->cpu_group)) != -1) {
+      res = vm_ckpt_restore_state(&ckpt);
+
+      /* Host pages have changed */
+      cpu_group_rebuild_mts(vm->cpu_group);
+   }
+
+   /* A partially restored VM must not run */
+   if (running && (res != -1))
+      vm_resume(vm);
+
+   VM_STATE_UNLOCK(vm);
+
+   if (vm->page_merge)
+      page_merge_unlock_rounds();
+
+   vm_ckpt_close(&ckpt);
+   free(ckpt.buf);
+
+   if (res == -1) {
+      vm_error(vm,"unable to restore checkpoint from '%s', instance left "
+               "suspended in an inconsistent state.\n",filename);
+      return(-1);
+   }
+
+   vm_log(vm,"CKPT","checkpoint restored from '%s'.\n",filename);
+   return(0);
+}
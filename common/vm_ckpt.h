@@ -0,0 +1,76 @@
+/*
+ * Cisco router simulation platform.
+ * Copyright (c) 2005,2006 Christophe Fillot (cf@utc.fr)
+ *
+ * vm_ckpt.h: VM checkpoints (save/restore of CPU, devices and RAM).
+ */
+
+#ifndef __VM_CKPT_H__
+#define __VM_CKPT_H__
+
+#include <sys/types.h>
+#include <stdio.h>
+#if HAS_ZLIB
+#include <zlib.h>
+#endif
+#include "utils.h"
+#include "vm.h"
+
+/* Checkpoint file format */
+#define VM_CKPT_MAGIC    0x444d434b  /* "DMCK" */
+#define VM_CKPT_VERSION  1
+
+/* Chunk types */
+enum {
+   VM_CKPT_CHUNK_END = 0,
+   VM_CKPT_CHUNK_CPU,
+   VM_CKPT_CHUNK_PCI,
+   VM_CKPT_CHUNK_DEV,
+   VM_CKPT_CHUNK_RAM,
+};
+
+/* End of the page records of a RAM chunk */
+#define VM_CKPT_RAM_END  0xFFFFFFFF
+
+/* Base content of a RAM device */
+#define VM_CKPT_RAM_BASE_ZERO   0   /* Pages not recorded are zeroed */
+#define VM_CKPT_RAM_BASE_GHOST  1   /* Pages not recorded are ghost pages */
+
+/* Maximum length of a chunk name */
+#define VM_CKPT_NAME_LEN  128
+
+/* PCI configuration registers restored by a checkpoint */
+#define VM_CKPT_PCI_REG_NR  9
+
+/* Checkpoint file */
+#if HAS_ZLIB
+typedef gzFile vm_ckpt_file_t;
+#else
+typedef FILE *vm_ckpt_file_t;
+#endif
+
+/* Checkpoint being saved or restored */
+struct vm_ckpt {
+   vm_instance_t *vm;
+   vm_ckpt_file_t fd;
+   int restore;               /* Restoring (fields are read) */
+   int error;
+
+   /* Data of the current chunk */
+   u_char *buf;
+   size_t buf_size,buf_len,buf_pos;
+};
+
+/* Save or restore a field of the current chunk */
+void vm_ckpt_field(vm_ckpt_t *ckpt,void *ptr,size_t len);
+
+#define VM_CKPT_FIELD(ckpt,field) \
+   vm_ckpt_field((ckpt),(void *)&(field),sizeof(field))
+
+/* Save a checkpoint of a VM */
+int vm_ckpt_save(vm_instance_t *vm,char *filename);
+
+/* Restore a checkpoint into a running VM */
+int vm_ckpt_restore(vm_instance_t *vm,char *filename);
+
+#endif
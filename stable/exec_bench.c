@@ -0,0 +1,349 @@
+/*
+ * Cisco router simulation platform.
+ * Copyright (c) 2005,2006 Christophe Fillot (cf@utc.fr)
+ *
+ * exec_bench.c: benchmark of the non-JIT MIPS64 and PPC32 interpreters.
+ *
+ * A small loop of ALU, load and store instructions is run on a bare VM
+ * (1 MB of RAM, no platform devices), in two modes:
+ *
+ *   - "step": one instruction at a time, as the interpreters did before
+ *     predecoding: each instruction is fetched and decoded through the
+ *     ILT, and the idle pc, timer and IRQ checks are done after each one;
+ *   - "block": the CPU thread, which runs predecoded blocks.
+ *
+ * The rate is computed from the loop counter of the guest, and the sum
+ * computed by the loop is checked.
+ *
+ * Usage: exec_bench [seconds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "cpu.h"
+#include "vm.h"
+#include "dynamips.h"
+#include "memory.h"
+#include "device.h"
+#include "mips64_exec.h"
+#include "ppc32_exec.h"
+
+/* Globals normally provided by dynamips.c */
+const char *os_name = "bench";
+const char *sw_version = "bench";
+const char *sw_version_tag = "bench";
+char *binding_addr = NULL;
+FILE *log_file = NULL;
+
+void dynamips_reset(void)
+{
+}
+
+/* Guest code and data */
+#define BENCH_CODE_ADDR  0x1000
+#define BENCH_DATA_ADDR  0x2000
+
+/* Number of instructions executed between two checks of the clock */
+#define BENCH_STEP_CHUNK  1000000
+
+/*
+ * MIPS64 loop (8 instructions), in KSEG0:
+ *   t1 = t1 + 1; data[0] = t1; t2 = data[0]; t3 += t2;
+ *   t4 = t3 ^ t1; t5 = t4 << 3; data[1] = t5 (delay slot).
+ */
+#define BENCH_MIPS_LOOP_LEN  8
+
+static m_uint32_t bench_mips_code[] = {
+   0x3C088000,    /* lui   t0,0x8000 */
+   0x35082000,    /* ori   t0,t0,0x2000 */
+   0x24090000,    /* li    t1,0 */
+   0x25290001,    /* loop: addiu t1,t1,1 */
+   0xAD090000,    /* sw    t1,0(t0) */
+   0x8D0A0000,    /* lw    t2,0(t0) */
+   0x016A5821,    /* addu  t3,t3,t2 */
+   0x01696026,    /* xor   t4,t3,t1 */
+   0x000C68C0,    /* sll   t5,t4,3 */
+   0x08000403,    /* j     loop */
+   0xAD0D0004,    /* sw    t5,4(t0) */
+};
+
+/* PPC32 loop (6 instructions), in real mode */
+#define BENCH_PPC_LOOP_LEN  6
+
+static m_uint32_t bench_ppc_code[] = {
+   0x38602000,    /* li    r3,0x2000 */
+   0x38800000,    /* li    r4,0 */
+   0x38840001,    /* loop: addi r4,r4,1 */
+   0x90830000,    /* stw   r4,0(r3) */
+   0x80A30000,    /* lwz   r5,0(r3) */
+   0x7CC62A14,    /* add   r6,r6,r5 */
+   0x7CC72278,    /* xor   r7,r6,r4 */
+   0x4BFFFFEC,    /* b     loop */
+};
+
+/* Get the current time in seconds */
+static double bench_get_time(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC,&ts);
+   return(ts.tv_sec + (ts.tv_nsec / 1e9));
+}
+
+/* Create a bare VM with 1 MB of RAM */
+static vm_instance_t *bench_create_vm(vm_platform_t *platform,
+                                      m_uint32_t *code,u_int code_len)
+{
+   vm_instance_t *vm;
+   u_char *ram;
+   u_int i;
+
+   if (!(vm = calloc(1,sizeof(*vm))))
+      return NULL;
+
+   vm->name = "bench";
+   vm->platform = platform;
+   vm->ios_image_fd = -1;
+   vm->status = VM_STATUS_RUNNING;
+   vm->ram_size = 1;
+   vm->jit_use = FALSE;
+   vm->cpu_group = cpu_group_create("bench");
+
+   if (dev_ram_init(vm,"ram",FALSE,FALSE,NULL,FALSE,0,1 << 20) == -1)
+      return NULL;
+
+   ram = (u_char *)dev_get_by_name(vm,"ram")->host_addr;
+
+   for(i=0;i<code_len;i++)
+      ((m_uint32_t *)(ram + BENCH_CODE_ADDR))[i] = htovm32(code[i]);
+
+   return vm;
+}
+
+/* Get the data word stored by the guest loop */
+static m_uint32_t bench_get_data(vm_instance_t *vm)
+{
+   u_char *ram = (u_char *)dev_get_by_name(vm,"ram")->host_addr;
+   return(vmtoh32(*(m_uint32_t *)(ram + BENCH_DATA_ADDR)));
+}
+
+/* Run the CPU thread (predecoded blocks) for some time */
+static double bench_run_thread(vm_instance_t *vm,double secs)
+{
+   double start;
+
+   start = bench_get_time();
+   cpu_start(vm->boot_cpu);
+   usleep(secs * 1000000);
+   vm_suspend(vm);
+   cpu_group_sync_state(vm->cpu_group);
+   return(bench_get_time() - start);
+}
+
+/* Run MIPS64 code one instruction at a time (former interpreter loop) */
+static double bench_mips_step(cpu_mips_t *cpu,double secs)
+{
+   m_uint64_t exec_page,cur_page = (m_uint64_t)-1;
+   mips_insn_t *ptr = NULL,insn;
+   int timer_irq_check = 0;
+   double start,now;
+   u_int i;
+
+   start = bench_get_time();
+
+   do {
+      for(i=0;i<BENCH_STEP_CHUNK;i++) {
+         if (unlikely(cpu->pc == cpu->idle_pc))
+            cpu->gen->idle_count++;
+
+         if (unlikely(++timer_irq_check == cpu->timer_irq_check_itv))
+            timer_irq_check = 0;
+
+         if (unlikely(cpu->irq_pending)) {
+            mips64_trigger_irq(cpu);
+            continue;
+         }
+
+         cpu->gpr[0] = 0;
+
+         exec_page = cpu->pc & ~(m_uint64_t)MIPS_MIN_PAGE_IMASK;
+
+         if (unlikely(exec_page != cur_page)) {
+            ptr = cpu->mem_op_lookup(cpu,exec_page);
+            cur_page = exec_page;
+         }
+
+         insn = vmtoh32(ptr[(cpu->pc & MIPS_MIN_PAGE_IMASK) >> 2]);
+         mips64_exec_single_step(cpu,insn);
+      }
+
+      now = bench_get_time();
+   }while((now - start) < secs);
+
+   return(now - start);
+}
+
+/* Run PPC32 code one instruction at a time (former interpreter loop) */
+static double bench_ppc_step(cpu_ppc_t *cpu,double secs)
+{
+   m_uint32_t exec_page,cur_page = (m_uint32_t)-1;
+   ppc_insn_t *ptr = NULL,insn;
+   int timer_irq_check = 0;
+   double start,now;
+   u_int i;
+
+   start = bench_get_time();
+
+   do {
+      for(i=0;i<BENCH_STEP_CHUNK;i++) {
+         if (unlikely(cpu->ia == cpu->idle_pc))
+            cpu->gen->idle_count++;
+
+         if (unlikely(++timer_irq_check == cpu->timer_irq_check_itv))
+            timer_irq_check = 0;
+
+         if (unlikely(cpu->irq_check))
+            ppc32_trigger_irq(cpu);
+
+         exec_page = cpu->ia & ~PPC32_MIN_PAGE_IMASK;
+
+         if (unlikely(exec_page != cur_page)) {
+            ptr = cpu->mem_op_lookup(cpu,exec_page,PPC32_MTS_ICACHE);
+            cur_page = exec_page;
+         }
+
+         insn = vmtoh32(ptr[(cpu->ia & PPC32_MIN_PAGE_IMASK) >> 2]);
+         ppc32_exec_single_insn_ext(cpu,insn);
+      }
+
+      now = bench_get_time();
+   }while((now - start) < secs);
+
+   return(now - start);
+}
+
+/* Print the result of a run, and check the computation of the guest */
+static int bench_report(char *cpu_name,char *mode,double elapsed,
+                        m_uint32_t loops,u_int loop_len,
+                        m_uint32_t sum,m_uint32_t data)
+{
+   m_uint64_t n = loops;
+   int ok;
+
+   /* The run may stop between the increment and the end of the loop */
+   ok = ((sum == (m_uint32_t)(n * (n + 1) / 2)) ||
+         (sum == (m_uint32_t)(n * (n - 1) / 2))) &&
+        ((data == loops) || (data == loops - 1));
+
+   printf("%-7s %-6s %10.1f Minsn/s  %s\n",cpu_name,mode,
+          (double)n * loop_len / elapsed / 1e6,ok ? "ok" : "BAD RESULT");
+   return(ok ? 0 : -1);
+}
+
+/* Benchmark the MIPS64 interpreter */
+static int bench_mips64(vm_platform_t *platform,double secs)
+{
+   vm_instance_t *vm;
+   cpu_mips_t *cpu;
+   cpu_gen_t *gen;
+   double elapsed;
+   int res = 0;
+
+   vm = bench_create_vm(platform,bench_mips_code,
+                        sizeof(bench_mips_code) / sizeof(m_uint32_t));
+
+   if (!vm || !(gen = cpu_create(vm,CPU_TYPE_MIPS64,0))) {
+      fprintf(stderr,"exec_bench: unable to create the MIPS64 VM.\n");
+      return(-1);
+   }
+
+   cpu = CPU_MIPS64(gen);
+   vm->boot_cpu = gen;
+   cpu_group_add(vm->cpu_group,gen);
+
+   /* Step mode (run before the CPU thread creates the page cache) */
+   cpu->pc = (m_int32_t)(0x80000000 | BENCH_CODE_ADDR);
+   elapsed = bench_mips_step(cpu,secs);
+   res |= bench_report("MIPS64","step",elapsed,cpu->gpr[MIPS_GPR_T1],
+                       BENCH_MIPS_LOOP_LEN,cpu->gpr[MIPS_GPR_T3],
+                       bench_get_data(vm));
+
+   /* Block mode */
+   cpu->gpr[MIPS_GPR_T3] = 0;
+   cpu->pc = (m_int32_t)(0x80000000 | BENCH_CODE_ADDR);
+   elapsed = bench_run_thread(vm,secs);
+   res |= bench_report("MIPS64","block",elapsed,cpu->gpr[MIPS_GPR_T1],
+                       BENCH_MIPS_LOOP_LEN,cpu->gpr[MIPS_GPR_T3],
+                       bench_get_data(vm));
+   return(res);
+}
+
+/* Benchmark the PPC32 interpreter */
+static int bench_ppc32(vm_platform_t *platform,double secs)
+{
+   vm_instance_t *vm;
+   cpu_ppc_t *cpu;
+   cpu_gen_t *gen;
+   double elapsed;
+   int res = 0;
+
+   vm = bench_create_vm(platform,bench_ppc_code,
+                        sizeof(bench_ppc_code) / sizeof(m_uint32_t));
+
+   if (!vm || !(gen = cpu_create(vm,CPU_TYPE_PPC32,0))) {
+      fprintf(stderr,"exec_bench: unable to create the PPC32 VM.\n");
+      return(-1);
+   }
+
+   cpu = CPU_PPC32(gen);
+   vm->boot_cpu = gen;
+   cpu_group_add(vm->cpu_group,gen);
+
+   /* Real mode, no address translation */
+   cpu->msr = 0;
+   gen->mts_rebuild(gen);
+
+   /* Step mode (run before the CPU thread creates the page cache) */
+   cpu->ia = BENCH_CODE_ADDR;
+   elapsed = bench_ppc_step(cpu,secs);
+   res |= bench_report("PPC32","step",elapsed,cpu->gpr[4],
+                       BENCH_PPC_LOOP_LEN,cpu->gpr[6],bench_get_data(vm));
+
+   /* Block mode */
+   cpu->gpr[6] = 0;
+   cpu->ia = BENCH_CODE_ADDR;
+   elapsed = bench_run_thread(vm,secs);
+   res |= bench_report("PPC32","block",elapsed,cpu->gpr[4],
+                       BENCH_PPC_LOOP_LEN,cpu->gpr[6],bench_get_data(vm));
+   return(res);
+}
+
+int main(int argc,char *argv[])
+{
+   vm_platform_t platform;
+   double secs = 2.0;
+   int res = 0;
+
+   if ((argc > 1) && ((secs = atof(argv[1])) <= 0)) {
+      fprintf(stderr,"Usage: %s [seconds]\n",argv[0]);
+      return(EXIT_FAILURE);
+   }
+
+   memset(&platform,0,sizeof(platform));
+   platform.name = "bench";
+   platform.log_name = "BENCH";
+
+   mips64_exec_create_ilt();
+   ppc32_exec_create_ilt();
+
+   res |= bench_mips64(&platform,secs);
+   res |= bench_ppc32(&platform,secs);
+
+   /* CPU threads are left suspended */
+   fflush(stdout);
+   _exit(res ? EXIT_FAILURE : EXIT_SUCCESS);
+}
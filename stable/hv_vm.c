@@ -29,6 +29,9 @@
 #include "device.h"
 #include "dev_c7200.h"
 #include "dev_vtty.h"
+#include "page_merge.h"
+#include "ram_snap.h"
+#include "vm_ckpt.h"
 #include "utils.h"
 #include "base64.h"
 #include "net.h"
@@ -340,6 +343,160 @@ static int cmd_set_ram_mmap(hypervisor_conn_t *conn,int argc,char *argv[])
    return(0);
 }
 
+/* Enable/disable use of huge pages to back RAM */
+static int cmd_set_ram_hugepages(hypervisor_conn_t *conn,int argc,char *argv[])
+{
+   vm_instance_t *vm;
+
+   if (!(vm = hypervisor_find_object(conn,argv[0],OBJ_TYPE_VM)))
+      return(-1);
+
+   vm->ram_hugepages = atoi(argv[1]);
+
+   vm_release(vm);
+   hypervisor_send_reply(conn,HSC_INFO_OK,1,"OK");
+   return(0);
+}
+
+/* Enable/disable merging of identical RAM pages (VM must be stopped) */
+static int cmd_set_page_merge(hypervisor_conn_t *conn,int argc,char *argv[])
+{
+   vm_instance_t *vm;
+
+   if (!(vm = hypervisor_find_object(conn,argv[0],OBJ_TYPE_VM)))
+      return(-1);
+
+   if (vm->status != VM_STATUS_HALTED) {
+      vm_release(vm);
+      hypervisor_send_reply(conn,HSC_ERR_INV_PARAM,1,
+                            "VM '%s' must be stopped",argv[0]);
+      return(-1);
+   }
+
+   vm->page_merge = atoi(argv[1]);
+
+   vm_release(vm);
+   hypervisor_send_reply(conn,HSC_INFO_OK,1,"OK");
+   return(0);
+}
+
+/* Show the memory saved by page merging */
+static int cmd_show_page_merge_stats(hypervisor_conn_t *conn,
+                                     int argc,char *argv[])
+{
+   page_merge_stats_t stats;
+   vm_instance_t *vm;
+
+   if (!(vm = hypervisor_find_object(conn,argv[0],OBJ_TYPE_VM)))
+      return(-1);
+
+   page_merge_get_stats(vm,&stats);
+
+   hypervisor_send_reply(conn,HSC_INFO_MSG,0,"shared pages: %u",
+                         stats.shared_pages);
+   hypervisor_send_reply(conn,HSC_INFO_MSG,0,"memory saved: %llu KB",
+                         (unsigned long long)stats.saved_kb);
+
+   vm_release(vm);
+   hypervisor_send_reply(conn,HSC_INFO_OK,1,"OK");
+   return(0);
+}
+
+/* Take an incremental RAM snapshot */
+static int cmd_save_ram_snapshot(hypervisor_conn_t *conn,
+                                 int argc,char *argv[])
+{
+   vm_instance_t *vm;
+
+   if (!(vm = hypervisor_find_object(conn,argv[0],OBJ_TYPE_VM)))
+      return(-1);
+
+   if (ram_snap_take(vm,argv[1]) == -1) {
+      vm_release(vm);
+      hypervisor_send_reply(conn,HSC_ERR_START,1,
+                            "VM %s: unable to take RAM snapshot",argv[0]);
+      return(-1);
+   }
+
+   vm_release(vm);
+   hypervisor_send_reply(conn,HSC_INFO_OK,1,"OK");
+   return(0);
+}
+
+/* Show the status of RAM snapshots */
+static int cmd_show_ram_snapshot(hypervisor_conn_t *conn,
+                                 int argc,char *argv[])
+{
+   ram_snap_t *snap;
+   vm_instance_t *vm;
+
+   if (!(vm = hypervisor_find_object(conn,argv[0],OBJ_TYPE_VM)))
+      return(-1);
+
+   if (!(snap = vm->ram_snap) || (!snap->in_progress && !snap->filename)) {
+      hypervisor_send_reply(conn,HSC_INFO_MSG,0,"no snapshot log");
+   } else {
+      hypervisor_send_reply(conn,HSC_INFO_MSG,0,"log: %s",snap->filename);
+      hypervisor_send_reply(conn,HSC_INFO_MSG,0,"in progress: %s",
+                            snap->in_progress ? "yes" : "no");
+   }
+
+   if (snap && snap->total) {
+      hypervisor_send_reply(conn,HSC_INFO_MSG,0,
+                            "last snapshot: %u (%s), %u pages, %llu ms, %s",
+                            snap->last_seq,
+                            snap->last_full ? "full" : "incremental",
+                            snap->last_pages,
+                            (unsigned long long)snap->last_time,
+                            (snap->last_status == -1) ? "failed" : "ok");
+   }
+
+   vm_release(vm);
+   hypervisor_send_reply(conn,HSC_INFO_OK,1,"OK");
+   return(0);
+}
+
+/* Save a checkpoint of the CPU, device and RAM state */
+static int cmd_save_checkpoint(hypervisor_conn_t *conn,int argc,char *argv[])
+{
+   vm_instance_t *vm;
+
+   if (!(vm = hypervisor_find_object(conn,argv[0],OBJ_TYPE_VM)))
+      return(-1);
+
+   if (vm_ckpt_save(vm,argv[1]) == -1) {
+      vm_release(vm);
+      hypervisor_send_reply(conn,HSC_ERR_START,1,
+                            "VM %s: unable to save checkpoint",argv[0]);
+      return(-1);
+   }
+
+   vm_release(vm);
+   hypervisor_send_reply(conn,HSC_INFO_OK,1,"OK");
+   return(0);
+}
+
+/* Restore a checkpoint in a started instance */
+static int cmd_restore_checkpoint(hypervisor_conn_t *conn,
+                                  int argc,char *argv[])
+{
+   vm_instance_t *vm;
+
+   if (!(vm = hypervisor_find_object(conn,argv[0],OBJ_TYPE_VM)))
+      return(-1);
+
+   if (vm_ckpt_restore(vm,argv[1]) == -1) {
+      vm_release(vm);
+      hypervisor_send_reply(conn,HSC_ERR_START,1,
+                            "VM %s: unable to restore checkpoint",argv[0]);
+      return(-1);
+   }
+
+   vm_release(vm);
+   hypervisor_send_reply(conn,HSC_INFO_OK,1,"OK");
+   return(0);
+}
+
 /* Enable/disable use of sparse memory */
 static int cmd_set_sparse_mem(hypervisor_conn_t *conn,int argc,char *argv[])
 {
@@ -512,6 +669,195 @@ static int cmd_set_idle_sleep_time(hypervisor_conn_t *conn,
    return(0);
 }
 
+/* Enable/Disable automatic idle PC detection */
+static int cmd_set_idle_auto(hypervisor_conn_t *conn,int argc,char *argv[])
+{
+   vm_instance_t *vm;
+   cpu_gen_t *cpu;
+
+   if (!(vm = hypervisor_find_object(conn,argv[0],OBJ_TYPE_VM)))
+      return(-1);
+
+   vm->idle_auto = atoi(argv[1]);
+
+   /* Apply the setting to the running CPUs */
+   if (vm->cpu_group != NULL) {
+      for(cpu=vm->cpu_group->cpu_list;cpu;cpu=cpu->next) {
+         if (cpu_idle_auto_enable(cpu,vm->idle_auto) == -1) {
+            vm_release(vm);
+            hypervisor_send_reply(conn,HSC_ERR_CREATE,1,
+                                  "unable to enable idle PC detection");
+            return(-1);
+         }
+      }
+   }
+
+   vm_release(vm);
+   hypervisor_send_reply(conn,HSC_INFO_OK,1,"OK");
+   return(0);
+}
+
+/* Show automatic idle PC detection statistics */
+static int cmd_show_idle_auto(hypervisor_conn_t *conn,int argc,char *argv[])
+{
+   cpu_idle_auto_t *ia;
+   vm_instance_t *vm;
+   m_tmcnt_t saved = 0;
+   cpu_gen_t *cpu;
+
+   if (!(vm = hypervisor_find_object(conn,argv[0],OBJ_TYPE_VM)))
+      return(-1);
+
+   if (vm->cpu_group != NULL) {
+      for(cpu=vm->cpu_group->cpu_list;cpu;cpu=cpu->next) {
+         if (!(ia = cpu->idle_auto))
+            continue;
+
+         hypervisor_send_reply(conn,HSC_INFO_MSG,0,
+                               "CPU%u: state=%s candidate=0x%llx "
+                               "load=%u.%u%% base_load=%u.%u%% "
+                               "idle_max=%u idle_sleep_time=%u",
+                               cpu->id,cpu_idle_auto_state_name(ia->state),
+                               ia->candidate,ia->load / 10,ia->load % 10,
+                               ia->base_load / 10,ia->base_load % 10,
+                               cpu->idle_max,cpu->idle_sleep_time);
+
+         hypervisor_send_reply(conn,HSC_INFO_MSG,0,
+                               "CPU%u: tried=%llu accepted=%llu "
+                               "reverted=%llu sleeps=%llu cpu_saved=%llu ms",
+                               cpu->id,ia->tried,ia->accepted,ia->reverted,
+                               cpu->idle_sleep_count,ia->cpu_saved / 1000000);
+
+         saved += ia->cpu_saved;
+      }
+   }
+
+   hypervisor_send_reply(conn,HSC_INFO_MSG,0,"Host CPU saved: %llu ms",
+                         saved / 1000000);
+
+   vm_release(vm);
+   hypervisor_send_reply(conn,HSC_INFO_OK,1,"OK");
+   return(0);
+}
+
+/* Set the CPU scheduler priority of a VM */
+static int cmd_set_sched_prio(hypervisor_conn_t *conn,int argc,char *argv[])
+{
+   vm_instance_t *vm;
+   int prio;
+
+   if (!(vm = hypervisor_find_object(conn,argv[0],OBJ_TYPE_VM)))
+      return(-1);
+
+   prio = atoi(argv[1]);
+
+   if ((prio < CPU_SCHED_PRIO_MIN) || (prio > CPU_SCHED_PRIO_MAX)) {
+      vm_release(vm);
+      hypervisor_send_reply(conn,HSC_ERR_INV_PARAM,1,
+                            "priority must be between %d and %d",
+                            CPU_SCHED_PRIO_MIN,CPU_SCHED_PRIO_MAX);
+      return(-1);
+   }
+
+   vm->sched_prio = prio;
+
+   vm_release(vm);
+   hypervisor_send_reply(conn,HSC_INFO_OK,1,"OK");
+   return(0);
+}
+
+/* Set the CPU quota of a VM (percentage of a host CPU, 0: no limit) */
+static int cmd_set_sched_quota(hypervisor_conn_t *conn,int argc,char *argv[])
+{
+   vm_instance_t *vm;
+   int quota;
+
+   if (!(vm = hypervisor_find_object(conn,argv[0],OBJ_TYPE_VM)))
+      return(-1);
+
+   quota = atoi(argv[1]);
+
+   if ((quota < 0) || (quota > CPU_SCHED_QUOTA_MAX)) {
+      vm_release(vm);
+      hypervisor_send_reply(conn,HSC_ERR_INV_PARAM,1,
+                            "quota must be between 0 and %d",
+                            CPU_SCHED_QUOTA_MAX);
+      return(-1);
+   }
+
+   vm->sched_quota = quota;
+
+   vm_release(vm);
+   hypervisor_send_reply(conn,HSC_INFO_OK,1,"OK");
+   return(0);
+}
+
+/* Show CPU scheduler statistics */
+static int cmd_show_sched_stats(hypervisor_conn_t *conn,int argc,char *argv[])
+{
+   cpu_sched_stats_t s;
+   vm_instance_t *vm;
+   cpu_gen_t *cpu;
+   int found = FALSE;
+
+   if (!(vm = hypervisor_find_object(conn,argv[0],OBJ_TYPE_VM)))
+      return(-1);
+
+   if (vm->cpu_group != NULL) {
+      for(cpu=vm->cpu_group->cpu_list;cpu;cpu=cpu->next) {
+         if (cpu_sched_get_stats(cpu,&s) == -1)
+            continue;
+
+         hypervisor_send_reply(conn,HSC_INFO_MSG,0,
+                               "CPU%u: state=%s worker=%u run=%llu ms "
+                               "wait=%llu ms wait_avg=%llu us "
+                               "wait_max=%llu us",
+                               cpu->id,cpu_sched_state_name(s.state),
+                               s.worker,s.run_time / 1000000,
+                               s.wait_time / 1000000,
+                               s.wait_time / m_max(s.switch_count,1) / 1000,
+                               s.wait_max / 1000);
+
+         hypervisor_send_reply(conn,HSC_INFO_MSG,0,
+                               "CPU%u: switches=%llu preempted=%llu "
+                               "wakeups=%llu migrations=%llu throttled=%llu",
+                               cpu->id,s.switch_count,s.preempt_count,
+                               s.wakeup_count,s.migrate_count,
+                               s.throttle_count);
+         found = TRUE;
+      }
+   }
+
+   if (found) {
+      hypervisor_send_reply(conn,HSC_INFO_MSG,0,
+                            "Priority: %d (weight %u), quota: %u%%, "
+                            "CPU time: %llu ms, throttled: %llu",
+                            vm->sched_prio,s.weight,vm->sched_quota,
+                            s.group_run_time / 1000000,
+                            s.group_throttle_count);
+   }
+
+   vm_release(vm);
+   hypervisor_send_reply(conn,HSC_INFO_OK,1,"OK");
+   return(0);
+}
+
+/* Show statistics of a CPU timer clock */
+static void show_timer_clock(hypervisor_conn_t *conn,vclock_t *vc)
+{
+   hypervisor_send_reply(conn,HSC_INFO_MSG,0,"Timer Ticks: %llu",
+                         vc->tick_count);
+
+   hypervisor_send_reply(conn,HSC_INFO_MSG,0,"Dropped Timer Ticks: %llu",
+                         vc->drop_count);
+
+   hypervisor_send_reply(conn,HSC_INFO_MSG,0,"Max Tick Latency: %llu us",
+                         vc->late_max / 1000);
+
+   hypervisor_send_reply(conn,HSC_INFO_MSG,0,"Clock Service Overruns: %llu",
+                         vclock_get_overruns());
+}
+
 /* Show info about potential timer drift */
 static int cmd_show_timer_drift(hypervisor_conn_t *conn,
                                 int argc,char *argv[])
@@ -532,6 +878,8 @@ static int cmd_show_timer_drift(hypervisor_conn_t *conn,
 
          hypervisor_send_reply(conn,HSC_INFO_MSG,0,"Pending Timer IRQ: %u",
                                CPU_MIPS64(cpu)->timer_irq_pending);
+
+         show_timer_clock(conn,&CPU_MIPS64(cpu)->timer_clock);
          break;
 
      case CPU_TYPE_PPC32:
@@ -540,6 +888,8 @@ static int cmd_show_timer_drift(hypervisor_conn_t *conn,
 
          hypervisor_send_reply(conn,HSC_INFO_MSG,0,"Pending Timer IRQ: %u",
                                CPU_PPC32(cpu)->timer_irq_pending);
+
+         show_timer_clock(conn,&CPU_PPC32(cpu)->timer_clock);
          break;
    }
 
@@ -563,6 +913,33 @@ static int cmd_set_exec_area(hypervisor_conn_t *conn,int argc,char *argv[])
    return(0);
 }
 
+/* Set the MTS L2 cache size (in entries) */
+static int cmd_set_mts_l2_size(hypervisor_conn_t *conn,int argc,char *argv[])
+{
+   vm_instance_t *vm;
+   int size;
+
+   if (!(vm = hypervisor_find_object(conn,argv[0],OBJ_TYPE_VM)))
+      return(-1);
+
+   size = atoi(argv[1]);
+
+   /* 0 selects the default size */
+   if (size && ((size < MTS_L2_WAYS) || (size > MTS_L2_MAX_SIZE))) {
+      vm_release(vm);
+      hypervisor_send_reply(conn,HSC_ERR_INV_PARAM,1,
+                            "size must be 0 or between %d and %d",
+                            MTS_L2_WAYS,MTS_L2_MAX_SIZE);
+      return(-1);
+   }
+
+   vm->mts_l2_size = size;
+
+   vm_release(vm);
+   hypervisor_send_reply(conn,HSC_INFO_OK,1,"OK");
+   return(0);
+}
+
 /* Set ghost RAM file */
 static int cmd_set_ghost_file(hypervisor_conn_t *conn,int argc,char *argv[])
 {
@@ -594,6 +971,22 @@ static int cmd_set_ghost_status(hypervisor_conn_t *conn,int argc,char *argv[])
    return(0);
 }
 
+/* Set the directory of the ghost image cache */
+static int cmd_set_ghost_cache(hypervisor_conn_t *conn,int argc,char *argv[])
+{
+   vm_instance_t *vm;
+
+   if (!(vm = hypervisor_find_object(conn,argv[0],OBJ_TYPE_VM)))
+      return(-1);
+
+   free(vm->ghost_cache_dir);
+   vm->ghost_cache_dir = *argv[1] ? strdup(argv[1]) : NULL;
+
+   vm_release(vm);
+   hypervisor_send_reply(conn,HSC_INFO_OK,1,"OK");
+   return(0);
+}
+
 
 /* Set PCMCIA ATA disk0 size */
 static int cmd_set_disk0(hypervisor_conn_t *conn,int argc,char *argv[])
@@ -835,7 +1228,9 @@ static int cmd_suspend(hypervisor_conn_t *conn,int argc,char *argv[])
    if (!(vm = hypervisor_find_object(conn,argv[0],OBJ_TYPE_VM)))
       return(-1);
 
+   VM_STATE_LOCK(vm);
    vm_suspend(vm);
+   VM_STATE_UNLOCK(vm);
 
    vm_release(vm);
    hypervisor_send_reply(conn,HSC_INFO_OK,1,"VM '%s' suspended",argv[0]);
@@ -850,7 +1245,9 @@ static int cmd_resume(hypervisor_conn_t *conn,int argc,char *argv[])
    if (!(vm = hypervisor_find_object(conn,argv[0],OBJ_TYPE_VM)))
       return(-1);
 
+   VM_STATE_LOCK(vm);
    vm_resume(vm);
+   VM_STATE_UNLOCK(vm);
 
    vm_release(vm);
    hypervisor_send_reply(conn,HSC_INFO_OK,1,"VM '%s' resumed",argv[0]);
@@ -1261,10 +1658,18 @@ static hypervisor_cmd_t vm_cmd_array[] = {
    { "set_ram", 2, 2, cmd_set_ram, NULL },
    { "set_nvram", 2, 2, cmd_set_nvram, NULL },
    { "set_ram_mmap", 2, 2, cmd_set_ram_mmap, NULL },
+   { "set_ram_hugepages", 2, 2, cmd_set_ram_hugepages, NULL },
+   { "set_page_merge", 2, 2, cmd_set_page_merge, NULL },
+   { "show_page_merge_stats", 1, 1, cmd_show_page_merge_stats, NULL },
+   { "save_ram_snapshot", 2, 2, cmd_save_ram_snapshot, NULL },
+   { "show_ram_snapshot", 1, 1, cmd_show_ram_snapshot, NULL },
+   { "save_checkpoint", 2, 2, cmd_save_checkpoint, NULL },
+   { "restore_checkpoint", 2, 2, cmd_restore_checkpoint, NULL },
    { "set_sparse_mem", 2, 2, cmd_set_sparse_mem, NULL },
    { "set_clock_divisor", 2, 2, cmd_set_clock_divisor, NULL },
    { "set_blk_direct_jump", 2, 2, cmd_set_blk_direct_jump, NULL },
    { "set_exec_area", 2, 2, cmd_set_exec_area, NULL },
+   { "set_mts_l2_size", 2, 2, cmd_set_mts_l2_size, NULL },
    { "set_disk0", 2, 2, cmd_set_disk0, NULL },
    { "set_disk1", 2, 2, cmd_set_disk1, NULL },
    { "set_conf_reg", 2, 2, cmd_set_conf_reg, NULL },
@@ -1274,9 +1679,15 @@ static hypervisor_cmd_t vm_cmd_array[] = {
    { "show_idle_pc_prop", 2, 2, cmd_show_idle_pc_prop, NULL },
    { "set_idle_max", 3, 3, cmd_set_idle_max, NULL },
    { "set_idle_sleep_time", 3, 3, cmd_set_idle_sleep_time, NULL },
+   { "set_idle_auto", 2, 2, cmd_set_idle_auto, NULL },
+   { "show_idle_auto", 1, 1, cmd_show_idle_auto, NULL },
+   { "set_sched_prio", 2, 2, cmd_set_sched_prio, NULL },
+   { "set_sched_quota", 2, 2, cmd_set_sched_quota, NULL },
+   { "show_sched_stats", 1, 1, cmd_show_sched_stats, NULL },
    { "show_timer_drift", 2, 2, cmd_show_timer_drift, NULL },
    { "set_ghost_file", 2, 2, cmd_set_ghost_file, NULL },
    { "set_ghost_status", 2, 2, cmd_set_ghost_status, NULL },
+   { "set_ghost_cache", 2, 2, cmd_set_ghost_cache, NULL },
    { "set_con_tcp_port", 2, 2, cmd_set_con_tcp_port, NULL },
    { "set_aux_tcp_port", 2, 2, cmd_set_aux_tcp_port, NULL },
    { "extract_config", 1, 1, cmd_extract_config, NULL },
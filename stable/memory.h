@@ -54,6 +54,11 @@
 /* MTS32 hash on virtual addresses */
 #define MTS32_HASH(vaddr)  (((vaddr) >> MTS32_HASH_SHIFT) & MTS32_HASH_MASK)
 
+/* MTS L2 cache: ways per set, default and maximum size (in entries) */
+#define MTS_L2_WAYS          4
+#define MTS_L2_DEFAULT_SIZE  32768
+#define MTS_L2_MAX_SIZE      (1 << 20)
+
 /* Number of entries per chunk */
 #define MTS64_CHUNK_SIZE   256
 #define MTS32_CHUNK_SIZE   256
@@ -82,6 +87,10 @@ void memlog_dump(cpu_gen_t *cpu);
 /* Update the data obtained by a read access */
 void memlog_update_read(cpu_gen_t *cpu,m_iptr_t raddr);
 
+/* Get a DMA window (host pointer span) for a physical memory range */
+void *physmem_dma_window(vm_instance_t *vm,m_uint64_t paddr,size_t len,
+                         u_int op_type,size_t *win_len);
+
 /* Copy a memory block from VM physical RAM to real host */
 void physmem_copy_from_vm(vm_instance_t *vm,void *real_buffer,
                           m_uint64_t paddr,size_t len);
@@ -22,6 +22,7 @@
 #include "dynamips.h"
 #include "memory.h"
 #include "device.h"
+#include "vm_ckpt.h"
 
 /* MIPS general purpose registers names */
 char *mips64_gpr_reg_names[MIPS64_GPR_NR] = {
@@ -65,6 +66,7 @@ int mips64_reset(cpu_mips_t *cpu)
 
    /* Clear the complete TLB */
    memset(&cpu->cp0.tlb,0,MIPS64_TLB_MAX_ENTRIES*sizeof(tlb_entry_t));
+   mips64_cp0_tlb_index_rebuild(cpu);
 
    /* Restart the MTS subsystem */
    mips64_set_addr_mode(cpu,32/*64*/);  /* zzz */
@@ -78,6 +80,8 @@ int mips64_reset(cpu_mips_t *cpu)
 /* Initialize a MIPS64 processor */
 int mips64_init(cpu_mips_t *cpu)
 {
+   u_int i;
+
    cpu->addr_bus_mask = 0xFFFFFFFFFFFFFFFFULL;
    cpu->cp0.reg[MIPS_CP0_PRID] = MIPS_PRID_R4600;
    cpu->cp0.tlb_entries = MIPS64_TLB_STD_ENTRIES;
@@ -103,6 +107,10 @@ int mips64_init(cpu_mips_t *cpu)
    pthread_mutex_init(&cpu->gen->idle_mutex,NULL);
    pthread_cond_init(&cpu->gen->idle_cond,NULL);
 
+   /* Every IRQ breaks the idle wait (cheap if the CPU is running) */
+   for(i=0;i<8;i++)
+      cpu->irq_idle_preempt[i] = TRUE;
+
    /* Set the CPU methods */
    cpu->gen->reg_set =  (void *)mips64_reg_set;
    cpu->gen->reg_dump = (void *)mips64_dump_regs;
@@ -124,6 +132,7 @@ void mips64_delete(cpu_mips_t *cpu)
    if (cpu) {
       mips64_mem_shutdown(cpu);
       mips64_jit_shutdown(cpu);
+      mips64_exec_free_cache(cpu);
    }
 }
 
@@ -142,48 +151,33 @@ void mips64_set_idle_pc(cpu_gen_t *cpu,m_uint64_t addr)
    CPU_MIPS64(cpu)->idle_pc = addr;
 }
 
-/* Timer IRQ */
-void *mips64_timer_irq_run(cpu_mips_t *cpu)
+/* Start (or resynchronize) the timer IRQ clock */
+void mips64_timer_irq_start(cpu_mips_t *cpu)
 {
-   pthread_mutex_t umutex = PTHREAD_MUTEX_INITIALIZER;
-   pthread_cond_t ucond = PTHREAD_COND_INITIALIZER;
-   struct timespec t_spc;
-   m_tmcnt_t expire;
-   u_int interval;
-   u_int threshold;
-
-   interval = 1000000 / cpu->timer_irq_freq;
-   threshold = cpu->timer_irq_freq * 10;
-   expire = m_gettime_usec() + interval;
-
-   while(cpu->gen->state != CPU_STATE_HALTED) {
-      pthread_mutex_lock(&umutex);
-      t_spc.tv_sec = expire / 1000000;
-      t_spc.tv_nsec = (expire % 1000000) * 1000;
-      pthread_cond_timedwait(&ucond,&umutex,&t_spc);
-      pthread_mutex_unlock(&umutex);
-
-      if (likely(!cpu->irq_disable) && 
-          likely(cpu->gen->state == CPU_STATE_RUNNING)) 
-      {
-         cpu->timer_irq_pending++;
-
-         if (unlikely(cpu->timer_irq_pending > threshold)) {
-            cpu->timer_irq_pending = 0;
-            cpu->timer_drift++;
-#if 0
-            printf("Timer IRQ not accurate (%u pending IRQ): "
-                   "reduce the \"--timer-irq-check-itv\" parameter "
-                   "(current value: %u)\n",
-                   cpu->timer_irq_pending,cpu->timer_irq_check_itv);
-#endif
-         }
-      }
+   vclock_start(&cpu->timer_clock,cpu->timer_irq_freq);
+}
+
+/* Update the number of pending timer IRQs from the virtual clock */
+void mips64_timer_irq_update(cpu_mips_t *cpu)
+{
+   u_int ticks;
 
-      expire += interval;
+   if (!(ticks = vclock_ticks(&cpu->timer_clock)))
+      return;
+
+   /* Ticks are dropped while timer interrupts cannot be taken */
+   if (unlikely(cpu->irq_disable)) {
+      cpu->timer_clock.drop_count += ticks;
+      return;
    }
 
-   return NULL;
+   cpu->timer_irq_pending += ticks;
+
+   if (unlikely(cpu->timer_irq_pending > cpu->timer_irq_freq * 10)) {
+      cpu->timer_clock.drop_count += cpu->timer_irq_pending;
+      cpu->timer_irq_pending = 0;
+      cpu->timer_drift++;
+   }
 }
 
 #define IDLE_HASH_SIZE  8192
@@ -635,9 +629,12 @@ void mips64_dump_regs(cpu_gen_t *cpu)
           "IRQ Pending: %u\n",
           mcpu->irq_count,mcpu->irq_fp_count,mcpu->irq_pending);
 
-   printf("  Timer IRQ count: %llu, pending: %u, timer drift: %u\n\n",
+   printf("  Timer IRQ count: %llu, pending: %u, timer drift: %u\n",
           mcpu->timer_irq_count,mcpu->timer_irq_pending,mcpu->timer_drift);
 
+   printf("  Idle sleeps: %llu, early wakeups: %llu\n\n",
+          cpu->idle_sleep_count,cpu->idle_wakeup_count);
+
    printf("  Device access count: %llu\n",cpu->dev_access_counter);
    printf("\n");
 }
@@ -840,6 +837,7 @@ int mips64_restore_state(cpu_mips_t *cpu,char *filename)
       }
    }
 
+   mips64_cp0_tlb_index_rebuild(cpu);
    mips64_cp0_map_all_tlb_to_mts(cpu);
 
    mips64_dump_regs(cpu->gen);
@@ -849,6 +847,50 @@ int mips64_restore_state(cpu_mips_t *cpu,char *filename)
    return(0);
 }
 
+/* Save or restore the CPU state in a VM checkpoint */
+int mips64_ckpt(cpu_mips_t *cpu,vm_ckpt_t *ckpt)
+{
+   u_int addr_mode = cpu->addr_mode;
+
+   VM_CKPT_FIELD(ckpt,cpu->pc);
+   VM_CKPT_FIELD(ckpt,cpu->gpr);
+   VM_CKPT_FIELD(ckpt,cpu->lo);
+   VM_CKPT_FIELD(ckpt,cpu->hi);
+   VM_CKPT_FIELD(ckpt,cpu->ll_bit);
+   VM_CKPT_FIELD(ckpt,cpu->irq_pending);
+   VM_CKPT_FIELD(ckpt,cpu->irq_cause);
+   VM_CKPT_FIELD(ckpt,cpu->irq_disable);
+   VM_CKPT_FIELD(ckpt,cpu->cp0.reg);
+   VM_CKPT_FIELD(ckpt,cpu->cp0.tlb);
+   VM_CKPT_FIELD(ckpt,cpu->cp0.ipl_lo);
+   VM_CKPT_FIELD(ckpt,cpu->cp0.ipl_hi);
+   VM_CKPT_FIELD(ckpt,cpu->cp0.int_ctl);
+   VM_CKPT_FIELD(ckpt,cpu->cp0.derraddr0);
+   VM_CKPT_FIELD(ckpt,cpu->cp0.derraddr1);
+   VM_CKPT_FIELD(ckpt,cpu->fpu.reg);
+   VM_CKPT_FIELD(ckpt,cpu->cp0_virt_cnt_reg);
+   VM_CKPT_FIELD(ckpt,cpu->cp0_virt_cmp_reg);
+   VM_CKPT_FIELD(ckpt,addr_mode);
+
+   if (!ckpt->restore || ckpt->error)
+      return(ckpt->error ? -1 : 0);
+
+   if ((addr_mode != 32) && (addr_mode != 64)) {
+      ckpt->error = TRUE;
+      return(-1);
+   }
+
+   mips64_set_addr_mode(cpu,addr_mode);
+   mips64_cp0_tlb_index_rebuild(cpu);
+
+   /* RAM is restored too: drop the translated code */
+   mips64_jit_flush(cpu,0);
+
+   /* Force a new lookup of the current exec page (non-JIT) */
+   cpu->njm_exec_page = (m_uint64_t)-1;
+   return(0);
+}
+
 /* Load a raw image into the simulated memory */
 int mips64_load_raw_image(cpu_mips_t *cpu,char *filename,m_uint64_t vaddr)
 {   
@@ -904,12 +946,38 @@ int mips64_load_raw_image(cpu_mips_t *cpu,char *filename,m_uint64_t vaddr)
    return(0);
 }
 
+/* 
+ * Map a page of an ELF image at the specified virtual address, instead of
+ * copying it. With sparse memory, the page is read from the image file on 
+ * first access, and duplicated on first write.
+ */
+static int mips64_load_elf_map_page(cpu_mips_t *cpu,u_char *img_ptr,
+                                    size_t img_size,m_uint64_t vaddr,
+                                    size_t offset)
+{
+   m_uint32_t phys_page;
+   m_uint64_t paddr;
+
+   if (!img_ptr || (vaddr & MIPS_MIN_PAGE_IMASK) ||
+       (offset & MIPS_MIN_PAGE_IMASK) || 
+       ((offset + MIPS_MIN_PAGE_SIZE) > img_size))
+      return(-1);
+
+   if (cpu->translate(cpu,vaddr,&phys_page) != 0)
+      return(-1);
+
+   paddr = (m_uint64_t)phys_page << MIPS_MIN_PAGE_SHIFT;
+   return(dev_sparse_map_file_page(cpu->vm,paddr,(m_iptr_t)img_ptr + offset));
+}
+
 /* Load an ELF image into the simulated memory */
 int mips64_load_elf_image(cpu_mips_t *cpu,char *filename,int skip_load,
                           m_uint32_t *entry_point)
 {
    m_uint64_t vaddr;
    m_uint32_t remain;
+   u_char *img_ptr = NULL;
+   size_t img_size = 0,offset;
    void *haddr;
    Elf32_Ehdr *ehdr;
    Elf32_Shdr *shdr;
@@ -959,6 +1027,10 @@ int mips64_load_elf_image(cpu_mips_t *cpu,char *filename,int skip_load,
    }
 
    if (!skip_load) {
+      /* With sparse memory, image pages are loaded on demand */
+      if (cpu->vm->sparse_mem)
+         img_ptr = vm_ios_image_map(cpu->vm,filename,&img_size);
+
       for(i=0;i<ehdr->e_shnum;i++) {
          scn = elf_getscn(img_elf,i);
 
@@ -971,6 +1043,7 @@ int mips64_load_elf_image(cpu_mips_t *cpu,char *filename,int skip_load,
 
          fseek(bfd,shdr->sh_offset,SEEK_SET);
          vaddr = sign_extend(shdr->sh_addr,32);
+         offset = shdr->sh_offset;
 
          if (cpu->vm->debug_level > 0) {
             printf("   * Adding section at virtual address 0x%8.8llx "
@@ -979,6 +1052,17 @@ int mips64_load_elf_image(cpu_mips_t *cpu,char *filename,int skip_load,
          
          while(len > 0)
          {
+            if ((shdr->sh_type == SHT_PROGBITS) && 
+                (len >= MIPS_MIN_PAGE_SIZE) &&
+                !mips64_load_elf_map_page(cpu,img_ptr,img_size,vaddr,offset))
+            {
+               fseek(bfd,MIPS_MIN_PAGE_SIZE,SEEK_CUR);
+               vaddr  += MIPS_MIN_PAGE_SIZE;
+               offset += MIPS_MIN_PAGE_SIZE;
+               len    -= MIPS_MIN_PAGE_SIZE;
+               continue;
+            }
+
             haddr = cpu->mem_op_lookup(cpu,vaddr);
    
             if (!haddr) {
@@ -1001,6 +1085,7 @@ int mips64_load_elf_image(cpu_mips_t *cpu,char *filename,int skip_load,
                break;
 
             vaddr += clen;
+            offset += clen;
             len -= clen;
          }
       }
@@ -10,6 +10,7 @@
 
 #include "utils.h" 
 #include "rbtree.h"
+#include "vclock.h"
 
 /* 
  * MIPS General Purpose Registers 
@@ -251,6 +252,13 @@
 #define MIPS64_TLB_MAX_ENTRIES  64
 #define MIPS64_TLB_IDX_MASK     0x3f   /* 6 bits */
 
+/* Hashed index of TLB entries (by VPN2, for each page size in use) */
+#define MIPS64_TLB_HASH_BITS    8
+#define MIPS64_TLB_HASH_SIZE    (1 << MIPS64_TLB_HASH_BITS)
+
+/* MTS hash slots remembered per TLB entry (more: range invalidation) */
+#define MIPS64_TLB_RMAP_SIZE    16
+
 /* Enable the 64 TLB entries for R7000 CPU */
 #define MIPS64_R7000_TLB64_ENABLE   0x20000000
 
@@ -327,6 +335,17 @@ typedef struct {
    /* Number of TLB entries */
    u_int tlb_entries;
 
+   /* TLB index: hash chains of entries, and page sizes in use */
+   int tlb_hash[MIPS64_TLB_HASH_SIZE];
+   int tlb_hash_next[MIPS64_TLB_MAX_ENTRIES];
+   u_int tlb_hash_bucket[MIPS64_TLB_MAX_ENTRIES];
+   m_uint64_t tlb_hash_mask[MIPS64_TLB_MAX_ENTRIES];
+   struct {
+      m_uint64_t mask;
+      u_int count;
+   }tlb_pmask[MIPS64_TLB_MAX_ENTRIES];
+   u_int tlb_pmask_count;
+
    /* Extensions for R7000 CP0 Set1 */
    m_uint32_t ipl_lo,ipl_hi,int_ctl;
    m_uint32_t derraddr0,derraddr1;
@@ -345,6 +364,13 @@ struct cpu_mips {
       mts64_entry_t *mts64_cache;
    }mts_u;
 
+   /* MTS32/MTS64 L2 caches (set-associative, behind the L1 above) */
+   union {
+      mts32_l2_entry_t *mts32_l2_cache;
+      mts64_l2_entry_t *mts64_l2_cache;
+   }mts_l2_u;
+   m_uint32_t mts_l2_set_mask;
+
    /* Virtual version of CP0 Compare Register */
    m_uint32_t cp0_virt_cnt_reg,cp0_virt_cmp_reg;
 
@@ -397,6 +423,7 @@ struct cpu_mips {
    u_int timer_irq_freq;
    u_int timer_irq_check_itv;
    u_int timer_drift;
+   vclock_t timer_clock;
 
    /* IRQ disable flag */
    volatile u_int irq_disable;
@@ -425,6 +452,17 @@ struct cpu_mips {
 
    /* MTS cache statistics */
    m_uint64_t mts_misses,mts_lookups;
+   m_uint64_t mts_tlb_inval,mts_tlb_inval_slots;
+   m_uint64_t mts_l2_hits;
+
+   /* Generation of each TLB entry, to validate the MTS L2 cache entries */
+   m_uint32_t mts_tlb_gen[MIPS64_TLB_MAX_ENTRIES];
+
+   /* Reverse map: MTS hash slots filled from each TLB entry */
+   struct {
+      m_uint32_t slots[MIPS64_TLB_RMAP_SIZE];
+      u_int count;
+   }mts_tlb_rmap[MIPS64_TLB_MAX_ENTRIES];
 
    /* JIT flush method */
    u_int jit_flush_method;
@@ -445,6 +483,10 @@ struct cpu_mips {
    m_uint64_t njm_exec_page;
    mips_insn_t *njm_exec_ptr;
 
+   /* Predecoded page cache (non-JIT) and page matching njm_exec_page */
+   struct mips64_njm_page **njm_cache;
+   struct mips64_njm_page *njm_page;
+
    /* Performance counter (number of instructions executed by CPU) */
    m_uint32_t perf_counter;
 
@@ -481,8 +523,11 @@ void mips64_set_prid(cpu_mips_t *cpu,m_uint32_t prid);
 /* Set idle PC value */
 void mips64_set_idle_pc(cpu_gen_t *cpu,m_uint64_t addr);
 
-/* Timer IRQ */
-void *mips64_timer_irq_run(cpu_mips_t *cpu);
+/* Start (or resynchronize) the timer IRQ clock */
+void mips64_timer_irq_start(cpu_mips_t *cpu);
+
+/* Update the number of pending timer IRQs from the virtual clock */
+void mips64_timer_irq_update(cpu_mips_t *cpu);
 
 /* Determine an "idling" PC */
 int mips64_get_idling_pc(cpu_gen_t *cpu);
@@ -568,6 +613,9 @@ void mips64_dump_stack(cpu_mips_t *cpu,u_int count);
 /* Save the CPU state into a file */
 int mips64_save_state(cpu_mips_t *cpu,char *filename);
 
+/* Save or restore the CPU state in a VM checkpoint */
+int mips64_ckpt(cpu_mips_t *cpu,vm_ckpt_t *ckpt);
+
 /* Load a raw image into the simulated memory */
 int mips64_load_raw_image(cpu_mips_t *cpu,char *filename,m_uint64_t vaddr);
 
@@ -2737,3 +2737,479 @@ struct mips64_insn_tag mips64_insn_tags[] = {
    { mips64_emit_unknown , 0x00000000 , 0x00000000, 1 },
    { NULL                , 0x00000000 , 0x00000000, 0 },
 };
+
+/* ======================================================================== */
+/* Tier 2: MIPS GPRs cached in host registers                               */
+/* ======================================================================== */
+
+/* Host registers available for GPR caching (unused by tier 1 emitters) */
+static int mips64_t2_hregs[MIPS64_JIT_TIER2_HREGS] = {
+   AMD64_R8, AMD64_R9, AMD64_R10, AMD64_R11, AMD64_R12, AMD64_R13,
+};
+
+#define DECLARE_T2_INSN(name) \
+   static int mips64_t2_emit_##name(cpu_mips_t *cpu,mips64_jit_tcb_t *b, \
+                                    mips_insn_t insn)
+
+/* Reset the tier 2 register cache */
+void mips64_jit_tier2_reset(struct mips64_jit_tier2 *t2)
+{
+   int i;
+
+   for(i=0;i<MIPS64_JIT_TIER2_HREGS;i++) {
+      t2->gpr[i] = -1;
+      t2->age[i] = 0;
+   }
+
+   t2->clock  = 0;
+   t2->dirty  = 0;
+   t2->region = FALSE;
+}
+
+/* Write back a host register to its GPR if modified */
+static void mips64_t2_spill(mips64_jit_tcb_t *b,int i)
+{
+   struct mips64_jit_tier2 *t2 = b->tier2;
+
+   if (t2->dirty & (1 << i)) {
+      amd64_mov_membase_reg(b->jit_ptr,AMD64_R15,REG_OFFSET(t2->gpr[i]),
+                            mips64_t2_hregs[i],8);
+      t2->dirty &= ~(1 << i);
+   }
+}
+
+/* End a tier 2 region: write back modified GPRs */
+void mips64_jit_tier2_flush(mips64_jit_tcb_t *b)
+{
+   int i;
+
+   for(i=0;i<MIPS64_JIT_TIER2_HREGS;i++)
+      mips64_t2_spill(b,i);
+
+   mips64_jit_tier2_reset(b->tier2);
+}
+
+/* Get a free host register, evicting the least recently used one */
+static int mips64_t2_alloc(mips64_jit_tcb_t *b,u_int pinned)
+{
+   struct mips64_jit_tier2 *t2 = b->tier2;
+   int i,victim = -1;
+
+   for(i=0;i<MIPS64_JIT_TIER2_HREGS;i++)
+      if (t2->gpr[i] == -1)
+         return(i);
+
+   for(i=0;i<MIPS64_JIT_TIER2_HREGS;i++) {
+      if (pinned & (1 << i))
+         continue;
+
+      if ((victim == -1) || (t2->age[i] < t2->age[victim]))
+         victim = i;
+   }
+
+   mips64_t2_spill(b,victim);
+   t2->gpr[victim] = -1;
+   return(victim);
+}
+
+/* Find the host register holding a GPR */
+static int mips64_t2_lookup(struct mips64_jit_tier2 *t2,int gpr)
+{
+   int i;
+
+   for(i=0;i<MIPS64_JIT_TIER2_HREGS;i++)
+      if (t2->gpr[i] == gpr)
+         return(i);
+
+   return(-1);
+}
+
+/* Get a host register holding the value of a source GPR */
+static int mips64_t2_get_src(mips64_jit_tcb_t *b,int gpr,u_int *pinned)
+{
+   struct mips64_jit_tier2 *t2 = b->tier2;
+   int i,hreg;
+
+   if ((i = mips64_t2_lookup(t2,gpr)) == -1) {
+      i = mips64_t2_alloc(b,*pinned);
+      hreg = mips64_t2_hregs[i];
+
+      if (gpr == 0) {
+         amd64_alu_reg_reg(b->jit_ptr,X86_XOR,hreg,hreg);
+      } else {
+         amd64_mov_reg_membase(b->jit_ptr,hreg,AMD64_R15,REG_OFFSET(gpr),8);
+      }
+
+      t2->gpr[i] = gpr;
+   }
+
+   t2->age[i] = ++t2->clock;
+   *pinned |= 1 << i;
+   return(mips64_t2_hregs[i]);
+}
+
+/* Get the host register receiving a destination GPR (never $0) */
+static int mips64_t2_get_dst(mips64_jit_tcb_t *b,int gpr,u_int pinned)
+{
+   struct mips64_jit_tier2 *t2 = b->tier2;
+   int i;
+
+   if ((i = mips64_t2_lookup(t2,gpr)) == -1) {
+      i = mips64_t2_alloc(b,pinned);
+      t2->gpr[i] = gpr;
+   }
+
+   t2->age[i] = ++t2->clock;
+   t2->dirty |= 1 << i;
+   return(mips64_t2_hregs[i]);
+}
+
+/* Emit a 3-operand ALU operation (64-bit, or 32-bit with sign extension) */
+static void mips64_t2_alu_reg(mips64_jit_tcb_t *b,int opc,
+                              int rd,int rs,int rt,int is_32)
+{
+   u_int pinned = 0;
+   int hs,ht,hd;
+
+   if (rd == 0)
+      return;
+
+   hs = mips64_t2_get_src(b,rs,&pinned);
+   ht = mips64_t2_get_src(b,rt,&pinned);
+   hd = mips64_t2_get_dst(b,rd,pinned);
+
+   amd64_mov_reg_reg(b->jit_ptr,AMD64_RAX,hs,8);
+   amd64_alu_reg_reg(b->jit_ptr,opc,AMD64_RAX,ht);
+
+   if (is_32)
+      amd64_movsxd_reg_reg(b->jit_ptr,hd,X86_EAX);
+   else
+      amd64_mov_reg_reg(b->jit_ptr,hd,AMD64_RAX,8);
+}
+
+/* Emit an ALU operation with an immediate value */
+static void mips64_t2_alu_imm(mips64_jit_tcb_t *b,int opc,
+                              int rt,int rs,m_uint64_t val,int is_32)
+{
+   u_int pinned = 0;
+   int hs,hd;
+
+   if (rt == 0)
+      return;
+
+   hs = mips64_t2_get_src(b,rs,&pinned);
+   hd = mips64_t2_get_dst(b,rt,pinned);
+
+   mips64_load_imm(b,AMD64_RAX,val);
+   amd64_alu_reg_reg(b->jit_ptr,opc,AMD64_RAX,hs);
+
+   if (is_32)
+      amd64_movsxd_reg_reg(b->jit_ptr,hd,X86_EAX);
+   else
+      amd64_mov_reg_reg(b->jit_ptr,hd,AMD64_RAX,8);
+}
+
+/* Emit a 32-bit shift by a constant amount */
+static void mips64_t2_shift_imm(mips64_jit_tcb_t *b,int opc,mips_insn_t insn)
+{
+   int rt = bits(insn,16,20);
+   int rd = bits(insn,11,15);
+   int sa = bits(insn,6,10);
+   u_int pinned = 0;
+   int ht,hd;
+
+   if (rd == 0)
+      return;
+
+   ht = mips64_t2_get_src(b,rt,&pinned);
+   hd = mips64_t2_get_dst(b,rd,pinned);
+
+   amd64_mov_reg_reg(b->jit_ptr,AMD64_RAX,ht,4);
+   amd64_shift_reg_imm_size(b->jit_ptr,opc,AMD64_RAX,sa,4);
+   amd64_movsxd_reg_reg(b->jit_ptr,hd,X86_EAX);
+}
+
+/* Emit a "set on less than" comparison */
+static void mips64_t2_set_lt(mips64_jit_tcb_t *b,int rd,int rs,int rt,
+                             m_uint64_t val,int use_imm,int is_signed)
+{
+   u_int pinned = 0;
+   int hs,ht,hd;
+
+   if (rd == 0)
+      return;
+
+   hs = mips64_t2_get_src(b,rs,&pinned);
+
+   if (use_imm) {
+      mips64_load_imm(b,AMD64_RDX,val);
+      ht = AMD64_RDX;
+   } else {
+      ht = mips64_t2_get_src(b,rt,&pinned);
+   }
+
+   hd = mips64_t2_get_dst(b,rd,pinned);
+
+   amd64_clear_reg(b->jit_ptr,AMD64_RAX);
+   amd64_alu_reg_reg(b->jit_ptr,X86_CMP,hs,ht);
+   amd64_set_reg(b->jit_ptr,X86_CC_LT,AMD64_RAX,is_signed);
+   amd64_mov_reg_reg(b->jit_ptr,hd,AMD64_RAX,8);
+}
+
+/* ADDIU */
+DECLARE_T2_INSN(ADDIU)
+{
+   int rs  = bits(insn,21,25);
+   int rt  = bits(insn,16,20);
+   int imm = bits(insn,0,15);
+
+   mips64_t2_alu_imm(b,X86_ADD,rt,rs,sign_extend(imm,16),TRUE);
+   return(0);
+}
+
+/* ADDU */
+DECLARE_T2_INSN(ADDU)
+{
+   int rs = bits(insn,21,25);
+   int rt = bits(insn,16,20);
+   int rd = bits(insn,11,15);
+
+   mips64_t2_alu_reg(b,X86_ADD,rd,rs,rt,TRUE);
+   return(0);
+}
+
+/* AND */
+DECLARE_T2_INSN(AND)
+{
+   int rs = bits(insn,21,25);
+   int rt = bits(insn,16,20);
+   int rd = bits(insn,11,15);
+
+   mips64_t2_alu_reg(b,X86_AND,rd,rs,rt,FALSE);
+   return(0);
+}
+
+/* ANDI */
+DECLARE_T2_INSN(ANDI)
+{
+   int rs  = bits(insn,21,25);
+   int rt  = bits(insn,16,20);
+   int imm = bits(insn,0,15);
+
+   mips64_t2_alu_imm(b,X86_AND,rt,rs,imm,FALSE);
+   return(0);
+}
+
+/* DADDIU */
+DECLARE_T2_INSN(DADDIU)
+{
+   int rs  = bits(insn,21,25);
+   int rt  = bits(insn,16,20);
+   int imm = bits(insn,0,15);
+
+   mips64_t2_alu_imm(b,X86_ADD,rt,rs,sign_extend(imm,16),FALSE);
+   return(0);
+}
+
+/* DADDU */
+DECLARE_T2_INSN(DADDU)
+{
+   int rs = bits(insn,21,25);
+   int rt = bits(insn,16,20);
+   int rd = bits(insn,11,15);
+
+   mips64_t2_alu_reg(b,X86_ADD,rd,rs,rt,FALSE);
+   return(0);
+}
+
+/* LUI */
+DECLARE_T2_INSN(LUI)
+{
+   int rt  = bits(insn,16,20);
+   int imm = bits(insn,0,15);
+   m_uint64_t val = sign_extend(imm,16) << 16;
+   int hd;
+
+   if (rt == 0)
+      return(0);
+
+   hd = mips64_t2_get_dst(b,rt,0);
+   mips64_load_imm(b,AMD64_RAX,val);
+   amd64_mov_reg_reg(b->jit_ptr,hd,AMD64_RAX,8);
+   return(0);
+}
+
+/* NOR */
+DECLARE_T2_INSN(NOR)
+{
+   int rs = bits(insn,21,25);
+   int rt = bits(insn,16,20);
+   int rd = bits(insn,11,15);
+   int hd;
+
+   if (rd == 0)
+      return(0);
+
+   mips64_t2_alu_reg(b,X86_OR,rd,rs,rt,FALSE);
+   hd = mips64_t2_get_dst(b,rd,0);
+   amd64_not_reg(b->jit_ptr,hd);
+   return(0);
+}
+
+/* OR */
+DECLARE_T2_INSN(OR)
+{
+   int rs = bits(insn,21,25);
+   int rt = bits(insn,16,20);
+   int rd = bits(insn,11,15);
+
+   mips64_t2_alu_reg(b,X86_OR,rd,rs,rt,FALSE);
+   return(0);
+}
+
+/* ORI */
+DECLARE_T2_INSN(ORI)
+{
+   int rs  = bits(insn,21,25);
+   int rt  = bits(insn,16,20);
+   int imm = bits(insn,0,15);
+
+   mips64_t2_alu_imm(b,X86_OR,rt,rs,imm,FALSE);
+   return(0);
+}
+
+/* SLL */
+DECLARE_T2_INSN(SLL)
+{
+   mips64_t2_shift_imm(b,X86_SHL,insn);
+   return(0);
+}
+
+/* SLT */
+DECLARE_T2_INSN(SLT)
+{
+   int rs = bits(insn,21,25);
+   int rt = bits(insn,16,20);
+   int rd = bits(insn,11,15);
+
+   mips64_t2_set_lt(b,rd,rs,rt,0,FALSE,TRUE);
+   return(0);
+}
+
+/* SLTI */
+DECLARE_T2_INSN(SLTI)
+{
+   int rs  = bits(insn,21,25);
+   int rt  = bits(insn,16,20);
+   int imm = bits(insn,0,15);
+
+   mips64_t2_set_lt(b,rt,rs,0,sign_extend(imm,16),TRUE,TRUE);
+   return(0);
+}
+
+/* SLTIU */
+DECLARE_T2_INSN(SLTIU)
+{
+   int rs  = bits(insn,21,25);
+   int rt  = bits(insn,16,20);
+   int imm = bits(insn,0,15);
+
+   mips64_t2_set_lt(b,rt,rs,0,sign_extend(imm,16),TRUE,FALSE);
+   return(0);
+}
+
+/* SLTU */
+DECLARE_T2_INSN(SLTU)
+{
+   int rs = bits(insn,21,25);
+   int rt = bits(insn,16,20);
+   int rd = bits(insn,11,15);
+
+   mips64_t2_set_lt(b,rd,rs,rt,0,FALSE,FALSE);
+   return(0);
+}
+
+/* SRA */
+DECLARE_T2_INSN(SRA)
+{
+   mips64_t2_shift_imm(b,X86_SAR,insn);
+   return(0);
+}
+
+/* SRL */
+DECLARE_T2_INSN(SRL)
+{
+   mips64_t2_shift_imm(b,X86_SHR,insn);
+   return(0);
+}
+
+/* SUBU */
+DECLARE_T2_INSN(SUBU)
+{
+   int rs = bits(insn,21,25);
+   int rt = bits(insn,16,20);
+   int rd = bits(insn,11,15);
+
+   mips64_t2_alu_reg(b,X86_SUB,rd,rs,rt,TRUE);
+   return(0);
+}
+
+/* XOR */
+DECLARE_T2_INSN(XOR)
+{
+   int rs = bits(insn,21,25);
+   int rt = bits(insn,16,20);
+   int rd = bits(insn,11,15);
+
+   mips64_t2_alu_reg(b,X86_XOR,rd,rs,rt,FALSE);
+   return(0);
+}
+
+/* XORI */
+DECLARE_T2_INSN(XORI)
+{
+   int rs  = bits(insn,21,25);
+   int rt  = bits(insn,16,20);
+   int imm = bits(insn,0,15);
+
+   mips64_t2_alu_imm(b,X86_XOR,rt,rs,imm,FALSE);
+   return(0);
+}
+
+/* MIPS instructions handled by the tier 2 code generator */
+static struct mips64_insn_tag mips64_insn_tags_tier2[] = {
+   { mips64_t2_emit_ADDIU   , 0xfc000000 , 0x24000000, 1 },
+   { mips64_t2_emit_ADDU    , 0xfc0007ff , 0x00000021, 1 },
+   { mips64_t2_emit_AND     , 0xfc0007ff , 0x00000024, 1 },
+   { mips64_t2_emit_ANDI    , 0xfc000000 , 0x30000000, 1 },
+   { mips64_t2_emit_DADDIU  , 0xfc000000 , 0x64000000, 1 },
+   { mips64_t2_emit_DADDU   , 0xfc0007ff , 0x0000002d, 1 },
+   { mips64_t2_emit_LUI     , 0xffe00000 , 0x3c000000, 1 },
+   { mips64_t2_emit_NOR     , 0xfc0007ff , 0x00000027, 1 },
+   { mips64_t2_emit_OR      , 0xfc0007ff , 0x00000025, 1 },
+   { mips64_t2_emit_ORI     , 0xfc000000 , 0x34000000, 1 },
+   { mips64_t2_emit_SLL     , 0xffe0003f , 0x00000000, 1 },
+   { mips64_t2_emit_SLT     , 0xfc0007ff , 0x0000002a, 1 },
+   { mips64_t2_emit_SLTI    , 0xfc000000 , 0x28000000, 1 },
+   { mips64_t2_emit_SLTIU   , 0xfc000000 , 0x2c000000, 1 },
+   { mips64_t2_emit_SLTU    , 0xfc0007ff , 0x0000002b, 1 },
+   { mips64_t2_emit_SRA     , 0xffe0003f , 0x00000003, 1 },
+   { mips64_t2_emit_SRL     , 0xffe0003f , 0x00000002, 1 },
+   { mips64_t2_emit_SUBU    , 0xfc0007ff , 0x00000023, 1 },
+   { mips64_t2_emit_XOR     , 0xfc0007ff , 0x00000026, 1 },
+   { mips64_t2_emit_XORI    , 0xfc000000 , 0x38000000, 1 },
+   { NULL                   , 0x00000000 , 0x00000000, 0 },
+};
+
+/* Find the tier 2 emitter for a MIPS instruction */
+struct mips64_insn_tag *mips64_jit_tier2_find(mips_insn_t insn)
+{
+   int i;
+
+   for(i=0;mips64_insn_tags_tier2[i].emit;i++)
+      if ((insn & mips64_insn_tags_tier2[i].mask) == 
+          mips64_insn_tags_tier2[i].value)
+         return(&mips64_insn_tags_tier2[i]);
+
+   return NULL;
+}
@@ -14,6 +14,27 @@
 
 #define JIT_SUPPORT 1
 
+/* Tier 2 code generation: MIPS GPRs cached in host registers R8-R13 */
+#define MIPS64_JIT_TIER2       1
+#define MIPS64_JIT_TIER2_HREGS 6
+
+/* Tier 2 compilation state of a translated block */
+struct mips64_jit_tier2 {
+   /* Static jump targets (bitmap of instruction positions) */
+   m_uint32_t targets[MIPS_INSN_PER_PAGE / 32];
+
+   /* MIPS GPR held by each host register (-1 if free) */
+   int gpr[MIPS64_JIT_TIER2_HREGS];
+   u_int age[MIPS64_JIT_TIER2_HREGS];
+   u_int clock;
+
+   /* Host registers to write back at the end of the region */
+   u_int dirty;
+
+   /* Inside a region (host registers are valid) */
+   int region;
+};
+
 /* Manipulate bitmasks atomically */
 static forced_inline void atomic_or(m_uint32_t *v,m_uint32_t m)
 {
@@ -32,6 +53,15 @@ static forced_inline void atomic_and(m_uint32_t *v,m_uint32_t m)
 /* MIPS instruction array */
 extern struct mips64_insn_tag mips64_insn_tags[];
 
+/* Reset the tier 2 register cache */
+void mips64_jit_tier2_reset(struct mips64_jit_tier2 *t2);
+
+/* End a tier 2 region: write back modified GPRs */
+void mips64_jit_tier2_flush(mips64_jit_tcb_t *b);
+
+/* Find the tier 2 emitter for a MIPS instruction */
+struct mips64_insn_tag *mips64_jit_tier2_find(mips_insn_t insn);
+
 /* Push epilog for an amd64 instruction block */
 static forced_inline void mips64_jit_tcb_push_epilog(mips64_jit_tcb_t *block)
 {
@@ -54,6 +84,7 @@ void mips64_jit_tcb_exec(cpu_mips_t *cpu,mips64_jit_tcb_t *block)
    }
 
    asm volatile ("movq %0,%%r15"::"r"(cpu):
+                 "r8","r9","r10","r11","r12","r13",
                  "r14","r15","rax","rbx","rcx","rdx","rdi","rsi");
    jit_code();
 }
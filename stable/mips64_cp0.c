@@ -343,13 +343,96 @@ static forced_inline m_uint64_t mips64_cp0_get_vpn2_mask(cpu_mips_t *cpu)
       return(MIPS_TLB_VPN2_MASK_32);
 }
 
-/* TLB lookup */
-int mips64_cp0_tlb_lookup(cpu_mips_t *cpu,m_uint64_t vaddr,mts_map_t *res)
+/* 
+ * Hash a VPN2 for the TLB index. Only bits 13-31 are used since they are
+ * compared in both 32-bit and 64-bit addressing modes.
+ */
+static forced_inline u_int mips64_cp0_tlb_hash(m_uint64_t vpn2)
+{
+   m_uint32_t val = (m_uint32_t)vpn2 >> 13;
+   return((val * 0x9e3779b1) >> (32 - MIPS64_TLB_HASH_BITS));
+}
+
+/* Remove a TLB entry from the TLB index */
+static void mips64_cp0_tlb_index_remove(mips_cp0_t *cp0,int index)
+{
+   int *ip;
+   u_int i;
+
+   for(ip=&cp0->tlb_hash[cp0->tlb_hash_bucket[index]];*ip!=-1;
+       ip=&cp0->tlb_hash_next[*ip])
+   {
+      if (*ip == index) {
+         *ip = cp0->tlb_hash_next[index];
+         break;
+      }
+   }
+
+   for(i=0;i<cp0->tlb_pmask_count;i++) {
+      if (cp0->tlb_pmask[i].mask == cp0->tlb_hash_mask[index]) {
+         if (!--cp0->tlb_pmask[i].count)
+            cp0->tlb_pmask[i] = cp0->tlb_pmask[--cp0->tlb_pmask_count];
+         break;
+      }
+   }
+}
+
+/* Add a TLB entry to the TLB index, given its current page mask and VPN2 */
+static void mips64_cp0_tlb_index_add(mips_cp0_t *cp0,int index)
+{
+   tlb_entry_t *entry = &cp0->tlb[index];
+   m_uint64_t page_mask;
+   u_int i,bucket;
+
+   page_mask = ~(entry->mask + 0x1FFF);
+   bucket = mips64_cp0_tlb_hash(entry->hi & page_mask);
+
+   cp0->tlb_hash_bucket[index] = bucket;
+   cp0->tlb_hash_mask[index] = entry->mask;
+   cp0->tlb_hash_next[index] = cp0->tlb_hash[bucket];
+   cp0->tlb_hash[bucket] = index;
+
+   for(i=0;i<cp0->tlb_pmask_count;i++) {
+      if (cp0->tlb_pmask[i].mask == entry->mask) {
+         cp0->tlb_pmask[i].count++;
+         return;
+      }
+   }
+
+   cp0->tlb_pmask[i].mask  = entry->mask;
+   cp0->tlb_pmask[i].count = 1;
+   cp0->tlb_pmask_count++;
+}
+
+/* Update the TLB index after a change of the specified TLB entry */
+void mips64_cp0_tlb_index_update(cpu_mips_t *cpu,int index)
+{
+   mips64_cp0_tlb_index_remove(&cpu->cp0,index);
+   mips64_cp0_tlb_index_add(&cpu->cp0,index);
+}
+
+/* Rebuild the TLB index from scratch */
+void mips64_cp0_tlb_index_rebuild(cpu_mips_t *cpu)
+{
+   mips_cp0_t *cp0 = &cpu->cp0;
+   int i;
+
+   for(i=0;i<MIPS64_TLB_HASH_SIZE;i++)
+      cp0->tlb_hash[i] = -1;
+
+   cp0->tlb_pmask_count = 0;
+
+   for(i=0;i<MIPS64_TLB_MAX_ENTRIES;i++)
+      mips64_cp0_tlb_index_add(cp0,i);
+}
+
+#if DEBUG_TLB_INDEX
+/* Find the first TLB entry matching a virtual address (linear scan) */
+static int mips64_cp0_tlb_find_linear(cpu_mips_t *cpu,m_uint64_t vaddr)
 {
    mips_cp0_t *cp0 = &cpu->cp0;
    m_uint64_t vpn_addr,vpn2_mask;
    m_uint64_t page_mask,hi_addr;
-   m_uint32_t page_size,pca;
    tlb_entry_t *entry;
    u_int asid;
    int i;
@@ -368,53 +451,96 @@ int mips64_cp0_tlb_lookup(cpu_mips_t *cpu,m_uint64_t vaddr,mts_map_t *res)
       if (((vpn_addr & page_mask) == hi_addr) &&
           ((entry->hi & MIPS_TLB_G_MASK) ||
            ((entry->hi & MIPS_TLB_ASID_MASK) == asid)))
-      {
-         page_size = get_page_size(entry->mask);
-
-         if ((vaddr & page_size) == 0) {
-            /* Even Page */
-            if (entry->lo0 & MIPS_TLB_V_MASK) {
-               res->vaddr = vaddr & MIPS_MIN_PAGE_MASK;
-               res->paddr = (entry->lo0 & MIPS_TLB_PFN_MASK) << 6;
-               res->paddr += (res->vaddr & (page_size-1));
-               res->paddr &= cpu->addr_bus_mask;
-
-               res->offset = vaddr & MIPS_MIN_PAGE_IMASK;
-
-               pca = (entry->lo0 & MIPS_TLB_C_MASK);
-               pca >>= MIPS_TLB_C_SHIFT;
-               res->cached = mips64_cca_cached(pca);
-            
-               res->tlb_index = i;
-               return(TRUE);
-            }
-         } else {
-            /* Odd Page */
-            if (entry->lo1 & MIPS_TLB_V_MASK) {
-
-               res->vaddr = vaddr & MIPS_MIN_PAGE_MASK;
-               res->paddr = (entry->lo1 & MIPS_TLB_PFN_MASK) << 6;
-               res->paddr += (res->vaddr & (page_size-1));
-               res->paddr &= cpu->addr_bus_mask;
-
-               res->offset = vaddr & MIPS_MIN_PAGE_IMASK;
-
-               pca = (entry->lo1 & MIPS_TLB_C_MASK);
-               pca >>= MIPS_TLB_C_SHIFT;
-               res->cached = mips64_cca_cached(pca);
-               
-               res->tlb_index = i;
-               return(TRUE);
-            }
-         }
-
-         /* Invalid entry */
-         return(FALSE);
+         return(i);
+   }
+
+   return(-1);
+}
+#endif
+
+/* 
+ * Find the first TLB entry matching a virtual address, using the TLB index:
+ * the hash chain is probed for each page size in use.
+ */
+static int mips64_cp0_tlb_find(cpu_mips_t *cpu,m_uint64_t vaddr)
+{
+   mips_cp0_t *cp0 = &cpu->cp0;
+   m_uint64_t vpn_addr,vpn2_mask;
+   m_uint64_t page_mask,hi_addr;
+   tlb_entry_t *entry;
+   u_int asid,p;
+   int i,res = -1;
+
+   vpn2_mask = mips64_cp0_get_vpn2_mask(cpu);
+   vpn_addr = vaddr & vpn2_mask;
+
+   asid = cp0->reg[MIPS_CP0_TLB_HI] & MIPS_TLB_ASID_MASK;
+
+   for(p=0;p<cp0->tlb_pmask_count;p++) {
+      page_mask = ~(cp0->tlb_pmask[p].mask + 0x1FFF);
+      i = cp0->tlb_hash[mips64_cp0_tlb_hash(vpn_addr & page_mask)];
+
+      for(;i!=-1;i=cp0->tlb_hash_next[i]) {
+         if ((i >= cp0->tlb_entries) || ((res != -1) && (i >= res)))
+            continue;
+
+         entry = &cp0->tlb[i];
+         hi_addr = entry->hi & vpn2_mask;
+
+         if (((vpn_addr & ~(entry->mask + 0x1FFF)) == hi_addr) &&
+             ((entry->hi & MIPS_TLB_G_MASK) ||
+              ((entry->hi & MIPS_TLB_ASID_MASK) == asid)))
+            res = i;
       }
    }
 
+#if DEBUG_TLB_INDEX
+   if (res != mips64_cp0_tlb_find_linear(cpu,vaddr)) {
+      cpu_log(cpu->gen,"TLB","index mismatch for vaddr 0x%llx: "
+              "index=%d, linear=%d\n",
+              vaddr,res,mips64_cp0_tlb_find_linear(cpu,vaddr));
+   }
+#endif
+
+   return(res);
+}
+
+/* TLB lookup */
+int mips64_cp0_tlb_lookup(cpu_mips_t *cpu,m_uint64_t vaddr,mts_map_t *res)
+{
+   mips_cp0_t *cp0 = &cpu->cp0;
+   m_uint32_t page_size,pca;
+   tlb_entry_t *entry;
+   m_uint64_t lo;
+   int i;
+
    /* No matching entry */
-   return(FALSE);
+   if ((i = mips64_cp0_tlb_find(cpu,vaddr)) == -1)
+      return(FALSE);
+
+   entry = &cp0->tlb[i];
+   page_size = get_page_size(entry->mask);
+
+   /* Even or Odd Page */
+   lo = ((vaddr & page_size) == 0) ? entry->lo0 : entry->lo1;
+
+   /* Invalid entry */
+   if (!(lo & MIPS_TLB_V_MASK))
+      return(FALSE);
+
+   res->vaddr = vaddr & MIPS_MIN_PAGE_MASK;
+   res->paddr = (lo & MIPS_TLB_PFN_MASK) << 6;
+   res->paddr += (res->vaddr & (page_size-1));
+   res->paddr &= cpu->addr_bus_mask;
+
+   res->offset = vaddr & MIPS_MIN_PAGE_IMASK;
+
+   pca = (lo & MIPS_TLB_C_MASK);
+   pca >>= MIPS_TLB_C_SHIFT;
+   res->cached = mips64_cca_cached(pca);
+
+   res->tlb_index = i;
+   return(TRUE);
 }
 
 /* 
@@ -496,8 +622,10 @@ fastcall void mips64_cp0_exec_tlbp(cpu_mips_t *cpu)
    mips_cp0_t *cp0 = &cpu->cp0;
    m_uint64_t hi_reg,asid;
    m_uint64_t vpn2,vpn2_mask;
+   m_uint64_t page_mask;
    tlb_entry_t *entry;
-   int i;
+   int i,res = -1;
+   u_int p;
   
    vpn2_mask = mips64_cp0_get_vpn2_mask(cpu);
    hi_reg = cp0->reg[MIPS_CP0_TLB_HI];
@@ -505,20 +633,31 @@ fastcall void mips64_cp0_exec_tlbp(cpu_mips_t *cpu)
    vpn2 = hi_reg & vpn2_mask;
 
    cp0->reg[MIPS_CP0_INDEX] = 0xffffffff80000000ULL;
-   
-   for(i=0;i<cp0->tlb_entries;i++) {
-      entry = &cp0->tlb[i];
 
-      if (((entry->hi & vpn2_mask) == vpn2) &&
-          ((entry->hi & MIPS_TLB_G_MASK) || 
-           ((entry->hi & MIPS_TLB_ASID_MASK) == asid)))
-      {
-         cp0->reg[MIPS_CP0_INDEX] = i;
+   /* The last matching entry is reported */
+   for(p=0;p<cp0->tlb_pmask_count;p++) {
+      page_mask = ~(cp0->tlb_pmask[p].mask + 0x1FFF);
+      i = cp0->tlb_hash[mips64_cp0_tlb_hash(vpn2 & page_mask)];
+
+      for(;i!=-1;i=cp0->tlb_hash_next[i]) {
+         if ((i >= cp0->tlb_entries) || (i <= res))
+            continue;
+
+         entry = &cp0->tlb[i];
+
+         if (((entry->hi & vpn2_mask) == vpn2) &&
+             ((entry->hi & MIPS_TLB_G_MASK) || 
+              ((entry->hi & MIPS_TLB_ASID_MASK) == asid)))
+            res = i;
+      }
+   }
+
+   if (res != -1) {
+      cp0->reg[MIPS_CP0_INDEX] = res;
 #if DEBUG_TLB_ACTIVITY
-         printf("CPU: CP0_TLBP returned %u\n",i);
-         tlb_dump(cpu);
+      printf("CPU: CP0_TLBP returned %u\n",res);
+      tlb_dump(cpu);
 #endif
-      }
    }
 }
 
@@ -590,7 +729,8 @@ static inline void mips64_cp0_exec_tlbw(cpu_mips_t *cpu,u_int index)
       entry->lo0 &= ~MIPS_CP0_LO_G_MASK;
       entry->lo1 &= ~MIPS_CP0_LO_G_MASK;
 
-      /* Inform the MTS subsystem */
+      /* Update the TLB index and inform the MTS subsystem */
+      mips64_cp0_tlb_index_update(cpu,index);
       mips64_cp0_map_tlb_to_mts(cpu,index);
 
 #if DEBUG_TLB_ACTIVITY
@@ -40,6 +40,12 @@ fastcall void mips64_cp0_exec_cfc0(cpu_mips_t *cpu,u_int gp_reg,u_int cp0_reg);
 /* CTC0 */
 fastcall void mips64_cp0_exec_ctc0(cpu_mips_t *cpu,u_int gp_reg,u_int cp0_reg);
 
+/* Update the TLB index after a change of the specified TLB entry */
+void mips64_cp0_tlb_index_update(cpu_mips_t *cpu,int index);
+
+/* Rebuild the TLB index from scratch */
+void mips64_cp0_tlb_index_rebuild(cpu_mips_t *cpu);
+
 /* TLB lookup */
 int mips64_cp0_tlb_lookup(cpu_mips_t *cpu,m_uint64_t vaddr,mts_map_t *res);
 
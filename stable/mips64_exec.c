@@ -313,6 +313,74 @@ static forced_inline void mips64_exec_memop2(cpu_mips_t *cpu,int memop,
    fn(cpu,vaddr,dst_reg);
 }
 
+/* Allocate a predecoded page (all slots hold the decoded "nop") */
+static struct mips64_njm_page *mips64_exec_alloc_page(void)
+{
+   struct mips64_njm_page *page;
+   int i,index;
+
+   if (!(page = malloc(sizeof(*page))))
+      return NULL;
+
+   index = ilt_lookup(ilt,0);
+
+   for(i=0;i<MIPS_INSN_PER_PAGE;i++) {
+      page->insn[i].exec  = mips64_exec_tags[index].exec;
+      page->insn[i].insn  = 0;
+      page->insn[i].index = index;
+   }
+
+   return page;
+}
+
+/* Free the predecoded page cache */
+void mips64_exec_free_cache(cpu_mips_t *cpu)
+{
+   int i;
+
+   if (!cpu->njm_cache)
+      return;
+
+   for(i=0;i<MIPS64_NJM_CACHE_SIZE;i++)
+      free(cpu->njm_cache[i]);
+
+   free(cpu->njm_cache);
+   cpu->njm_cache = NULL;
+   cpu->njm_page = NULL;
+}
+
+/* 
+ * Set the current exec page.
+ *
+ * The predecoded page is selected by physical page number. It never needs
+ * to be invalidated: each slot is checked against the instruction word
+ * in memory before use, so code modified by stores, DMA or a restored
+ * checkpoint is simply decoded again.
+ */
+static void mips64_exec_set_page(cpu_mips_t *cpu,m_uint64_t exec_page)
+{
+   struct mips64_njm_page **slot;
+   m_uint32_t phys_page;
+   mips_insn_t *ptr;
+
+   ptr = cpu->mem_op_lookup(cpu,exec_page);
+   cpu->njm_exec_page = exec_page;
+   cpu->njm_exec_ptr  = ptr;
+
+   if (!cpu->njm_cache)
+      return;
+
+   if (cpu->translate(cpu,exec_page,&phys_page) == -1)
+      phys_page = 0;
+
+   slot = &cpu->njm_cache[phys_page & (MIPS64_NJM_CACHE_SIZE - 1)];
+
+   if (!*slot)
+      *slot = mips64_exec_alloc_page();
+
+   cpu->njm_page = *slot;
+}
+
 /* Fetch an instruction */
 static forced_inline int mips64_exec_fetch(cpu_mips_t *cpu,m_uint64_t pc,
                                            mips_insn_t *insn)
@@ -322,10 +390,8 @@ static forced_inline int mips64_exec_fetch(cpu_mips_t *cpu,m_uint64_t pc,
 
    exec_page = pc & ~(m_uint64_t)MIPS_MIN_PAGE_IMASK;
 
-   if (unlikely(exec_page != cpu->njm_exec_page)) {
-      cpu->njm_exec_page = exec_page;
-      cpu->njm_exec_ptr  = cpu->mem_op_lookup(cpu,exec_page);
-   }
+   if (unlikely(exec_page != cpu->njm_exec_page))
+      mips64_exec_set_page(cpu,exec_page);
 
    offset = (pc & MIPS_MIN_PAGE_IMASK) >> 2;
    *insn = vmtoh32(cpu->njm_exec_ptr[offset]);
@@ -375,6 +441,64 @@ mips64_exec_single_instruction(cpu_mips_t *cpu,mips_insn_t instruction)
    return(exec(cpu,instruction));
 }
 
+/* Execute a predecoded instruction, decoding it again if it has changed */
+static forced_inline int
+mips64_exec_njm_insn(cpu_mips_t *cpu,struct mips64_njm_insn *slot,
+                     mips_insn_t insn)
+{
+   if (unlikely(slot->insn != insn)) {
+      slot->index = ilt_lookup(ilt,insn);
+      slot->exec  = mips64_exec_tags[slot->index].exec;
+      slot->insn  = insn;
+   }
+
+#if DEBUG_INSN_PERF_CNT
+   cpu->perf_counter++;
+#endif
+
+   /* Increment CP0 count register */
+   mips64_exec_inc_cp0_cnt(cpu);
+
+#if NJM_STATS_ENABLE
+   cpu->insn_exec_count++;
+   mips64_exec_tags[slot->index].count++;
+#endif
+   return(slot->exec(cpu,insn));
+}
+
+/* 
+ * Execute predecoded instructions from the current pc until a branch or
+ * an exception changes the flow, the end of the page or the idle pc is
+ * reached. Returns the number of instructions executed.
+ */
+static forced_inline u_int mips64_exec_block(cpu_mips_t *cpu)
+{
+   struct mips64_njm_page *page = cpu->njm_page;
+   mips_insn_t *ptr = cpu->njm_exec_ptr;
+   u_int offset,count = 0;
+   mips_insn_t insn;
+
+   offset = (cpu->pc & MIPS_MIN_PAGE_IMASK) >> 2;
+
+   for(;;) {
+      /* Reset "zero register" (for safety) */
+      cpu->gpr[0] = 0;
+
+      insn = vmtoh32(ptr[offset]);
+      count++;
+
+      if (mips64_exec_njm_insn(cpu,&page->insn[offset],insn))
+         break;
+
+      cpu->pc += sizeof(mips_insn_t);
+
+      if ((++offset == MIPS_INSN_PER_PAGE) || (cpu->pc == cpu->idle_pc))
+         break;
+   }
+
+   return(count);
+}
+
 /* Single-step execution */
 fastcall void mips64_exec_single_step(cpu_mips_t *cpu,mips_insn_t instruction)
 {
@@ -390,20 +514,26 @@ fastcall void mips64_exec_single_step(cpu_mips_t *cpu,mips_insn_t instruction)
 void *mips64_exec_run_cpu(cpu_gen_t *gen)
 {   
    cpu_mips_t *cpu = CPU_MIPS64(gen);
-   pthread_t timer_irq_thread;
    int timer_irq_check = 0;
-   mips_insn_t insn;
-   int res;
+   m_uint64_t exec_page;
 
-   if (pthread_create(&timer_irq_thread,NULL,
-                      (void *)mips64_timer_irq_run,cpu))
-   {
-      fprintf(stderr,"VM '%s': unable to create Timer IRQ thread for CPU%u.\n",
-              cpu->vm->name,gen->id);
-      cpu_stop(gen);
-      return NULL;
+   if (!cpu->njm_cache) {
+      cpu->njm_cache = calloc(MIPS64_NJM_CACHE_SIZE,sizeof(*cpu->njm_cache));
+
+      if (!cpu->njm_cache) {
+         fprintf(stderr,"VM '%s': unable to create instruction cache "
+                 "for CPU%u.\n",cpu->vm->name,gen->id);
+         cpu_stop(gen);
+         return NULL;
+      }
    }
 
+   cpu->njm_exec_page = (m_uint64_t)-1;
+   cpu->njm_page = NULL;
+
+   /* Start the timer IRQ clock */
+   mips64_timer_irq_start(cpu);
+
    gen->cpu_thread_running = TRUE;
    cpu_exec_loop_set(gen);
 
@@ -423,8 +553,17 @@ void *mips64_exec_run_cpu(cpu_gen_t *gen)
       }
 
       /* Handle the virtual CPU clock */
-      if (++timer_irq_check == cpu->timer_irq_check_itv) {
+      if (timer_irq_check >= cpu->timer_irq_check_itv) {
          timer_irq_check = 0;
+         mips64_timer_irq_update(cpu);
+
+         /* Automatic idle PC detection */
+         if (unlikely(gen->idle_auto != NULL))
+            cpu_idle_auto_check(gen);
+
+         /* End of the time slice on the CPU scheduler */
+         if (unlikely(gen->sched != NULL))
+            cpu_sched_check(gen);
 
          if (cpu->timer_irq_pending && !cpu->irq_disable) {
             mips64_trigger_timer_irq(cpu);
@@ -433,21 +572,27 @@ void *mips64_exec_run_cpu(cpu_gen_t *gen)
          }
       }
 
-      /* Reset "zero register" (for safety) */
-      cpu->gpr[0] = 0;
-
       /* Check IRQ */
       if (unlikely(cpu->irq_pending)) {
          mips64_trigger_irq(cpu);
          continue;
       }
 
-      /* Fetch and execute the instruction */      
-      mips64_exec_fetch(cpu,cpu->pc,&insn);
-      res = mips64_exec_single_instruction(cpu,insn);
+      /* Execute the next block of instructions */
+      exec_page = cpu->pc & ~(m_uint64_t)MIPS_MIN_PAGE_IMASK;
+
+      if (unlikely((exec_page != cpu->njm_exec_page) || !cpu->njm_page)) {
+         mips64_exec_set_page(cpu,exec_page);
+
+         if (unlikely(!cpu->njm_page)) {
+            fprintf(stderr,"VM '%s': unable to allocate predecoded page "
+                    "for CPU%u.\n",cpu->vm->name,gen->id);
+            cpu_stop(gen);
+            break;
+         }
+      }
 
-      /* Normal flow ? */
-      if (likely(!res)) cpu->pc += sizeof(mips_insn_t);
+      timer_irq_check += mips64_exec_block(cpu);
    }
 
    if (!cpu->pc) {
@@ -462,16 +607,16 @@ void *mips64_exec_run_cpu(cpu_gen_t *gen)
       switch(gen->state) {
          case CPU_STATE_RUNNING:
             gen->state = CPU_STATE_RUNNING;
+            mips64_timer_irq_start(cpu);
             goto start_cpu;
 
          case CPU_STATE_HALTED:     
             gen->cpu_thread_running = FALSE;
-            pthread_join(timer_irq_thread,NULL);
             break;
       }
       
       /* CPU is paused */
-      usleep(200000);
+      cpu_idle_wait(gen,200000);
    }
 
    return NULL;
@@ -480,13 +625,20 @@ void *mips64_exec_run_cpu(cpu_gen_t *gen)
 /* Execute the instruction in delay slot */
 static forced_inline void mips64_exec_bdslot(cpu_mips_t *cpu)
 {
+   m_uint64_t pc = cpu->pc + sizeof(mips_insn_t);
+   m_uint32_t offset;
    mips_insn_t insn;
 
    /* Fetch the instruction in delay slot */
-   mips64_exec_fetch(cpu,cpu->pc+4,&insn);
-
-   /* Execute the instruction */
-   mips64_exec_single_instruction(cpu,insn);
+   mips64_exec_fetch(cpu,pc,&insn);
+
+   /* Execute the instruction (predecoded, except in JIT mode) */
+   if (likely(cpu->njm_page != NULL)) {
+      offset = (pc & MIPS_MIN_PAGE_IMASK) >> 2;
+      mips64_exec_njm_insn(cpu,&cpu->njm_page->insn[offset],insn);
+   } else {
+      mips64_exec_single_instruction(cpu,insn);
+   }
 }
 
 /* ADD */
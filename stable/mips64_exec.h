@@ -18,6 +18,21 @@ struct mips64_insn_exec_tag {
    m_uint64_t count;
 };
 
+/* Number of predecoded pages kept per CPU (non-JIT mode, power of 2) */
+#define MIPS64_NJM_CACHE_SIZE  512
+
+/* Predecoded instruction: raw instruction word, its handler and tag index */
+struct mips64_njm_insn {
+   fastcall int (*exec)(cpu_mips_t *,mips_insn_t);
+   mips_insn_t insn;
+   int index;
+};
+
+/* Predecoded page, indexed in the per-CPU cache by physical page number */
+struct mips64_njm_page {
+   struct mips64_njm_insn insn[MIPS_INSN_PER_PAGE];
+};
+
 /* Initialize instruction lookup table */
 void mips64_exec_create_ilt(void);
 
@@ -35,6 +50,9 @@ void mips64_dump_insn_block(cpu_mips_t *cpu,m_uint64_t pc,u_int count,
 /* Single-step execution */
 fastcall void mips64_exec_single_step(cpu_mips_t *cpu,mips_insn_t instruction);
 
+/* Free the predecoded page cache */
+void mips64_exec_free_cache(cpu_mips_t *cpu);
+
 /* Run MIPS code in step-by-step mode */
 void *mips64_exec_run_cpu(cpu_gen_t *cpu);
 
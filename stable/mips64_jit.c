@@ -28,6 +28,13 @@
 
 #include MIPS64_ARCH_INC_FILE
 
+#ifndef MIPS64_JIT_TIER2
+#define MIPS64_JIT_TIER2 0
+#endif
+
+/* Executions of a page before tier 2 recompilation (0 = disabled) */
+u_int mips64_jit_tier2_threshold = MIPS64_JIT_TIER2_THRESHOLD;
+
 #if DEBUG_BLOCK_TIMESTAMP
 static volatile m_uint64_t jit_jiffies = 0;
 #endif
@@ -53,6 +60,7 @@ struct mips64_insn_jump mips64_insn_jumps[] = {
    { "bne"     , 0xfc000000, 0x14000000, 16, 1 },
    { "bnel"    , 0xfc000000, 0x54000000, 16, 1 },
    { "j"       , 0xfc000000, 0x08000000, 26, 0 },
+   { "jal"     , 0xfc000000, 0x0c000000, 26, 0 },
    { NULL      , 0x00000000, 0x00000000,  0, 0 },
 };
 
@@ -127,6 +135,22 @@ int mips64_jit_init(cpu_mips_t *cpu)
       return(-1);
    }
 
+   /*
+    * Translated code is hot: try to keep it on huge pages. The exec area
+    * is a shared anonymous mapping (shmem), which only gets them when
+    * shmem_enabled allows it.
+    */
+   if (cpu->vm->ram_hugepages) {
+      int backing = MEMZONE_BACKING_STD;
+
+      if (!memzone_advise_hugepages(cpu->exec_page_area,
+                                    cpu->exec_page_area_size,TRUE))
+         backing = MEMZONE_BACKING_THP;
+
+      vm_log(cpu->vm,"JIT","exec area backed by %s\n",
+             memzone_get_backing_str(backing));
+   }
+
    /* Carve the executable page area */
    cpu->exec_page_count = cpu->exec_page_area_size / MIPS_JIT_BUFSIZE;
 
@@ -316,6 +340,46 @@ int mips64_jit_is_delay_slot(mips64_jit_tcb_t *b,m_uint64_t pc)
    return(!tag->delay_slot);
 }
 
+#if MIPS64_JIT_TIER2
+/* Check if an instruction position is a static jump target */
+static forced_inline 
+int mips64_jit_tier2_is_target(mips64_jit_tcb_t *block,u_int pos)
+{
+   return(block->tier2->targets[pos >> 5] & (1U << (pos & 0x1f)));
+}
+
+/* Mark the static jump targets of a page before tier 2 compilation */
+static void mips64_jit_tier2_scan(mips64_jit_tcb_t *block)
+{
+   struct mips64_insn_jump *jump;
+   m_uint64_t new_pc;
+   mips_insn_t insn;
+   u_int i,offset;
+
+   for(i=0;i<MIPS_INSN_PER_PAGE;i++) {
+      insn = vmtoh32(block->mips_code[i]);
+
+      if (!(jump = insn_jump_find(insn)))
+         continue;
+
+      new_pc = block->start_pc + ((i + 1) << 2);
+      offset = bits(insn,0,jump->offset_bits - 1);
+
+      if (jump->relative) {
+         new_pc += sign_extend(offset << 2,jump->offset_bits + 2);
+      } else {
+         new_pc &= ~((1 << (jump->offset_bits + 2)) - 1);
+         new_pc |= offset << 2;
+      }
+
+      if ((new_pc & MIPS_MIN_PAGE_MASK) == block->start_pc) {
+         offset = (new_pc & MIPS_MIN_PAGE_IMASK) >> 2;
+         block->tier2->targets[offset >> 5] |= 1U << (offset & 0x1f);
+      }
+   }
+}
+#endif
+
 /* Fetch a MIPS instruction and emit corresponding translated code */
 struct mips64_insn_tag *mips64_jit_fetch_and_emit(cpu_mips_t *cpu,
                                                   mips64_jit_tcb_t *block,
@@ -328,6 +392,34 @@ struct mips64_insn_tag *mips64_jit_fetch_and_emit(cpu_mips_t *cpu,
    tag = insn_tag_find(code);
    assert(tag);
 
+#if MIPS64_JIT_TIER2
+   if (block->tier2 && !delay_slot) {
+      struct mips64_insn_tag *t2_tag;
+      u_int pos = block->mips_trans_pos;
+
+      /* 
+       * Straight-line ALU code: keep GPRs in host registers. Only the
+       * first instruction of a region and static jump targets get an
+       * entry point, other ones are single-stepped if entered directly.
+       */
+      if ((pos < (MIPS_INSN_PER_PAGE-1)) && 
+          (t2_tag = mips64_jit_tier2_find(code))) 
+      {
+         if (!block->tier2->region || mips64_jit_tier2_is_target(block,pos)) {
+            mips64_jit_tier2_flush(block);
+            block->jit_insn_ptr[pos] = block->jit_ptr;
+            block->tier2->region = TRUE;
+         }
+
+         block->mips_trans_pos++;
+         t2_tag->emit(cpu,block,code);
+         return tag;
+      }
+
+      mips64_jit_tier2_flush(block);
+   }
+#endif
+
    /* Branch-delay slot is in another page: slow exec */
    if ((block->mips_trans_pos == (MIPS_INSN_PER_PAGE-1)) && !tag->delay_slot) {
       block->jit_insn_ptr[block->mips_trans_pos] = block->jit_ptr;
@@ -542,6 +634,9 @@ void mips64_jit_tcb_free(cpu_mips_t *cpu,mips64_jit_tcb_t *block,
       /* Free the MIPS-to-native code mapping */
       free(block->jit_insn_ptr);
 
+      /* Free the tier 2 compilation state */
+      free(block->tier2);
+
       /* Make the block return to the free list */
       block->next = cpu->tcb_free_list;
       cpu->tcb_free_list = block;
@@ -588,7 +683,8 @@ static mips64_jit_tcb_t *mips64_jit_tcb_create(cpu_mips_t *cpu,
 
 /* Compile a MIPS instruction page */
 static inline 
-mips64_jit_tcb_t *mips64_jit_tcb_compile(cpu_mips_t *cpu,m_uint64_t vaddr)
+mips64_jit_tcb_t *mips64_jit_tcb_compile(cpu_mips_t *cpu,m_uint64_t vaddr,
+                                         u_int tier)
 {  
    mips64_jit_tcb_t *block;
    struct mips64_insn_tag *tag;
@@ -610,6 +706,21 @@ mips64_jit_tcb_t *mips64_jit_tcb_compile(cpu_mips_t *cpu,m_uint64_t vaddr)
       goto error;
    }
 
+   block->tier = tier;
+
+#if MIPS64_JIT_TIER2
+   if (tier > 1) {
+      if (!(block->tier2 = malloc(sizeof(*block->tier2)))) {
+         fprintf(stderr,"insn_page_compile: unable to create tier 2 state.\n");
+         goto error;
+      }
+
+      memset(block->tier2->targets,0,sizeof(block->tier2->targets));
+      mips64_jit_tier2_reset(block->tier2);
+      mips64_jit_tier2_scan(block);
+   }
+#endif
+
    /* Emit native code for each instruction */
    block->mips_trans_pos = 0;
 
@@ -628,6 +739,14 @@ mips64_jit_tcb_t *mips64_jit_tcb_compile(cpu_mips_t *cpu,m_uint64_t vaddr)
       mips64_jit_tcb_adjust_buffer(cpu,block);
    }
 
+#if MIPS64_JIT_TIER2
+   if (block->tier2) {
+      mips64_jit_tier2_flush(block);
+      free(block->tier2);
+      block->tier2 = NULL;
+   }
+#endif
+
    mips64_jit_tcb_add_end(block);
    mips64_jit_tcb_apply_patches(cpu,block);
    mips64_jit_tcb_free_patches(block);
@@ -651,6 +770,30 @@ mips64_jit_tcb_t *mips64_jit_tcb_compile(cpu_mips_t *cpu,m_uint64_t vaddr)
    return NULL;
 }
 
+#if MIPS64_JIT_TIER2
+/* 
+ * Recompile a hot page at tier 2 and switch the PC hash entry to it.
+ * If compilation fails, the tier 1 block is kept. The old block may
+ * have been reclaimed by a JIT flush during compilation.
+ */
+static void mips64_jit_tcb_promote(cpu_mips_t *cpu,mips64_jit_tcb_t *block,
+                                   m_uint32_t pc_hash)
+{
+   mips64_jit_tcb_t *new_block;
+
+   if (!(new_block = mips64_jit_tcb_compile(cpu,block->start_pc,2)))
+      return;
+
+   if (cpu->exec_blk_map[pc_hash] == block) {
+      mips64_jit_tcb_free(cpu,block,TRUE);
+      cpu->compiled_pages--;
+   }
+
+   new_block->acc_count = mips64_jit_tier2_threshold;
+   cpu->exec_blk_map[pc_hash] = new_block;
+}
+#endif
+
 /* Run a compiled MIPS instruction block */
 static forced_inline 
 void mips64_jit_tcb_run(cpu_mips_t *cpu,mips64_jit_tcb_t *block)
@@ -698,20 +841,12 @@ void mips64_jit_tcb_run(cpu_mips_t *cpu,mips64_jit_tcb_t *block)
 void *mips64_jit_run_cpu(cpu_gen_t *gen)
 {    
    cpu_mips_t *cpu = CPU_MIPS64(gen);
-   pthread_t timer_irq_thread;
    mips64_jit_tcb_t *block;
    int timer_irq_check = 0;
    m_uint32_t pc_hash;
 
-   if (pthread_create(&timer_irq_thread,NULL,
-                      (void *)mips64_timer_irq_run,cpu)) 
-   {
-      fprintf(stderr,
-              "VM '%s': unable to create Timer IRQ thread for CPU%u.\n",
-              cpu->vm->name,gen->id);
-      cpu_stop(cpu->gen);
-      return NULL;
-   }
+   /* Start the timer IRQ clock */
+   mips64_timer_irq_start(cpu);
 
    gen->cpu_thread_running = TRUE;
    cpu_exec_loop_set(gen);
@@ -737,6 +872,15 @@ void *mips64_jit_run_cpu(cpu_gen_t *gen)
       /* Handle the virtual CPU clock */
       if (++timer_irq_check == cpu->timer_irq_check_itv) {
          timer_irq_check = 0;
+         mips64_timer_irq_update(cpu);
+
+         /* Automatic idle PC detection */
+         if (unlikely(gen->idle_auto != NULL))
+            cpu_idle_auto_check(gen);
+
+         /* End of the time slice on the CPU scheduler */
+         if (unlikely(gen->sched != NULL))
+            cpu_sched_check(gen);
 
          if (cpu->timer_irq_pending && !cpu->irq_disable) {
             mips64_trigger_timer_irq(cpu);
@@ -756,7 +900,7 @@ void *mips64_jit_run_cpu(cpu_gen_t *gen)
             cpu->exec_blk_map[pc_hash] = NULL;
          }
 
-         block = mips64_jit_tcb_compile(cpu,cpu->pc);
+         block = mips64_jit_tcb_compile(cpu,cpu->pc,1);
          if (unlikely(!block)) {
             fprintf(stderr,
                     "VM '%s': unable to compile block for CPU%u PC=0x%llx\n",
@@ -772,6 +916,17 @@ void *mips64_jit_run_cpu(cpu_gen_t *gen)
       block->tm_last_use = jit_jiffies++;
 #endif
       block->acc_count++;
+
+#if MIPS64_JIT_TIER2
+      /* Hot page: switch to the tier 2 translation */
+      if (unlikely(block->acc_count == mips64_jit_tier2_threshold) &&
+          (block->tier == 1) && !cpu->breakpoints_enabled)
+      {
+         mips64_jit_tcb_promote(cpu,block,pc_hash);
+         continue;
+      }
+#endif
+
       mips64_jit_tcb_run(cpu,block);
    }
       
@@ -787,16 +942,16 @@ void *mips64_jit_run_cpu(cpu_gen_t *gen)
       switch(gen->state) {
          case CPU_STATE_RUNNING:
             gen->state = CPU_STATE_RUNNING;
+            mips64_timer_irq_start(cpu);
             goto start_cpu;
 
          case CPU_STATE_HALTED:
             gen->cpu_thread_running = FALSE;
-            pthread_join(timer_irq_thread,NULL);
             return NULL;
       }
       
       /* CPU is paused */
-      usleep(200000);
+      cpu_idle_wait(gen,200000);
    }
 
    return NULL;
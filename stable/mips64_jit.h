@@ -24,6 +24,9 @@
 /* Maximum number of X86 chunks */
 #define MIPS_JIT_MAX_CHUNKS  32
 
+/* Default number of executions before a page is recompiled at tier 2 */
+#define MIPS64_JIT_TIER2_THRESHOLD  4096
+
 /* Size of hash for PC lookup */
 #define MIPS_JIT_PC_HASH_BITS   16
 #define MIPS_JIT_PC_HASH_MASK   ((1 << MIPS_JIT_PC_HASH_BITS) - 1)
@@ -56,6 +59,8 @@ struct mips64_jit_tcb {
    insn_exec_page_t *jit_buffer;
    insn_exec_page_t *jit_chunks[MIPS_JIT_MAX_CHUNKS];
    struct mips64_jit_patch_table *patch_table;
+   struct mips64_jit_tier2 *tier2;
+   u_int tier;
    mips64_jit_tcb_t *prev,*next;
 #if DEBUG_BLOCK_TIMESTAMP
    m_uint64_t tm_first_use,tm_last_use;
@@ -119,6 +124,9 @@ static forced_inline m_uint32_t mips64_jit_get_pc_hash(m_uint64_t pc)
    return((page_hash ^ (page_hash >> 12)) & MIPS_JIT_PC_HASH_MASK);
 }
 
+/* Executions of a page before tier 2 recompilation (0 = disabled) */
+extern u_int mips64_jit_tier2_threshold;
+
 /* Check if there are pending IRQ */
 extern void mips64_check_pending_irq(mips64_jit_tcb_t *b);
 
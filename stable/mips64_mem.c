@@ -109,6 +109,28 @@ void mips64_access_special(cpu_mips_t *cpu,m_uint64_t vaddr,m_uint32_t mask,
    }
 }
 
+/* Remember that a MTS hash slot has been filled from a TLB entry */
+static inline void mips64_mts_tlb_rmap_add(cpu_mips_t *cpu,int tlb_index,
+                                           m_uint32_t slot)
+{
+   u_int i,count;
+
+   count = cpu->mts_tlb_rmap[tlb_index].count;
+
+   /* Already overflowed: the TLB entry range will be invalidated */
+   if (count > MIPS64_TLB_RMAP_SIZE)
+      return;
+
+   for(i=0;i<count;i++)
+      if (cpu->mts_tlb_rmap[tlb_index].slots[i] == slot)
+         return;
+
+   if (count < MIPS64_TLB_RMAP_SIZE)
+      cpu->mts_tlb_rmap[tlb_index].slots[count] = slot;
+
+   cpu->mts_tlb_rmap[tlb_index].count = count + 1;
+}
+
 /* === MTS for 64-bit address space ======================================= */
 #define MTS_ADDR_SIZE      64
 #define MTS_NAME(name)     mts64_##name
@@ -142,13 +164,18 @@ mips64_mts64_slow_lookup(cpu_mips_t *cpu,m_uint64_t vaddr,
 
    map.tlb_index = -1;
    hash_bucket = MTS64_HASH(vaddr);
-   entry = &cpu->mts_u.mts64_cache[hash_bucket];
    zone = vaddr >> 40;
 
 #if DEBUG_MTS_STATS
    cpu->mts_misses++;
 #endif
 
+   /* Try the L2 cache before walking the TLB and the device list */
+   if ((entry = mips64_mts64_l2_lookup(cpu,vaddr,op_type,hash_bucket)))
+      return(entry);
+
+   entry = &cpu->mts_u.mts64_cache[hash_bucket];
+
    switch(zone) {
       case 0x000000:   /* xkuseg */
       case 0x400000:   /* xksseg */
@@ -160,6 +187,9 @@ mips64_mts64_slow_lookup(cpu_mips_t *cpu,m_uint64_t vaddr,
          if (!(entry = mips64_mts64_map(cpu,op_type,&map,entry,alt_entry)))
             goto err_undef;
 
+         if (entry != alt_entry)
+            mips64_mts64_l2_fill(cpu,entry,map.tlb_index,hash_bucket);
+
          return(entry);
 
       case 0xffffff:
@@ -176,6 +206,9 @@ mips64_mts64_slow_lookup(cpu_mips_t *cpu,m_uint64_t vaddr,
                                               entry,alt_entry)))
                   goto err_undef;
 
+               if (entry != alt_entry)
+                  mips64_mts64_l2_fill(cpu,entry,map.tlb_index,hash_bucket);
+
                return(entry);
 
             case 0x7fd:   /* ckseg1 */
@@ -187,7 +220,10 @@ mips64_mts64_slow_lookup(cpu_mips_t *cpu,m_uint64_t vaddr,
                if (!(entry = mips64_mts64_map(cpu,op_type,&map,
                                               entry,alt_entry)))
                   goto err_undef;
-               
+
+               if (entry != alt_entry)
+                  mips64_mts64_l2_fill(cpu,entry,map.tlb_index,hash_bucket);
+
                return(entry);
 
             case 0x7fe:   /* cksseg */
@@ -200,6 +236,9 @@ mips64_mts64_slow_lookup(cpu_mips_t *cpu,m_uint64_t vaddr,
                                               &map,entry,alt_entry)))
                   goto err_undef;
 
+               if (entry != alt_entry)
+                  mips64_mts64_l2_fill(cpu,entry,map.tlb_index,hash_bucket);
+
                return(entry);
 
             default:
@@ -227,6 +266,9 @@ mips64_mts64_slow_lookup(cpu_mips_t *cpu,m_uint64_t vaddr,
          if (!(entry = mips64_mts64_map(cpu,op_type,&map,entry,alt_entry)))
             goto err_undef;
 
+         if (entry != alt_entry)
+            mips64_mts64_l2_fill(cpu,entry,map.tlb_index,hash_bucket);
+
          return(entry);
 
       default:
@@ -332,13 +374,18 @@ mips64_mts32_slow_lookup(cpu_mips_t *cpu,m_uint64_t vaddr,
 
    map.tlb_index = -1;
    hash_bucket = MTS32_HASH(vaddr);
-   entry = &cpu->mts_u.mts32_cache[hash_bucket];
    zone = (vaddr >> 29) & 0x7;
 
 #if DEBUG_MTS_STATS
    cpu->mts_misses++;
 #endif
 
+   /* Try the L2 cache before walking the TLB and the device list */
+   if ((entry = mips64_mts32_l2_lookup(cpu,vaddr,op_type,hash_bucket)))
+      return(entry);
+
+   entry = &cpu->mts_u.mts32_cache[hash_bucket];
+
    switch(zone) {
       case 0x00 ... 0x03:   /* kuseg */
          /* trigger TLB exception if no matching entry found */
@@ -348,6 +395,9 @@ mips64_mts32_slow_lookup(cpu_mips_t *cpu,m_uint64_t vaddr,
          if (!(entry = mips64_mts32_map(cpu,op_type,&map,entry,alt_entry)))
             goto err_undef;
 
+         if (entry != alt_entry)
+            mips64_mts32_l2_fill(cpu,entry,map.tlb_index,hash_bucket);
+
          return(entry);
 
       case 0x04:   /* kseg0 */
@@ -359,6 +409,9 @@ mips64_mts32_slow_lookup(cpu_mips_t *cpu,m_uint64_t vaddr,
          if (!(entry = mips64_mts32_map(cpu,op_type,&map,entry,alt_entry)))
             goto err_undef;
 
+         if (entry != alt_entry)
+            mips64_mts32_l2_fill(cpu,entry,map.tlb_index,hash_bucket);
+
          return(entry);
 
       case 0x05:   /* kseg1 */
@@ -370,6 +423,9 @@ mips64_mts32_slow_lookup(cpu_mips_t *cpu,m_uint64_t vaddr,
          if (!(entry = mips64_mts32_map(cpu,op_type,&map,entry,alt_entry)))
             goto err_undef;
 
+         if (entry != alt_entry)
+            mips64_mts32_l2_fill(cpu,entry,map.tlb_index,hash_bucket);
+
          return(entry);
 
       case 0x06:   /* ksseg */
@@ -381,6 +437,9 @@ mips64_mts32_slow_lookup(cpu_mips_t *cpu,m_uint64_t vaddr,
          if (!(entry = mips64_mts32_map(cpu,op_type,&map,entry,alt_entry)))
             goto err_undef;
 
+         if (entry != alt_entry)
+            mips64_mts32_l2_fill(cpu,entry,map.tlb_index,hash_bucket);
+
          return(entry);
    }
 
@@ -7,6 +7,8 @@
 
 #define MTS_ENTRY  MTS_NAME(entry_t)
 #define MTS_CACHE(cpu)  ( cpu->mts_u. MTS_NAME(cache) )
+#define MTS_L2_ENTRY  MTS_NAME(l2_entry_t)
+#define MTS_L2_CACHE(cpu)  ( cpu->mts_l2_u. MTS_NAME(l2_cache) )
 
 /* Forward declarations */
 static forced_inline void *MTS_PROTO(access)(cpu_mips_t *cpu,m_uint64_t vaddr,
@@ -20,6 +22,7 @@ static fastcall int MTS_PROTO(translate)(cpu_mips_t *cpu,m_uint64_t vaddr,
 int MTS_PROTO(init)(cpu_mips_t *cpu)
 {
    size_t len;
+   u_int sets;
 
    /* Initialize the cache entries to 0 (empty) */
    len = MTS_NAME_UP(HASH_SIZE) * sizeof(MTS_ENTRY);
@@ -27,17 +30,47 @@ int MTS_PROTO(init)(cpu_mips_t *cpu)
       return(-1);
 
    memset(MTS_CACHE(cpu),0xFF,len);
+
+   /* L2 cache: a power of 2 number of sets of MTS_L2_WAYS entries */
+   if (!(sets = cpu->vm->mts_l2_size))
+      sets = MTS_L2_DEFAULT_SIZE;
+
+   sets /= MTS_L2_WAYS;
+   while(sets & (sets - 1))
+      sets &= sets - 1;
+
+   if (!sets)
+      sets = 1;
+
+   len = sets * MTS_L2_WAYS * sizeof(MTS_L2_ENTRY);
+   if (!(MTS_L2_CACHE(cpu) = malloc(len))) {
+      free(MTS_CACHE(cpu));
+      MTS_CACHE(cpu) = NULL;
+      return(-1);
+   }
+
+   memset(MTS_L2_CACHE(cpu),0xFF,len);
+   cpu->mts_l2_set_mask = sets - 1;
+
+   memset(cpu->mts_tlb_rmap,0,sizeof(cpu->mts_tlb_rmap));
+   memset(cpu->mts_tlb_gen,0,sizeof(cpu->mts_tlb_gen));
    cpu->mts_lookups = 0;
    cpu->mts_misses  = 0;
+   cpu->mts_l2_hits = 0;
+   cpu->mts_tlb_inval = 0;
+   cpu->mts_tlb_inval_slots = 0;
    return(0);
 }
 
 /* Free memory used by MTS */
 void MTS_PROTO(shutdown)(cpu_mips_t *cpu)
 {
-   /* Free the cache itself */
+   /* Free the caches themselves */
    free(MTS_CACHE(cpu));
    MTS_CACHE(cpu) = NULL;
+
+   free(MTS_L2_CACHE(cpu));
+   MTS_L2_CACHE(cpu) = NULL;
 }
 
 /* Show MTS detailed information (debugging only!) */
@@ -71,6 +104,15 @@ void MTS_PROTO(show_stats)(cpu_gen_t *gen_cpu)
           cpu->mts_lookups, cpu->mts_misses,
           100 - ((double)(cpu->mts_misses*100)/
                  (double)cpu->mts_lookups));
+
+   printf("   L1 hits: %llu, L2 hits: %llu (%u sets of %u entries), "
+          "full lookups: %llu\n",
+          cpu->mts_lookups - cpu->mts_misses,cpu->mts_l2_hits,
+          cpu->mts_l2_set_mask + 1,MTS_L2_WAYS,
+          cpu->mts_misses - cpu->mts_l2_hits);
+
+   printf("   TLB invalidations: %llu, invalidated slots: %llu\n",
+          cpu->mts_tlb_inval,cpu->mts_tlb_inval_slots);
 }
 
 /* Invalidate the complete MTS cache */
@@ -80,14 +122,154 @@ void MTS_PROTO(invalidate_cache)(cpu_mips_t *cpu)
 
    len = MTS_NAME_UP(HASH_SIZE) * sizeof(MTS_ENTRY);
    memset(MTS_CACHE(cpu),0xFF,len);
+   memset(cpu->mts_tlb_rmap,0,sizeof(cpu->mts_tlb_rmap));
+
+   len = (cpu->mts_l2_set_mask + 1) * MTS_L2_WAYS * sizeof(MTS_L2_ENTRY);
+   memset(MTS_L2_CACHE(cpu),0xFF,len);
+}
+
+/* Invalidate the MTS hash slots covering a virtual address range */
+static void MTS_PROTO(invalidate_range)(cpu_mips_t *cpu,m_uint64_t vaddr,
+                                        m_uint32_t len)
+{
+   m_uint64_t page;
+   m_uint32_t slot;
+   
+   if ((len >> MIPS_MIN_PAGE_SHIFT) >= MTS_NAME_UP(HASH_SIZE)) {
+      MTS_PROTO(invalidate_cache)(cpu);
+      return;
+   }
+
+   for(page=vaddr;page<vaddr+len;page+=MIPS_MIN_PAGE_SIZE) {
+      slot = MTS_NAME_UP(HASH)(page);
+      memset(&MTS_CACHE(cpu)[slot],0xFF,sizeof(MTS_ENTRY));
+   }
+
+#if DEBUG_MTS_STATS
+   cpu->mts_tlb_inval_slots += len >> MIPS_MIN_PAGE_SHIFT;
+#endif
 }
 
-/* Invalidate partially the MTS cache, given a TLB entry index */
-void MTS_PROTO(invalidate_tlb_entry)(cpu_mips_t *cpu,u_int tlb_index)
+/* 
+ * Invalidate partially the MTS cache, given a TLB entry index: only the
+ * hash slots filled from this entry are flushed. If too many slots were
+ * filled to be tracked, the virtual range of the entry is invalidated.
+ */
+void MTS_PROTO(invalidate_tlb_entry)(cpu_mips_t *cpu,u_int tlb_index,
+                                     m_uint64_t vaddr,m_uint32_t len)
 {
-   MTS_PROTO(invalidate_cache)(cpu);
+   u_int i,count;
+
+   /* L2 entries filled from this TLB entry become stale */
+   if (!++cpu->mts_tlb_gen[tlb_index]) {
+      memset(MTS_L2_CACHE(cpu),0xFF,(cpu->mts_l2_set_mask + 1) *
+             MTS_L2_WAYS * sizeof(MTS_L2_ENTRY));
+   }
+
+   count = cpu->mts_tlb_rmap[tlb_index].count;
+
+#if DEBUG_MTS_STATS
+   cpu->mts_tlb_inval++;
+#endif
+
+   if (count > MIPS64_TLB_RMAP_SIZE) {
+      MTS_PROTO(invalidate_range)(cpu,vaddr,len);
+      return;
+   }
+
+   for(i=0;i<count;i++) {
+      memset(&MTS_CACHE(cpu)[cpu->mts_tlb_rmap[tlb_index].slots[i]],0xFF,
+             sizeof(MTS_ENTRY));
+   }
+
+#if DEBUG_MTS_STATS
+   cpu->mts_tlb_inval_slots += count;
+#endif
+
+   cpu->mts_tlb_rmap[tlb_index].count = 0;
 } 
 
+/* Get the first L2 cache entry of the set for a virtual address */
+static forced_inline MTS_L2_ENTRY *
+MTS_PROTO(l2_set)(cpu_mips_t *cpu,m_uint64_t vaddr)
+{
+   m_uint32_t set;
+
+   set = (vaddr >> MIPS_MIN_PAGE_SHIFT) & cpu->mts_l2_set_mask;
+   return(&MTS_L2_CACHE(cpu)[set * MTS_L2_WAYS]);
+}
+
+/* 
+ * Lookup a virtual page in the L2 cache. On hit, the entry is moved to
+ * the front of its set and copied into the L1 slot which is returned.
+ */
+static MTS_ENTRY *MTS_PROTO(l2_lookup)(cpu_mips_t *cpu,m_uint64_t vaddr,
+                                       u_int op_type,m_uint32_t hash_bucket)
+{
+   MTS_L2_ENTRY *set,tmp;
+   m_uint64_t gvpa;
+   u_int i;
+
+   set  = MTS_PROTO(l2_set)(cpu,vaddr);
+   gvpa = vaddr & MIPS_MIN_PAGE_MASK;
+
+   for(i=0;i<MTS_L2_WAYS;i++) {
+      if (set[i].entry.gvpa != (typeof(set[i].entry.gvpa))gvpa)
+         continue;
+
+      /* Stale TLB-mapped entry, or write to a Copy-On-Write page */
+      if ((set[i].tlb_index != (m_uint32_t)-1) &&
+          (set[i].tlb_gen != cpu->mts_tlb_gen[set[i].tlb_index]))
+         return NULL;
+
+      if ((op_type == MTS_WRITE) && (set[i].entry.flags & MTS_FLAG_COW))
+         return NULL;
+
+      if (i != 0) {
+         tmp = set[i];
+         memmove(&set[1],&set[0],i * sizeof(MTS_L2_ENTRY));
+         set[0] = tmp;
+      }
+
+      if (set[0].tlb_index != (m_uint32_t)-1)
+         mips64_mts_tlb_rmap_add(cpu,set[0].tlb_index,hash_bucket);
+
+#if DEBUG_MTS_STATS
+      cpu->mts_l2_hits++;
+#endif
+      MTS_CACHE(cpu)[hash_bucket] = set[0].entry;
+      return(&MTS_CACHE(cpu)[hash_bucket]);
+   }
+
+   return NULL;
+}
+
+/* 
+ * Record a translation just stored in a L1 slot by the slow lookup:
+ * remember the slot for the TLB entry it comes from, and insert it at the
+ * front of its L2 set (replacing a previous copy or the LRU entry).
+ */
+static void MTS_PROTO(l2_fill)(cpu_mips_t *cpu,MTS_ENTRY *entry,
+                               int tlb_index,m_uint32_t hash_bucket)
+{
+   MTS_L2_ENTRY *set;
+   u_int i;
+
+   if (tlb_index != -1)
+      mips64_mts_tlb_rmap_add(cpu,tlb_index,hash_bucket);
+
+   set = MTS_PROTO(l2_set)(cpu,entry->gvpa);
+
+   for(i=0;i<MTS_L2_WAYS-1;i++)
+      if (set[i].entry.gvpa == entry->gvpa)
+         break;
+
+   memmove(&set[1],&set[0],i * sizeof(MTS_L2_ENTRY));
+   set[0].entry     = *entry;
+   set[0].tlb_index = tlb_index;
+   set[0].tlb_gen   = (tlb_index != -1) ? cpu->mts_tlb_gen[tlb_index] : 0;
+}
+
 /* 
  * MTS mapping.
  *
@@ -549,7 +731,7 @@ void MTS_PROTO(api_unmap)(cpu_mips_t *cpu,m_uint64_t vaddr,m_uint32_t len,
 {
    /* Invalidate the TLB entry or the full cache if no index is specified */
    if (tlb_index != -1)
-      MTS_PROTO(invalidate_tlb_entry)(cpu,tlb_index);
+      MTS_PROTO(invalidate_tlb_entry)(cpu,tlb_index,vaddr,len);
    else
       MTS_PROTO(invalidate_cache)(cpu);
 }
@@ -636,4 +818,6 @@ void MTS_PROTO(init_memop_vectors)(cpu_mips_t *cpu)
 #undef MTS_PROTO
 #undef MTS_PROTO_UP
 #undef MTS_ENTRY
+#undef MTS_L2_ENTRY
+#undef MTS_L2_CACHE
 #undef MTS_CHUNK
@@ -10,6 +10,7 @@
 
 #include "utils.h" 
 #include "rbtree.h"
+#include "vclock.h"
 
 /* CPU identifiers */
 #define PPC32_PVR_405     0x40110000
@@ -162,6 +163,18 @@
 /* Page Table Entry (PTE) size: 64-bits */
 #define PPC32_PTE_SIZE   8
 
+/* PTE cache (host-side TLB over the hashed page table) */
+#define PPC32_PTE_CACHE_WAYS  4
+#define PPC32_PTE_CACHE_SETS  1024
+
+/* PTE cache entry: virtual page (VSID+page) to physical page */
+struct ppc32_pte_cache_entry {
+   m_uint64_t gen;     /* Cache generation (0: invalid) */
+   m_uint64_t paddr;   /* Physical page address */
+   m_uint32_t vsid;    /* Virtual Segment ID */
+   m_uint32_t vpage;   /* Virtual page number */
+};
+
 /* PTE entry (Up and Lo) */
 #define PPC32_PTEU_V           0x80000000    /* Valid entry */
 #define PPC32_PTEU_VSID_MASK   0x7FFFFF80    /* Virtual Segment ID */
@@ -352,6 +365,7 @@ struct cpu_ppc {
    u_int timer_irq_freq;
    u_int timer_irq_check_itv;
    u_int timer_drift;
+   vclock_t timer_clock;
 
    /* IRQ disable flag */
    volatile u_int irq_disable;
@@ -366,6 +380,10 @@ struct cpu_ppc {
    m_uint32_t sdr1;
    void *sdr1_hptr;
 
+   /* PTE cache, valid for the current generation only */
+   struct ppc32_pte_cache_entry *pte_cache;
+   m_uint64_t pte_cache_gen;
+
    /* MSR (Machine state register) */
    m_uint32_t msr;
 
@@ -408,6 +426,7 @@ struct cpu_ppc {
    
    /* MTS cache statistics */
    m_uint64_t mts_misses,mts_lookups;
+   m_uint64_t mts_pte_hits,mts_pte_walks;
 
    /* JIT flush method */
    u_int jit_flush_method;
@@ -425,6 +444,10 @@ struct cpu_ppc {
    m_uint64_t njm_exec_page;
    mips_insn_t *njm_exec_ptr;
 
+   /* Predecoded page cache (non-JIT) and page matching njm_exec_page */
+   struct ppc32_njm_page **njm_cache;
+   struct ppc32_njm_page *njm_page;
+
    /* Performance counter (non-JIT) */
    m_uint32_t perf_counter;
 
@@ -502,8 +525,11 @@ void ppc32_set_pvr(cpu_ppc_t *cpu,m_uint32_t pvr);
 /* Set idle PC value */
 void ppc32_set_idle_pc(cpu_gen_t *cpu,m_uint64_t addr);
 
-/* Timer IRQ */
-void *ppc32_timer_irq_run(cpu_ppc_t *cpu);
+/* Start (or resynchronize) the timer IRQ clock */
+void ppc32_timer_irq_start(cpu_ppc_t *cpu);
+
+/* Update the number of pending timer IRQs from the virtual clock */
+void ppc32_timer_irq_update(cpu_ppc_t *cpu);
 
 /* Determine an "idling" PC */
 int ppc32_get_idling_pc(cpu_gen_t *cpu);
@@ -535,6 +561,9 @@ void ppc32_dump_regs(cpu_gen_t *cpu);
 /* Dump MMU registers */
 void ppc32_dump_mmu(cpu_gen_t *cpu);
 
+/* Save or restore the CPU state in a VM checkpoint */
+int ppc32_ckpt(cpu_ppc_t *cpu,vm_ckpt_t *ckpt);
+
 /* Load a raw image into the simulated memory */
 int ppc32_load_raw_image(cpu_ppc_t *cpu,char *filename,m_uint32_t vaddr);
 
@@ -542,6 +571,9 @@ int ppc32_load_raw_image(cpu_ppc_t *cpu,char *filename,m_uint32_t vaddr);
 int ppc32_load_elf_image(cpu_ppc_t *cpu,char *filename,int skip_load,
                          m_uint32_t *entry_point);
 
+/* Free the predecoded page cache (non-JIT mode) */
+void ppc32_exec_free_cache(cpu_ppc_t *cpu);
+
 /* Run PowerPC code in step-by-step mode */
 void *ppc32_exec_run_cpu(cpu_gen_t *gen);
 
@@ -3608,6 +3608,11 @@ DECLARE_INSN(SUBFIC)
 /* SYNC - Synchronize */
 DECLARE_INSN(SYNC)
 {
+   jit_op_t *iop;
+
+   /* Page table updates become visible: drop the PTE cache */
+   iop = ppc32_op_emit_insn_output(cpu,1,"sync");
+   amd64_inc_membase(iop->ob_ptr,AMD64_R15,OFFSET(cpu_ppc_t,pte_cache_gen));
    return(0);
 }
 
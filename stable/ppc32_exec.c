@@ -94,6 +94,72 @@ static forced_inline void ppc32_exec_memop(cpu_ppc_t *cpu,int memop,
    fn(cpu,vaddr,dst_reg);
 }
 
+/* Allocate a predecoded page (all slots hold the decoded zero word) */
+static struct ppc32_njm_page *ppc32_exec_alloc_page(void)
+{
+   struct ppc32_njm_page *page;
+   int i,index;
+
+   if (!(page = malloc(sizeof(*page))))
+      return NULL;
+
+   index = ilt_lookup(ilt,0);
+
+   for(i=0;i<PPC32_INSN_PER_PAGE;i++) {
+      page->insn[i].exec  = ppc32_exec_tags[index].exec;
+      page->insn[i].insn  = 0;
+      page->insn[i].index = index;
+   }
+
+   return page;
+}
+
+/* Free the predecoded page cache */
+void ppc32_exec_free_cache(cpu_ppc_t *cpu)
+{
+   int i;
+
+   if (!cpu->njm_cache)
+      return;
+
+   for(i=0;i<PPC32_NJM_CACHE_SIZE;i++)
+      free(cpu->njm_cache[i]);
+
+   free(cpu->njm_cache);
+   cpu->njm_cache = NULL;
+   cpu->njm_page = NULL;
+}
+
+/* 
+ * Set the current exec page.
+ *
+ * As for MIPS64, predecoded slots are checked against the instruction
+ * word in memory before use, so no invalidation on writes is needed.
+ */
+static void ppc32_exec_set_page(cpu_ppc_t *cpu,m_uint32_t exec_page)
+{
+   struct ppc32_njm_page **slot;
+   m_uint32_t phys_page;
+   ppc_insn_t *ptr;
+
+   ptr = cpu->mem_op_lookup(cpu,exec_page,PPC32_MTS_ICACHE);
+   cpu->njm_exec_page = exec_page;
+   cpu->njm_exec_ptr  = ptr;
+
+   if (!cpu->njm_cache)
+      return;
+
+   if (cpu->translate(cpu,exec_page,PPC32_MTS_ICACHE,&phys_page) == -1)
+      phys_page = 0;
+
+   slot = &cpu->njm_cache[phys_page & (PPC32_NJM_CACHE_SIZE - 1)];
+
+   if (!*slot)
+      *slot = ppc32_exec_alloc_page();
+
+   cpu->njm_page = *slot;
+}
+
 /* Fetch an instruction */
 static forced_inline int ppc32_exec_fetch(cpu_ppc_t *cpu,m_uint32_t ia,
                                           ppc_insn_t *insn)
@@ -102,10 +168,8 @@ static forced_inline int ppc32_exec_fetch(cpu_ppc_t *cpu,m_uint32_t ia,
 
    exec_page = ia & ~PPC32_MIN_PAGE_IMASK;
 
-   if (unlikely(exec_page != cpu->njm_exec_page)) {
-      cpu->njm_exec_page = exec_page;
-      cpu->njm_exec_ptr  = cpu->mem_op_lookup(cpu,exec_page,PPC32_MTS_ICACHE);
-   }
+   if (unlikely(exec_page != cpu->njm_exec_page))
+      ppc32_exec_set_page(cpu,exec_page);
 
    offset = (ia & PPC32_MIN_PAGE_IMASK) >> 2;
    *insn = vmtoh32(cpu->njm_exec_ptr[offset]);
@@ -144,6 +208,61 @@ ppc32_exec_single_instruction(cpu_ppc_t *cpu,ppc_insn_t instruction)
    return(exec(cpu,instruction));
 }
 
+/* Execute a predecoded instruction, decoding it again if it has changed */
+static forced_inline int
+ppc32_exec_njm_insn(cpu_ppc_t *cpu,struct ppc32_njm_insn *slot,
+                    ppc_insn_t insn)
+{
+   if (unlikely(slot->insn != insn)) {
+      slot->index = ilt_lookup(ilt,insn);
+      slot->exec  = ppc32_exec_tags[slot->index].exec;
+      slot->insn  = insn;
+   }
+
+#if DEBUG_INSN_PERF_CNT
+   cpu->perf_counter++;
+#endif
+
+#if NJM_STATS_ENABLE
+   cpu->insn_exec_count++;
+   ppc32_exec_tags[slot->index].count++;
+#endif
+   return(slot->exec(cpu,insn));
+}
+
+/* 
+ * Execute predecoded instructions from the current ia until a taken
+ * branch or an exception changes the flow, the end of the page or the
+ * idle pc is reached. Returns the number of instructions executed.
+ */
+static forced_inline u_int ppc32_exec_block(cpu_ppc_t *cpu)
+{
+   struct ppc32_njm_page *page = cpu->njm_page;
+   ppc_insn_t *ptr = cpu->njm_exec_ptr;
+   u_int offset,count = 0;
+   ppc_insn_t insn;
+
+   offset = (cpu->ia & PPC32_MIN_PAGE_IMASK) >> 2;
+
+   for(;;) {
+      /* Increment the time base */
+      cpu->tb += 100;
+
+      insn = vmtoh32(ptr[offset]);
+      count++;
+
+      if (ppc32_exec_njm_insn(cpu,&page->insn[offset],insn))
+         break;
+
+      cpu->ia += sizeof(ppc_insn_t);
+
+      if ((++offset == PPC32_INSN_PER_PAGE) || (cpu->ia == cpu->idle_pc))
+         break;
+   }
+
+   return(count);
+}
+
 /* Execute a single instruction (external) */
 fastcall int ppc32_exec_single_insn_ext(cpu_ppc_t *cpu,ppc_insn_t insn)
 {
@@ -180,20 +299,26 @@ fastcall int ppc32_exec_page(cpu_ppc_t *cpu)
 void *ppc32_exec_run_cpu(cpu_gen_t *gen)
 {   
    cpu_ppc_t *cpu = CPU_PPC32(gen);
-   pthread_t timer_irq_thread;
    int timer_irq_check = 0;
-   ppc_insn_t insn;
-   int res;
+   m_uint32_t exec_page;
 
-   if (pthread_create(&timer_irq_thread,NULL,
-                      (void *)ppc32_timer_irq_run,cpu))
-   {
-      fprintf(stderr,"VM '%s': unable to create Timer IRQ thread for CPU%u.\n",
-              cpu->vm->name,gen->id);
-      cpu_stop(gen);
-      return NULL;
+   if (!cpu->njm_cache) {
+      cpu->njm_cache = calloc(PPC32_NJM_CACHE_SIZE,sizeof(*cpu->njm_cache));
+
+      if (!cpu->njm_cache) {
+         fprintf(stderr,"VM '%s': unable to create instruction cache "
+                 "for CPU%u.\n",cpu->vm->name,gen->id);
+         cpu_stop(gen);
+         return NULL;
+      }
    }
 
+   cpu->njm_exec_page = (m_uint64_t)-1;
+   cpu->njm_page = NULL;
+
+   /* Start the timer IRQ clock */
+   ppc32_timer_irq_start(cpu);
+
    gen->cpu_thread_running = TRUE;
    cpu_exec_loop_set(gen);
 
@@ -215,8 +340,17 @@ void *ppc32_exec_run_cpu(cpu_gen_t *gen)
       }
 
       /* Handle the virtual CPU clock */
-      if (++timer_irq_check == cpu->timer_irq_check_itv) {
+      if (timer_irq_check >= cpu->timer_irq_check_itv) {
          timer_irq_check = 0;
+         ppc32_timer_irq_update(cpu);
+
+         /* Automatic idle PC detection */
+         if (unlikely(gen->idle_auto != NULL))
+            cpu_idle_auto_check(gen);
+
+         /* End of the time slice on the CPU scheduler */
+         if (unlikely(gen->sched != NULL))
+            cpu_sched_check(gen);
 
          if (cpu->timer_irq_pending && !cpu->irq_disable && 
              (cpu->msr & PPC32_MSR_EE)) 
@@ -229,15 +363,21 @@ void *ppc32_exec_run_cpu(cpu_gen_t *gen)
          }
       }
 
-      /* Increment the time base */
-      cpu->tb += 100;
+      /* Execute the next block of instructions */
+      exec_page = cpu->ia & ~PPC32_MIN_PAGE_IMASK;
 
-      /* Fetch and execute the instruction */
-      ppc32_exec_fetch(cpu,cpu->ia,&insn);
-      res = ppc32_exec_single_instruction(cpu,insn);
+      if (unlikely((exec_page != cpu->njm_exec_page) || !cpu->njm_page)) {
+         ppc32_exec_set_page(cpu,exec_page);
 
-      /* Normal flow ? */
-      if (likely(!res)) cpu->ia += sizeof(ppc_insn_t);
+         if (unlikely(!cpu->njm_page)) {
+            fprintf(stderr,"VM '%s': unable to allocate predecoded page "
+                    "for CPU%u.\n",cpu->vm->name,gen->id);
+            cpu_stop(gen);
+            break;
+         }
+      }
+
+      timer_irq_check += ppc32_exec_block(cpu);
    }
 
    /* Check regularly if the CPU has been restarted */
@@ -247,16 +387,16 @@ void *ppc32_exec_run_cpu(cpu_gen_t *gen)
       switch(gen->state) {
          case CPU_STATE_RUNNING:
             gen->state = CPU_STATE_RUNNING;
+            ppc32_timer_irq_start(cpu);
             goto start_cpu;
 
          case CPU_STATE_HALTED:     
             gen->cpu_thread_running = FALSE;
-            pthread_join(timer_irq_thread,NULL);
             break;
       }
       
       /* CPU is paused */
-      usleep(200000);
+      cpu_idle_wait(gen,200000);
    }
 
    return NULL;
@@ -3451,6 +3591,8 @@ static fastcall int ppc32_exec_SUBFZE_dot(cpu_ppc_t *cpu,ppc_insn_t insn)
 /* SYNC - Synchronize */
 static fastcall int ppc32_exec_SYNC(cpu_ppc_t *cpu,ppc_insn_t insn)
 {
+   /* Page table updates become visible: drop the PTE cache */
+   cpu->pte_cache_gen++;
    return(0);
 }
 
@@ -98,8 +98,20 @@ int ppc32_mem_init(cpu_ppc_t *cpu)
    memset(cpu->mts_cache[PPC32_MTS_ICACHE],0xFF,len);
    memset(cpu->mts_cache[PPC32_MTS_DCACHE],0xFF,len);
 
+   /* PTE cache: entries with generation 0 are invalid */
+   len = PPC32_PTE_CACHE_SETS * PPC32_PTE_CACHE_WAYS * 
+      sizeof(struct ppc32_pte_cache_entry);
+
+   if (!(cpu->pte_cache = malloc(len)))
+      return(-1);
+
+   memset(cpu->pte_cache,0,len);
+   cpu->pte_cache_gen = 1;
+
    cpu->mts_lookups = 0;
    cpu->mts_misses  = 0;
+   cpu->mts_pte_hits  = 0;
+   cpu->mts_pte_walks = 0;
    return(0);
 }
 
@@ -112,6 +124,9 @@ void ppc32_mem_shutdown(cpu_ppc_t *cpu)
       free(cpu->mts_cache[PPC32_MTS_DCACHE]);
       cpu->mts_cache[PPC32_MTS_ICACHE] = NULL;
       cpu->mts_cache[PPC32_MTS_DCACHE] = NULL;
+
+      free(cpu->pte_cache);
+      cpu->pte_cache = NULL;
    }
 }
 
@@ -163,6 +178,9 @@ void ppc32_mem_show_stats(cpu_gen_t *gen_cpu)
           cpu->mts_lookups, cpu->mts_misses,
           100 - ((double)(cpu->mts_misses*100)/
                  (double)cpu->mts_lookups));
+
+   printf("   PTE cache hits: %llu, page table walks: %llu\n",
+          cpu->mts_pte_hits,cpu->mts_pte_walks);
 }
 
 /* Invalidate the MTS caches (instruction and data) */
@@ -173,6 +191,58 @@ void ppc32_mem_invalidate_cache(cpu_ppc_t *cpu)
    len = MTS32_HASH_SIZE * sizeof(mts32_entry_t);
    memset(cpu->mts_cache[PPC32_MTS_ICACHE],0xFF,len);
    memset(cpu->mts_cache[PPC32_MTS_DCACHE],0xFF,len);
+
+   /* Drop the PTE cache too (tlbie/tlbia, SR and SDR1 changes) */
+   cpu->pte_cache_gen++;
+}
+
+/* Get the PTE cache set for a virtual page */
+static forced_inline struct ppc32_pte_cache_entry *
+ppc32_pte_cache_set(cpu_ppc_t *cpu,m_uint32_t vsid,m_uint32_t vpage)
+{
+   m_uint32_t set;
+
+   set = (vpage ^ vsid) & (PPC32_PTE_CACHE_SETS - 1);
+   return(&cpu->pte_cache[set * PPC32_PTE_CACHE_WAYS]);
+}
+
+/* Lookup a virtual page in the PTE cache */
+static forced_inline int ppc32_pte_cache_lookup(cpu_ppc_t *cpu,
+                                                m_uint32_t vsid,
+                                                m_uint32_t vpage,
+                                                m_uint64_t *paddr)
+{
+   struct ppc32_pte_cache_entry *set;
+   u_int i;
+
+   set = ppc32_pte_cache_set(cpu,vsid,vpage);
+
+   for(i=0;i<PPC32_PTE_CACHE_WAYS;i++) {
+      if ((set[i].gen == cpu->pte_cache_gen) &&
+          (set[i].vpage == vpage) && (set[i].vsid == vsid))
+      {
+         *paddr = set[i].paddr;
+         return(TRUE);
+      }
+   }
+
+   return(FALSE);
+}
+
+/* Add a translation at the front of its PTE cache set (LRU is dropped) */
+static void ppc32_pte_cache_add(cpu_ppc_t *cpu,m_uint32_t vsid,
+                                m_uint32_t vpage,m_uint64_t paddr)
+{
+   struct ppc32_pte_cache_entry *set;
+
+   set = ppc32_pte_cache_set(cpu,vsid,vpage);
+   memmove(&set[1],&set[0],
+           (PPC32_PTE_CACHE_WAYS-1) * sizeof(struct ppc32_pte_cache_entry));
+
+   set[0].gen   = cpu->pte_cache_gen;
+   set[0].paddr = paddr;
+   set[0].vsid  = vsid;
+   set[0].vpage = vpage;
 }
 
 /* 
@@ -315,6 +385,18 @@ static mts32_entry_t *ppc32_slow_lookup(cpu_ppc_t *cpu,m_uint32_t vaddr,
    segment = vaddr >> 28;
    vsid = cpu->sr[segment] & PPC32_SD_VSID_MASK;
 
+   /* Try the PTE cache before walking the page table */
+   if (ppc32_pte_cache_lookup(cpu,vsid,vaddr >> PPC32_MIN_PAGE_SHIFT,&paddr)) {
+#if DEBUG_MTS_STATS
+      cpu->mts_pte_hits++;
+#endif
+      goto pte_map;
+   }
+
+#if DEBUG_MTS_STATS
+   cpu->mts_pte_walks++;
+#endif
+
    /* Compute the first hash value */
    hash =  (vaddr >> PPC32_MIN_PAGE_SHIFT) & 0xFFFF;
    hash ^= vsid;
@@ -364,6 +446,9 @@ static mts32_entry_t *ppc32_slow_lookup(cpu_ppc_t *cpu,m_uint32_t vaddr,
    paddr |= (pte2 & PPC32_PTEL_XPN_MASK) << (33 - PPC32_PTEL_XPN_SHIFT);
    paddr |= (pte2 & PPC32_PTEL_X_MASK) << (32 - PPC32_PTEL_X_SHIFT);
 
+   ppc32_pte_cache_add(cpu,vsid,vaddr >> PPC32_MIN_PAGE_SHIFT,paddr);
+
+ pte_map:
    map.vaddr  = vaddr & ~PPC32_MIN_PAGE_IMASK;
    map.paddr  = paddr;
    map.offset = vaddr & PPC32_MIN_PAGE_IMASK;
@@ -528,6 +613,7 @@ int ppc32_set_sdr1(cpu_ppc_t *cpu,m_uint32_t sdr1)
    }
 
    cpu->sdr1_hptr = (char *)dev->host_addr + (pt_addr - dev->phys_addr);
+   cpu->pte_cache_gen++;
    return(0);
 }
 
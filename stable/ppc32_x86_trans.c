@@ -3675,6 +3675,14 @@ DECLARE_INSN(SUBFIC)
 /* SYNC - Synchronize */
 DECLARE_INSN(SYNC)
 {
+   jit_op_t *iop;
+
+   /* Page table updates become visible: drop the PTE cache */
+   iop = ppc32_op_emit_insn_output(cpu,1,"sync");
+   x86_alu_membase_imm(iop->ob_ptr,X86_ADD,X86_EDI,
+                       OFFSET(cpu_ppc_t,pte_cache_gen),1);
+   x86_alu_membase_imm(iop->ob_ptr,X86_ADC,X86_EDI,
+                       OFFSET(cpu_ppc_t,pte_cache_gen)+4,0);
    return(0);
 }
 
@@ -0,0 +1,308 @@
+/*
+ * Cisco router simulation platform.
+ * Copyright (c) 2005,2006 Christophe Fillot (cf@utc.fr)
+ *
+ * tlb_check.c: randomized check of the MIPS64 TLB index.
+ *
+ * Random TLB entries are written with TLBWI and TLBWR (few VPN2 and ASID
+ * values, all page sizes, global or not, so that entries overlap), and
+ * the address mode is switched between 32 and 64 bits from time to time.
+ * After each write, TLB lookups and TLBP are compared with a linear scan
+ * of the TLB, which is the code used before the index: the lowest
+ * matching entry for lookups, the highest one for TLBP.
+ *
+ * Usage: tlb_check [iterations [seed]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cpu.h"
+#include "vm.h"
+#include "dynamips.h"
+#include "memory.h"
+#include "device.h"
+#include "mips64.h"
+#include "mips64_cp0.h"
+#include "mips64_mem.h"
+
+/* Globals normally provided by dynamips.c */
+const char *os_name = "check";
+const char *sw_version = "check";
+const char *sw_version_tag = "check";
+char *binding_addr = NULL;
+FILE *log_file = NULL;
+
+void dynamips_reset(void)
+{
+}
+
+/* Number of lookups and probes per TLB write */
+#define CHECK_LOOKUPS  16
+
+/* Maximum number of reported mismatches */
+#define CHECK_MAX_ERRORS  20
+
+/* Page masks (4 KB to 16 MB pages) */
+static m_uint64_t check_page_masks[] = {
+   0x00000000, 0x00006000, 0x0001e000, 0x0007e000,
+   0x001fe000, 0x007fe000, 0x01ffe000,
+};
+
+#define CHECK_PAGE_MASKS  (sizeof(check_page_masks) / sizeof(m_uint64_t))
+
+/* Virtual addresses used as VPN2 (some differ only above bit 31) */
+static m_uint64_t check_vaddrs[] = {
+   0x0000000000000000ULL, 0x0000000000400000ULL, 0x0000000000402000ULL,
+   0x0000000001000000ULL, 0x000000007fffe000ULL, 0xffffffffc0000000ULL,
+   0xffffffffc0804000ULL, 0x0000000100400000ULL, 0xc000000000400000ULL,
+   0x4000000000000000ULL,
+};
+
+#define CHECK_VADDRS  (sizeof(check_vaddrs) / sizeof(m_uint64_t))
+
+static u_int check_errors = 0;
+
+/* Get a random value */
+static m_uint64_t check_rand(u_int max)
+{
+   return((m_uint64_t)(rand() % max));
+}
+
+/* Get a random virtual address close to a VPN2 of the pool */
+static m_uint64_t check_rand_vaddr(void)
+{
+   return(check_vaddrs[check_rand(CHECK_VADDRS)] +
+          (check_rand(0x4000) << 8));
+}
+
+/* Get the VPN2 mask */
+static m_uint64_t check_vpn2_mask(cpu_mips_t *cpu)
+{
+   if (cpu->addr_mode == 64)
+      return(MIPS_TLB_VPN2_MASK_64);
+   else
+      return(MIPS_TLB_VPN2_MASK_32);
+}
+
+/* Get the page size corresponding to a page mask */
+static m_uint64_t check_page_size(m_uint64_t page_mask)
+{
+   return((page_mask + 0x2000) >> 1);
+}
+
+/* Check if a TLB entry matches a VPN2 and an ASID */
+static int check_entry_match(tlb_entry_t *entry,m_uint64_t vpn_addr,
+                             m_uint64_t vpn2_mask,u_int asid)
+{
+   return(((vpn_addr & ~(entry->mask + 0x1FFF)) ==
+           (entry->hi & vpn2_mask)) &&
+          ((entry->hi & MIPS_TLB_G_MASK) ||
+           ((entry->hi & MIPS_TLB_ASID_MASK) == asid)));
+}
+
+/* Find the first TLB entry matching a virtual address (linear scan) */
+static int check_find_linear(cpu_mips_t *cpu,m_uint64_t vaddr)
+{
+   mips_cp0_t *cp0 = &cpu->cp0;
+   m_uint64_t vpn2_mask;
+   u_int asid;
+   int i;
+
+   vpn2_mask = check_vpn2_mask(cpu);
+   asid = cp0->reg[MIPS_CP0_TLB_HI] & MIPS_TLB_ASID_MASK;
+
+   for(i=0;i<cp0->tlb_entries;i++)
+      if (check_entry_match(&cp0->tlb[i],vaddr & vpn2_mask,vpn2_mask,asid))
+         return(i);
+
+   return(-1);
+}
+
+/* Find the last TLB entry matching EntryHi (linear TLBP) */
+static int check_tlbp_linear(cpu_mips_t *cpu)
+{
+   mips_cp0_t *cp0 = &cpu->cp0;
+   m_uint64_t vpn2,vpn2_mask;
+   tlb_entry_t *entry;
+   u_int asid;
+   int i,res = -1;
+
+   vpn2_mask = check_vpn2_mask(cpu);
+   vpn2 = cp0->reg[MIPS_CP0_TLB_HI] & vpn2_mask;
+   asid = cp0->reg[MIPS_CP0_TLB_HI] & MIPS_TLB_ASID_MASK;
+
+   for(i=0;i<cp0->tlb_entries;i++) {
+      entry = &cp0->tlb[i];
+
+      if (((entry->hi & vpn2_mask) == vpn2) &&
+          ((entry->hi & MIPS_TLB_G_MASK) ||
+           ((entry->hi & MIPS_TLB_ASID_MASK) == asid)))
+         res = i;
+   }
+
+   return(res);
+}
+
+/* Report a mismatch */
+static void check_error(cpu_mips_t *cpu,char *op,m_uint64_t addr,
+                        int index,int linear)
+{
+   if (++check_errors > CHECK_MAX_ERRORS)
+      return;
+
+   printf("%s mismatch (%u-bit mode): addr=0x%16.16llx asid=%llu "
+          "index=%d linear=%d\n",op,cpu->addr_mode,addr,
+          cpu->cp0.reg[MIPS_CP0_TLB_HI] & MIPS_TLB_ASID_MASK,index,linear);
+}
+
+/* Check TLB lookups for a virtual address */
+static void check_lookup(cpu_mips_t *cpu,m_uint64_t vaddr)
+{
+   tlb_entry_t *entry;
+   mts_map_t map;
+   m_uint64_t lo;
+   int i,res;
+
+   i = check_find_linear(cpu,vaddr);
+   res = mips64_cp0_tlb_lookup(cpu,vaddr,&map);
+
+   /* Entries with the V bit cleared give no mapping */
+   if (i != -1) {
+      entry = &cpu->cp0.tlb[i];
+      lo = (vaddr & check_page_size(entry->mask)) ? entry->lo1 : entry->lo0;
+
+      if (!(lo & MIPS_TLB_V_MASK))
+         i = -1;
+   }
+
+   if (res ? (map.tlb_index != i) : (i != -1))
+      check_error(cpu,"lookup",vaddr,res ? map.tlb_index : -1,i);
+}
+
+/* Check TLBP for an EntryHi value */
+static void check_tlbp(cpu_mips_t *cpu,m_uint64_t hi)
+{
+   mips_cp0_t *cp0 = &cpu->cp0;
+   int i,res;
+
+   cp0->reg[MIPS_CP0_TLB_HI] = hi;
+   i = check_tlbp_linear(cpu);
+
+   mips64_cp0_exec_tlbp(cpu);
+   res = (cp0->reg[MIPS_CP0_INDEX] & 0x80000000) ?
+      -1 : (int)cp0->reg[MIPS_CP0_INDEX];
+
+   if (res != i)
+      check_error(cpu,"TLBP",hi,res,i);
+}
+
+/* Write a random TLB entry with TLBWI or TLBWR */
+static void check_write_entry(cpu_mips_t *cpu)
+{
+   mips_cp0_t *cp0 = &cpu->cp0;
+   m_uint64_t g;
+
+   g = (check_rand(4) == 0) ? MIPS_CP0_LO_G_MASK : 0;
+
+   cp0->reg[MIPS_CP0_PAGEMASK] =
+      check_page_masks[check_rand(CHECK_PAGE_MASKS)];
+   cp0->reg[MIPS_CP0_TLB_HI] = check_rand_vaddr() | check_rand(4);
+   cp0->reg[MIPS_CP0_TLB_LO_0] = (check_rand(2) * MIPS_TLB_V_MASK) | g;
+   cp0->reg[MIPS_CP0_TLB_LO_1] = (check_rand(2) * MIPS_TLB_V_MASK) | g;
+
+   if (check_rand(2)) {
+      cp0->reg[MIPS_CP0_INDEX] = check_rand(cp0->tlb_entries);
+      mips64_cp0_exec_tlbwi(cpu);
+   } else {
+      mips64_cp0_exec_tlbwr(cpu);
+   }
+}
+
+/* Create a bare VM with 1 MB of RAM */
+static vm_instance_t *check_create_vm(vm_platform_t *platform)
+{
+   vm_instance_t *vm;
+
+   if (!(vm = calloc(1,sizeof(*vm))))
+      return NULL;
+
+   vm->name = "check";
+   vm->platform = platform;
+   vm->ios_image_fd = -1;
+   vm->status = VM_STATUS_RUNNING;
+   vm->ram_size = 1;
+   vm->cpu_group = cpu_group_create("check");
+
+   if (dev_ram_init(vm,"ram",FALSE,FALSE,NULL,FALSE,0,1 << 20) == -1)
+      return NULL;
+
+   return vm;
+}
+
+int main(int argc,char *argv[])
+{
+   vm_platform_t platform;
+   vm_instance_t *vm;
+   cpu_mips_t *cpu;
+   cpu_gen_t *gen;
+   u_long iterations = 100000,n;
+   u_int seed = 1,i;
+
+   if (argc > 1)
+      iterations = strtoul(argv[1],NULL,0);
+
+   if (argc > 2)
+      seed = strtoul(argv[2],NULL,0);
+
+   if (!iterations) {
+      fprintf(stderr,"Usage: %s [iterations [seed]]\n",argv[0]);
+      return(EXIT_FAILURE);
+   }
+
+   memset(&platform,0,sizeof(platform));
+   platform.name = "check";
+   platform.log_name = "CHECK";
+
+   if (!(vm = check_create_vm(&platform)) ||
+       !(gen = cpu_create(vm,CPU_TYPE_MIPS64,0)))
+   {
+      fprintf(stderr,"tlb_check: unable to create the VM.\n");
+      return(EXIT_FAILURE);
+   }
+
+   cpu = CPU_MIPS64(gen);
+   srand(seed);
+
+   for(n=0;n<iterations;n++) {
+      /* Switch the address mode, the TLB size and the wired entries */
+      if (check_rand(1000) == 0)
+         mips64_set_addr_mode(cpu,(cpu->addr_mode == 32) ? 64 : 32);
+
+      if (check_rand(5000) == 0) {
+         cpu->cp0.tlb_entries = (cpu->cp0.tlb_entries ==
+                                 MIPS64_TLB_MAX_ENTRIES) ?
+            MIPS64_TLB_STD_ENTRIES : MIPS64_TLB_MAX_ENTRIES;
+      }
+
+      if (check_rand(500) == 0)
+         cpu->cp0.reg[MIPS_CP0_WIRED] = check_rand(8);
+
+      check_write_entry(cpu);
+
+      for(i=0;i<CHECK_LOOKUPS;i++) {
+         cpu->cp0.reg[MIPS_CP0_TLB_HI] = check_rand(4);
+         check_lookup(cpu,check_rand_vaddr());
+         check_tlbp(cpu,(check_rand_vaddr() & ~0x1FFFULL) | check_rand(4));
+      }
+   }
+
+   printf("%lu TLB writes, %lu lookups and probes, %u mismatches.\n",
+          iterations,iterations * CHECK_LOOKUPS,check_errors);
+
+   /* The CPU thread is left suspended */
+   fflush(stdout);
+   _exit(check_errors ? EXIT_FAILURE : EXIT_SUCCESS);
+}
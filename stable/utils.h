@@ -61,6 +61,7 @@ typedef struct vm_platform vm_platform_t;
 typedef struct mips64_jit_tcb mips64_jit_tcb_t;
 typedef struct ppc32_jit_tcb ppc32_jit_tcb_t;
 typedef struct jit_op jit_op_t;
+typedef struct vm_ckpt vm_ckpt_t;
 
 /* Translated block function pointer */
 typedef void (*insn_tblock_fptr)(void);
@@ -83,6 +84,14 @@ typedef m_uint32_t ppc_insn_t;
 #define MAP_ANONYMOUS MAP_ANON
 #endif
 
+/* Huge page size assumed for hugetlbfs mappings */
+#define MEMZONE_HUGE_PAGE_SIZE  (2 * 1048576)
+
+/* Host memory backing of a memory zone */
+#define MEMZONE_BACKING_STD      0   /* Standard pages */
+#define MEMZONE_BACKING_THP      1   /* Transparent huge pages advised */
+#define MEMZONE_BACKING_HUGETLB  2   /* hugetlbfs pages */
+
 /* List item */
 typedef struct m_list m_list_t;
 struct m_list {
@@ -129,6 +138,22 @@ struct mts64_entry {
    m_uint32_t flags;  /* Flags */
 }__attribute__ ((aligned(16)));
 
+/* MTS64: L2 cache entry, tagged with the TLB entry it comes from */
+typedef struct mts64_l2_entry mts64_l2_entry_t;
+struct mts64_l2_entry {
+   mts64_entry_t entry;
+   m_uint32_t tlb_index;   /* TLB entry index (-1: not TLB-mapped) */
+   m_uint32_t tlb_gen;     /* Generation of the TLB entry */
+};
+
+/* MTS32: L2 cache entry, tagged with the TLB entry it comes from */
+typedef struct mts32_l2_entry mts32_l2_entry_t;
+struct mts32_l2_entry {
+   mts32_entry_t entry;
+   m_uint32_t tlb_index;   /* TLB entry index (-1: not TLB-mapped) */
+   m_uint32_t tlb_gen;     /* Generation of the TLB entry */
+};
+
 /* Host register allocation */
 #define HREG_FLAG_ALLOC_LOCKED  1
 #define HREG_FLAG_ALLOC_FORCED  2
@@ -344,6 +369,18 @@ int memzone_sync_all(void *addr, size_t len);
 /* Unmap a memory zone */
 int memzone_unmap(void *addr, size_t len);
 
+/* Discard the content of a memory zone and give its memory back */
+int memzone_discard(void *addr, size_t len);
+
+/* Advise the kernel to back an anonymous zone with transparent huge pages */
+int memzone_advise_hugepages(void *addr,size_t len,int shared);
+
+/* Map an anonymous memory zone, backed by huge pages if possible */
+u_char *memzone_map_huge(size_t len,int *backing);
+
+/* Get the name of a memory zone backing */
+char *memzone_get_backing_str(int backing);
+
 /* Map a memory zone as an executable area */
 u_char *memzone_map_exec_area(size_t len);
 
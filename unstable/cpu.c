@@ -16,6 +16,14 @@
 #include <fcntl.h>
 #include <pthread.h>
 
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#define CPU_IDLE_USE_FUTEX  1
+#else
+#define CPU_IDLE_USE_FUTEX  0
+#endif
+
 #include "cpu.h"
 #include "vm.h"
 #include "tcb.h"
@@ -119,6 +127,28 @@ int cpu_group_rebuild_mts(cpu_group_t *group)
    return(0);
 }
 
+/* 
+ * Drop the translated code of a CPU group, and force a new lookup of the
+ * current exec page (non-JIT). The CPUs must be suspended.
+ */
+void cpu_group_flush_code(cpu_group_t *group)
+{
+   cpu_gen_t *cpu;
+
+   for(cpu=group->cpu_list;cpu;cpu=cpu->next) {
+      switch(cpu->type) {
+         case CPU_TYPE_MIPS64:
+            cpu_jit_tcb_flush_all(cpu);
+            CPU_MIPS64(cpu)->njm_exec_page = (m_uint64_t)-1;
+            break;
+         case CPU_TYPE_PPC32:
+            ppc32_jit_flush(CPU_PPC32(cpu),0);
+            CPU_PPC32(cpu)->njm_exec_page = (m_uint64_t)-1;
+            break;
+      }
+   }
+}
+
 /* Log a message for a CPU */
 void cpu_log(cpu_gen_t *cpu,char *module,char *format,...)
 {
@@ -182,13 +212,24 @@ cpu_gen_t *cpu_create(vm_instance_t *vm,u_int type,u_int id)
          break;
    }
 
-   /* create the CPU thread execution */
-   if (pthread_create(&cpu->cpu_thread,NULL,cpu_run_fn,cpu) != 0) {
+   /* Automatic idle PC detection */
+   if (vm->idle_auto)
+      cpu_idle_auto_enable(cpu,TRUE);
+
+   /* run the CPU on the scheduler workers, or create its own thread */
+   if (cpu_sched_workers >= 0) {
+      if (cpu_sched_add(cpu,cpu_run_fn) == -1) {
+         fprintf(stderr,"cpu_create: unable to schedule CPU%u\n",id);
+         free(cpu);
+         return NULL;
+      }
+   } else if (pthread_create(&cpu->cpu_thread,NULL,cpu_run_fn,cpu) != 0) {
       fprintf(stderr,"cpu_create: unable to create thread for CPU%u\n",id);
       free(cpu);
       return NULL;
    }
 
+   vclock_register();
    return cpu;
 }
 
@@ -198,7 +239,11 @@ void cpu_delete(cpu_gen_t *cpu)
    if (cpu) {
       /* Stop activity of this CPU */
       cpu_stop(cpu);
-      pthread_join(cpu->cpu_thread,NULL);
+
+      if (cpu->sched != NULL)
+         cpu_sched_remove(cpu);
+      else
+         pthread_join(cpu->cpu_thread,NULL);
 
       /* Free resources */
       switch(cpu->type) {
@@ -211,6 +256,8 @@ void cpu_delete(cpu_gen_t *cpu)
             break;
       }
 
+      vclock_unregister();
+      cpu_idle_auto_free(cpu);
       free(cpu->jit_op_array);
       free(cpu);
    }
@@ -222,6 +269,7 @@ void cpu_start(cpu_gen_t *cpu)
    if (cpu) {
       cpu_log(cpu,"CPU_STATE","Starting CPU (old state=%u)...\n",cpu->state);
       cpu->state = CPU_STATE_RUNNING;
+      cpu_idle_break_wait(cpu);
    }
 }
 
@@ -231,6 +279,7 @@ void cpu_stop(cpu_gen_t *cpu)
    if (cpu) {
       cpu_log(cpu,"CPU_STATE","Halting CPU (old state=%u)...\n",cpu->state);
       cpu->state = CPU_STATE_HALTED;
+      cpu_idle_break_wait(cpu);
    }
 }
 
@@ -257,8 +306,10 @@ void cpu_group_set_state(cpu_group_t *group,u_int state)
 {
    cpu_gen_t *cpu;
    
-   for(cpu=group->cpu_list;cpu;cpu=cpu->next)
+   for(cpu=group->cpu_list;cpu;cpu=cpu->next) {
       cpu->state = state;
+      cpu_idle_break_wait(cpu);
+   }
 }
 
 /* Returns TRUE if all CPUs in a CPU group are inactive */
@@ -323,24 +374,164 @@ int cpu_group_restore_state(cpu_group_t *group)
    return(TRUE);
 }
 
-/* Virtual idle loop */
-void cpu_idle_loop(cpu_gen_t *cpu)
+/*
+ * Idle wait: the CPU thread sleeps on a wake word, which is set by any
+ * thread raising an event for this CPU (IRQ, state change). A wakeup
+ * posted while the CPU is running is kept, so it is never lost if the
+ * CPU enters the idle loop just after, and waking a CPU which is not
+ * sleeping doesn't cost a system call.
+ */
+#if CPU_IDLE_USE_FUTEX
+/* Sleep on the wake word (Linux futex) */
+static void cpu_idle_sleep(cpu_gen_t *cpu,u_int usec)
+{
+   struct timespec t_spc;
+
+   t_spc.tv_sec = usec / 1000000;
+   t_spc.tv_nsec = (usec % 1000000) * 1000;
+
+   syscall(SYS_futex,&cpu->idle_wake,FUTEX_WAIT_PRIVATE,CPU_IDLE_SLEEPING,
+           &t_spc,NULL,0);
+}
+
+/* Wake up the thread sleeping on the wake word (Linux futex) */
+static void cpu_idle_wakeup(cpu_gen_t *cpu)
+{
+   syscall(SYS_futex,&cpu->idle_wake,FUTEX_WAKE_PRIVATE,1,NULL,NULL,0);
+}
+#else
+/* Sleep on the wake word (condition variable) */
+static void cpu_idle_sleep(cpu_gen_t *cpu,u_int usec)
 {
    struct timespec t_spc;
    m_tmcnt_t expire;
 
-   expire = m_gettime_usec() + cpu->idle_sleep_time;
+   expire = m_gettime_usec() + usec;
 
    pthread_mutex_lock(&cpu->idle_mutex);
    t_spc.tv_sec = expire / 1000000;
    t_spc.tv_nsec = (expire % 1000000) * 1000;
-   pthread_cond_timedwait(&cpu->idle_cond,&cpu->idle_mutex,&t_spc);
+
+   if (cpu->idle_wake == CPU_IDLE_SLEEPING)
+      pthread_cond_timedwait(&cpu->idle_cond,&cpu->idle_mutex,&t_spc);
+
+   pthread_mutex_unlock(&cpu->idle_mutex);
+}
+
+/* Wake up the thread sleeping on the wake word (condition variable) */
+static void cpu_idle_wakeup(cpu_gen_t *cpu)
+{
+   pthread_mutex_lock(&cpu->idle_mutex);
+   pthread_cond_signal(&cpu->idle_cond);
    pthread_mutex_unlock(&cpu->idle_mutex);
 }
+#endif
+
+/*
+ * Wait for an event (IRQ, state change) or until the timeout expires.
+ * Returns TRUE if the wait was ended by an event.
+ */
+int cpu_idle_wait(cpu_gen_t *cpu,u_int usec)
+{
+   /* An event has been posted since the last wait */
+   if (!__sync_bool_compare_and_swap(&cpu->idle_wake,
+                                     CPU_IDLE_RUNNING,CPU_IDLE_SLEEPING))
+   {
+      __sync_lock_test_and_set(&cpu->idle_wake,CPU_IDLE_RUNNING);
+      return(TRUE);
+   }
+
+   /* A scheduled CPU gives its worker to another CPU meanwhile */
+   if (cpu->sched != NULL)
+      cpu_sched_sleep(cpu,usec);
+   else
+      cpu_idle_sleep(cpu,usec);
+
+   return(__sync_lock_test_and_set(&cpu->idle_wake,CPU_IDLE_RUNNING) ==
+          CPU_IDLE_WAKEUP);
+}
+
+/* 
+ * Get the timer IRQ clock of a CPU, if the guest can take a timer IRQ
+ * now (NULL otherwise).
+ */
+static vclock_t *cpu_get_timer_clock(cpu_gen_t *cpu)
+{
+   m_uint64_t status,mask;
+   cpu_mips_t *mcpu;
+   cpu_ppc_t *pcpu;
+
+   switch(cpu->type) {
+      case CPU_TYPE_MIPS64:
+         mcpu = CPU_MIPS64(cpu);
+         status = mcpu->cp0.reg[MIPS_CP0_STATUS];
+         mask = MIPS_CP0_STATUS_IE|MIPS_CP0_STATUS_EXL|MIPS_CP0_STATUS_ERL;
+
+         if (mcpu->irq_disable || ((status & mask) != MIPS_CP0_STATUS_IE) ||
+             !(status & MIPS_CP0_STATUS_IMASK7))
+            return NULL;
+
+         return(&mcpu->timer_clock);
+
+      case CPU_TYPE_PPC32:
+         pcpu = CPU_PPC32(cpu);
+
+         if (pcpu->irq_disable || !(pcpu->msr & PPC32_MSR_EE))
+            return NULL;
+
+         return(&pcpu->timer_clock);
+
+      default:
+         return NULL;
+   }
+}
+
+/* 
+ * Virtual idle loop. Timer ticks are computed by the CPU loop and nobody
+ * wakes the CPU up for them: if the guest can take a timer IRQ, the sleep
+ * ends at the next tick at most. This costs one wakeup per tick (e.g. 250
+ * per second instead of about 33 with the default 30 ms sleep time), but
+ * the guest gets its timer IRQs on time rather than in a batch at the end
+ * of the sleep. With timer IRQs masked, the ticks would be dropped anyway
+ * and the CPU sleeps for idle_sleep_time.
+ */
+void cpu_idle_loop(cpu_gen_t *cpu)
+{
+   m_tmcnt_t delay;
+   vclock_t *vc;
+   u_int usec;
+
+   usec = cpu->idle_sleep_time;
+
+   if ((vc = cpu_get_timer_clock(cpu)) != NULL) {
+      delay = (vclock_next_delay(vc) + 999) / 1000;
+
+      /* A tick is due: go back to the CPU loop to take it */
+      if (!delay)
+         return;
+
+      usec = m_min(usec,delay);
+   }
+
+   cpu->idle_sleep_count++;
+
+   if (cpu_idle_wait(cpu,usec))
+      cpu->idle_wakeup_count++;
+}
 
 /* Break idle wait state */
 void cpu_idle_break_wait(cpu_gen_t *cpu)
 {
-   pthread_cond_signal(&cpu->idle_cond);
+   int prev;
+
+   prev = __sync_lock_test_and_set(&cpu->idle_wake,CPU_IDLE_WAKEUP);
+
+   if (prev == CPU_IDLE_SLEEPING) {
+      if (cpu->sched != NULL)
+         cpu_sched_wakeup(cpu);
+      else
+         cpu_idle_wakeup(cpu);
+   }
+
    cpu->idle_count = 0;
 }
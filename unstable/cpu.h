@@ -14,6 +14,8 @@
 #include "mips64.h"
 #include "mips64_cp0.h"
 #include "ppc32.h"
+#include "cpu_idle_auto.h"
+#include "cpu_sched.h"
 
 /* Possible CPU types */
 enum {
@@ -28,6 +30,13 @@ enum {
    CPU_STATE_SUSPENDED,
 };
 
+/* Idle wait states (wake word) */
+enum {
+   CPU_IDLE_RUNNING = 0,
+   CPU_IDLE_SLEEPING,
+   CPU_IDLE_WAKEUP,
+};
+
 /* Maximum results for idle pc */
 #define CPU_IDLE_PC_MAX_RES  10
 
@@ -75,6 +84,14 @@ struct cpu_gen {
    u_int idle_count,idle_max,idle_sleep_time;
    pthread_mutex_t idle_mutex;
    pthread_cond_t idle_cond;
+   volatile int idle_wake;
+   m_uint64_t idle_sleep_count,idle_wakeup_count;
+
+   /* Automatic idle PC detection */
+   cpu_idle_auto_t *idle_auto;
+
+   /* Context in the CPU scheduler (NULL if the CPU has its own thread) */
+   cpu_sched_vcpu_t *sched;
 
    /* VM instance */
    vm_instance_t *vm;
@@ -190,6 +207,9 @@ void cpu_group_delete(cpu_group_t *group);
 /* Rebuild the MTS subsystem for a CPU group */
 int cpu_group_rebuild_mts(cpu_group_t *group);
 
+/* Drop the translated code of a CPU group */
+void cpu_group_flush_code(cpu_group_t *group);
+
 /* Log a message for a CPU */
 void cpu_log(cpu_gen_t *cpu,char *module,char *format,...);
 
@@ -223,6 +243,9 @@ int cpu_group_save_state(cpu_group_t *group);
 /* Restore state of all CPUs */
 int cpu_group_restore_state(cpu_group_t *group);
 
+/* Wait for an event (IRQ, state change) or until the timeout expires */
+int cpu_idle_wait(cpu_gen_t *cpu,u_int usec);
+
 /* Virtual idle loop */
 void cpu_idle_loop(cpu_gen_t *cpu);
 
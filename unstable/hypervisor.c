@@ -44,6 +44,7 @@
 #include "net_io_bridge.h"
 #include "frame_relay.h"
 #include "atm.h"
+#include "ptask.h"
 
 #define DEBUG_TOKEN  0
 
@@ -107,6 +108,51 @@ static int cmd_modcmd_list(hypervisor_conn_t *conn,int argc,char *argv[])
    return(0);
 }
 
+/* Show statistics of a periodic task */
+static void cmd_show_ptask_stats(ptask_stats_t *s,void *opt)
+{
+   hypervisor_conn_t *conn = opt;
+
+   hypervisor_send_reply(conn,HSC_INFO_MSG,0,
+                         "%s (object %p): worker=%u, interval=%u ms, "
+                         "runs=%llu, kicks=%llu, late=%llu, "
+                         "total=%llu us, max=%llu us",
+                         s->name,s->object,s->worker,s->interval,
+                         s->run_count,s->kick_count,s->late_count,
+                         s->run_time,s->run_time_max);
+}
+
+/* Show periodic task statistics */
+static int cmd_ptask_stats(hypervisor_conn_t *conn,int argc,char *argv[])
+{
+   ptask_stats_foreach(cmd_show_ptask_stats,conn);
+   hypervisor_send_reply(conn,HSC_INFO_OK,1,"OK");
+   return(0);
+}
+
+/* Show statistics of a CPU scheduler worker */
+static void cmd_show_cpu_sched_stats(cpu_sched_worker_stats_t *s,void *opt)
+{
+   hypervisor_conn_t *conn = opt;
+   m_tmcnt_t total = s->busy_time + s->idle_time;
+
+   hypervisor_send_reply(conn,HSC_INFO_MSG,0,
+                         "worker %u: %s, queued=%u, switches=%llu, "
+                         "steals=%llu, busy=%llu ms (%llu%%)",
+                         s->index,s->running ? "running" : "idle",
+                         s->rq_count,s->switch_count,s->steal_count,
+                         s->busy_time / 1000000,
+                         (s->busy_time * 100) / m_max(total,1));
+}
+
+/* Show CPU scheduler statistics */
+static int cmd_cpu_sched_stats(hypervisor_conn_t *conn,int argc,char *argv[])
+{
+   cpu_sched_worker_stats_foreach(cmd_show_cpu_sched_stats,conn);
+   hypervisor_send_reply(conn,HSC_INFO_OK,1,"OK");
+   return(0);
+}
+
 /* Set working directory */
 static int cmd_set_working_dir(hypervisor_conn_t *conn,int argc,char *argv[])
 {
@@ -187,6 +233,8 @@ static hypervisor_cmd_t hypervisor_cmd_array[] = {
    { "reset", 0, 0, cmd_reset, NULL },
    { "close", 0, 0, cmd_close, NULL },
    { "stop", 0, 0, cmd_stop, NULL },
+   { "ptask_stats", 0, 0, cmd_ptask_stats, NULL },
+   { "cpu_sched_stats", 0, 0, cmd_cpu_sched_stats, NULL },
    { "tsg_stats", 0, 0, cmd_tsg_stats, NULL },
    { NULL, -1, -1, NULL, NULL },
 };
@@ -89,6 +89,10 @@ void memlog_dump(cpu_gen_t *cpu);
 /* Update the data obtained by a read access */
 void memlog_update_read(cpu_gen_t *cpu,m_iptr_t raddr);
 
+/* Get a DMA window (host pointer span) for a physical memory range */
+void *physmem_dma_window(vm_instance_t *vm,m_uint64_t paddr,size_t len,
+                         u_int op_type,size_t *win_len);
+
 /* Copy a memory block from VM physical RAM to real host */
 void physmem_copy_from_vm(vm_instance_t *vm,void *real_buffer,
                           m_uint64_t paddr,size_t len);
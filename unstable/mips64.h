@@ -10,6 +10,7 @@
 
 #include "utils.h" 
 #include "rbtree.h"
+#include "vclock.h"
 
 /* 
  * MIPS General Purpose Registers 
@@ -427,6 +428,7 @@ struct cpu_mips {
    u_int timer_irq_freq;
    u_int timer_irq_check_itv;
    u_int timer_drift;
+   vclock_t timer_clock;
 
    /* IRQ disable flag */
    volatile u_int irq_disable;
@@ -456,6 +458,9 @@ struct cpu_mips {
    /* Number of compiled pages */
    u_int compiled_pages;
 
+   /* Host functions called by position-independent translated code */
+   void **jit_helpers;
+
    /* Fast memory operations use */
    u_int fast_memop;
 
@@ -508,8 +513,11 @@ void mips64_set_prid(cpu_mips_t *cpu,m_uint32_t prid);
 /* Set idle PC value */
 void mips64_set_idle_pc(cpu_gen_t *cpu,m_uint64_t addr);
 
-/* Timer IRQ */
-void *mips64_timer_irq_run(cpu_mips_t *cpu);
+/* Start (or resynchronize) the timer IRQ clock */
+void mips64_timer_irq_start(cpu_mips_t *cpu);
+
+/* Update the number of pending timer IRQs from the virtual clock */
+void mips64_timer_irq_update(cpu_mips_t *cpu);
 
 /* Determine an "idling" PC */
 int mips64_get_idling_pc(cpu_gen_t *cpu);
@@ -606,6 +614,9 @@ void mips64_dump_stack(cpu_mips_t *cpu,u_int count);
 /* Save the CPU state into a file */
 int mips64_save_state(cpu_mips_t *cpu,char *filename);
 
+/* Save or restore the CPU state in a VM checkpoint */
+int mips64_ckpt(cpu_mips_t *cpu,vm_ckpt_t *ckpt);
+
 /* Load a raw image into the simulated memory */
 int mips64_load_raw_image(cpu_mips_t *cpu,char *filename,m_uint64_t vaddr);
 
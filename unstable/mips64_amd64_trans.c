@@ -152,7 +152,12 @@ static void mips64_set_jump(cpu_mips_t *cpu,cpu_tc_t *b,
 
    if (!return_to_caller && mips64_jit_tcb_local_addr(b,new_pc,&jump_ptr)) {
       if (jump_ptr) {
-         amd64_jump_code(b->jit_ptr,jump_ptr);
+         if (b->flags & TC_FLAG_PERSIST) {
+            tc_record_reloc(b,TC_RELOC_JUMP,b->jit_ptr,jump_ptr);
+            amd64_jump32_code_fn(&b->jit_ptr,jump_ptr);
+         } else {
+            amd64_jump_code(b->jit_ptr,jump_ptr);
+         }
       } else {
          /* Never jump directly to code in a delay slot */
          if (mips64_jit_is_delay_slot(b,new_pc)) {
@@ -175,10 +180,66 @@ static void mips64_set_jump(cpu_mips_t *cpu,cpu_tc_t *b,
    }
 }
 
+/* forward prototype declarations */
+static fastcall void mips64_unknown_opcode(cpu_mips_t *cpu,m_uint32_t opcode);
+static fastcall void mips64_invalid_delay_slot(cpu_mips_t *cpu);
+
+/* 
+ * Host functions called by translated code. When code has to be saved or 
+ * shared between processes, they are called through cpu->jit_helpers so
+ * that the code doesn't contain host addresses.
+ */
+static void *mips64_jit_helpers[] = {
+   mips64_exec_single_step, mips64_run_breakpoint, mips64_unknown_opcode,
+   mips64_invalid_delay_slot, mips64_trigger_timer_irq, mips64_trigger_irq,
+   mips64_exec_break, mips64_exec_eret, mips64_debug_jr0,
+   mips64_exec_syscall, mips64_trigger_trap_exception,
+   mips64_cp0_exec_cfc0, mips64_cp0_exec_ctc0,
+   mips64_cp0_exec_mfc0, mips64_cp0_exec_mtc0,
+   mips64_cp0_exec_dmfc0, mips64_cp0_exec_dmtc0,
+   mips64_exec_mfc1, mips64_exec_mtc1, mips64_exec_dmfc1, mips64_exec_dmtc1,
+   mips64_cp0_exec_tlbp, mips64_cp0_exec_tlbr,
+   mips64_cp0_exec_tlbwi, mips64_cp0_exec_tlbwr,
+};
+
+#define MIPS64_JIT_HELPER_COUNT \
+   (sizeof(mips64_jit_helpers) / sizeof(mips64_jit_helpers[0]))
+
+/* Get the table of host functions called by translated code */
+void **mips64_jit_get_helpers(void)
+{
+   return(mips64_jit_helpers);
+}
+
+/* Load the address of a C function in RCX */
+static void mips64_load_c_func(cpu_tc_t *b,void *f)
+{
+   int i;
+
+   if (!(b->flags & TC_FLAG_PERSIST)) {
+      amd64_mov_reg_imm(b->jit_ptr,AMD64_RCX,f);
+      return;
+   }
+
+   for(i=0;i<MIPS64_JIT_HELPER_COUNT;i++) {
+      if (mips64_jit_helpers[i] == f) {
+         amd64_mov_reg_membase(b->jit_ptr,AMD64_RCX,
+                               AMD64_R15,OFFSET(cpu_mips_t,jit_helpers),8);
+         amd64_mov_reg_membase(b->jit_ptr,AMD64_RCX,
+                               AMD64_RCX,i*sizeof(void *),8);
+         return;
+      }
+   }
+
+   /* Not in the table, use a 64-bit immediate so that it can be relocated */
+   tc_record_reloc(b,TC_RELOC_FUNC,b->jit_ptr,f);
+   amd64_mov_reg_imm_size(b->jit_ptr,AMD64_RCX,(m_uint64_t)f,8);
+}
+
 /* Basic C call */
 static forced_inline void mips64_emit_basic_c_call(cpu_tc_t *b,void *f)
 {
-   amd64_mov_reg_imm(b->jit_ptr,AMD64_RCX,f);
+   mips64_load_c_func(b,f);
    amd64_call_reg(b->jit_ptr,AMD64_RCX);
 }
 
@@ -186,7 +247,7 @@ static forced_inline void mips64_emit_basic_c_call(cpu_tc_t *b,void *f)
 static void mips64_emit_c_call(cpu_tc_t *b,void *f)
 {   
    mips64_set_pc(b,b->vaddr+((b->trans_pos-1)<<2));
-   amd64_mov_reg_imm(b->jit_ptr,AMD64_RCX,f);
+   mips64_load_c_func(b,f);
    amd64_call_reg(b->jit_ptr,AMD64_RCX);
 }
 
@@ -2848,3 +2909,28 @@ struct mips64_insn_tag mips64_insn_tags[] = {
    { mips64_emit_unknown , 0x00000000 , 0x00000000, 1 },
    { NULL                , 0x00000000 , 0x00000000, 0 },
 };
+
+/* Signature of the code generator for the persistent JIT cache */
+m_uint64_t mips64_jit_cache_signature(void)
+{
+   m_uint64_t sig = 0xcbf29ce484222325ULL;
+   const char *p;
+   int i;
+
+   /* Helper locations (relative to the cache anchor) detect a new build */
+   for(i=0;i<MIPS64_JIT_HELPER_COUNT;i++)
+      sig = (sig ^ ((u_char *)mips64_jit_helpers[i] - 
+                    (u_char *)tsg_checksum_page)) * 0x100000001b3ULL;
+
+   sig = (sig ^ ((u_char *)mips64_emit_unknown - 
+                 (u_char *)tsg_checksum_page)) * 0x100000001b3ULL;
+
+   sig = (sig ^ sizeof(cpu_mips_t)) * 0x100000001b3ULL;
+   sig = (sig ^ sizeof(cpu_gen_t)) * 0x100000001b3ULL;
+   sig = (sig ^ sizeof(mts64_entry_t)) * 0x100000001b3ULL;
+
+   for(p=sw_version;*p;p++)
+      sig = (sig ^ *p) * 0x100000001b3ULL;
+
+   return(sig);
+}
@@ -14,6 +14,9 @@
 
 #define JIT_SUPPORT 1
 
+/* Translated code can be saved in a persistent cache */
+#define MIPS64_JIT_CACHE 1
+
 /* Manipulate bitmasks atomically */
 static forced_inline void atomic_or(m_uint32_t *v,m_uint32_t m)
 {
@@ -28,10 +31,17 @@ static forced_inline void atomic_and(m_uint32_t *v,m_uint32_t m)
 /* Wrappers to amd64-codegen functions */
 #define mips64_jit_tcb_set_patch amd64_patch
 #define mips64_jit_tcb_set_jump  amd64_jump_code_fn
+#define mips64_jit_tcb_set_jump32 amd64_jump32_code_fn
 
 /* MIPS instruction array */
 extern struct mips64_insn_tag mips64_insn_tags[];
 
+/* Get the table of host functions called by translated code */
+void **mips64_jit_get_helpers(void);
+
+/* Signature of the code generator for the persistent JIT cache */
+m_uint64_t mips64_jit_cache_signature(void);
+
 /* Push epilog for an amd64 instruction block */
 static forced_inline void mips64_jit_tcb_push_epilog(cpu_tc_t *tc)
 {
@@ -80,4 +90,13 @@ static inline void amd64_patch(u_char *code,u_char *target)
       x86_patch(code,target);
 }
 
+/* Jump with a 32-bit displacement (can be relocated with amd64_patch) */
+static inline void amd64_jump32_code_fn(u_char **instp,u_char *target)
+{
+   u_char *insn = *instp;
+
+   amd64_jump32(*instp,0);
+   amd64_patch(insn,target);
+}
+
 #endif
@@ -418,19 +418,12 @@ fastcall int mips64_exec_page(cpu_mips_t *cpu)
 void *mips64_exec_run_cpu(cpu_gen_t *gen)
 {   
    cpu_mips_t *cpu = CPU_MIPS64(gen);
-   pthread_t timer_irq_thread;
    int timer_irq_check = 0;
    mips_insn_t insn;
    int res;
 
-   if (pthread_create(&timer_irq_thread,NULL,
-                      (void *)mips64_timer_irq_run,cpu))
-   {
-      fprintf(stderr,"VM '%s': unable to create Timer IRQ thread for CPU%u.\n",
-              cpu->vm->name,gen->id);
-      cpu_stop(gen);
-      return NULL;
-   }
+   /* Start the timer IRQ clock */
+   mips64_timer_irq_start(cpu);
 
    gen->cpu_thread_running = TRUE;
    cpu_exec_loop_set(gen);
@@ -453,6 +446,15 @@ void *mips64_exec_run_cpu(cpu_gen_t *gen)
       /* Handle the virtual CPU clock */
       if (++timer_irq_check == cpu->timer_irq_check_itv) {
          timer_irq_check = 0;
+         mips64_timer_irq_update(cpu);
+
+         /* Automatic idle PC detection */
+         if (unlikely(gen->idle_auto != NULL))
+            cpu_idle_auto_check(gen);
+
+         /* End of the time slice on the CPU scheduler */
+         if (unlikely(gen->sched != NULL))
+            cpu_sched_check(gen);
 
          if (cpu->timer_irq_pending && !cpu->irq_disable) {
             mips64_trigger_timer_irq(cpu);
@@ -490,16 +492,16 @@ void *mips64_exec_run_cpu(cpu_gen_t *gen)
       switch(gen->state) {
          case CPU_STATE_RUNNING:
             gen->state = CPU_STATE_RUNNING;
+            mips64_timer_irq_start(cpu);
             goto start_cpu;
 
          case CPU_STATE_HALTED:     
             gen->cpu_thread_running = FALSE;
-            pthread_join(timer_irq_thread,NULL);
             break;
       }
       
       /* CPU is paused */
-      usleep(200000);
+      cpu_idle_wait(gen,200000);
    }
 
    return NULL;
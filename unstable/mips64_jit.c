@@ -31,6 +31,10 @@
 
 #define DEBUG_JIT_SHARED  0
 
+#ifndef MIPS64_JIT_CACHE
+#define MIPS64_JIT_CACHE  0
+#endif
+
 #if DEBUG_BLOCK_TIMESTAMP
 static volatile m_uint64_t jit_jiffies = 0;
 #endif
@@ -106,6 +110,16 @@ int mips64_jit_init(cpu_mips_t *cpu)
 {
    if (tsg_bind_cpu(cpu->gen) == -1)
       return(-1);
+
+#if MIPS64_JIT_CACHE
+   cpu->jit_helpers = mips64_jit_get_helpers();
+
+   if (tc_cache_file != NULL)
+      tc_cache_open(mips64_jit_cache_signature());
+
+   if (tsg_shm_name != NULL)
+      tsg_shm_attach(mips64_jit_cache_signature());
+#endif
    
    return(cpu_jit_init(cpu->gen,
                        MIPS_JIT_VIRT_HASH_SIZE,
@@ -274,9 +288,32 @@ static int mips64_jit_tcb_apply_patches(cpu_mips_t *cpu,cpu_tc_t *tc)
 /* Adjust the JIT buffer if its size is not sufficient */
 static int mips64_jit_tcb_adjust_buffer(cpu_mips_t *cpu,cpu_tc_t *tc)
 {
+#if MIPS64_JIT_CACHE
+   if (tc->flags & TC_FLAG_PERSIST)
+      return(tc_adjust_jit_buffer(cpu->gen,tc,mips64_jit_tcb_set_jump32));
+#endif
    return(tc_adjust_jit_buffer(cpu->gen,tc,mips64_jit_tcb_set_jump));
 }
 
+#if MIPS64_JIT_CACHE
+/* Code generation settings which must match to use the JIT cache */
+static inline m_uint32_t mips64_jit_cache_cfg(cpu_mips_t *cpu)
+{
+   return(cpu->addr_mode | (cpu->fast_memop << 8));
+}
+
+/* 
+ * Returns TRUE if the JIT cache or the shared memory TSG can be used.
+ * Symbol tracing and breakpoints change the generated code, so they are
+ * bypassed in that case.
+ */
+static inline int mips64_jit_cache_usable(cpu_mips_t *cpu)
+{
+   return((tc_cache_enabled() || tsg_shm_enabled()) && 
+          !cpu->sym_trace && !cpu->breakpoints_enabled);
+}
+#endif
+
 /* Produce translated code for a page. If this fails, use non-compiled mode */
 static cpu_tc_t *mips64_jit_tcb_translate(cpu_mips_t *cpu,cpu_tb_t *tb)
 {
@@ -291,6 +328,12 @@ static cpu_tc_t *mips64_jit_tcb_translate(cpu_mips_t *cpu,cpu_tb_t *tb)
    
    tc->target_code = tb->target_code;
    tc->trans_pos   = 0;
+
+#if MIPS64_JIT_CACHE
+   /* Record relocations to save the code in the JIT cache */
+   if (mips64_jit_cache_usable(cpu))
+      tc->flags |= TC_FLAG_PERSIST;
+#endif
    
    /* Emit native code for each instruction */
    while(tc->trans_pos < MIPS_INSN_PER_PAGE)
@@ -314,6 +357,16 @@ static cpu_tc_t *mips64_jit_tcb_translate(cpu_mips_t *cpu,cpu_tb_t *tb)
    mips64_jit_tcb_add_end(tc);
    mips64_jit_tcb_apply_patches(cpu,tc);
    tc_free_patches(tc);
+
+#if MIPS64_JIT_CACHE
+   if (tc->flags & TC_FLAG_PERSIST) {
+      tc_cache_store(cpu->gen,tb,tc,mips64_jit_cache_cfg(cpu));
+      tc = tsg_shm_publish(cpu->gen,tb,tc,mips64_jit_cache_cfg(cpu),
+                           mips64_jit_tcb_set_patch);
+      tc_free_relocs(tc);
+   }
+#endif
+
    tc->target_code = NULL;
    return tc;
 }
@@ -360,8 +413,22 @@ mips64_jit_tcb_compile(cpu_mips_t *cpu,m_uint64_t vaddr,m_uint32_t exec_state)
       return tb;
    }
 
+   tc = NULL;
+
+#if MIPS64_JIT_CACHE
+   /* Try to reuse code translated by another process or a previous run */
+   if (mips64_jit_cache_usable(cpu)) {
+      tc = tsg_shm_lookup(cpu->gen,tb,mips64_jit_cache_cfg(cpu));
+
+      if (tc == NULL)
+         tc = tc_cache_load(cpu->gen,tb,mips64_jit_cache_cfg(cpu),
+                            mips64_jit_tcb_set_patch);
+   }
+#endif
+
    /* The page is not shared, we have to compile it */
-   tc = mips64_jit_tcb_translate(cpu,tb);
+   if (tc == NULL)
+      tc = mips64_jit_tcb_translate(cpu,tb);
    
    if (tc != NULL) {
       tc->target_code = tb->target_code;
@@ -424,21 +491,13 @@ void mips64_jit_tcb_run(cpu_mips_t *cpu,cpu_tb_t *tb)
 void *mips64_jit_run_cpu(cpu_gen_t *gen)
 {    
    cpu_mips_t *cpu = CPU_MIPS64(gen);
-   pthread_t timer_irq_thread;
    cpu_tb_t *tb;
    m_uint32_t hv,hp;
    m_uint32_t phys_page;
    int timer_irq_check = 0;
 
-   if (pthread_create(&timer_irq_thread,NULL,
-                      (void *)mips64_timer_irq_run,cpu)) 
-   {
-      fprintf(stderr,
-              "VM '%s': unable to create Timer IRQ thread for CPU%u.\n",
-              cpu->vm->name,gen->id);
-      cpu_stop(cpu->gen);
-      return NULL;
-   }
+   /* Start the timer IRQ clock */
+   mips64_timer_irq_start(cpu);
 
    gen->cpu_thread_running = TRUE;
    cpu_exec_loop_set(gen);
@@ -470,6 +529,15 @@ void *mips64_jit_run_cpu(cpu_gen_t *gen)
       /* Handle the virtual CPU clock */
       if (++timer_irq_check == cpu->timer_irq_check_itv) {
          timer_irq_check = 0;
+         mips64_timer_irq_update(cpu);
+
+         /* Automatic idle PC detection */
+         if (unlikely(gen->idle_auto != NULL))
+            cpu_idle_auto_check(gen);
+
+         /* End of the time slice on the CPU scheduler */
+         if (unlikely(gen->sched != NULL))
+            cpu_sched_check(gen);
 
          if (cpu->timer_irq_pending && !cpu->irq_disable) {
             mips64_trigger_timer_irq(cpu);
@@ -528,16 +596,16 @@ void *mips64_jit_run_cpu(cpu_gen_t *gen)
       switch(gen->state) {
          case CPU_STATE_RUNNING:
             printf("VM %s: starting CPU!\n",cpu->vm->name);
+            mips64_timer_irq_start(cpu);
             goto start_cpu;
 
          case CPU_STATE_HALTED:
             gen->cpu_thread_running = FALSE;
-            pthread_join(timer_irq_thread,NULL);
             return NULL;
       }
       
       /* CPU is paused */
-      usleep(200000);
+      cpu_idle_wait(gen,200000);
    }
 
    return NULL;
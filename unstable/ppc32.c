@@ -22,6 +22,7 @@
 #include "ppc32_mem.h"
 #include "ppc32_exec.h"
 #include "ppc32_jit.h"
+#include "vm_ckpt.h"
 
 /* Reset a PowerPC CPU */
 int ppc32_reset(cpu_ppc_t *cpu)
@@ -96,54 +97,33 @@ void ppc32_set_idle_pc(cpu_gen_t *cpu,m_uint64_t addr)
    CPU_PPC32(cpu)->idle_pc = (m_uint32_t)addr;
 }
 
-/* Timer IRQ */
-void *ppc32_timer_irq_run(cpu_ppc_t *cpu)
+/* Start (or resynchronize) the timer IRQ clock */
+void ppc32_timer_irq_start(cpu_ppc_t *cpu)
 {
-   pthread_mutex_t umutex = PTHREAD_MUTEX_INITIALIZER;
-   pthread_cond_t ucond = PTHREAD_COND_INITIALIZER;
-   struct timespec t_spc;
-   m_tmcnt_t expire;
-   u_int interval;
-   u_int threshold;
-
-#if 0
-   while(!cpu->timer_irq_armed)
-      sleep(1);
-#endif
+   vclock_start(&cpu->timer_clock,cpu->timer_irq_freq);
+}
 
-   interval = 1000000 / cpu->timer_irq_freq;
-   threshold = cpu->timer_irq_freq * 10;
-   expire = m_gettime_usec() + interval;
+/* Update the number of pending timer IRQs from the virtual clock */
+void ppc32_timer_irq_update(cpu_ppc_t *cpu)
+{
+   u_int ticks;
 
-   while(cpu->gen->state != CPU_STATE_HALTED) {
-      pthread_mutex_lock(&umutex);
-      t_spc.tv_sec = expire / 1000000;
-      t_spc.tv_nsec = (expire % 1000000) * 1000;
-      pthread_cond_timedwait(&ucond,&umutex,&t_spc);
-      pthread_mutex_unlock(&umutex);
+   if (!(ticks = vclock_ticks(&cpu->timer_clock)))
+      return;
 
-      if (likely(!cpu->irq_disable) &&
-          likely(cpu->gen->state == CPU_STATE_RUNNING) &&
-          likely(cpu->msr & PPC32_MSR_EE))
-      {
-         cpu->timer_irq_pending++;
+   /* Ticks are dropped while timer interrupts cannot be taken */
+   if (unlikely(cpu->irq_disable || !(cpu->msr & PPC32_MSR_EE))) {
+      cpu->timer_clock.drop_count += ticks;
+      return;
+   }
 
-         if (unlikely(cpu->timer_irq_pending > threshold)) {
-            cpu->timer_irq_pending = 0;
-            cpu->timer_drift++;
-#if 0
-            printf("Timer IRQ not accurate (%u pending IRQ): "
-                   "reduce the \"--timer-irq-check-itv\" parameter "
-                   "(current value: %u)\n",
-                   cpu->timer_irq_pending,cpu->timer_irq_check_itv);
-#endif
-         }
-      }
+   cpu->timer_irq_pending += ticks;
 
-      expire += interval;
+   if (unlikely(cpu->timer_irq_pending > cpu->timer_irq_freq * 10)) {
+      cpu->timer_clock.drop_count += cpu->timer_irq_pending;
+      cpu->timer_irq_pending = 0;
+      cpu->timer_drift++;
    }
-
-   return NULL;
 }
 
 #define IDLE_HASH_SIZE  8192
@@ -434,9 +414,12 @@ void ppc32_dump_regs(cpu_gen_t *cpu)
           pcpu->irq_count,pcpu->irq_fp_count,pcpu->irq_pending,
           pcpu->irq_check ? "yes" : "no");
 
-   printf("  Timer IRQ count: %llu, pending: %u, timer drift: %u\n\n",
+   printf("  Timer IRQ count: %llu, pending: %u, timer drift: %u\n",
           pcpu->timer_irq_count,pcpu->timer_irq_pending,pcpu->timer_drift);
 
+   printf("  Idle sleeps: %llu, early wakeups: %llu\n\n",
+          cpu->idle_sleep_count,cpu->idle_wakeup_count);
+
    printf("  Device access count: %llu\n",cpu->dev_access_counter);
 
    printf("\n");
@@ -473,6 +456,58 @@ void ppc32_dump_mmu(cpu_gen_t *cpu)
    printf(" - SDR1: 0x%8.8x\n",pcpu->sdr1);
 }
 
+/* Save or restore the CPU state in a VM checkpoint */
+int ppc32_ckpt(cpu_ppc_t *cpu,vm_ckpt_t *ckpt)
+{
+   VM_CKPT_FIELD(ckpt,cpu->ia);
+   VM_CKPT_FIELD(ckpt,cpu->exec_state);
+   VM_CKPT_FIELD(ckpt,cpu->gpr);
+   VM_CKPT_FIELD(ckpt,cpu->irq_pending);
+   VM_CKPT_FIELD(ckpt,cpu->irq_check);
+   VM_CKPT_FIELD(ckpt,cpu->xer);
+   VM_CKPT_FIELD(ckpt,cpu->lr);
+   VM_CKPT_FIELD(ckpt,cpu->ctr);
+   VM_CKPT_FIELD(ckpt,cpu->reserve);
+   VM_CKPT_FIELD(ckpt,cpu->xer_ca);
+   VM_CKPT_FIELD(ckpt,cpu->cr_fields);
+   VM_CKPT_FIELD(ckpt,cpu->timer_irq_armed);
+   VM_CKPT_FIELD(ckpt,cpu->irq_disable);
+   VM_CKPT_FIELD(ckpt,cpu->bat);
+   VM_CKPT_FIELD(ckpt,cpu->sr);
+   VM_CKPT_FIELD(ckpt,cpu->sdr1);
+   VM_CKPT_FIELD(ckpt,cpu->msr);
+   VM_CKPT_FIELD(ckpt,cpu->srr0);
+   VM_CKPT_FIELD(ckpt,cpu->srr1);
+   VM_CKPT_FIELD(ckpt,cpu->dsisr);
+   VM_CKPT_FIELD(ckpt,cpu->dar);
+   VM_CKPT_FIELD(ckpt,cpu->sprg);
+   VM_CKPT_FIELD(ckpt,cpu->pvr);
+   VM_CKPT_FIELD(ckpt,cpu->tb);
+   VM_CKPT_FIELD(ckpt,cpu->dec);
+   VM_CKPT_FIELD(ckpt,cpu->hid0);
+   VM_CKPT_FIELD(ckpt,cpu->hid1);
+   VM_CKPT_FIELD(ckpt,cpu->ppc405_tlb);
+   VM_CKPT_FIELD(ckpt,cpu->ppc405_pid);
+   VM_CKPT_FIELD(ckpt,cpu->mpc860_immr);
+   VM_CKPT_FIELD(ckpt,cpu->fpu);
+
+   if (!ckpt->restore || ckpt->error)
+      return(ckpt->error ? -1 : 0);
+
+   /* Locate the page table on the host */
+   if (cpu->sdr1 && (ppc32_set_sdr1(cpu,cpu->sdr1) == -1)) {
+      ckpt->error = TRUE;
+      return(-1);
+   }
+
+   /* RAM is restored too: drop the translated code */
+   ppc32_jit_flush(cpu,0);
+
+   /* Force a new lookup of the current exec page (non-JIT) */
+   cpu->njm_exec_page = (m_uint64_t)-1;
+   return(0);
+}
+
 /* Load a raw image into the simulated memory */
 int ppc32_load_raw_image(cpu_ppc_t *cpu,char *filename,m_uint32_t vaddr)
 {   
@@ -528,11 +563,37 @@ int ppc32_load_raw_image(cpu_ppc_t *cpu,char *filename,m_uint32_t vaddr)
    return(0);
 }
 
+/* 
+ * Map a page of an ELF image at the specified virtual address, instead of
+ * copying it. With sparse memory, the page is read from the image file on 
+ * first access, and duplicated on first write.
+ */
+static int ppc32_load_elf_map_page(cpu_ppc_t *cpu,u_char *img_ptr,
+                                   size_t img_size,m_uint32_t vaddr,
+                                   size_t offset)
+{
+   m_uint32_t phys_page;
+   m_uint64_t paddr;
+
+   if (!img_ptr || (vaddr & PPC32_MIN_PAGE_IMASK) ||
+       (offset & PPC32_MIN_PAGE_IMASK) || 
+       ((offset + PPC32_MIN_PAGE_SIZE) > img_size))
+      return(-1);
+
+   if (cpu->translate(cpu,vaddr,PPC32_MTS_DCACHE,&phys_page) != 0)
+      return(-1);
+
+   paddr = (m_uint64_t)phys_page << PPC32_MIN_PAGE_SHIFT;
+   return(dev_sparse_map_file_page(cpu->vm,paddr,(m_iptr_t)img_ptr + offset));
+}
+
 /* Load an ELF image into the simulated memory */
 int ppc32_load_elf_image(cpu_ppc_t *cpu,char *filename,int skip_load,
                          m_uint32_t *entry_point)
 {
    m_uint32_t vaddr,remain;
+   u_char *img_ptr = NULL;
+   size_t img_size = 0,offset;
    void *haddr;
    Elf32_Ehdr *ehdr;
    Elf32_Shdr *shdr;
@@ -582,6 +643,10 @@ int ppc32_load_elf_image(cpu_ppc_t *cpu,char *filename,int skip_load,
    }
 
    if (!skip_load) {
+      /* With sparse memory, image pages are loaded on demand */
+      if (cpu->vm->sparse_mem)
+         img_ptr = vm_ios_image_map(cpu->vm,filename,&img_size);
+
       for(i=0;i<ehdr->e_shnum;i++) {
          scn = elf_getscn(img_elf,i);
 
@@ -594,6 +659,7 @@ int ppc32_load_elf_image(cpu_ppc_t *cpu,char *filename,int skip_load,
 
          fseek(bfd,shdr->sh_offset,SEEK_SET);
          vaddr = shdr->sh_addr;
+         offset = shdr->sh_offset;
 
          if (cpu->vm->debug_level > 0) {
             printf("   * Adding section at virtual address 0x%8.8x "
@@ -602,6 +668,17 @@ int ppc32_load_elf_image(cpu_ppc_t *cpu,char *filename,int skip_load,
          
          while(len > 0)
          {
+            if ((shdr->sh_type == SHT_PROGBITS) && 
+                (len >= PPC32_MIN_PAGE_SIZE) &&
+                !ppc32_load_elf_map_page(cpu,img_ptr,img_size,vaddr,offset))
+            {
+               fseek(bfd,PPC32_MIN_PAGE_SIZE,SEEK_CUR);
+               vaddr  += PPC32_MIN_PAGE_SIZE;
+               offset += PPC32_MIN_PAGE_SIZE;
+               len    -= PPC32_MIN_PAGE_SIZE;
+               continue;
+            }
+
             haddr = cpu->mem_op_lookup(cpu,vaddr,PPC32_MTS_DCACHE);
 
             if (!haddr) {
@@ -624,6 +701,7 @@ int ppc32_load_elf_image(cpu_ppc_t *cpu,char *filename,int skip_load,
                break;
 
             vaddr += clen;
+            offset += clen;
             len -= clen;
          }
       }
@@ -10,6 +10,7 @@
 
 #include "utils.h" 
 #include "rbtree.h"
+#include "vclock.h"
 
 /* CPU identifiers */
 #define PPC32_PVR_405     0x40110000
@@ -346,6 +347,7 @@ struct cpu_ppc {
    u_int timer_irq_freq;
    u_int timer_irq_check_itv;
    u_int timer_drift;
+   vclock_t timer_clock;
 
    /* IRQ disable flag */
    volatile u_int irq_disable;
@@ -496,8 +498,11 @@ void ppc32_set_pvr(cpu_ppc_t *cpu,m_uint32_t pvr);
 /* Set idle PC value */
 void ppc32_set_idle_pc(cpu_gen_t *cpu,m_uint64_t addr);
 
-/* Timer IRQ */
-void *ppc32_timer_irq_run(cpu_ppc_t *cpu);
+/* Start (or resynchronize) the timer IRQ clock */
+void ppc32_timer_irq_start(cpu_ppc_t *cpu);
+
+/* Update the number of pending timer IRQs from the virtual clock */
+void ppc32_timer_irq_update(cpu_ppc_t *cpu);
 
 /* Determine an "idling" PC */
 int ppc32_get_idling_pc(cpu_gen_t *cpu);
@@ -529,6 +534,9 @@ void ppc32_dump_regs(cpu_gen_t *cpu);
 /* Dump MMU registers */
 void ppc32_dump_mmu(cpu_gen_t *cpu);
 
+/* Save or restore the CPU state in a VM checkpoint */
+int ppc32_ckpt(cpu_ppc_t *cpu,vm_ckpt_t *ckpt);
+
 /* Load a raw image into the simulated memory */
 int ppc32_load_raw_image(cpu_ppc_t *cpu,char *filename,m_uint32_t vaddr);
 
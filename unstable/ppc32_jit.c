@@ -102,6 +102,22 @@ int ppc32_jit_init(cpu_ppc_t *cpu)
       return(-1);
    }
 
+   /*
+    * Translated code is hot: try to keep it on huge pages. The exec area
+    * is a shared anonymous mapping (shmem), which only gets them when
+    * shmem_enabled allows it.
+    */
+   if (cpu->vm->ram_hugepages) {
+      int backing = MEMZONE_BACKING_STD;
+
+      if (!memzone_advise_hugepages(cpu->exec_page_area,
+                                    cpu->exec_page_area_size,TRUE))
+         backing = MEMZONE_BACKING_THP;
+
+      vm_log(cpu->vm,"JIT","exec area backed by %s\n",
+             memzone_get_backing_str(backing));
+   }
+
    /* Carve the executable page area */
    cpu->exec_page_count = cpu->exec_page_area_size / PPC_JIT_BUFSIZE;
 
@@ -1249,7 +1265,6 @@ void ppc32_jit_tcb_run(cpu_ppc_t *cpu,ppc32_jit_tcb_t *tcb)
 void *ppc32_jit_run_cpu(cpu_gen_t *gen)
 {    
    cpu_ppc_t *cpu = CPU_PPC32(gen);
-   pthread_t timer_irq_thread;
    ppc32_jit_tcb_t *tcb;
    m_uint32_t hv,hp;
    m_uint32_t phys_page;
@@ -1257,14 +1272,8 @@ void *ppc32_jit_run_cpu(cpu_gen_t *gen)
 
    ppc32_jit_init_hreg_mapping(cpu);
 
-   if (pthread_create(&timer_irq_thread,NULL,(void *)ppc32_timer_irq_run,cpu)) 
-   {
-      fprintf(stderr,
-              "VM '%s': unable to create Timer IRQ thread for CPU%u.\n",
-              cpu->vm->name,gen->id);
-      cpu_stop(cpu->gen);
-      return NULL;
-   }
+   /* Start the timer IRQ clock */
+   ppc32_timer_irq_start(cpu);
 
    gen->cpu_thread_running = TRUE;
    cpu_exec_loop_set(gen);
@@ -1290,6 +1299,15 @@ void *ppc32_jit_run_cpu(cpu_gen_t *gen)
       /* Handle the virtual CPU clock */
       if (++timer_irq_check == cpu->timer_irq_check_itv) {
          timer_irq_check = 0;
+         ppc32_timer_irq_update(cpu);
+
+         /* Automatic idle PC detection */
+         if (unlikely(gen->idle_auto != NULL))
+            cpu_idle_auto_check(gen);
+
+         /* End of the time slice on the CPU scheduler */
+         if (unlikely(gen->sched != NULL))
+            cpu_sched_check(gen);
 
          if (cpu->timer_irq_pending && !cpu->irq_disable &&
              (cpu->msr & PPC32_MSR_EE))
@@ -1357,16 +1375,16 @@ void *ppc32_jit_run_cpu(cpu_gen_t *gen)
       switch(gen->state) {
          case CPU_STATE_RUNNING:
             gen->state = CPU_STATE_RUNNING;
+            ppc32_timer_irq_start(cpu);
             goto start_cpu;
 
          case CPU_STATE_HALTED:
             gen->cpu_thread_running = FALSE;
-            pthread_join(timer_irq_thread,NULL);
             break;
       }
       
       /* CPU is paused */
-      usleep(200000);
+      cpu_idle_wait(gen,200000);
    }
 
    return NULL;
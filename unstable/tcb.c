@@ -13,6 +13,10 @@
 #include <fcntl.h>
 #include <pthread.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <signal.h>
 #include <assert.h>
 
 #include "device.h"
@@ -83,6 +87,8 @@ static tsg_t *tsg_array[TSG_MAX_GROUPS];
 /* forward prototype declarations */
 int tsg_remove_single_desc(cpu_gen_t *cpu);
 static int tc_free(tsg_t *tsg,cpu_tc_t *tc);
+static void tc_cache_show_stats(void);
+static void tsg_shm_release(cpu_tc_t *tc);
 
 /* Create a new exec area */
 static int exec_page_create_area(tsg_t *tsg)
@@ -362,10 +368,16 @@ static int tc_free(tsg_t *tsg,cpu_tc_t *tc)
       tc->flags &= ~TC_FLAG_VALID;
       
       tc_free_patches(tc);
+      tc_free_relocs(tc);
       
       tc_remove_from_hash(tc);
       tc_remove_cpu_local(tc);
-      tc_free_jit_chunks(tsg,tc);
+
+      if (tc->flags & TC_FLAG_SHM)
+         tsg_shm_release(tc);
+      else
+         tc_free_jit_chunks(tsg,tc);
+
       free(tc->jit_insn_ptr);
       
       tc->sc_next = tsg->tc_free_list;
@@ -379,8 +391,9 @@ static int tc_free(tsg_t *tsg,cpu_tc_t *tc)
    return(FALSE);
 }
 
-/* Allocate a new TC descriptor */
-cpu_tc_t *tc_alloc(cpu_gen_t *cpu,m_uint64_t vaddr,m_uint32_t exec_state)
+/* Allocate a new TC descriptor without JIT buffer */
+static cpu_tc_t *tc_alloc_desc(cpu_gen_t *cpu,m_uint64_t vaddr,
+                               m_uint32_t exec_state)
 {
    tsg_t *tsg = tsg_array[cpu->tsg];
    cpu_tc_t *tc;
@@ -401,19 +414,31 @@ cpu_tc_t *tc_alloc(cpu_gen_t *cpu,m_uint64_t vaddr,m_uint32_t exec_state)
    tc->exec_state = exec_state;
    tc->ref_count = 1;
    
-   /* 
-    * Allocate the array used to convert target code ptr to native code ptr,
-    * and create the first JIT buffer.
-    */
+   /* Allocate the array used to convert target code ptr to native code ptr */
    len = VM_PAGE_SIZE / sizeof(m_uint32_t);
 
-   if (!(tc->jit_insn_ptr = calloc(len,sizeof(u_char *))) ||
-       (tc_alloc_jit_chunk(cpu,tc) == -1))
-   {
+   if (!(tc->jit_insn_ptr = calloc(len,sizeof(u_char *)))) {
       tc_free(tsg,tc);
       return NULL;
    }
 
+   return tc;
+}
+
+/* Allocate a new TC descriptor */
+cpu_tc_t *tc_alloc(cpu_gen_t *cpu,m_uint64_t vaddr,m_uint32_t exec_state)
+{
+   cpu_tc_t *tc;
+
+   if (!(tc = tc_alloc_desc(cpu,vaddr,exec_state)))
+      return NULL;
+
+   /* Create the first JIT buffer */
+   if (tc_alloc_jit_chunk(cpu,tc) == -1) {
+      tc_free(tsg_array[cpu->tsg],tc);
+      return NULL;
+   }
+
    tc->jit_ptr = tc->jit_buffer->ptr;
    return tc;
 }
@@ -659,6 +684,7 @@ void tsg_show_stats(void)
       }
    }
 
+   tc_cache_show_stats();
    printf("\n");
 }
 
@@ -687,7 +713,11 @@ int tc_adjust_jit_buffer(cpu_gen_t *cpu,cpu_tc_t *tc,
       return(-1);
    }
 
-   /* jump to the new exec page (link) */
+   /* 
+    * jump to the new exec page (link). With TC_FLAG_PERSIST, set_jump must
+    * emit a jump which can be relocated with a 32-bit displacement.
+    */
+   tc_record_reloc(tc,TC_RELOC_JUMP,tc->jit_ptr,tc->jit_buffer->ptr);
    set_jump(&tc->jit_ptr,tc->jit_buffer->ptr);
    tc->jit_ptr = tc->jit_buffer->ptr;
    return(0);
@@ -757,6 +787,7 @@ int tc_apply_patches(cpu_tc_t *tc,void (*set_patch)(u_char *insn,u_char *dst))
                    tc->vaddr,patch->jit_insn,patch->vaddr,jit_dst);
 #endif
             set_patch(patch->jit_insn,jit_dst);
+            tc_record_reloc(tc,TC_RELOC_JUMP,patch->jit_insn,jit_dst);
          }
       }
 
@@ -776,6 +807,1425 @@ void tc_free_patches(cpu_tc_t *tc)
    tc->patch_table = NULL;
 }
 
+/* Record a relocation in translated code */
+int tc_record_reloc(cpu_tc_t *tc,u_int type,u_char *site,void *target)
+{
+   struct tc_reloc_table *rt = tc->reloc_table;
+   struct tc_reloc *reloc;
+
+   if (!(tc->flags & TC_FLAG_PERSIST))
+      return(0);
+
+   if (!rt || (rt->cur_reloc >= TC_RELOC_TABLE_SIZE))
+   {
+      /* full table or no table, create a new one */
+      if (!(rt = malloc(sizeof(*rt)))) {
+         /* the code will not be stored in the persistent cache */
+         tc_free_relocs(tc);
+         return(-1);
+      }
+
+      memset(rt,0,sizeof(*rt));
+      rt->next = tc->reloc_table;
+      tc->reloc_table = rt;
+   }
+
+   reloc = &rt->relocs[rt->cur_reloc];
+   reloc->site   = site;
+   reloc->target = target;
+   reloc->type   = type;
+   rt->cur_reloc++;
+   return(0);
+}
+
+/* Free the relocation table */
+void tc_free_relocs(cpu_tc_t *tc)
+{
+   struct tc_reloc_table *p,*next;
+
+   for(p=tc->reloc_table;p;p=next) {
+      next = p->next;
+      free(p);
+   }
+
+   tc->reloc_table = NULL;
+   tc->flags &= ~TC_FLAG_PERSIST;
+}
+
+/* ======================================================================== */
+/* Persistent translation cache                                             */
+/* ======================================================================== */
+
+/* 
+ * The cache file contains a header followed by records appended by all
+ * the instances sharing it. Each record holds a translated page with:
+ *   - the guest page (to check it is really the same code),
+ *   - the instruction map (guest instruction -> position in the code),
+ *   - the relocations to apply when the code is loaded,
+ *   - the translated code itself (copy of the JIT chunks).
+ *
+ * Positions in the translated code are stored as (chunk,offset) and host
+ * function addresses as offsets from an anchor function, so that the code
+ * can be loaded at any address, even if the binary is position-independent.
+ */
+#define TC_CACHE_MAGIC    0x4443544a  /* "JTCD" */
+#define TC_CACHE_VERSION  1
+
+/* Hash table to retrieve cache records from their checksums */
+#define TC_CACHE_HASH_BITS  12
+#define TC_CACHE_HASH_SIZE  (1 << TC_CACHE_HASH_BITS)
+#define TC_CACHE_HASH_MASK  (TC_CACHE_HASH_SIZE - 1)
+
+/* Number of entries in the instruction map */
+#define TC_CACHE_MAP_SIZE  (VM_PAGE_SIZE / sizeof(m_uint32_t))
+
+/* No translated code for this instruction */
+#define TC_CACHE_NO_INSN  0xFFFFFFFF
+
+/* Position in translated code */
+#define TC_CACHE_POS(chunk,offset)  (((chunk) << 16) | (offset))
+#define TC_CACHE_POS_CHUNK(pos)     ((pos) >> 16)
+#define TC_CACHE_POS_OFFSET(pos)    ((pos) & 0xFFFF)
+
+/* Anchor for host function addresses */
+#define TC_CACHE_ANCHOR  ((u_char *)tsg_checksum_page)
+
+/* Cache file header */
+struct tc_cache_hdr {
+   m_uint32_t magic;
+   m_uint32_t version;
+   m_uint64_t signature;
+};
+
+/* Cache record */
+struct tc_cache_rec {
+   m_uint32_t size;
+   m_uint32_t exec_state;
+   m_uint32_t cfg;
+   m_uint32_t chunk_count;
+   m_uint32_t last_chunk_len;
+   m_uint32_t reloc_count;
+   m_uint64_t vaddr;
+   m_uint64_t checksum;
+};
+
+/* Relocation in a cache record */
+struct tc_cache_reloc {
+   m_uint32_t type;
+   m_uint32_t site;
+   m_int64_t target;
+};
+
+/* Reference to a cache record */
+struct tc_cache_ref {
+   struct tc_cache_ref *next;
+   struct tc_cache_rec *rec;  /* NULL if appended by this instance */
+   tsg_checksum_t checksum;
+   m_uint64_t vaddr;
+   m_uint32_t exec_state;
+   m_uint32_t cfg;
+};
+
+/* Persistent translation cache file */
+char *tc_cache_file = NULL;
+
+static pthread_mutex_t tc_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tc_cache_ref **tc_cache_hash = NULL;
+static u_char *tc_cache_map = NULL;
+static size_t tc_cache_map_size = 0;
+static m_uint64_t tc_cache_signature = 0;
+static int tc_cache_fd = -1;
+static u_int tc_cache_hits = 0;
+static u_int tc_cache_stores = 0;
+
+/* Compute the size of a cache record */
+static inline size_t tc_cache_rec_size(u_int chunk_count,u_int last_chunk_len,
+                                       u_int reloc_count)
+{
+   size_t len;
+
+   len = sizeof(struct tc_cache_rec) + VM_PAGE_SIZE;
+   len += TC_CACHE_MAP_SIZE * sizeof(m_uint32_t);
+   len += (size_t)reloc_count * sizeof(struct tc_cache_reloc);
+   len += (size_t)(chunk_count - 1) * TC_JIT_PAGE_SIZE + last_chunk_len;
+   return((len + 7) & ~(size_t)7);
+}
+
+/* Get the guest page of a cache record */
+static inline u_char *tc_cache_rec_page(struct tc_cache_rec *rec)
+{
+   return((u_char *)(rec + 1));
+}
+
+/* Get the instruction map of a cache record */
+static inline m_uint32_t *tc_cache_rec_map(struct tc_cache_rec *rec)
+{
+   return((m_uint32_t *)(tc_cache_rec_page(rec) + VM_PAGE_SIZE));
+}
+
+/* Get the relocations of a cache record */
+static inline struct tc_cache_reloc *tc_cache_rec_relocs(struct tc_cache_rec *rec)
+{
+   return((struct tc_cache_reloc *)(tc_cache_rec_map(rec)+TC_CACHE_MAP_SIZE));
+}
+
+/* Get the translated code of a cache record */
+static inline u_char *tc_cache_rec_code(struct tc_cache_rec *rec)
+{
+   return((u_char *)(tc_cache_rec_relocs(rec) + rec->reloc_count));
+}
+
+/* Add a record in the cache hash table */
+static int tc_cache_add_ref(struct tc_cache_rec *rec,tsg_checksum_t checksum,
+                            m_uint64_t vaddr,m_uint32_t exec_state,
+                            m_uint32_t cfg)
+{
+   struct tc_cache_ref *ref;
+   u_int hash_bucket;
+
+   if (!(ref = malloc(sizeof(*ref))))
+      return(-1);
+
+   ref->rec        = rec;
+   ref->checksum   = checksum;
+   ref->vaddr      = vaddr;
+   ref->exec_state = exec_state;
+   ref->cfg        = cfg;
+
+   hash_bucket = tsg_cksum_hash(checksum) & TC_CACHE_HASH_MASK;
+   ref->next = tc_cache_hash[hash_bucket];
+   tc_cache_hash[hash_bucket] = ref;
+   return(0);
+}
+
+/* Find a record in the cache hash table (lock must be held) */
+static struct tc_cache_ref *tc_cache_find_ref(cpu_tb_t *tb,m_uint32_t cfg)
+{
+   struct tc_cache_ref *ref;
+   u_int hash_bucket;
+
+   hash_bucket = tsg_cksum_hash(tb->checksum) & TC_CACHE_HASH_MASK;
+
+   for(ref=tc_cache_hash[hash_bucket];ref;ref=ref->next) {
+      if ((ref->checksum != tb->checksum) || (ref->vaddr != tb->vaddr) ||
+          (ref->exec_state != tb->exec_state) || (ref->cfg != cfg))
+         continue;
+
+      if (ref->rec && memcmp(tc_cache_rec_page(ref->rec),
+                             tb->target_code,VM_PAGE_SIZE))
+         continue;
+
+      return ref;
+   }
+
+   return NULL;
+}
+
+/* Index the records available in the cache file */
+static u_int tc_cache_scan(void)
+{
+   struct tc_cache_rec *rec;
+   size_t pos,len;
+   u_int count = 0;
+
+   pos = sizeof(struct tc_cache_hdr);
+
+   while((pos + sizeof(*rec)) <= tc_cache_map_size) {
+      rec = (struct tc_cache_rec *)(tc_cache_map + pos);
+
+      /* Stop on a truncated or invalid record */
+      if ((rec->size & 0x07) || (rec->size > (tc_cache_map_size - pos)) ||
+          !rec->chunk_count || (rec->chunk_count > TC_MAX_CHUNKS) ||
+          (rec->last_chunk_len > TC_JIT_PAGE_SIZE))
+         break;
+
+      len = tc_cache_rec_size(rec->chunk_count,rec->last_chunk_len,
+                              rec->reloc_count);
+
+      if (len != rec->size)
+         break;
+
+      if (tc_cache_add_ref(rec,rec->checksum,rec->vaddr,
+                           rec->exec_state,rec->cfg) == -1)
+         break;
+
+      pos += rec->size;
+      count++;
+   }
+
+   return(count);
+}
+
+/* Open the persistent translation cache */
+int tc_cache_open(m_uint64_t signature)
+{
+   struct tc_cache_hdr hdr;
+   struct stat st;
+   u_int count;
+   int fd,res = -1;
+
+   pthread_mutex_lock(&tc_cache_lock);
+
+   /* Already opened (by another CPU or VM) */
+   if (tc_cache_fd != -1) {
+      res = (signature == tc_cache_signature) ? 0 : -1;
+      goto done;
+   }
+
+   if (!tc_cache_file)
+      goto done;
+
+   if ((fd = open(tc_cache_file,O_RDWR|O_CREAT|O_APPEND,0644)) == -1) {
+      fprintf(stderr,"JIT cache: unable to open '%s': %s\n",
+              tc_cache_file,strerror(errno));
+      goto done;
+   }
+
+   flock(fd,LOCK_EX);
+
+   if (fstat(fd,&st) == -1)
+      goto err_file;
+
+   if (st.st_size == 0) {
+      memset(&hdr,0,sizeof(hdr));
+      hdr.magic     = TC_CACHE_MAGIC;
+      hdr.version   = TC_CACHE_VERSION;
+      hdr.signature = signature;
+
+      if (write(fd,&hdr,sizeof(hdr)) != sizeof(hdr)) {
+         fprintf(stderr,"JIT cache: unable to write '%s': %s\n",
+                 tc_cache_file,strerror(errno));
+         goto err_file;
+      }
+
+      st.st_size = sizeof(hdr);
+   } else {
+      if ((pread(fd,&hdr,sizeof(hdr),0) != sizeof(hdr)) ||
+          (hdr.magic != TC_CACHE_MAGIC) || 
+          (hdr.version != TC_CACHE_VERSION) ||
+          (hdr.signature != signature))
+      {
+         fprintf(stderr,"JIT cache: '%s' was not created by this build, "
+                 "ignoring it.\n",tc_cache_file);
+         goto err_file;
+      }
+   }
+
+   if (!(tc_cache_hash = calloc(TC_CACHE_HASH_SIZE,sizeof(*tc_cache_hash))))
+      goto err_file;
+
+   /* Records appended later by other instances are ignored */
+   tc_cache_map_size = st.st_size;
+   tc_cache_map = mmap(NULL,tc_cache_map_size,PROT_READ,MAP_SHARED,fd,0);
+
+   if (tc_cache_map == MAP_FAILED) {
+      perror("tc_cache_open: mmap");
+      goto err_map;
+   }
+
+   flock(fd,LOCK_UN);
+
+   tc_cache_fd = fd;
+   tc_cache_signature = signature;
+   count = tc_cache_scan();
+
+   printf("JIT cache: %u translated pages available in '%s'.\n",
+          count,tc_cache_file);
+   res = 0;
+   goto done;
+
+ err_map:
+   free(tc_cache_hash);
+   tc_cache_hash = NULL;
+   tc_cache_map = NULL;
+ err_file:
+   flock(fd,LOCK_UN);
+   close(fd);
+ done:
+   pthread_mutex_unlock(&tc_cache_lock);
+   return(res);
+}
+
+/* Returns TRUE if the persistent translation cache is usable */
+int tc_cache_enabled(void)
+{
+   return(tc_cache_fd != -1);
+}
+
+/* Show statistics about the persistent translation cache */
+static void tc_cache_show_stats(void)
+{
+   if (tc_cache_fd != -1) {
+      printf("\nJIT cache: %u pages loaded, %u pages stored.\n",
+             tc_cache_hits,tc_cache_stores);
+   }
+}
+
+/* Get the position of a host pointer in translated code */
+static int tc_cache_get_pos(cpu_tc_t *tc,u_char *ptr,m_uint32_t *pos)
+{
+   u_char *base;
+   int i;
+
+   for(i=0;i<tc->jit_chunk_pos;i++) {
+      base = tc->jit_chunks[i]->ptr;
+
+      if ((ptr >= base) && (ptr < (base + TC_JIT_PAGE_SIZE))) {
+         *pos = TC_CACHE_POS(i,ptr - base);
+         return(0);
+      }
+   }
+
+   return(-1);
+}
+
+/* Get the host pointer of a position in translated code */
+static u_char *tc_cache_get_ptr(cpu_tc_t *tc,m_uint32_t pos)
+{
+   if ((TC_CACHE_POS_CHUNK(pos) >= tc->jit_chunk_pos) ||
+       (TC_CACHE_POS_OFFSET(pos) >= TC_JIT_PAGE_SIZE))
+      return NULL;
+
+   return(tc->jit_chunks[TC_CACHE_POS_CHUNK(pos)]->ptr + 
+          TC_CACHE_POS_OFFSET(pos));
+}
+
+/* 
+ * Returns TRUE if a relocation has to be stored. Jumps inside a chunk are
+ * relative and are kept as is since chunks are saved entirely.
+ */
+static int tc_cache_reloc_needed(cpu_tc_t *tc,struct tc_reloc *reloc)
+{
+   m_uint32_t site,target;
+
+   if (reloc->type != TC_RELOC_JUMP)
+      return(TRUE);
+
+   if ((tc_cache_get_pos(tc,reloc->site,&site) == -1) ||
+       (tc_cache_get_pos(tc,reloc->target,&target) == -1))
+      return(TRUE);
+
+   return(TC_CACHE_POS_CHUNK(site) != TC_CACHE_POS_CHUNK(target));
+}
+
+/* Store translated code in the persistent cache */
+int tc_cache_store(cpu_gen_t *cpu,cpu_tb_t *tb,cpu_tc_t *tc,m_uint32_t cfg)
+{
+   struct tc_reloc_table *rt;
+   struct tc_reloc *reloc;
+   struct tc_cache_rec *rec;
+   struct tc_cache_reloc *crel;
+   m_uint32_t *map,pos;
+   u_int i,chunk_count,last_len,reloc_count;
+   u_char *code;
+   size_t len;
+   int res = -1;
+
+   if (!(tc->flags & TC_FLAG_PERSIST) || (tc_cache_fd == -1))
+      return(-1);
+
+   /* The page has been modified during the translation */
+   if (tsg_checksum_page(tb->target_code,VM_PAGE_SIZE) != tb->checksum)
+      return(-1);
+
+   chunk_count = tc->jit_chunk_pos;
+   last_len = tc->jit_ptr - tc->jit_buffer->ptr;
+   reloc_count = 0;
+
+   for(rt=tc->reloc_table;rt;rt=rt->next)
+      for(i=0;i<rt->cur_reloc;i++)
+         if (tc_cache_reloc_needed(tc,&rt->relocs[i]))
+            reloc_count++;
+
+   len = tc_cache_rec_size(chunk_count,last_len,reloc_count);
+
+   if (!(rec = calloc(1,len)))
+      return(-1);
+
+   rec->size           = len;
+   rec->exec_state     = tb->exec_state;
+   rec->cfg            = cfg;
+   rec->chunk_count    = chunk_count;
+   rec->last_chunk_len = last_len;
+   rec->reloc_count    = reloc_count;
+   rec->vaddr          = tb->vaddr;
+   rec->checksum       = tb->checksum;
+   memcpy(tc_cache_rec_page(rec),tb->target_code,VM_PAGE_SIZE);
+
+   /* Instruction map */
+   map = tc_cache_rec_map(rec);
+
+   for(i=0;i<TC_CACHE_MAP_SIZE;i++) {
+      if (!tc->jit_insn_ptr[i])
+         map[i] = TC_CACHE_NO_INSN;
+      else if (tc_cache_get_pos(tc,tc->jit_insn_ptr[i],&map[i]) == -1)
+         goto done;
+   }
+
+   /* Relocations */
+   crel = tc_cache_rec_relocs(rec);
+
+   for(rt=tc->reloc_table;rt;rt=rt->next) {
+      for(i=0;i<rt->cur_reloc;i++) {
+         reloc = &rt->relocs[i];
+
+         if (!tc_cache_reloc_needed(tc,reloc))
+            continue;
+
+         if (tc_cache_get_pos(tc,reloc->site,&crel->site) == -1)
+            goto done;
+
+         if (reloc->type == TC_RELOC_FUNC) {
+            crel->target = reloc->target - TC_CACHE_ANCHOR;
+         } else {
+            if (tc_cache_get_pos(tc,reloc->target,&pos) == -1)
+               goto done;
+            crel->target = pos;
+         }
+
+         crel->type = reloc->type;
+         crel++;
+      }
+   }
+
+   /* Translated code */
+   code = tc_cache_rec_code(rec);
+
+   for(i=0;i<chunk_count;i++) {
+      len = (i == (chunk_count - 1)) ? last_len : TC_JIT_PAGE_SIZE;
+      memcpy(code,tc->jit_chunks[i]->ptr,len);
+      code += len;
+   }
+
+   pthread_mutex_lock(&tc_cache_lock);
+
+   /* Another CPU may have stored the same page */
+   if (!tc_cache_find_ref(tb,cfg)) {
+      flock(tc_cache_fd,LOCK_EX);
+
+      if (write(tc_cache_fd,rec,rec->size) == rec->size) {
+         tc_cache_add_ref(NULL,tb->checksum,tb->vaddr,tb->exec_state,cfg);
+         tc_cache_stores++;
+         res = 0;
+      }
+
+      flock(tc_cache_fd,LOCK_UN);
+   }
+
+   pthread_mutex_unlock(&tc_cache_lock);
+
+ done:
+   free(rec);
+   return(res);
+}
+
+/* Load translated code from the persistent cache */
+cpu_tc_t *tc_cache_load(cpu_gen_t *cpu,cpu_tb_t *tb,m_uint32_t cfg,
+                        void (*set_patch)(u_char *insn,u_char *dst))
+{
+   tsg_t *tsg = tsg_array[cpu->tsg];
+   struct tc_cache_ref *ref;
+   struct tc_cache_rec *rec;
+   struct tc_cache_reloc *crel;
+   m_uint32_t *map;
+   u_char *code,*site,*target;
+   cpu_tc_t *tc;
+   size_t len;
+   u_int i;
+
+   if (tc_cache_fd == -1)
+      return NULL;
+
+   pthread_mutex_lock(&tc_cache_lock);
+   ref = tc_cache_find_ref(tb,cfg);
+   rec = (ref != NULL) ? ref->rec : NULL;
+   pthread_mutex_unlock(&tc_cache_lock);
+
+   if (!rec)
+      return NULL;
+
+   if (!(tc = tc_alloc(cpu,tb->vaddr,tb->exec_state)))
+      return NULL;
+
+   for(i=1;i<rec->chunk_count;i++)
+      if (tc_alloc_jit_chunk(cpu,tc) == -1)
+         goto err;
+
+   /* Copy the translated code */
+   code = tc_cache_rec_code(rec);
+
+   for(i=0;i<rec->chunk_count;i++) {
+      len = (i == (rec->chunk_count - 1)) ? 
+         rec->last_chunk_len : TC_JIT_PAGE_SIZE;
+      memcpy(tc->jit_chunks[i]->ptr,code,len);
+      code += len;
+   }
+
+   tc->jit_ptr = tc->jit_buffer->ptr + rec->last_chunk_len;
+
+   /* Rebuild the instruction map */
+   map = tc_cache_rec_map(rec);
+
+   for(i=0;i<TC_CACHE_MAP_SIZE;i++) {
+      if (map[i] == TC_CACHE_NO_INSN)
+         continue;
+
+      if (!(tc->jit_insn_ptr[i] = tc_cache_get_ptr(tc,map[i])))
+         goto err;
+   }
+
+   /* Apply relocations */
+   crel = tc_cache_rec_relocs(rec);
+
+   for(i=0;i<rec->reloc_count;i++,crel++) {
+      if (!(site = tc_cache_get_ptr(tc,crel->site)))
+         goto err;
+
+      switch(crel->type) {
+         case TC_RELOC_FUNC:
+            target = TC_CACHE_ANCHOR + crel->target;
+            break;
+         case TC_RELOC_JUMP:
+            if (!(target = tc_cache_get_ptr(tc,crel->target)))
+               goto err;
+            break;
+         default:
+            goto err;
+      }
+
+      set_patch(site,target);
+   }
+
+   __sync_fetch_and_add(&tc_cache_hits,1);
+   return tc;
+
+ err:
+   cpu_log(cpu,"JIT","TC 0x%8.8llx: invalid record in JIT cache.\n",
+           tb->vaddr);
+   tc_free(tsg,tc);
+   return NULL;
+}
+
+/* ======================================================================== */
+/* Shared memory TSG                                                        */
+/* ======================================================================== */
+
+/* 
+ * The shared memory TSG allows several dynamips processes to share the
+ * translated code of identical pages. The named shared memory area holds:
+ *   - a header with a robust process-shared lock, the hash table of records
+ *     and the table of attached processes,
+ *   - the free list of exec pages,
+ *   - the records (description of translated code),
+ *   - the metadata of records (guest page and instruction map),
+ *   - the exec pages.
+ *
+ * Only position-independent code (without host addresses) is published.
+ * Each process builds local TC descriptors pointing to the shared exec
+ * pages. A record is used by the processes set in its "users" bitmap, 
+ * entries of processes which died are cleared when a new process attaches.
+ * Unused records are kept until their exec pages are needed.
+ *
+ * Attached processes are identified by their PID and start time, so that
+ * a reused PID is not taken for a live user. If a process dies while it
+ * holds the lock, the lists may be half-updated: the area is marked as
+ * invalid and its name is removed. Code already in use keeps running from
+ * the mapped pages, but nothing is looked up or published anymore, and the
+ * next process to start creates a new area.
+ *
+ * The creator holds an exclusive file lock on the area until it is
+ * initialized. A process which finds the area unlocked but still not
+ * initialized knows that the creator died, and creates the area again.
+ *
+ * The area is mapped writable and executable in all attached processes:
+ * any of them can change the code run by the others, so it must only be
+ * shared between trusted processes.
+ */
+#define TSG_SHM_MAGIC      0x5453474d  /* "MGST" */
+#define TSG_SHM_VERSION    2
+#define TSG_SHM_AREA_SIZE  128  /* in Mb */
+#define TSG_SHM_MAX_USERS  32
+#define TSG_SHM_NONE       0xFFFFFFFF
+
+/* Hash table to retrieve shared records from their checksums */
+#define TSG_SHM_HASH_BITS  12
+#define TSG_SHM_HASH_SIZE  (1 << TSG_SHM_HASH_BITS)
+#define TSG_SHM_HASH_MASK  (TSG_SHM_HASH_SIZE - 1)
+
+/* Size of record metadata (guest page + instruction map) */
+#define TSG_SHM_META_SIZE  (VM_PAGE_SIZE + TC_CACHE_MAP_SIZE*sizeof(m_uint32_t))
+
+/* Shared translated code record */
+struct tsg_shm_rec {
+   m_uint32_t next;
+   m_uint32_t users;
+   m_uint32_t exec_state;
+   m_uint32_t cfg;
+   m_uint32_t chunk_count;
+   m_uint32_t last_chunk_len;
+   m_uint64_t vaddr;
+   tsg_checksum_t checksum;
+   m_uint32_t pages[TC_MAX_CHUNKS];
+};
+
+/* Process attached to the shared memory area */
+struct tsg_shm_user {
+   pid_t pid;
+   m_uint64_t start_time;
+};
+
+/* Shared memory area header */
+struct tsg_shm_hdr {
+   m_uint32_t magic;
+   m_uint32_t version;
+   m_uint64_t signature;
+   pthread_mutex_t lock;
+   m_uint32_t invalid;
+   m_uint32_t page_count;
+   m_uint32_t page_avail;
+   m_uint32_t page_free;
+   m_uint32_t rec_free;
+   struct tsg_shm_user users[TSG_SHM_MAX_USERS];
+   m_uint32_t hash[TSG_SHM_HASH_SIZE];
+};
+
+/* Name of the shared memory TSG */
+char *tsg_shm_name = NULL;
+
+static pthread_mutex_t tsg_shm_attach_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tsg_shm_hdr *tsg_shm_hdr = NULL;
+static m_uint32_t *tsg_shm_page_next;
+static struct tsg_shm_rec *tsg_shm_recs;
+static u_char *tsg_shm_meta;
+static insn_exec_page_t *tsg_shm_pages;
+static u_int *tsg_shm_refs;
+static int tsg_shm_user = -1;
+static char tsg_shm_path[256];
+
+/* Compute the offsets of the shared memory area sections */
+static size_t tsg_shm_layout(u_int page_count,size_t *recs,size_t *meta,
+                             size_t *pages)
+{
+   size_t pos;
+
+   pos = sizeof(struct tsg_shm_hdr) + page_count * sizeof(m_uint32_t);
+   pos = (pos + 63) & ~(size_t)63;
+   *recs = pos;
+
+   pos += page_count * sizeof(struct tsg_shm_rec);
+   pos = (pos + 4095) & ~(size_t)4095;
+   *meta = pos;
+
+   pos += (size_t)page_count * TSG_SHM_META_SIZE;
+   pos = (pos + 4095) & ~(size_t)4095;
+   *pages = pos;
+
+   return(pos + (size_t)page_count * TC_JIT_PAGE_SIZE);
+}
+
+/* Get the guest page of a shared record */
+static inline u_char *tsg_shm_rec_page(m_uint32_t index)
+{
+   return(tsg_shm_meta + (size_t)index * TSG_SHM_META_SIZE);
+}
+
+/* Get the instruction map of a shared record */
+static inline m_uint32_t *tsg_shm_rec_map(m_uint32_t index)
+{
+   return((m_uint32_t *)(tsg_shm_rec_page(index) + VM_PAGE_SIZE));
+}
+
+/* Stop using an invalid shared memory area (lock held) */
+static void tsg_shm_invalidate(void)
+{
+   static int reported = FALSE;
+
+   if (reported)
+      return;
+
+   /* New processes will create a fresh area */
+   shm_unlink(tsg_shm_path);
+
+   fprintf(stderr,"TSG: shared memory '%s' left inconsistent by a dead "
+           "process, sharing disabled.\n",tsg_shm_path);
+   reported = TRUE;
+}
+
+/* 
+ * Lock the shared memory area. Returns -1 if the area cannot be used
+ * anymore (the lock is not held in this case).
+ */
+static int tsg_shm_lock(void)
+{
+   int res;
+
+   res = pthread_mutex_lock(&tsg_shm_hdr->lock);
+
+   /* The owner died: the lists and hash chains cannot be trusted */
+   if (res == EOWNERDEAD) {
+      tsg_shm_hdr->invalid = TRUE;
+      pthread_mutex_consistent(&tsg_shm_hdr->lock);
+      res = 0;
+   }
+
+   if (res != 0)
+      return(-1);
+
+   if (tsg_shm_hdr->invalid) {
+      tsg_shm_invalidate();
+      pthread_mutex_unlock(&tsg_shm_hdr->lock);
+      return(-1);
+   }
+
+   return(0);
+}
+
+/* Unlock the shared memory area */
+static inline void tsg_shm_unlock(void)
+{
+   pthread_mutex_unlock(&tsg_shm_hdr->lock);
+}
+
+/* Initialize a newly created shared memory area */
+static int tsg_shm_init_area(struct tsg_shm_hdr *hdr,u_int page_count,
+                             m_uint64_t signature)
+{
+   pthread_mutexattr_t attr;
+   int i;
+
+   pthread_mutexattr_init(&attr);
+   pthread_mutexattr_setpshared(&attr,PTHREAD_PROCESS_SHARED);
+   pthread_mutexattr_setrobust(&attr,PTHREAD_MUTEX_ROBUST);
+
+   if (pthread_mutex_init(&hdr->lock,&attr) != 0) {
+      pthread_mutexattr_destroy(&attr);
+      return(-1);
+   }
+
+   pthread_mutexattr_destroy(&attr);
+
+   hdr->signature  = signature;
+   hdr->invalid    = FALSE;
+   hdr->page_count = page_count;
+   hdr->page_avail = page_count;
+   hdr->page_free  = 0;
+   hdr->rec_free   = 0;
+
+   for(i=0;i<page_count;i++) {
+      tsg_shm_page_next[i] = (i < (page_count - 1)) ? i + 1 : TSG_SHM_NONE;
+      tsg_shm_recs[i].next = tsg_shm_page_next[i];
+   }
+
+   for(i=0;i<TSG_SHM_HASH_SIZE;i++)
+      hdr->hash[i] = TSG_SHM_NONE;
+
+   /* The area is usable by other processes once the magic is set */
+   hdr->version = TSG_SHM_VERSION;
+   __sync_synchronize();
+   hdr->magic = TSG_SHM_MAGIC;
+   return(0);
+}
+
+/* Clear the references of a user to all records (lock held) */
+static void tsg_shm_clear_user(int user)
+{
+   m_uint32_t i,mask = ~(1U << user);
+
+   for(i=0;i<tsg_shm_hdr->page_count;i++)
+      tsg_shm_recs[i].users &= mask;
+
+   tsg_shm_hdr->users[user].pid = 0;
+   tsg_shm_hdr->users[user].start_time = 0;
+}
+
+/* 
+ * Get the start time of a process (in clock ticks since boot).
+ * Returns 0 if it is unknown.
+ */
+static m_uint64_t tsg_shm_proc_start(pid_t pid)
+{
+   unsigned long long start_time;
+   char path[64],buffer[1024],*p;
+   ssize_t len;
+   int i,fd;
+
+   snprintf(path,sizeof(path),"/proc/%ld/stat",(long)pid);
+
+   if ((fd = open(path,O_RDONLY)) == -1)
+      return(0);
+
+   len = read(fd,buffer,sizeof(buffer)-1);
+   close(fd);
+
+   if (len <= 0)
+      return(0);
+
+   buffer[len] = 0;
+
+   /* Skip the command name, which may contain spaces */
+   if (!(p = strrchr(buffer,')')))
+      return(0);
+
+   /* The start time is the 20th field after the command name */
+   for(i=0;i<20;i++) {
+      if (!(p = strchr(p+1,' ')))
+         return(0);
+   }
+
+   if (sscanf(p+1,"%llu",&start_time) != 1)
+      return(0);
+
+   return(start_time);
+}
+
+/* Returns TRUE if the process using a slot is still alive (lock held) */
+static int tsg_shm_user_alive(struct tsg_shm_user *user)
+{
+   /* The PID may have been reused by another process */
+   if (user->start_time != 0)
+      return(tsg_shm_proc_start(user->pid) == user->start_time);
+
+   /* No start time available: EPERM means a process of another user */
+   return((kill(user->pid,0) == 0) || (errno == EPERM));
+}
+
+/* Clear the references of processes which died (lock held) */
+static void tsg_shm_reap_users(void)
+{
+   int i;
+
+   for(i=0;i<TSG_SHM_MAX_USERS;i++) {
+      if (!tsg_shm_hdr->users[i].pid || (i == tsg_shm_user))
+         continue;
+
+      if (!tsg_shm_user_alive(&tsg_shm_hdr->users[i]))
+         tsg_shm_clear_user(i);
+   }
+}
+
+/* Detach from the shared memory TSG */
+static void tsg_shm_detach(void)
+{
+   if (!tsg_shm_hdr || (tsg_shm_user == -1))
+      return;
+
+   if (tsg_shm_lock() != -1) {
+      tsg_shm_clear_user(tsg_shm_user);
+      tsg_shm_unlock();
+   }
+
+   tsg_shm_user = -1;
+}
+
+/* 
+ * Wait for the creator of a shared memory area to initialize it. The
+ * creator holds an exclusive lock on the file until the magic is set.
+ * Returns -1 if the area is still not initialized: the creator died.
+ */
+static int tsg_shm_wait_init(int fd)
+{
+   m_uint32_t magic;
+   struct stat st;
+   int i,ready;
+
+   for(i=0;i<100;i++) {
+      if (flock(fd,LOCK_EX) == -1)
+         return(-1);
+
+      ready = (fstat(fd,&st) == 0) && (st.st_size != 0) &&
+         (pread(fd,&magic,sizeof(magic),0) == sizeof(magic)) && (magic != 0);
+
+      flock(fd,LOCK_UN);
+
+      if (ready)
+         return(0);
+
+      /* Let a creator which did not take the lock yet run */
+      usleep(10000);
+   }
+
+   return(-1);
+}
+
+/* Attach to the shared memory TSG */
+int tsg_shm_attach(m_uint64_t signature)
+{
+   size_t area_size,recs_off,meta_off,pages_off;
+   struct tsg_shm_hdr *hdr;
+   struct stat st;
+   char name[256];
+   u_int page_count;
+   int i,fd,created,retry,res = -1;
+
+   pthread_mutex_lock(&tsg_shm_attach_lock);
+
+   /* Already attached (by another CPU or VM) */
+   if (tsg_shm_hdr != NULL) {
+      res = (tsg_shm_hdr->signature == signature) ? 0 : -1;
+      goto done;
+   }
+
+   if (!tsg_shm_name)
+      goto done;
+
+   snprintf(name,sizeof(name),"/dynamips-tsg-%s",tsg_shm_name);
+   strcpy(tsg_shm_path,name);
+
+   page_count = (TSG_SHM_AREA_SIZE * 1048576) / TC_JIT_PAGE_SIZE;
+   area_size = tsg_shm_layout(page_count,&recs_off,&meta_off,&pages_off);
+
+   for(retry=0;;retry++) {
+      if ((fd = shm_open(name,O_RDWR|O_CREAT|O_EXCL,0600)) != -1) {
+         created = TRUE;
+
+         /* Other processes wait for the lock before using the area */
+         if ((flock(fd,LOCK_EX) == -1) || (ftruncate(fd,area_size) == -1)) {
+            perror("tsg_shm_attach: ftruncate");
+            close(fd);
+            shm_unlink(name);
+            goto done;
+         }
+         break;
+      }
+
+      created = FALSE;
+
+      if ((fd = shm_open(name,O_RDWR,0)) == -1) {
+         if ((errno == ENOENT) && !retry)
+            continue;
+
+         fprintf(stderr,"TSG: unable to open shared memory '%s': %s\n",
+                 name,strerror(errno));
+         goto done;
+      }
+
+      if (tsg_shm_wait_init(fd) != -1)
+         break;
+
+      close(fd);
+
+      if (retry) {
+         fprintf(stderr,"TSG: shared memory '%s' is not initialized.\n",
+                 name);
+         goto done;
+      }
+
+      /* The creator died before the area was usable: create it again */
+      fprintf(stderr,"TSG: shared memory '%s' left uninitialized by a dead "
+              "process, re-creating it.\n",name);
+      shm_unlink(name);
+   }
+
+   /* An area of another size would fault beyond its end */
+   if (!created && ((fstat(fd,&st) == -1) || (st.st_size != area_size))) {
+      fprintf(stderr,"TSG: shared memory '%s' is used by another build.\n",
+              name);
+      close(fd);
+      goto done;
+   }
+
+   hdr = mmap(NULL,area_size,PROT_READ|PROT_WRITE|PROT_EXEC,MAP_SHARED,fd,0);
+
+   if (hdr == MAP_FAILED) {
+      perror("tsg_shm_attach: mmap");
+      close(fd);
+      goto done;
+   }
+
+   tsg_shm_page_next = (m_uint32_t *)(hdr + 1);
+   tsg_shm_recs = (struct tsg_shm_rec *)((u_char *)hdr + recs_off);
+   tsg_shm_meta = (u_char *)hdr + meta_off;
+
+   if (created) {
+      res = tsg_shm_init_area(hdr,page_count,signature);
+      close(fd);
+
+      if (res == -1) {
+         shm_unlink(name);
+         goto err_area;
+      }
+
+      res = -1;
+   } else {
+      close(fd);
+      __sync_synchronize();
+
+      if ((hdr->magic != TSG_SHM_MAGIC) || 
+          (hdr->version != TSG_SHM_VERSION) ||
+          (hdr->page_count != page_count) || (hdr->signature != signature))
+      {
+         fprintf(stderr,"TSG: shared memory '%s' is used by another build.\n",
+                 name);
+         goto err_area;
+      }
+   }
+
+   /* Local descriptors of shared exec pages and local reference counts */
+   tsg_shm_pages = calloc(page_count,sizeof(insn_exec_page_t));
+   tsg_shm_refs = calloc(page_count,sizeof(u_int));
+
+   if (!tsg_shm_pages || !tsg_shm_refs)
+      goto err_local;
+
+   for(i=0;i<page_count;i++)
+      tsg_shm_pages[i].ptr = (u_char *)hdr + pages_off + 
+         (size_t)i * TC_JIT_PAGE_SIZE;
+
+   /* Take a user slot */
+   tsg_shm_hdr = hdr;
+
+   if (tsg_shm_lock() == -1) {
+      tsg_shm_hdr = NULL;
+      goto err_local;
+   }
+
+   tsg_shm_reap_users();
+
+   for(i=0;i<TSG_SHM_MAX_USERS;i++) {
+      if (!hdr->users[i].pid) {
+         hdr->users[i].pid = getpid();
+         hdr->users[i].start_time = tsg_shm_proc_start(getpid());
+         tsg_shm_user = i;
+         break;
+      }
+   }
+
+   tsg_shm_unlock();
+
+   if (tsg_shm_user == -1) {
+      fprintf(stderr,"TSG: too many processes attached to '%s'.\n",name);
+      tsg_shm_hdr = NULL;
+      goto err_local;
+   }
+
+   atexit(tsg_shm_detach);
+   printf("TSG: attached to shared memory '%s' (%u/%u pages available).\n",
+          name,hdr->page_avail,page_count);
+   res = 0;
+   goto done;
+
+ err_local:
+   free(tsg_shm_pages);
+   free(tsg_shm_refs);
+   tsg_shm_pages = NULL;
+   tsg_shm_refs = NULL;
+ err_area:
+   memzone_unmap(hdr,area_size);
+ done:
+   pthread_mutex_unlock(&tsg_shm_attach_lock);
+   return(res);
+}
+
+/* Returns TRUE if the shared memory TSG is usable */
+int tsg_shm_enabled(void)
+{
+   return(tsg_shm_hdr != NULL);
+}
+
+/* Find a record matching a TB (lock held) */
+static m_uint32_t tsg_shm_find(cpu_tb_t *tb,m_uint32_t cfg)
+{
+   struct tsg_shm_rec *rec;
+   m_uint32_t index;
+
+   index = tsg_shm_hdr->hash[tsg_cksum_hash(tb->checksum) & TSG_SHM_HASH_MASK];
+
+   for(;index!=TSG_SHM_NONE;index=rec->next) {
+      rec = &tsg_shm_recs[index];
+
+      if ((rec->checksum == tb->checksum) && (rec->vaddr == tb->vaddr) &&
+          (rec->exec_state == tb->exec_state) && (rec->cfg == cfg) &&
+          !memcmp(tsg_shm_rec_page(index),tb->target_code,VM_PAGE_SIZE))
+         return(index);
+   }
+
+   return(TSG_SHM_NONE);
+}
+
+/* Take a reference on a record (lock held) */
+static inline void tsg_shm_ref(m_uint32_t index)
+{
+   if (tsg_shm_refs[index]++ == 0)
+      tsg_shm_recs[index].users |= 1U << tsg_shm_user;
+}
+
+/* Release a reference on a record (lock held) */
+static inline void tsg_shm_unref(m_uint32_t index)
+{
+   if (--tsg_shm_refs[index] == 0)
+      tsg_shm_recs[index].users &= ~(1U << tsg_shm_user);
+}
+
+/* Release the shared record used by a TC descriptor */
+static void tsg_shm_release(cpu_tc_t *tc)
+{
+   int i;
+
+   /* An invalid area is not updated anymore */
+   if (tsg_shm_lock() != -1) {
+      tsg_shm_unref(tc->shm_index);
+      tsg_shm_unlock();
+   }
+
+   for(i=0;i<tc->jit_chunk_pos;i++)
+      tc->jit_chunks[i] = NULL;
+
+   tc->flags &= ~TC_FLAG_SHM;
+}
+
+/* Free an unused record and its exec pages (lock held) */
+static void tsg_shm_free_rec(m_uint32_t index)
+{
+   struct tsg_shm_rec *rec = &tsg_shm_recs[index];
+   m_uint32_t *p;
+   int i;
+
+   /* Remove it from the hash table */
+   p = &tsg_shm_hdr->hash[tsg_cksum_hash(rec->checksum) & TSG_SHM_HASH_MASK];
+
+   while(*p != TSG_SHM_NONE) {
+      if (*p == index) {
+         *p = rec->next;
+         break;
+      }
+
+      p = &tsg_shm_recs[*p].next;
+   }
+
+   for(i=0;i<rec->chunk_count;i++) {
+      tsg_shm_page_next[rec->pages[i]] = tsg_shm_hdr->page_free;
+      tsg_shm_hdr->page_free = rec->pages[i];
+      tsg_shm_hdr->page_avail++;
+   }
+
+   rec->chunk_count = 0;
+   rec->next = tsg_shm_hdr->rec_free;
+   tsg_shm_hdr->rec_free = index;
+}
+
+/* Free unused records until the specified number of pages is available */
+static void tsg_shm_evict(u_int page_count)
+{
+   m_uint32_t index,next;
+   int i;
+
+   for(i=0;i<TSG_SHM_HASH_SIZE;i++) {
+      for(index=tsg_shm_hdr->hash[i];index!=TSG_SHM_NONE;index=next) {
+         next = tsg_shm_recs[index].next;
+
+         if (!tsg_shm_recs[index].users)
+            tsg_shm_free_rec(index);
+      }
+
+      if ((tsg_shm_hdr->page_avail >= page_count) && 
+          (tsg_shm_hdr->rec_free != TSG_SHM_NONE))
+         return;
+   }
+}
+
+/* Create a local TC descriptor for a shared record */
+static cpu_tc_t *tsg_shm_create_tc(cpu_gen_t *cpu,cpu_tb_t *tb,
+                                   m_uint32_t index)
+{
+   struct tsg_shm_rec *rec = &tsg_shm_recs[index];
+   m_uint32_t *map = tsg_shm_rec_map(index);
+   cpu_tc_t *tc;
+   int i;
+
+   if (!(tc = tc_alloc_desc(cpu,tb->vaddr,tb->exec_state)))
+      return NULL;
+
+   for(i=0;i<rec->chunk_count;i++)
+      tc->jit_chunks[i] = &tsg_shm_pages[rec->pages[i]];
+
+   tc->jit_chunk_pos = rec->chunk_count;
+   tc->jit_buffer = tc->jit_chunks[rec->chunk_count - 1];
+   tc->jit_ptr = tc->jit_buffer->ptr + rec->last_chunk_len;
+   tc->shm_index = index;
+   tc->flags |= TC_FLAG_SHM;
+
+   for(i=0;i<TC_CACHE_MAP_SIZE;i++)
+      if (map[i] != TC_CACHE_NO_INSN)
+         tc->jit_insn_ptr[i] = tc_cache_get_ptr(tc,map[i]);
+
+   return tc;
+}
+
+/* Find translated code in the shared memory TSG */
+cpu_tc_t *tsg_shm_lookup(cpu_gen_t *cpu,cpu_tb_t *tb,m_uint32_t cfg)
+{
+   m_uint32_t index;
+   cpu_tc_t *tc;
+
+   if (!tsg_shm_hdr)
+      return NULL;
+
+   if (tsg_shm_lock() == -1)
+      return NULL;
+
+   if ((index = tsg_shm_find(tb,cfg)) != TSG_SHM_NONE)
+      tsg_shm_ref(index);
+   tsg_shm_unlock();
+
+   if (index == TSG_SHM_NONE)
+      return NULL;
+
+   if (!(tc = tsg_shm_create_tc(cpu,tb,index)) && (tsg_shm_lock() != -1)) {
+      tsg_shm_unref(index);
+      tsg_shm_unlock();
+   }
+
+   return tc;
+}
+
+/* Copy translated code in a new shared record (lock held) */
+static m_uint32_t tsg_shm_copy_tc(cpu_tb_t *tb,cpu_tc_t *tc,m_uint32_t cfg,
+                                  void (*set_patch)(u_char *insn,u_char *dst))
+{
+   struct tc_reloc_table *rt;
+   struct tc_reloc *reloc;
+   struct tsg_shm_rec *rec;
+   m_uint32_t index,site,target,*map;
+   u_int i,chunk_count,last_len;
+   u_char *base;
+
+   chunk_count = tc->jit_chunk_pos;
+   last_len = tc->jit_ptr - tc->jit_buffer->ptr;
+
+   if ((tsg_shm_hdr->page_avail < chunk_count) || 
+       (tsg_shm_hdr->rec_free == TSG_SHM_NONE))
+   {
+      tsg_shm_evict(chunk_count);
+
+      if ((tsg_shm_hdr->page_avail < chunk_count) ||
+          (tsg_shm_hdr->rec_free == TSG_SHM_NONE))
+         return(TSG_SHM_NONE);
+   }
+
+   /* Instruction map */
+   index = tsg_shm_hdr->rec_free;
+   map = tsg_shm_rec_map(index);
+
+   for(i=0;i<TC_CACHE_MAP_SIZE;i++) {
+      if (!tc->jit_insn_ptr[i])
+         map[i] = TC_CACHE_NO_INSN;
+      else if (tc_cache_get_pos(tc,tc->jit_insn_ptr[i],&map[i]) == -1)
+         return(TSG_SHM_NONE);
+   }
+
+   memcpy(tsg_shm_rec_page(index),tb->target_code,VM_PAGE_SIZE);
+
+   /* Take the record and copy the code in exec pages */
+   rec = &tsg_shm_recs[index];
+   tsg_shm_hdr->rec_free = rec->next;
+
+   for(i=0;i<chunk_count;i++) {
+      rec->pages[i] = tsg_shm_hdr->page_free;
+      tsg_shm_hdr->page_free = tsg_shm_page_next[rec->pages[i]];
+      tsg_shm_hdr->page_avail--;
+
+      base = tsg_shm_pages[rec->pages[i]].ptr;
+      memcpy(base,tc->jit_chunks[i]->ptr,
+             (i == (chunk_count - 1)) ? last_len : TC_JIT_PAGE_SIZE);
+   }
+
+   /* Fix jumps between chunks */
+   for(rt=tc->reloc_table;rt;rt=rt->next) {
+      for(i=0;i<rt->cur_reloc;i++) {
+         reloc = &rt->relocs[i];
+
+         if (!tc_cache_reloc_needed(tc,reloc))
+            continue;
+
+         /* positions were checked by tsg_shm_publish() */
+         site = target = 0;
+         tc_cache_get_pos(tc,reloc->site,&site);
+         tc_cache_get_pos(tc,reloc->target,&target);
+
+         set_patch(tsg_shm_pages[rec->pages[TC_CACHE_POS_CHUNK(site)]].ptr +
+                   TC_CACHE_POS_OFFSET(site),
+                   tsg_shm_pages[rec->pages[TC_CACHE_POS_CHUNK(target)]].ptr +
+                   TC_CACHE_POS_OFFSET(target));
+      }
+   }
+
+   rec->users          = 0;
+   rec->exec_state     = tb->exec_state;
+   rec->cfg            = cfg;
+   rec->chunk_count    = chunk_count;
+   rec->last_chunk_len = last_len;
+   rec->vaddr          = tb->vaddr;
+   rec->checksum       = tb->checksum;
+
+   /* Make the record visible to other processes */
+   __sync_synchronize();
+   rec->next = tsg_shm_hdr->hash[tsg_cksum_hash(tb->checksum) & 
+                                 TSG_SHM_HASH_MASK];
+   tsg_shm_hdr->hash[tsg_cksum_hash(tb->checksum) & TSG_SHM_HASH_MASK] = index;
+   return(index);
+}
+
+/* 
+ * Publish translated code in the shared memory TSG. The local TC descriptor
+ * is replaced by a descriptor pointing to the shared code if possible.
+ */
+cpu_tc_t *tsg_shm_publish(cpu_gen_t *cpu,cpu_tb_t *tb,cpu_tc_t *tc,
+                          m_uint32_t cfg,
+                          void (*set_patch)(u_char *insn,u_char *dst))
+{
+   struct tc_reloc_table *rt;
+   struct tc_reloc *reloc;
+   cpu_tc_t *shm_tc;
+   m_uint32_t index,pos;
+   int i;
+
+   if (!tsg_shm_hdr || !(tc->flags & TC_FLAG_PERSIST))
+      return tc;
+
+   /* Code containing host addresses cannot be shared */
+   for(rt=tc->reloc_table;rt;rt=rt->next) {
+      for(i=0;i<rt->cur_reloc;i++) {
+         reloc = &rt->relocs[i];
+
+         if ((reloc->type != TC_RELOC_JUMP) ||
+             (tc_cache_get_pos(tc,reloc->site,&pos) == -1) ||
+             (tc_cache_get_pos(tc,reloc->target,&pos) == -1))
+            return tc;
+      }
+   }
+
+   /* The page has been modified during the translation */
+   if (tsg_checksum_page(tb->target_code,VM_PAGE_SIZE) != tb->checksum)
+      return tc;
+
+   if (tsg_shm_lock() == -1)
+      return tc;
+
+   /* Another process may have published the same page */
+   if ((index = tsg_shm_find(tb,cfg)) == TSG_SHM_NONE)
+      index = tsg_shm_copy_tc(tb,tc,cfg,set_patch);
+
+   if (index != TSG_SHM_NONE)
+      tsg_shm_ref(index);
+
+   tsg_shm_unlock();
+
+   if (index == TSG_SHM_NONE)
+      return tc;
+
+   if (!(shm_tc = tsg_shm_create_tc(cpu,tb,index))) {
+      if (tsg_shm_lock() != -1) {
+         tsg_shm_unref(index);
+         tsg_shm_unlock();
+      }
+      return tc;
+   }
+
+   shm_tc->target_code = tc->target_code;
+   tc_free(tsg_array[cpu->tsg],tc);
+   return shm_tc;
+}
+
 /* Initialize the JIT structures of a CPU */
 int cpu_jit_init(cpu_gen_t *cpu,size_t virt_hash_size,size_t phys_hash_size)
 {
@@ -30,6 +30,26 @@ struct insn_patch_table {
    u_int cur_patch;
 };
 
+/* Relocation types for translated code stored in the persistent cache */
+#define TC_RELOC_FUNC  1  /* Absolute address of a host function */
+#define TC_RELOC_JUMP  2  /* Jump to another location of the same TC */
+
+/* Relocation of a translated code location */
+struct tc_reloc {
+   u_char *site;
+   u_char *target;
+   u_int type;
+};
+
+/* Relocation table */
+#define TC_RELOC_TABLE_SIZE  64
+
+struct tc_reloc_table {
+   struct tc_reloc_table *next;
+   struct tc_reloc relocs[TC_RELOC_TABLE_SIZE];
+   u_int cur_reloc;
+};
+
 /* Flags for CPU Tranlation Blocks (TB) */
 #define TB_FLAG_SMC      0x01  /* Self-modifying code */
 #define TB_FLAG_RECOMP   0x02  /* Page being recompiled */
@@ -74,6 +94,8 @@ struct cpu_tb {
 /* TC descriptor flags */
 #define TC_FLAG_REMOVAL  0x01  /* Descriptor marked for removal */
 #define TC_FLAG_VALID    0x02
+#define TC_FLAG_PERSIST  0x04  /* Record relocations for the code cache */
+#define TC_FLAG_SHM      0x08  /* Code located in the shared memory TSG */
 
 /* CPU Translated Code */
 struct cpu_tc {
@@ -96,6 +118,12 @@ struct cpu_tc {
    /* Patch table */
    struct insn_patch_table *patch_table;
 
+   /* Relocation table (only used with TC_FLAG_PERSIST) */
+   struct tc_reloc_table *reloc_table;
+
+   /* Record in the shared memory TSG (only used with TC_FLAG_SHM) */
+   m_uint32_t shm_index;
+
    /* Translation position in target code */
    u_int trans_pos;
    
@@ -222,6 +250,45 @@ int tc_apply_patches(cpu_tc_t *tc,void (*set_patch)(u_char *insn,u_char *dst));
 /* Free the patch table */
 void tc_free_patches(cpu_tc_t *tc);
 
+/* Record a relocation in translated code */
+int tc_record_reloc(cpu_tc_t *tc,u_int type,u_char *site,void *target);
+
+/* Free the relocation table */
+void tc_free_relocs(cpu_tc_t *tc);
+
+/* Persistent translation cache file (NULL if disabled) */
+extern char *tc_cache_file;
+
+/* Open the persistent translation cache */
+int tc_cache_open(m_uint64_t signature);
+
+/* Returns TRUE if the persistent translation cache is usable */
+int tc_cache_enabled(void);
+
+/* Load translated code from the persistent cache */
+cpu_tc_t *tc_cache_load(cpu_gen_t *cpu,cpu_tb_t *tb,m_uint32_t cfg,
+                        void (*set_patch)(u_char *insn,u_char *dst));
+
+/* Store translated code in the persistent cache */
+int tc_cache_store(cpu_gen_t *cpu,cpu_tb_t *tb,cpu_tc_t *tc,m_uint32_t cfg);
+
+/* Name of the shared memory TSG (NULL if disabled) */
+extern char *tsg_shm_name;
+
+/* Attach to the shared memory TSG */
+int tsg_shm_attach(m_uint64_t signature);
+
+/* Returns TRUE if the shared memory TSG is usable */
+int tsg_shm_enabled(void);
+
+/* Find translated code in the shared memory TSG */
+cpu_tc_t *tsg_shm_lookup(cpu_gen_t *cpu,cpu_tb_t *tb,m_uint32_t cfg);
+
+/* Publish translated code in the shared memory TSG */
+cpu_tc_t *tsg_shm_publish(cpu_gen_t *cpu,cpu_tb_t *tb,cpu_tc_t *tc,
+                          m_uint32_t cfg,
+                          void (*set_patch)(u_char *insn,u_char *dst));
+
 /* Initialize the JIT structures of a CPU */
 int cpu_jit_init(cpu_gen_t *cpu,size_t virt_hash_size,size_t phys_hash_size);
 
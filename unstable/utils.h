@@ -61,6 +61,7 @@ typedef struct vm_platform vm_platform_t;
 typedef struct mips64_jit_tcb mips64_jit_tcb_t;
 typedef struct ppc32_jit_tcb ppc32_jit_tcb_t;
 typedef struct jit_op jit_op_t;
+typedef struct vm_ckpt vm_ckpt_t;
 typedef struct cpu_tb cpu_tb_t;
 typedef struct cpu_tc cpu_tc_t;
 
@@ -86,6 +87,14 @@ typedef m_uint32_t ppc_insn_t;
 #define MAP_ANONYMOUS MAP_ANON
 #endif
 
+/* Huge page size assumed for hugetlbfs mappings */
+#define MEMZONE_HUGE_PAGE_SIZE  (2 * 1048576)
+
+/* Host memory backing of a memory zone */
+#define MEMZONE_BACKING_STD      0   /* Standard pages */
+#define MEMZONE_BACKING_THP      1   /* Transparent huge pages advised */
+#define MEMZONE_BACKING_HUGETLB  2   /* hugetlbfs pages */
+
 /* Macros for double linked list */
 #define M_LIST_ADD(item,head,prefix) \
    do { \
@@ -373,6 +382,18 @@ int memzone_sync_all(void *addr, size_t len);
 /* Unmap a memory zone */
 int memzone_unmap(void *addr, size_t len);
 
+/* Discard the content of a memory zone and give its memory back */
+int memzone_discard(void *addr, size_t len);
+
+/* Advise the kernel to back an anonymous zone with transparent huge pages */
+int memzone_advise_hugepages(void *addr,size_t len,int shared);
+
+/* Map an anonymous memory zone, backed by huge pages if possible */
+u_char *memzone_map_huge(size_t len,int *backing);
+
+/* Get the name of a memory zone backing */
+char *memzone_get_backing_str(int backing);
+
 /* Map a memory zone as an executable area */
 u_char *memzone_map_exec_area(size_t len);
 
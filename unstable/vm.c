@@ -12,6 +12,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <assert.h>
 #include <glob.h>
 
@@ -24,6 +25,8 @@
 #include "tcb.h"
 #include "mips64_jit.h"
 #include "dev_vtty.h"
+#include "page_merge.h"
+#include "ram_snap.h"
 
 #include MIPS64_ARCH_INC_FILE
 
@@ -32,6 +35,12 @@
 #define VM_GLOCK()   pthread_mutex_lock(&vm_global_lock)
 #define VM_GUNLOCK() pthread_mutex_unlock(&vm_global_lock)
 
+#define VM_GHOST_CACHE_LOCK()   pthread_mutex_lock(&vm_ghost_cache_lock)
+#define VM_GHOST_CACHE_UNLOCK() pthread_mutex_unlock(&vm_ghost_cache_lock)
+
+/* Suffix of ghost images being generated in the cache */
+#define VM_GHOST_CACHE_TMP  ".tmp"
+
 /* Type of VM file naming (0=use VM name, 1=use instance ID) */
 int vm_file_naming_type = 0;
 
@@ -44,6 +53,9 @@ static vm_ghost_image_t *vm_ghost_pool = NULL;
 /* Global lock for VM manipulation */
 static pthread_mutex_t vm_global_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/* Serializes ghost image generation in the cache between threads */
+static pthread_mutex_t vm_ghost_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /* Free all chunks used by a VM */
 static void vm_chunk_free_all(vm_instance_t *vm);
 
@@ -346,6 +358,7 @@ static vm_instance_t *vm_create(char *name,int instance_id,
                                 vm_platform_t *platform)
 {
    vm_instance_t *vm;
+   u_int i;
 
    if (!(vm = malloc(sizeof(*vm)))) {
       fprintf(stderr,"VM %s: unable to create new instance!\n",name);
@@ -353,6 +366,9 @@ static vm_instance_t *vm_create(char *name,int instance_id,
    }
    
    memset(vm,0,sizeof(*vm));
+   pthread_mutex_init(&vm->mem_lock,NULL);
+   pthread_mutex_init(&vm->ram_lock,NULL);
+   pthread_mutex_init(&vm->state_lock,NULL);
 
    if (!(vm->name = strdup(name))) {
       fprintf(stderr,"VM %s: unable to store instance name!\n",name);
@@ -368,11 +384,17 @@ static vm_instance_t *vm_create(char *name,int instance_id,
    vm->vtty_aux_type        = VTTY_TYPE_NONE;
    vm->timer_irq_check_itv  = VM_TIMER_IRQ_CHECK_ITV;
    vm->log_file_enabled     = TRUE;
+   vm->ghost_cache_fd       = -1;
+   vm->ios_image_fd         = -1;
    vm->rommon_vars.filename = vm_build_filename(vm,"rommon_vars");
 
    if (!vm->rommon_vars.filename)
       goto err_rommon;
 
+   /* Every IRQ breaks the idle wait of the CPU (cheap if it is running) */
+   for(i=0;i<sizeof(vm->irq_idle_preempt)/sizeof(u_int);i++)
+      vm->irq_idle_preempt[i] = TRUE;
+
    /* XXX */
    rommon_load_file(&vm->rommon_vars);
 
@@ -421,12 +443,21 @@ int vm_hardware_shutdown(vm_instance_t *vm)
 
    vm_log(vm,"VM","shutdown procedure engaged.\n");
 
+   /* Wait for the RAM snapshot being written */
+   ram_snap_shutdown(vm);
+
+   /* Stop merging pages of this VM */
+   page_merge_remove_vm(vm);
+
    /* Mark the VM as halted */
    vm->status = VM_STATUS_HALTED;
 
    /* Free the object list */
    vm_object_free_list(vm);
 
+   /* RAM is gone, release the IOS image pages it was pointing to */
+   vm_ios_image_unmap(vm);
+
    /* Free resources used by PCI busses */
    vm_log(vm,"VM","removing PCI busses.\n");
    pci_io_data_remove(vm,vm->pci_io_space);
@@ -456,6 +487,9 @@ int vm_hardware_shutdown(vm_instance_t *vm)
    vm->cpu_group = NULL;
    vm->boot_cpu = NULL;
 
+   /* No device lookup can use the replaced device indexes anymore */
+   dev_index_reclaim(vm);
+
    vm_log(vm,"VM","shutdown procedure completed.\n");
    m_log("VM","VM %s shutdown.\n",vm->name);
    return(0);
@@ -476,12 +510,21 @@ void vm_free(vm_instance_t *vm)
       /* Remove the lock file */
       vm_release_lock(vm,TRUE);
 
+      /* No lookup can be in progress anymore */
+      dev_index_free(vm);
+
       /* Free all chunks */
       vm_chunk_free_all(vm);
+      free(vm->free_pages);
+
+      pthread_mutex_destroy(&vm->mem_lock);
+      pthread_mutex_destroy(&vm->ram_lock);
+      pthread_mutex_destroy(&vm->state_lock);
 
       /* Free various elements */
       free(vm->rommon_vars.filename);
       free(vm->ghost_ram_filename);
+      free(vm->ghost_cache_dir);
       free(vm->sym_filename);
       free(vm->ios_image);
       free(vm->ios_startup_config);
@@ -516,8 +559,13 @@ int vm_ram_init(vm_instance_t *vm,m_uint64_t paddr)
                                 paddr,len));
    }
 
-   return(dev_ram_init(vm,"ram",vm->ram_mmap,
-                       (vm->ghost_status != VM_GHOST_RAM_GENERATE),
+   /* A ghost image is generated in a memory-mapped file */
+   if (vm->ghost_status == VM_GHOST_RAM_GENERATE) {
+      return(dev_ram_init(vm,"ram",TRUE,FALSE,vm->ghost_ram_filename,
+                          FALSE,paddr,len));
+   }
+
+   return(dev_ram_init(vm,"ram",vm->ram_mmap,TRUE,
                        vm->ghost_ram_filename,vm->sparse_mem,paddr,len));
 }
 
@@ -577,6 +625,8 @@ int vm_bind_device(vm_instance_t *vm,struct vdevice *dev)
    if (*cur) (*cur)->pprev = &dev->next;
    dev->pprev = cur;
    *cur = dev;
+
+   dev_index_rebuild(vm);
    return(0);
 }
 
@@ -604,6 +654,8 @@ int vm_unbind_device(vm_instance_t *vm,struct vdevice *dev)
    /* Clear device list info */
    dev->next = NULL;
    dev->pprev = NULL;
+
+   dev_index_rebuild(vm);
    return(0);
 }
 
@@ -715,22 +767,62 @@ static void vm_chunk_free_all(vm_instance_t *vm)
    vm->chunks = NULL;
 }
 
-/* Allocate an host page */
+/* Allocate an host page (CPU, device and page merging threads) */
 void *vm_alloc_host_page(vm_instance_t *vm)
 {
-   vm_chunk_t *chunk = vm->chunks;
-   void *ptr;
+   vm_chunk_t *chunk;
+   void *ptr = NULL;
+
+   VM_MEM_LOCK(vm);
+
+   if (vm->free_pages_count) {
+      ptr = vm->free_pages[--vm->free_pages_count];
+      goto done;
+   }
+
+   chunk = vm->chunks;
 
    if (!chunk || (chunk->page_alloc == chunk->page_total)) {
-      chunk = vm_chunk_create(vm);
-      if (!chunk) return NULL;
+      if (!(chunk = vm_chunk_create(vm)))
+         goto done;
    }
 
    ptr = chunk->area + (chunk->page_alloc * VM_PAGE_SIZE);
    chunk->page_alloc++;
+
+ done:
+   VM_MEM_UNLOCK(vm);
    return(ptr);
 }
 
+/* Free an host page */
+void vm_free_host_page(vm_instance_t *vm,void *ptr)
+{
+   void **list;
+   u_int max;
+
+   /* Give the memory back to the host until the page is reused */
+   memzone_discard(ptr,VM_PAGE_SIZE);
+
+   VM_MEM_LOCK(vm);
+
+   if (vm->free_pages_count == vm->free_pages_max) {
+      max = vm->free_pages_max ? vm->free_pages_max * 2 : VM_CHUNK_AREA_SIZE;
+
+      /* The page is lost if the free list cannot grow */
+      if (!(list = realloc(vm->free_pages,max * sizeof(void *))))
+         goto done;
+
+      vm->free_pages = list;
+      vm->free_pages_max = max;
+   }
+
+   vm->free_pages[vm->free_pages_count++] = ptr;
+
+ done:
+   VM_MEM_UNLOCK(vm);
+}
+
 /* Free resources used by a ghost image */
 static void vm_ghost_image_free(vm_ghost_image_t *img)
 {
@@ -855,6 +947,47 @@ int vm_ghost_image_release(int fd)
    return(-1);
 }
 
+/* 
+ * Map an IOS image file, to load RAM pages from it on demand.
+ *
+ * The mapping is shared with other VMs running the same image, and is kept
+ * until the VM hardware is shut down. Only one image can be mapped at a
+ * time: NULL is returned if the VM already uses one.
+ */
+u_char *vm_ios_image_map(vm_instance_t *vm,char *filename,size_t *size)
+{
+   struct stat st;
+   u_char *ptr;
+   int fd;
+
+   if (vm->ios_image_fd != -1)
+      return NULL;
+
+   if (vm_ghost_image_get(filename,&ptr,&fd) == -1)
+      return NULL;
+
+   if (fstat(fd,&st) == -1) {
+      vm_ghost_image_release(fd);
+      return NULL;
+   }
+
+   vm_log(vm,"VM","IOS image '%s' mapped for on-demand loading.\n",
+          filename);
+
+   vm->ios_image_fd = fd;
+   *size = st.st_size;
+   return ptr;
+}
+
+/* Release the IOS image file mapped by a VM */
+void vm_ios_image_unmap(vm_instance_t *vm)
+{
+   if (vm->ios_image_fd != -1) {
+      vm_ghost_image_release(vm->ios_image_fd);
+      vm->ios_image_fd = -1;
+   }
+}
+
 /* Open a VM file and map it in memory */
 int vm_mmap_open_file(vm_instance_t *vm,char *name,
                       u_char **ptr,off_t *fsize)
@@ -1050,6 +1183,21 @@ void vm_save_config(vm_instance_t *vm,FILE *fd)
    fprintf(fd,"vm set_clock_divisor %s %u\n",vm->name,vm->clock_divisor);
    fprintf(fd,"vm set_conf_reg %s 0x%4.4x\n",vm->name,vm->conf_reg_setup);
 
+   if (vm->ram_hugepages)
+      fprintf(fd,"vm set_ram_hugepages %s %u\n",vm->name,vm->ram_hugepages);
+
+   if (vm->page_merge)
+      fprintf(fd,"vm set_page_merge %s %u\n",vm->name,vm->page_merge);
+
+   if (vm->ghost_cache_dir)
+      fprintf(fd,"vm set_ghost_cache %s %s\n",vm->name,vm->ghost_cache_dir);
+
+   if (vm->sched_prio)
+      fprintf(fd,"vm set_sched_prio %s %d\n",vm->name,vm->sched_prio);
+
+   if (vm->sched_quota)
+      fprintf(fd,"vm set_sched_quota %s %u\n",vm->name,vm->sched_quota);
+
    if (vm->vtty_con_type == VTTY_TYPE_TCP)
       fprintf(fd,"vm set_con_tcp_port %s %d\n",
               vm->name,vm->vtty_con_tcp_port);
@@ -1260,10 +1408,172 @@ int vm_rename_instance(vm_instance_t *vm, char *name)
    return(-1);
 }
 
+/* Hash the content of a file (FNV-1a) */
+static int vm_ghost_cache_hash_file(char *filename,m_uint64_t *hash)
+{
+   u_char buffer[16384];
+   m_uint64_t h = 0xcbf29ce484222325ULL;
+   size_t i,len;
+   FILE *fd;
+
+   if (!(fd = fopen(filename,"rb")))
+      return(-1);
+
+   while((len = fread(buffer,1,sizeof(buffer),fd)) > 0)
+      for(i=0;i<len;i++)
+         h = (h ^ buffer[i]) * 0x100000001b3ULL;
+
+   fclose(fd);
+   *hash = h;
+   return(0);
+}
+
+/* 
+ * Use the cached ghost image of a VM, or prepare its generation.
+ *
+ * Images are keyed by platform, RAM size and hash of the IOS image. When
+ * the image has to be generated, the cache lock is held until the image
+ * is published by vm_ghost_cache_release(), so that other VMs (in this 
+ * process or in other ones) wait for it instead of building it again.
+ */
+static int vm_ghost_cache_setup(vm_instance_t *vm)
+{
+   struct flock lock;
+   struct stat fprop;
+   m_uint64_t hash;
+   char *image,*lock_file;
+   int fd;
+
+   if (!vm->ios_image ||
+       (vm_ghost_cache_hash_file(vm->ios_image,&hash) == -1)) 
+   {
+      vm_error(vm,"ghost cache: unable to read IOS image.\n");
+      return(-1);
+   }
+
+   image = dyn_sprintf("%s/%s-%uM-%16.16llx.ghost",vm->ghost_cache_dir,
+                       vm->platform->name,vm->ram_size,hash);
+   if (!image)
+      return(-1);
+
+   VM_GHOST_CACHE_LOCK();
+
+   if (!(lock_file = dyn_sprintf("%s.lock",image)))
+      goto err_lock;
+
+   fd = open(lock_file,O_CREAT|O_RDWR,S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+   free(lock_file);
+
+   if (fd == -1) {
+      vm_error(vm,"ghost cache: unable to create lock file for %s.\n",image);
+      goto err_lock;
+   }
+
+   memset(&lock,0,sizeof(lock));
+   lock.l_type   = F_WRLCK;
+   lock.l_whence = SEEK_SET;
+
+   if (fcntl(fd,F_SETLKW,&lock) == -1) {
+      vm_error(vm,"ghost cache: unable to lock %s.\n",image);
+      close(fd);
+      goto err_lock;
+   }
+
+   free(vm->ghost_ram_filename);
+
+   /* The image is in the cache */
+   if (!stat(image,&fprop) &&
+       (fprop.st_size == (off_t)vm->ram_size * 1048576))
+   {
+      close(fd);
+      VM_GHOST_CACHE_UNLOCK();
+
+      vm_log(vm,"GHOST","using cached ghost image %s.\n",image);
+      vm->ghost_ram_filename = image;
+      vm->ghost_status = VM_GHOST_RAM_USE;
+      return(0);
+   }
+
+   /* Build it in a temporary file (a previous attempt may have failed) */
+   vm->ghost_ram_filename = dyn_sprintf("%s%s",image,VM_GHOST_CACHE_TMP);
+   vm->ghost_status = VM_GHOST_RAM_GENERATE;
+   vm->ghost_cache_fd = fd;
+
+   if (vm->ghost_ram_filename != NULL)
+      unlink(vm->ghost_ram_filename);
+
+   vm_log(vm,"GHOST","generating ghost image %s.\n",image);
+   free(image);
+   return(0);
+
+ err_lock:
+   VM_GHOST_CACHE_UNLOCK();
+   free(image);
+   return(-1);
+}
+
+/* End the generation of a cached ghost image, publishing it on success */
+static int vm_ghost_cache_release(vm_instance_t *vm,int publish)
+{
+   char *image = NULL;
+   size_t len;
+   int res = -1;
+
+   if (vm->ghost_ram_filename && (image = strdup(vm->ghost_ram_filename))) {
+      len = strlen(image) - strlen(VM_GHOST_CACHE_TMP);
+      image[len] = 0;
+
+      if (publish)
+         res = rename(vm->ghost_ram_filename,image);
+      else
+         unlink(vm->ghost_ram_filename);
+   }
+
+   close(vm->ghost_cache_fd);
+   vm->ghost_cache_fd = -1;
+   VM_GHOST_CACHE_UNLOCK();
+
+   free(vm->ghost_ram_filename);
+   vm->ghost_ram_filename = image;
+
+   if (res == -1) {
+      vm->ghost_status = VM_GHOST_RAM_NONE;
+      return(-1);
+   }
+
+   vm->ghost_status = VM_GHOST_RAM_USE;
+   return(0);
+}
+
 /* Initialize a VM instance */
 int vm_init_instance(vm_instance_t *vm)
 {
-   return(vm->platform->init_instance(vm));
+   if (vm->ghost_cache_dir && (vm_ghost_cache_setup(vm) == -1))
+      return(-1);
+
+   if (vm->platform->init_instance(vm) == -1) {
+      if (vm->ghost_cache_fd != -1)
+         vm_ghost_cache_release(vm,FALSE);
+      return(-1);
+   }
+
+   /* The ghost image has just been generated: publish it and boot on it */
+   if (vm->ghost_cache_fd != -1) {
+      vm->platform->stop_instance(vm);
+
+      if (vm_ghost_cache_release(vm,TRUE) == -1) {
+         vm_error(vm,"ghost cache: unable to store ghost image.\n");
+         return(-1);
+      }
+
+      if (vm->platform->init_instance(vm) == -1)
+         return(-1);
+   }
+
+   if (vm->page_merge)
+      page_merge_add_vm(vm);
+
+   return(0);
 }
 
 /* Stop a VM instance */
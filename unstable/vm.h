@@ -48,6 +48,24 @@ struct vm_ghost_image {
 /* Maximum number of devices per VM */
 #define VM_DEVICE_MAX  (1 << 6)
 
+/* 
+ * Physical address index of devices (sorted by start address).
+ * max_end[i] is the highest end address of devices 0..i, which allows
+ * a binary search returning the same device as a linear list walk.
+ *
+ * Lookups are done without lock: an index is never modified once
+ * published, a new one replaces it and the old one is kept in the
+ * retired list until the VM hardware is shut down.
+ */
+typedef struct vm_dev_index vm_dev_index_t;
+struct vm_dev_index {
+   vm_dev_index_t *next;
+   u_int count;
+   m_uint64_t *max_end;
+   m_uint64_t *start;
+   struct vdevice **dev;
+};
+
 /* Size of the PCI bus pool */
 #define VM_PCI_POOL_SIZE  32
 
@@ -103,6 +121,8 @@ struct vm_instance {
    u_int conf_reg,conf_reg_setup; /* Config register */
    u_int clock_divisor;           /* Clock Divisor (see cp0.c) */
    u_int ram_mmap;                /* Memory-mapped RAM ? */
+   u_int ram_hugepages;           /* Back RAM with huge pages ? */
+   u_int page_merge;              /* Merge identical RAM pages ? */
    u_int restart_ios;             /* Restart IOS on reload ? */
    u_int elf_machine_id;          /* ELF machine identifier */
    u_int exec_area_size;          /* Size of execution area for CPU */
@@ -124,6 +144,19 @@ struct vm_instance {
    /* Memory chunks */
    vm_chunk_t *chunks;
 
+   /* Host pages released by page merging, ready to be reused */
+   void **free_pages;
+   u_int free_pages_count,free_pages_max;
+
+   /* Host page allocator lock (chunks and free pages) */
+   pthread_mutex_t mem_lock;
+
+   /* Held by devices accessing RAM pages, and while pages are replaced */
+   pthread_mutex_t ram_lock;
+
+   /* Serializes suspend/resume of the VM (operator and internal pauses) */
+   pthread_mutex_t state_lock;
+
    /* Basic hardware: system CPU, PCI busses and PCI I/O space */
    cpu_group_t *cpu_group;
    cpu_gen_t *boot_cpu;
@@ -135,6 +168,10 @@ struct vm_instance {
    struct vdevice *dev_list;
    struct vdevice *dev_array[VM_DEVICE_MAX];
 
+   /* Device index (all devices, and devices supporting caching) */
+   vm_dev_index_t *dev_index,*dev_cindex;
+   vm_dev_index_t *dev_index_retired;
+
    /* IRQ routing */
    void (*set_irq)(vm_instance_t *vm,u_int irq);
    void (*clear_irq)(vm_instance_t *vm,u_int irq);
@@ -152,6 +189,16 @@ struct vm_instance {
    /* Ghost RAM image handling */
    int ghost_status;
 
+   /* Cache of ghost images, and lock of the image being generated */
+   char *ghost_cache_dir;
+   int ghost_cache_fd;
+
+   /* IOS image file mapped for on-demand loading of RAM pages */
+   int ios_image_fd;
+
+   /* Incremental RAM snapshots */
+   struct ram_snap *ram_snap;
+
    /* Timer IRQ interval check */
    u_int timer_irq_check_itv;
 
@@ -161,6 +208,13 @@ struct vm_instance {
    /* "idling" pointer counter */
    m_uint64_t idle_pc;
 
+   /* Automatic idle PC detection */
+   int idle_auto;
+
+   /* CPU scheduler: priority and CPU quota (% of a host CPU, 0: none) */
+   int sched_prio;
+   u_int sched_quota;
+
    /* JIT block direct jumps */
    int exec_blk_direct_jump;
 
@@ -206,6 +260,7 @@ struct vm_platform {
    int (*cli_parse_options)(vm_instance_t *vm,int option);
    void (*cli_show_options)(vm_instance_t *vm);
    void (*show_spec_drivers)(void);
+   int (*ckpt_check)(vm_instance_t *vm);
 };
 
 /* VM platform list item */
@@ -216,6 +271,13 @@ struct vm_platform_list {
 
 extern int vm_file_naming_type;
 
+#define VM_MEM_LOCK(vm)     pthread_mutex_lock(&(vm)->mem_lock)
+#define VM_MEM_UNLOCK(vm)   pthread_mutex_unlock(&(vm)->mem_lock)
+#define VM_RAM_LOCK(vm)     pthread_mutex_lock(&(vm)->ram_lock)
+#define VM_RAM_UNLOCK(vm)   pthread_mutex_unlock(&(vm)->ram_lock)
+#define VM_STATE_LOCK(vm)   pthread_mutex_lock(&(vm)->state_lock)
+#define VM_STATE_UNLOCK(vm) pthread_mutex_unlock(&(vm)->state_lock)
+
 /* Set an IRQ for a VM */
 static inline void vm_set_irq(vm_instance_t *vm,u_int irq)
 {
@@ -344,6 +406,12 @@ int vm_ghost_image_get(char *filename,u_char **ptr,int *fd);
 /* Release a ghost image */
 int vm_ghost_image_release(int fd);
 
+/* Map an IOS image file, to load RAM pages from it on demand */
+u_char *vm_ios_image_map(vm_instance_t *vm,char *filename,size_t *size);
+
+/* Release the IOS image file mapped by a VM */
+void vm_ios_image_unmap(vm_instance_t *vm);
+
 /* Open a VM file and map it in memory */
 int vm_mmap_open_file(vm_instance_t *vm,char *name,
                       u_char **ptr,off_t *fsize);